@@ -0,0 +1,50 @@
+#if	!defined(_backend_h)
+#define	_backend_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "ft8goblin_types.h"
+#include "qrz-ratelimit.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	BACKEND_MAX		8		// registered backends
+   #define	BACKEND_TIER_MAX	8
+
+   // A source of calldata. lookup() runs on a worker thread and may block, it
+   // should give up as soon as it notices *cancelled (someone else answered, or
+   // we stopped waiting). The loop thread owns everything else.
+   typedef struct lookup_backend {
+      const char	*name;			// as used in callsign-lookup/backends
+      callsign_datasrc_t	origin;
+      bool		online;			// an internet service, we're only offline when none of these are usable
+      int		default_timeout_ms;	// if callsign-lookup/backend-timeouts/<name> isn't set
+      bool		(*usable)(void);	// enabled and (for online ones) reachable right now?
+      calldata_t	*(*lookup)(const char *callsign, qrz_prio_t prio, const atomic_bool *cancelled);
+
+      // filled in by backends_init()
+      int		timeout_ms;		// latency budget, after this the chain moves on without it
+      int		tier;
+      atomic_ulong	asked, answered, missed, timeouts, cancelled;
+   } lookup_backend_t;
+
+   // Backends in a tier are asked at the same time and the first answer wins,
+   // the next tier is only asked if nobody in this one had it
+   typedef struct backend_tier {
+      int		n;
+      lookup_backend_t	*backend[BACKEND_MAX];
+   } backend_tier_t;
+
+   extern bool backend_register(lookup_backend_t *b);
+   extern void backends_init(const char *chain);
+   extern int backend_tiers(void);
+   extern const backend_tier_t *backend_tier(int tier);
+   extern void backends_dump(outbuf_t *ob);
+   extern void backends_online_changed(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_backend_h)
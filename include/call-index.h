@@ -0,0 +1,45 @@
+#if	!defined(_call_index_h)
+#define	_call_index_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <ev.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // where we've seen a callsign
+   #define	CALLIDX_SRC_CACHE	0x01
+   #define	CALLIDX_SRC_ULS		0x02
+   #define	CALLIDX_SRC_LOTW	0x04
+   #define	CALLIDX_SRC_HEARD	0x08		// answered lately (corrections only)
+
+   #define	CALLIDX_MAX_RESULTS	200		// most a /SEARCH can ask for
+
+   typedef struct callidx_match {
+      char		callsign[MAX_CALLSIGN];
+      uint8_t		src;			// CALLIDX_SRC_*
+      uint8_t		dist;			// edits from the query (0 for pattern matches)
+      uint8_t		score;			// corrections: 0-100, how likely it's the one they meant
+   } callidx_match_t;
+
+   typedef struct callidx_result {
+      int		total;			// matches found, may be more than n
+      int		n;			// best ones, in rank order
+      callidx_match_t	match[CALLIDX_MAX_RESULTS];
+   } callidx_result_t;
+
+   extern void callidx_start(struct ev_loop *loop);
+   extern void callidx_rebuild(void);
+   extern void callidx_stop(void);
+   extern bool callidx_search(const char *query, int limit, callidx_result_t *res);
+   extern void callidx_search_dump(const char *query, int limit, outbuf_t *ob);
+   extern void callidx_dump(outbuf_t *ob);
+   extern bool callidx_correct(const char *callsign, callidx_result_t *res);
+   extern size_t callidx_correct_str(const callidx_result_t *res, char *buf, size_t bufsz);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_call_index_h)
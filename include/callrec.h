@@ -0,0 +1,98 @@
+#if	!defined(_callrec_h)
+#define	_callrec_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "ft8goblin_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   //
+   // Compact, immutable form of a calldata_t for the in-memory cache and replies.
+   //
+   // calldata_t is several KB of fixed size arrays, mostly empty. Here every
+   // free-form string is a slice of one blob allocated with the record, and
+   // strings that repeat across thousands of stations (country, state, class,
+   // ...) are interned and stored as a 16 bit id. Records are reference
+   // counted, so the cache and any number of replies can share one.
+   //
+
+   // strings stored in the record's blob
+   typedef enum callrec_str {
+      CR_CALLSIGN = 0,
+      CR_ALIASES,
+      CR_FIRST_NAME,
+      CR_LAST_NAME,
+      CR_ADDRESS1,
+      CR_ADDRESS2,
+      CR_ADDRESS_ATTN,
+      CR_ZIP,
+      CR_GRID,
+      CR_FIPS,
+      CR_PREVIOUS_CALL,
+      CR_EMAIL,
+      CR_URL,
+      CR_IMAGE_URL,
+      CR_QSL_MSG,
+      CR_NICKNAME,
+      CR_STR_MAX
+   } callrec_str_t;
+
+   // strings shared between records
+   typedef enum callrec_interned {
+      CR_COUNTRY = 0,
+      CR_STATE,
+      CR_CLASS,
+      CR_CODES,
+      CR_LAND,
+      CR_COUNTY,
+      CR_GMT_OFFSET,
+      CR_INTERN_MAX
+   } callrec_interned_t;
+
+   typedef struct callrec_slice {
+      uint16_t		off, len;	// into blob, always NUL terminated (empty = off 0, len 0)
+   } callrec_slice_t;
+
+   typedef struct callrec {
+      _Atomic int	refs;
+      uint8_t		origin;			// callsign_datasrc_t
+      bool		cached;
+      char		mi;
+      uint8_t		flags;			// CR_FLAG_*
+      uint8_t		cq_zone, itu_zone;
+      uint16_t		alias_count;
+      int32_t		dxcc, country_code;
+      float		latitude, longitude;
+      time_t		cache_fetched, cache_expiry;
+      time_t		license_effective, license_expiry;
+      time_t		bio_updated;
+      uint64_t		qrz_views, qrz_serial;
+      uint16_t		interned[CR_INTERN_MAX];	// 0 = unset
+      callrec_slice_t	str[CR_STR_MAX];
+      uint16_t		blob_len;
+      char		blob[];
+   } callrec_t;
+
+   #define	CR_FLAG_DST		0x01
+   #define	CR_FLAG_EQSL		0x02
+   #define	CR_FLAG_PAPER_QSL	0x04
+
+   extern callrec_t *callrec_pack(const calldata_t *cd);
+   extern calldata_t *callrec_unpack(const callrec_t *rec);
+   extern const char *callrec_get(const callrec_t *rec, callrec_str_t which);
+   extern const char *callrec_get_interned(const callrec_t *rec, callrec_interned_t which);
+   extern callrec_t *callrec_ref(callrec_t *rec);
+   extern void callrec_put(callrec_t *rec);
+   extern size_t callrec_size(const callrec_t *rec);
+   extern uint16_t intern_string(const char *s);
+   extern const char *interned_string(uint16_t id);
+   extern int intern_count(void);
+   extern size_t intern_bytes(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_callrec_h)
@@ -0,0 +1,57 @@
+#if	!defined(_callsign_lookup_h)
+#define	_callsign_lookup_h
+#include <stdbool.h>
+#include <stdint.h>
+#include "ft8goblin_types.h"
+#include "qrz-ratelimit.h"
+#include "workers.h"
+#include "backend.h"
+#include "proto.h"
+#include "client.h"
+#include "callrec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	LOOKUP_TAG_LEN		16	// /CALL#<tag>, letters, digits, - and _
+
+   // A callsign lookup on it's way through the worker pool
+   typedef struct lookup_req {
+      work_t		work;			// must be first
+      struct lookup_req	*next_pending;		// replies go out in the order requests came in
+      bool		complete;		// worker is done, waiting for it's turn to reply
+      char		tag[LOOKUP_TAG_LEN + 1];	// client's request tag, tagged requests reply out of order
+      char		callsign[MAX_CALLSIGN];	// what was asked for, upper case: VE3/K1ABC/P
+      char		base[MAX_CALLSIGN];	// what we look up and cache it as: K1ABC
+      qrz_prio_t	prio;
+      proto_format_t	format;			// reply format the client wanted when it asked
+      uint64_t		submitted;		// stats_now() when it was queued
+      callrec_t		*result;		// NULL if not found, callrec_put() when done
+      void		(*reply)(struct lookup_req *req);	// called on the loop thread, in order
+      void		*priv;			// for the caller's use (call_reply: the client_t)
+
+      // where it is in the backend chain (loop thread only)
+      int		tier;			// next tier to ask
+      int		waiting;		// backends in the current tier we're still waiting on
+      int		jobs_out;		// backend jobs the workers haven't handed back, can't free it until 0
+      bool		answered;		// got an answer, or nobody had one
+      bool		replied;		// reply() has been called
+      struct lookup_job	*jobs[BACKEND_MAX];	// the current tier's, NULL once they're done or out of time
+   } lookup_req_t;
+
+   typedef void (*lookup_reply_cb_t)(lookup_req_t *req);
+
+   extern bool lookup_submit(const char *callsign, qrz_prio_t prio, const char *tag, proto_format_t format, lookup_reply_cb_t reply, void *priv);
+   extern int lookup_pending(void);
+   extern calldata_t *callsign_cache_find(const char *callsign);
+   extern bool callsign_cache_save(calldata_t *cp);
+   extern bool callsign_cache_each(void (*cb)(const char *callsign, void *priv), void *priv);
+   extern bool calldata_dump(client_t *cl, const callrec_t *calldata, const char *callsign);
+   extern const char *calldata_opclass(const callrec_t *calldata);
+   extern bool calldata_heading(const callrec_t *calldata, double *distance, double *bearing);
+   extern const char *origin_name[DATASRC_MAX + 1];
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_callsign_lookup_h)
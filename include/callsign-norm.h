@@ -0,0 +1,25 @@
+#if	!defined(_callsign_norm_h)
+#define	_callsign_norm_h
+#include <stdbool.h>
+#include "ft8goblin_types.h"
+#include "cty.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // A callsign as sent, taken apart: VE3/K1ABC/P
+   typedef struct callsign_parts {
+      char		full[MAX_CALLSIGN];	// upper case, trimmed: VE3/K1ABC/P
+      char		base[MAX_CALLSIGN];	// the station's own call, what we look up: K1ABC
+      char		prefix[MAX_CALLSIGN];	// operating prefix in front: VE3
+      char		suffix[MAX_CALLSIGN];	// anything after: P
+      bool		portable;		// full isn't just base
+      const cty_match_t	*entity;		// where they're operating from (cty.dat), NULL if unknown
+   } callsign_parts_t;
+
+   extern bool callsign_normalize(const char *raw, callsign_parts_t *parts);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_callsign_norm_h)
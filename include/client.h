@@ -0,0 +1,75 @@
+#if	!defined(_client_h)
+#define	_client_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <ev.h>
+#include "proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	CLIENT_INBUF_SIZE	1024		// longest request line
+   #define	CLIENT_HIGH_WATER	(256 * 1024)	// stop reading requests when this much output is queued
+   #define	CLIENT_LOW_WATER	(64 * 1024)	// ... and start again once it drains below this
+
+   // A chunk of queued output, written with writev() along with it's neighbours
+   typedef struct outbuf_chunk {
+      struct outbuf_chunk	*next;
+      size_t			len;		// bytes used
+      size_t			off;		// bytes already written
+      size_t			size;		// bytes allocated for data
+      char			data[];
+   } outbuf_chunk_t;
+
+   typedef struct outbuf {
+      outbuf_chunk_t	*head, *tail;
+      size_t		pending;	// bytes queued but not written yet
+   } outbuf_t;
+
+   struct client;
+   struct watch;
+   struct grid_batch;
+   typedef void (*client_line_cb_t)(struct client *cl, const char *line);
+   typedef void (*client_eof_cb_t)(struct client *cl);
+
+   typedef struct client {
+      int		in_fd, out_fd;	// in_fd may be -1 if we're only writing (command line mode)
+      struct ev_loop	*loop;
+      ev_io		read_watcher;
+      ev_io		write_watcher;
+      char		inbuf[CLIENT_INBUF_SIZE];
+      size_t		in_len;
+      outbuf_t		out;
+      proto_format_t	format;		// what the client asked for with /PROTO
+      bool		paused;		// not reading, because output is backed up
+      bool		eof;		// input is closed
+      struct watch	*watch;		// streaming decodes, see /WATCH (NULL if not)
+      struct grid_batch	*grids;		// reading a /GRIDS request (NULL if not)
+      client_line_cb_t	on_line;
+      client_eof_cb_t	on_eof;
+      struct client	*next;		// all clients, for notices
+   } client_t;
+
+   extern void outbuf_append(outbuf_t *ob, const void *data, size_t len);
+   extern void outbuf_printf(outbuf_t *ob, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+   extern void outbuf_vprintf(outbuf_t *ob, const char *fmt, va_list ap);
+   extern ssize_t outbuf_writev(outbuf_t *ob, int fd);
+   extern void outbuf_free(outbuf_t *ob);
+
+   extern void client_init(client_t *cl, struct ev_loop *loop, int in_fd, int out_fd, client_line_cb_t on_line, client_eof_cb_t on_eof);
+   extern void client_fini(client_t *cl);
+   extern void client_printf(client_t *cl, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+   extern void client_write(client_t *cl, const void *data, size_t len);
+   extern bool client_flush(client_t *cl);
+   extern void client_drain(client_t *cl);
+   extern void clients_notice(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+   extern void clients_flush(void);
+   extern void clients_drain(void);
+   extern void clients_fini(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_client_h)
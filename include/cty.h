@@ -0,0 +1,37 @@
+#if	!defined(_cty_h)
+#define	_cty_h
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // A DXCC entity from cty.dat
+   typedef struct cty_entity {
+      char		name[48];
+      char		prefix[12];		// primary prefix, ex: VE
+      char		continent[3];
+      uint8_t		cq_zone, itu_zone;
+      bool		wae_only;		// listed with a *, only counts for the WAE award
+      float		latitude, longitude;	// east is positive (cty.dat has it the other way around)
+      float		utc_offset;		// hours, east is positive
+   } cty_entity_t;
+
+   // What a prefix (or exact callsign) resolves to, with any per-prefix overrides applied
+   typedef struct cty_match {
+      const cty_entity_t	*entity;
+      char			continent[3];
+      uint8_t			cq_zone, itu_zone;
+      float			latitude, longitude;
+   } cty_match_t;
+
+   extern bool cty_load(const char *path);
+   extern void cty_unload(void);
+   extern bool cty_loaded(void);
+   extern const cty_match_t *cty_find(const char *callsign);
+   extern const cty_match_t *cty_find_exact(const char *callsign);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_cty_h)
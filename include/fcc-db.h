@@ -1,6 +1,7 @@
 #include <libied/cfg.h>
 #include <libied/sql.h>
 #include "ft8goblin_types.h"
+#include "client.h"
 
 #if	!defined(_fcc_db_h)
 #define	_fcc_db_h
@@ -9,7 +10,12 @@
 extern "C" {
 #endif
 
+    extern bool uls_init(const char *path);
+    extern void uls_fini(void);
+    extern void uls_close(void);
     extern calldata_t *uls_lookup_callsign(const char *callsign);
+    extern void uls_dump(outbuf_t *ob);
+    extern bool uls_each_callsign(void (*cb)(const char *callsign, void *priv), void *priv);
 #ifdef __cplusplus
 };
 #endif
@@ -24,7 +24,9 @@ extern "C" {
       DATASRC_NONE = 0,
       DATASRC_ULS,
       DATASRC_QRZ,
-      DATASRC_CACHE					// cache with no other origin type set
+      DATASRC_CACHE,					// cache with no other origin type set
+      DATASRC_HAMQTH,
+      DATASRC_MAX
    } callsign_datasrc_t;
 
    typedef struct calldata {
@@ -94,6 +96,7 @@ extern "C" {
      bool		use_cache;	// Should we use caching?
      bool		use_uls;	// Should we use ULS?
      bool		use_qrz;	// Should we use QRZ XML API?
+     bool		use_hamqth;	// Should we use HamQTH XML API?
      // Run-time options
      bool		auto_cycle;	// automatically move to next message
      bool		cq_only;	// Only show active QSOs and CQs?
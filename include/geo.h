@@ -0,0 +1,19 @@
+#if	!defined(_geo_h)
+#define	_geo_h
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	GEO_EARTH_RADIUS_KM	6371.0
+
+   // Great circle distance (km) and initial bearing (degrees, 0-360) from
+   // my_lat/my_lon to each of n points, in degrees. Same results as libied's
+   // calculateDistance/calculateBearing, to within a few ulp.
+   extern void geo_heading_batch(double my_lat, double my_lon, const double *lat, const double *lon, int n, double *distance, double *bearing);
+   extern void geo_heading_scalar(double my_lat, double my_lon, const double *lat, const double *lon, int n, double *distance, double *bearing);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_geo_h)
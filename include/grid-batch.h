@@ -0,0 +1,30 @@
+#if	!defined(_grid_batch_h)
+#define	_grid_batch_h
+#include <stdbool.h>
+#include "grid.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	GRID_BATCH_MAX		65536		// points in one /GRIDS request
+   #define	GRID_BATCH_QUERY_LEN	32		// longest point we'll echo back
+
+   // A /GRIDS request being read, one or more points per line until "."
+   typedef struct grid_batch {
+      int		n, size;
+      char		(*query)[GRID_BATCH_QUERY_LEN];	// as given, or the grid once it's resolved
+      double		*lat, *lon;
+      bool		*ok;
+      bool		overflow;			// sent more than GRID_BATCH_MAX
+   } grid_batch_t;
+
+   extern grid_batch_t *grid_batch_start(void);
+   extern void grid_batch_line(grid_batch_t *b, const char *line);
+   extern void grid_batch_run(grid_batch_t *b, bool have_coords, double my_lat, double my_lon, outbuf_t *ob);
+   extern void grid_batch_free(grid_batch_t *b);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_grid_batch_h)
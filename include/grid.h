@@ -0,0 +1,24 @@
+#if	!defined(_grid_h)
+#define	_grid_h
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	GRID_MAX_LEN		10		// AA00aa00aa
+
+   // Maidenhead locator <-> WGS-84, center of the square. Grids are 2, 4, 6, 8
+   // or 10 characters, any case. norm (GRID_MAX_LEN + 1, may be NULL) gets the
+   // canonical form: FN31pr.
+   extern bool grid_decode(const char *grid, double *lat, double *lon, char *norm);
+   extern bool grid_encode(double lat, double lon, int len, char *buf);
+
+   // distance (km) and bearing from our station to each 4 character grid,
+   // worked out once at startup since the same few thousand show up all day
+   extern void grid_heading_init(double my_lat, double my_lon);
+   extern bool grid_heading(const char *grid, double *distance, double *bearing);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_grid_h)
@@ -0,0 +1,22 @@
+#if	!defined(_hamqth_h)
+#define _hamqth_h
+#include <stdio.h>
+#include <ev.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+#include "qrz-ratelimit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   extern void hamqth_register(void);
+   extern bool hamqth_start_session(struct ev_loop *loop);
+   extern bool hamqth_usable(void);
+   extern bool hamqth_login_pending(void);
+   extern void hamqth_set_online(bool online);
+   extern void hamqth_session_dump(outbuf_t *ob);
+   extern calldata_t *hamqth_lookup_callsign(const char *callsign, qrz_prio_t prio);
+#ifdef __cplusplus
+};
+#endif
+#endif	// !defined(_hamqth_h)
@@ -0,0 +1,49 @@
+#if	!defined(_heard_h)
+#define	_heard_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	HEARD_SLOTS		24		// buckets of history per station
+   #define	HEARD_SNR_NONE		INT8_MIN	// client didn't say
+   #define	HEARD_BAND_NONE		0
+
+   // requests for one station in one heard-bucket of time
+   typedef struct heard_bucket {
+      uint32_t		start;			// unix time, a multiple of the bucket width, 0 = unused
+      uint32_t		bands;			// 1 << band, for each band it was heard on
+      uint16_t		count;
+      int8_t		snr;			// best reported, HEARD_SNR_NONE if none were
+   } heard_bucket_t;
+
+   typedef struct heard_entry {
+      char		callsign[MAX_CALLSIGN];	// base call, upper case
+      uint32_t		hash;
+      uint32_t		total;			// requests since we started tracking it
+      time_t		first, last;
+      time_t		found;			// last time a lookup for it was answered, 0 = never
+      uint8_t		head;			// newest bucket in ring
+      heard_bucket_t	ring[HEARD_SLOTS];
+   } heard_entry_t;
+
+   extern bool heard_start(void);
+   extern void heard_stop(void);
+   extern int heard_band_parse(const char *s);
+   extern const heard_entry_t *heard_record(const char *callsign, int band, int snr);
+   extern const heard_entry_t *heard_find(const char *callsign);
+   extern void heard_found(const char *callsign);
+   extern void heard_each(void (*cb)(const heard_entry_t *e, void *priv), void *priv);
+   extern unsigned heard_recent(const heard_entry_t *e, uint32_t *bands, int *snr);
+   extern double heard_rate(const heard_entry_t *e);
+   extern void heard_query_dump(const char *arg, outbuf_t *ob);
+   extern void heard_dump(outbuf_t *ob);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_heard_h)
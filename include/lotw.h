@@ -0,0 +1,22 @@
+#if	!defined(_lotw_h)
+#define	_lotw_h
+#include <stdbool.h>
+#include <time.h>
+#include <ev.h>
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   extern bool use_lotw;
+   extern bool lotw_start(struct ev_loop *loop);
+   extern void lotw_cancel(void);
+   extern void lotw_stop(void);
+   extern time_t lotw_last_upload(const char *callsign);
+   extern void lotw_dump(outbuf_t *ob);
+   extern int lotw_each_callsign(void (*cb)(const char *callsign, void *priv), void *priv);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_lotw_h)
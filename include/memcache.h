@@ -0,0 +1,26 @@
+#if	!defined(_memcache_h)
+#define	_memcache_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "callrec.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // In-memory LRU cache of compact records, in front of the sqlite cache
+   extern bool memcache_init(int max_entries);
+   extern void memcache_fini(void);
+   extern callrec_t *memcache_find(const char *callsign);
+   extern void memcache_insert(callrec_t *rec);
+   extern void memcache_remove(const char *callsign);
+   extern int memcache_collect(callrec_t ***recs, uint64_t *gen);
+   extern int memcache_entries(void);
+   extern size_t memcache_bytes(void);
+   extern void memcache_dump(outbuf_t *ob);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_memcache_h)
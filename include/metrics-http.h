@@ -0,0 +1,17 @@
+#if	!defined(_metrics_http_h)
+#define	_metrics_http_h
+#include <stdbool.h>
+#include <stdio.h>
+#include <ev.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   extern bool metrics_http_init(struct ev_loop *loop, const char *listen_addr);
+   extern void metrics_http_fini(void);
+   extern void metrics_dump(FILE *fp);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_metrics_http_h)
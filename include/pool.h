@@ -0,0 +1,55 @@
+#if	!defined(_pool_h)
+#define	_pool_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // Counters shared by every thread's pool of the same kind
+   typedef struct pool_stats {
+      const char		*name;
+      size_t			obj_size;
+      _Atomic long		live;		// handed out, not returned yet
+      _Atomic long		high_water;	// most live at once
+      _Atomic uint64_t		gets;		// total pool_get()s
+      _Atomic uint64_t		heap;		// ... that had to malloc()
+      struct pool_stats		*next;
+   } pool_stats_t;
+
+   //
+   // Freelist of fixed size objects. A pool_t is NOT thread safe: give each
+   // thread it's own (__thread) and point them all at the same pool_stats_t.
+   // Objects may be returned to a different thread's pool than they came from.
+   //
+   typedef struct pool {
+      pool_stats_t	*stats;
+      void		*free_list;
+      int		n_free;
+      int		max_free;	// keep at most this many around, free() the rest
+   } pool_t;
+
+   #define	POOL_STATS_INIT(n, sz)		{ .name = (n), .obj_size = (sz) }
+   #define	POOL_INIT(st, max)		{ .stats = (st), .free_list = NULL, .n_free = 0, .max_free = (max) }
+
+   extern void *pool_get(pool_t *p);
+   extern void pool_put(pool_t *p, void *obj);
+   extern void pool_drain(pool_t *p);
+   extern void pool_stats_register(pool_stats_t *st);
+   extern void pools_dump(outbuf_t *ob);
+   extern void pools_dump_prometheus(FILE *fp);
+
+   // calldata_t from the calling thread's pool, zeroed
+   extern calldata_t *calldata_alloc(void);
+   extern void calldata_free(calldata_t *cd);
+   extern void calldata_pool_drain(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_pool_h)
@@ -0,0 +1,101 @@
+#if	!defined(_proto_h)
+#define	_proto_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ft8goblin_types.h"
+#include "callrec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // Reply formats a client can ask for with /PROTO
+   typedef enum proto_format {
+      PROTO_FMT_TEXT = 0,		// "Key: value" lines ending in +EOR (default)
+      PROTO_FMT_JSON,			// one JSON object per line
+      PROTO_FMT_BINARY,			// length prefixed TLV frames, see below
+      PROTO_FMT_MAX
+   } proto_format_t;
+
+   //
+   // Binary frames:
+   //	0x00 | type (1) | length (4, big endian) | length bytes of fields
+   //
+   // No text line starts with a NUL, so clients can tell frames from the
+   // +NOTICE lines etc that may come between them. Each field is
+   //	tag (1) | length (2, big endian) | value
+   // Integers are 8 byte big endian signed, doubles are 8 byte big endian
+   // IEEE-754, booleans are 1 byte and strings are not NUL terminated.
+   // Unknown tags should be skipped, so we can add more later.
+   //
+   #define	PROTO_FRAME_MARKER	0x00
+   #define	PROTO_FRAME_HDR_LEN	6
+
+   typedef enum proto_frame_type {
+      PROTO_FRAME_CALLDATA = 1,		// 200 OK
+      PROTO_FRAME_NOTFOUND = 2		// 404 NOT FOUND, only QUERY, ONLINE and TIME are sent
+   } proto_frame_type_t;
+
+   typedef enum proto_tag {
+      PROTO_TAG_CALLSIGN = 1,		// string
+      PROTO_TAG_QUERY,			// string, the callsign that was asked for
+      PROTO_TAG_ORIGIN,			// int, DATASRC_*
+      PROTO_TAG_ONLINE,			// bool
+      PROTO_TAG_TIME,			// int, unix time of the reply
+      PROTO_TAG_CACHED,			// bool
+      PROTO_TAG_CACHE_FETCHED,		// int, unix time
+      PROTO_TAG_CACHE_EXPIRY,		// int, unix time
+      PROTO_TAG_FIRST_NAME,		// string
+      PROTO_TAG_LAST_NAME,		// string
+      PROTO_TAG_CLASS,			// string
+      PROTO_TAG_GRID,			// string
+      PROTO_TAG_LATITUDE,		// double
+      PROTO_TAG_LONGITUDE,		// double
+      PROTO_TAG_DISTANCE,		// double, km from us
+      PROTO_TAG_BEARING,		// double, degrees from us
+      PROTO_TAG_ALIASES,		// string
+      PROTO_TAG_DXCC,			// int
+      PROTO_TAG_EMAIL,			// string
+      PROTO_TAG_ADDRESS1,		// string
+      PROTO_TAG_ADDRESS_ATTN,		// string
+      PROTO_TAG_ADDRESS2,		// string
+      PROTO_TAG_STATE,			// string
+      PROTO_TAG_ZIP,			// string
+      PROTO_TAG_COUNTY,			// string
+      PROTO_TAG_FIPS,			// string
+      PROTO_TAG_LICENSE_EFFECTIVE,	// int, unix time
+      PROTO_TAG_LICENSE_EXPIRY,		// int, unix time
+      PROTO_TAG_COUNTRY,		// string
+      PROTO_TAG_COUNTRY_CODE,		// int
+      PROTO_TAG_REQUEST_TAG,		// string, the client's /CALL#<tag>, if it gave one
+      PROTO_TAG_OP_CALLSIGN,		// string, the full call if it's portable (VE3/K1ABC/P), the rest are only sent with it
+      PROTO_TAG_OP_ENTITY,		// string, where they're operating from (cty.dat)
+      PROTO_TAG_OP_PREFIX,		// string, that entity's primary prefix
+      PROTO_TAG_OP_CONTINENT,		// string
+      PROTO_TAG_OP_CQ_ZONE,		// int
+      PROTO_TAG_OP_ITU_ZONE,		// int
+      PROTO_TAG_LOTW_UPLOAD,		// int, unix time of their last LoTW upload (only if they're a LoTW user)
+      PROTO_TAG_SUGGESTION,		// string, "CALL SCORE", not found frames only, one per suggestion, best first
+      PROTO_TAG_HEARD_LAST,		// int, unix time a client last asked about them (only if one has since we started)
+      PROTO_TAG_HEARD_COUNT,		// int, how many times they've been asked about
+      PROTO_TAG_HEARD_RATE		// double, requests an hour lately
+   } proto_tag_t;
+
+   // growable buffer to encode a whole record into
+   typedef struct proto_buf {
+      char	*data;
+      size_t	len, size;
+   } proto_buf_t;
+
+   extern const char *proto_format_name[PROTO_FMT_MAX + 1];
+   extern int proto_parse_format(const char *name);
+   extern void proto_buf_append(proto_buf_t *b, const void *data, size_t len);
+   extern void proto_buf_reset(proto_buf_t *b);
+   extern void proto_buf_free(proto_buf_t *b);
+   extern bool proto_encode_calldata(proto_buf_t *b, proto_format_t fmt, const callrec_t *cd, const char *query, const char *tag);
+   extern void proto_fini(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_proto_h)
@@ -0,0 +1,36 @@
+#if	!defined(_qrz_ratelimit_h)
+#define	_qrz_ratelimit_h
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // Request priorities, lower values are served first
+   typedef enum qrz_prio {
+      QRZ_PRIO_INTERACTIVE = 0,		// /CALL from a client
+      QRZ_PRIO_BATCH,			// command line or bulk lookups
+      QRZ_PRIO_PREFETCH,		// prefetch and cache refresh
+      QRZ_PRIO_MAX
+   } qrz_prio_t;
+
+   // called by qrz_sched_run() for each deferred request that got a token
+   typedef void (*qrz_sched_cb_t)(const char *callsign, qrz_prio_t prio);
+
+   extern void qrz_ratelimit_init(void);
+   extern bool qrz_sched_try(qrz_prio_t prio);
+   extern bool qrz_sched_enqueue(const char *callsign, qrz_prio_t prio);
+   extern int qrz_sched_run(qrz_sched_cb_t cb);
+   extern void qrz_ratelimit_sync_count(int count);
+   extern int qrz_sched_queue_depth(qrz_prio_t prio);
+   extern int qrz_budget_remaining(void);
+   extern void qrz_ratelimit_dump(outbuf_t *ob);
+   extern void qrz_ratelimit_dump_prometheus(FILE *fp);
+   extern const char *qrz_prio_name[QRZ_PRIO_MAX + 1];
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_qrz_ratelimit_h)
@@ -1,6 +1,10 @@
 #if	!defined(_qrz_xml_h)
 #define _qrz_xml_h
+#include <stdio.h>
+#include <ev.h>
 #include "ft8goblin_types.h"
+#include "client.h"
+#include "qrz-ratelimit.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,8 +25,15 @@ extern "C" {
       char	*last_error;	// point to last error message (must be freed() and NULLed!)
    } qrz_session_t;
 
-   extern bool qrz_start_session(void);
-   extern calldata_t *qrz_lookup_callsign(const char *callsign);
+   extern bool qrz_start_session(struct ev_loop *loop);
+   extern bool qrz_usable(void);
+   extern bool qrz_login_pending(void);
+   extern void qrz_set_online(bool online);
+   extern void qrz_session_dump(outbuf_t *ob);
+   extern void qrz_session_dump_prometheus(FILE *fp);
+   extern calldata_t *qrz_lookup_callsign(const char *callsign, qrz_prio_t prio);
+   extern void http_init(void);
+   extern bool http_post(const char *url, const char *postdata, char *buf, size_t bufsz);
    extern Config_t Config;		// from clalsign-lookup.c
 #ifdef __cplusplus
 };
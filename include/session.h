@@ -0,0 +1,72 @@
+#if	!defined(_session_h)
+#define	_session_h
+#include <stdbool.h>
+#include <pthread.h>
+#include <ev.h>
+#include "workers.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   typedef enum session_state {
+      SESSION_OFFLINE = 0,		// not logged in, waiting on the retry timer
+      SESSION_REAUTH,			// (re)logging in, ex: session key expired
+      SESSION_ONLINE,			// logged in and answering
+      SESSION_DEGRADED			// logged in, but recent requests are failing
+   } session_state_t;
+
+   typedef enum session_login_res {
+      SESSION_LOGIN_OK = 0,
+      SESSION_LOGIN_FAILED,		// network or server trouble, retry with backoff
+      SESSION_LOGIN_DENIED		// bad credentials, don't bother until retry-delay
+   } session_login_res_t;
+
+   struct online_session;
+   typedef session_login_res_t (*session_login_cb_t)(struct online_session *s);
+   typedef void (*session_change_cb_t)(struct online_session *s, session_state_t old_state);
+
+   typedef struct online_session {
+      work_t		login_work;	// login runs on a worker thread (must be first)
+      const char	*name;		// service name, for logging
+      session_state_t	state;
+      session_state_t	reported_state;	// last state we told everyone about
+      bool		manual_offline;	// user sent /OFFLINE, don't retry on our own
+      bool		login_busy;	// login_work is queued, running or waiting on its done()
+      int		attempts;	// logins tried since startup
+      int		tries;		// consecutive failed logins
+      int		max_tries;	// failed logins before waiting backoff_max
+      int		failures;	// consecutive failed requests
+      int		max_failures;	// failed requests before going offline
+      ev_tstamp		backoff;	// current retry delay
+      ev_tstamp		backoff_min, backoff_max;
+      ev_tstamp		last_change;	// when did we enter this state?
+      ev_tstamp		last_login;	// when did we last log in succesfully?
+      bool		retry_pending;	// retry_timer needs (re)starting from the loop
+      ev_tstamp		retry_delay;
+      ev_timer		retry_timer;
+      ev_async		notify;		// wakes the loop to report changes / start timers
+      pthread_mutex_t	lock;		// protects everything above
+      pthread_mutex_t	login_lock;	// only one login at a time
+      struct ev_loop	*loop;
+      session_login_cb_t	login;
+      session_change_cb_t	on_change;
+      void		*priv;		// for the service's use
+   } online_session_t;
+
+   extern const char *session_state_name[5];
+   extern void session_init(online_session_t *s, const char *name, struct ev_loop *loop, session_login_cb_t login);
+   extern void session_start(online_session_t *s);
+   extern void session_retry_now(online_session_t *s);
+   extern void session_force_offline(online_session_t *s);
+   extern void session_request_ok(online_session_t *s);
+   extern void session_request_failed(online_session_t *s);
+   extern bool session_expired(online_session_t *s);
+   extern bool session_usable(online_session_t *s);
+   extern session_state_t session_get_state(online_session_t *s);
+   extern ev_tstamp session_retry_in(const online_session_t *s);
+   extern bool session_login_pending(online_session_t *s);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_session_h)
@@ -0,0 +1,123 @@
+#if	!defined(_shm_ring_h)
+#define	_shm_ring_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   //
+   // Shared memory lookup channel, for clients on the same box (ex: ft8goblin)
+   //
+   // Connect to the unix socket in cfg:callsign-lookup/shm-listen and read the
+   // hello line "+SHM <version> <segment bytes>\n", which carries 3 fds in
+   // SCM_RIGHTS: the memfd segment, the request eventfd and the response eventfd.
+   // mmap() the segment, it starts with a shm_hdr_t. Then:
+   //	- write requests into hdr->req and write(2) 1 to the request eventfd
+   //	- wait on the response eventfd, read(2) it, then drain hdr->resp
+   //	- if SHM_F_RESP_FULL is set after draining, kick the request eventfd
+   //	  so we send the replies that didn't fit
+   // Closing the socket ends the session.
+   //
+   // Each ring has exactly one producer and one consumer. A record is a 4 byte
+   // length and that many bytes, padded to 4. A length of SHM_REC_WRAP means
+   // skip to the start of the ring.
+   //
+   // Request record:	id (4, native endian) | callsign (NUL terminated)
+   // Response record:	binary reply frame (see proto.h), with REQUEST_TAG
+   //			set to the decimal id
+   //
+   #define	SHM_MAGIC		0x4b4c4c43	// "CLLK"
+   #define	SHM_VERSION		1
+   #define	SHM_REC_WRAP		0xffffffffu
+   #define	SHM_F_RESP_FULL		0x01		// server has replies waiting for room
+
+   typedef struct shm_ring {
+      _Atomic uint32_t	head __attribute__((aligned(64)));	// producer: next byte to write (free running)
+      _Atomic uint32_t	tail __attribute__((aligned(64)));	// consumer: next byte to read
+      uint32_t		size __attribute__((aligned(64)));	// bytes, power of 2
+      uint32_t		offset;					// of the data, from the start of the segment
+   } shm_ring_t;
+
+   typedef struct shm_hdr {
+      uint32_t		magic;
+      uint32_t		version;
+      _Atomic uint32_t	flags;
+      shm_ring_t	req;			// client -> server
+      shm_ring_t	resp;			// server -> client
+   } shm_hdr_t;
+
+   static inline uint32_t shm_rec_space(uint32_t len) {
+      return 4 + ((len + 3) & ~3u);
+   }
+
+   // Producer: add a record, false if there isn't room for it right now
+   static inline bool shm_ring_put(shm_ring_t *r, char *base, const void *data, uint32_t len) {
+      char *buf = base + r->offset;
+      uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+      uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+      uint32_t pos = head & (r->size - 1);
+      uint32_t need = shm_rec_space(len), skip = 0;
+
+      if (need > r->size / 2) {
+         return false;
+      }
+
+      // doesn't fit before the end? waste the rest and start over at 0
+      if (pos + need > r->size) {
+         skip = r->size - pos;
+      }
+
+      if ((head - tail) + skip + need > r->size) {
+         return false;
+      }
+
+      if (skip > 0) {
+         uint32_t wrap = SHM_REC_WRAP;
+         memcpy(buf + pos, &wrap, 4);
+         pos = 0;
+      }
+
+      memcpy(buf + pos, &len, 4);
+      memcpy(buf + pos + 4, data, len);
+      atomic_store_explicit(&r->head, head + skip + need, memory_order_release);
+      return true;
+   }
+
+   // Consumer: next record (pointing into the ring), NULL if empty. Call shm_ring_done() after using it
+   static inline const void *shm_ring_peek(shm_ring_t *r, char *base, uint32_t *len) {
+      char *buf = base + r->offset;
+      uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+      uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+      while (tail != head) {
+         uint32_t pos = tail & (r->size - 1), l;
+
+         memcpy(&l, buf + pos, 4);
+         if (l == SHM_REC_WRAP) {
+            tail += r->size - pos;
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+            continue;
+         }
+
+         if (l > r->size / 2) {		// corrupt, the other side is broken
+            return NULL;
+         }
+         *len = l;
+         return buf + pos + 4;
+      }
+      return NULL;
+   }
+
+   static inline void shm_ring_done(shm_ring_t *r, uint32_t len) {
+      uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+      atomic_store_explicit(&r->tail, tail + shm_rec_space(len), memory_order_release);
+   }
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_shm_ring_h)
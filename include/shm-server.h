@@ -0,0 +1,16 @@
+#if	!defined(_shm_server_h)
+#define	_shm_server_h
+#include <stdbool.h>
+#include <ev.h>
+#include "shm-ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   extern bool shm_server_init(struct ev_loop *loop, const char *path);
+   extern void shm_server_fini(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_shm_server_h)
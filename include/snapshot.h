@@ -0,0 +1,118 @@
+#if	!defined(_snapshot_h)
+#define	_snapshot_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <ev.h>
+#include "callrec.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   //
+   // Read-only snapshot of the memory cache, for local tools to mmap
+   //
+   // Written every cfg:callsign-lookup/snapshot-interval to a temporary file
+   // and renamed over cfg:callsign-lookup/snapshot-file, so a reader never sees
+   // a partial file. A mapping stays valid after the file is replaced; stat()
+   // the path now and then and remap when the inode changes.
+   //
+   // Layout (native endian, everything 8 byte aligned):
+   //	snapshot_hdr_t
+   //	snapshot_slot_t[index_slots]	open addressing on snapshot_hash(), off 0 = empty
+   //	uint32_t[n_strings + 1]		interned string offsets, from the end of this table
+   //	interned strings		NUL terminated, id 0 is ""
+   //	records				callrec_t images, refs is always 0
+   //
+   // Use snapshot_str(rec, CR_GRID) for the record's own strings and
+   // snapshot_string(map, rec->interned[CR_STATE]) for interned ones, the ids
+   // in a record are only good for the snapshot it came from. rec_size changes
+   // whenever callrec_t does. Only this header is needed, nothing to link.
+   //
+   #define	SNAPSHOT_MAGIC		0x53534c43	// "CLSS"
+   #define	SNAPSHOT_VERSION	1
+
+   typedef struct snapshot_hdr {
+      uint32_t		magic;
+      uint32_t		version;
+      uint32_t		rec_size;		// sizeof(callrec_t) of the writer
+      uint32_t		n_records;
+      uint32_t		index_slots;		// power of 2
+      uint32_t		n_strings;
+      int64_t		created;		// unix time
+      uint64_t		index_off;
+      uint64_t		strings_off;
+      uint64_t		records_off;
+      uint64_t		file_len;
+   } snapshot_hdr_t;
+
+   typedef struct snapshot_slot {
+      uint32_t		hash;
+      uint32_t		off;			// of the record, from the start of the file
+   } snapshot_slot_t;
+
+   // FNV-1a of the upper cased callsign
+   static inline uint32_t snapshot_hash(const char *callsign) {
+      uint32_t h = 2166136261u;
+
+      while (*callsign != '\0') {
+         h ^= (uint8_t)toupper((unsigned char)*callsign++);
+         h *= 16777619u;
+      }
+      return h;
+   }
+
+   // Sanity check a mapped snapshot, NULL if it's not one we understand
+   static inline const snapshot_hdr_t *snapshot_check(const void *map, size_t len) {
+      const snapshot_hdr_t *h = (const snapshot_hdr_t *)map;
+
+      if (map == NULL || len < sizeof(snapshot_hdr_t) || h->magic != SNAPSHOT_MAGIC ||
+          h->version != SNAPSHOT_VERSION || h->rec_size != sizeof(callrec_t) || h->file_len != len) {
+         return NULL;
+      }
+      return h;
+   }
+
+   static inline const char *snapshot_str(const callrec_t *rec, callrec_str_t which) {
+      return rec->blob + rec->str[which].off;
+   }
+
+   static inline const callrec_t *snapshot_find(const void *map, const char *callsign) {
+      const snapshot_hdr_t *h = (const snapshot_hdr_t *)map;
+      const snapshot_slot_t *index = (const snapshot_slot_t *)((const char *)map + h->index_off);
+      uint32_t hash = snapshot_hash(callsign), mask = h->index_slots - 1;
+
+      for (uint32_t i = hash & mask; index[i].off != 0; i = (i + 1) & mask) {
+         const callrec_t *rec = (const callrec_t *)((const char *)map + index[i].off);
+
+         if (index[i].hash == hash && strcasecmp(snapshot_str(rec, CR_CALLSIGN), callsign) == 0) {
+            return rec;
+         }
+      }
+      return NULL;
+   }
+
+   static inline const char *snapshot_string(const void *map, uint16_t id) {
+      const snapshot_hdr_t *h = (const snapshot_hdr_t *)map;
+      const uint32_t *offs = (const uint32_t *)((const char *)map + h->strings_off);
+
+      if (id > h->n_strings) {
+         return "";
+      }
+      return (const char *)(offs + h->n_strings + 1) + offs[id];
+   }
+
+   // daemon side
+   extern bool snapshot_init(struct ev_loop *loop, const char *path, time_t interval);
+   extern void snapshot_fini(void);
+   extern void snapshot_dump(outbuf_t *ob);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_snapshot_h)
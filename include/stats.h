@@ -0,0 +1,63 @@
+#if	!defined(_stats_h)
+#define	_stats_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   // Stages of a lookup that we keep latency histograms for
+   typedef enum stat_stage {
+      STAT_REQUEST = 0,			// whole request, submit to reply
+      STAT_CACHE_FIND,			// sqlite cache SELECT
+      STAT_ULS,				// FCC ULS lookup
+      STAT_QRZ_HTTP,			// QRZ XML API round trip
+      STAT_HAMQTH_HTTP,			// HamQTH XML API round trip
+      STAT_XML_PARSE,			// parsing the QRZ reply
+      STAT_CACHE_SAVE,			// sqlite cache INSERT
+      STAT_RESPONSE_WRITE,		// formatting and writing the reply
+      STAT_STAGE_MAX
+   } stat_stage_t;
+
+   // What the cache had for us
+   typedef enum stat_cache {
+      STAT_CACHE_HIT = 0,
+      STAT_CACHE_MISS,
+      STAT_CACHE_STALE,			// expired, but returned anyways (offline)
+      STAT_CACHE_MAX
+   } stat_cache_t;
+
+   #define	STAT_ORIGIN_MAX		(DATASRC_MAX + 1)	// every DATASRC_* plus not found
+   #define	STAT_ORIGIN_NOTFOUND	DATASRC_MAX
+
+   extern const char *stat_stage_name[STAT_STAGE_MAX + 1];
+
+   // monotonic nanoseconds, cheap enough (vDSO) to call around every stage
+   static inline uint64_t stats_now(void) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+   }
+
+   extern void stats_init(void);
+   extern void stats_record(stat_stage_t stage, uint64_t start_ns);
+   extern void stats_record_usec(stat_stage_t stage, uint64_t usec);
+   extern void stats_count_origin(int origin);
+   extern void stats_count_cache(stat_cache_t what);
+   extern uint64_t stats_cache_count(stat_cache_t what);
+   extern uint64_t stats_percentile(stat_stage_t stage, double pct);
+   extern uint64_t stats_count(stat_stage_t stage);
+   extern uint64_t stats_origin_count(int origin);
+   extern long stats_rss_kb(void);
+   extern void stats_dump(outbuf_t *ob);
+   extern void stats_log(void);
+   extern void stats_dump_prometheus(FILE *fp);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_stats_h)
@@ -0,0 +1,48 @@
+#if	!defined(_watch_h)
+#define	_watch_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	WATCH_TAG		"watch"		// request tag on pushed replies
+
+   typedef enum watch_state {
+      WATCH_LOOKUP = 0,			// lookup in flight
+      WATCH_ANSWERED,			// got a full answer
+      WATCH_UNRESOLVED			// not found (or ULS only), push QRZ data if it turns up later
+   } watch_state_t;
+
+   typedef struct watch_entry {
+      char		callsign[MAX_CALLSIGN];	// base call (callsign_normalize()), "" = empty slot
+      char		query[MAX_CALLSIGN];	// as decoded, normalized (VE3/K1ABC/P), what we look up
+      time_t		seen;			// last decoded
+      uint8_t		state;			// watch_state_t
+   } watch_entry_t;
+
+   // A client in /WATCH mode, and the callsigns it's decoded recently
+   typedef struct watch {
+      client_t		*cl;
+      time_t		window;			// ignore repeats this close together
+      int		size, used;		// open addressing, size is a power of 2
+      watch_entry_t	*table;
+      uint64_t		decodes, dups, lookups, pushed, enriched, refused;
+      time_t		rehashed;		// last watch_rehash(), at most once a second once it's as big as it gets
+      struct watch	*next;
+   } watch_t;
+
+   extern watch_t *watch_start(client_t *cl, time_t window);
+   extern void watch_stop(watch_t *w);
+   extern watch_entry_t *watch_decode(watch_t *w, const char *callsign);
+   extern watch_entry_t *watch_find(watch_t *w, const char *callsign);
+   extern watch_t *watch_list(void);
+   extern void watch_dump(watch_t *w, outbuf_t *ob);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_watch_h)
@@ -0,0 +1,43 @@
+#if	!defined(_workers_h)
+#define	_workers_h
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <ev.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+   #define	WORK_PRIO_MAX	3		// matches QRZ_PRIO_MAX
+
+   // A unit of blocking work. Embed this as the first member of your request.
+   typedef struct work {
+      struct work * _Atomic next;		// queue link (owned by whichever queue holds it)
+      int		prio;			// 0 is served first
+      void		(*run)(struct work *w);	// runs on a worker thread
+      void		(*done)(struct work *w);	// runs on the loop thread after run() (may be NULL)
+   } work_t;
+
+   // Lock-free multi-producer, single-consumer queue (intrusive, Vyukov style)
+   typedef struct mpsc_queue {
+      work_t * _Atomic	head;		// producers push here
+      work_t		*tail;		// consumer pops here
+      work_t		stub;
+   } mpsc_queue_t;
+
+   typedef void (*worker_thread_cb_t)(int id);
+
+   extern void mpsc_init(mpsc_queue_t *q);
+   extern void mpsc_push(mpsc_queue_t *q, work_t *w);
+   extern work_t *mpsc_pop(mpsc_queue_t *q);
+
+   extern bool workers_init(struct ev_loop *loop, int nthreads, worker_thread_cb_t thread_init, worker_thread_cb_t thread_fini);
+   extern void workers_submit(work_t *w);
+   extern void workers_stop(void);
+   extern int workers_queue_depth(void);
+   extern int workers_busy(void);
+   extern int workers_count(void);
+#ifdef __cplusplus
+};
+#endif
+
+#endif	// !defined(_workers_h)
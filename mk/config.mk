@@ -10,7 +10,7 @@ POSTGRESQL=n
 
 # required libraries: -l${x} will be expanded later...
 common_libs += yajl ev
-callsign_lookup_libs += m curl ied termbox2
+callsign_lookup_libs += m curl ied termbox2 pthread
 
 # If building DEBUG release
 ifeq (${DEBUG},y)
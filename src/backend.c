@@ -0,0 +1,267 @@
+/*
+ * The lookup chain: where answers come from, in what order
+ *
+ * callsign-lookup/backends lists the backends to ask, tiers separated by
+ * commas and backends that race each other within a tier by |, ex:
+ *	"cache,qrz|uls"
+ * asks the sqlite cache first, then QRZ and the ULS at the same time, and
+ * whichever answers first wins (a local ULS hit doesn't wait on QRZ). Each
+ * backend has a latency budget (callsign-lookup/backend-timeouts/<name>, ms),
+ * once it's spent the chain stops waiting for that one.
+ *
+ * Put hamqth after qrz ("cache,qrz,hamqth,uls") to fall back on it when QRZ
+ * is down or out of quota.
+ *
+ * Backends register themselves with backend_register() before
+ * backends_init() runs. The chain is built once at startup and read-only
+ * after that; the counters are atomic since workers bump them too.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <libied/cfg.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "callsign-lookup.h"
+#include "fcc-db.h"
+#include "qrz-xml.h"
+#include "qrz-ratelimit.h"
+#include "hamqth.h"
+#include "stats.h"
+#include "backend.h"
+
+#define	BACKEND_DEFAULT_CHAIN	"cache,qrz,uls"
+
+extern struct Config Config;	// in callsign-lookup.c
+extern time_t now;
+
+static lookup_backend_t *backends[BACKEND_MAX];
+static int n_backends = 0;
+static backend_tier_t tiers[BACKEND_TIER_MAX];
+static int n_tiers = 0;
+
+///////////
+// cache //
+///////////
+static bool backend_cache_usable(void) {
+   return Config.use_cache;
+}
+
+static calldata_t *backend_cache_lookup(const char *callsign, qrz_prio_t prio, const atomic_bool *cancelled) {
+   uint64_t t_stage = stats_now();
+   calldata_t *cd = callsign_cache_find(callsign);
+
+   stats_record(STAT_CACHE_FIND, t_stage);
+
+   if (cd == NULL) {
+      stats_count_cache(STAT_CACHE_MISS);
+      return NULL;
+   }
+   stats_count_cache(cd->cache_expiry <= now ? STAT_CACHE_STALE : STAT_CACHE_HIT);
+   log_send(mainlog, LOG_DEBUG, "got cached calldata for %s", callsign);
+
+   // is it due for a refresh? queue it up behind the real requests
+   if (!Config.offline && Config.use_qrz && Config.cache_refresh_time > 0 &&
+       cd->origin != DATASRC_ULS && (cd->cache_fetched + Config.cache_refresh_time) <= now) {
+      qrz_sched_enqueue(callsign, QRZ_PRIO_PREFETCH);
+   }
+   return cd;
+}
+
+static lookup_backend_t backend_cache = {
+   .name = "cache",
+   .origin = DATASRC_CACHE,
+   .default_timeout_ms = 1000,
+   .usable = backend_cache_usable,
+   .lookup = backend_cache_lookup
+};
+
+/////////
+// QRZ //
+/////////
+// if we're offline, the QRZ session state machine is already working on getting us back online
+static bool backend_qrz_usable(void) {
+   return (Config.use_qrz && qrz_usable());
+}
+
+static calldata_t *backend_qrz_lookup(const char *callsign, qrz_prio_t prio, const atomic_bool *cancelled) {
+   calldata_t *cd = NULL;
+
+   // don't spend a token on something that's already been answered
+   if (atomic_load(cancelled)) {
+      return NULL;
+   }
+
+   if (!qrz_sched_try(prio)) {
+      // out of tokens or budget, let the scheduler send it when it can, so it'll be in cache next time
+      log_send(mainlog, LOG_INFO, "qrz rate limited, deferring %s lookup for %s", qrz_prio_name[prio], callsign);
+      qrz_sched_enqueue(callsign, prio);
+   } else if ((cd = qrz_lookup_callsign(callsign, prio)) != NULL) {
+      log_send(mainlog, LOG_DEBUG, "got qrz calldata for %s", callsign);
+   }
+   return cd;
+}
+
+static lookup_backend_t backend_qrz = {
+   .name = "qrz",
+   .origin = DATASRC_QRZ,
+   .online = true,
+   .default_timeout_ms = 10000,
+   .usable = backend_qrz_usable,
+   .lookup = backend_qrz_lookup
+};
+
+/////////
+// ULS //
+/////////
+static bool backend_uls_usable(void) {
+   return Config.use_uls;
+}
+
+static calldata_t *backend_uls_lookup(const char *callsign, qrz_prio_t prio, const atomic_bool *cancelled) {
+   uint64_t t_stage = stats_now();
+   calldata_t *cd = uls_lookup_callsign(callsign);
+
+   stats_record(STAT_ULS, t_stage);
+
+   if (cd != NULL) {
+      log_send(mainlog, LOG_DEBUG, "got uls calldata for %s", callsign);
+   }
+   return cd;
+}
+
+static lookup_backend_t backend_uls = {
+   .name = "uls",
+   .origin = DATASRC_ULS,
+   .default_timeout_ms = 1000,
+   .usable = backend_uls_usable,
+   .lookup = backend_uls_lookup
+};
+
+///////////
+// chain //
+///////////
+bool backend_register(lookup_backend_t *b) {
+   for (int i = 0; i < n_backends; i++) {
+      if (strcasecmp(backends[i]->name, b->name) == 0) {
+         return true;
+      }
+   }
+
+   if (n_backends >= BACKEND_MAX) {
+      log_send(mainlog, LOG_WARNING, "backend: can't register %s, already have %d", b->name, BACKEND_MAX);
+      return false;
+   }
+   backends[n_backends++] = b;
+   return true;
+}
+
+static lookup_backend_t *backend_find(const char *name) {
+   for (int i = 0; i < n_backends; i++) {
+      if (strcasecmp(backends[i]->name, name) == 0) {
+         return backends[i];
+      }
+   }
+   return NULL;
+}
+
+// build the chain from cfg:callsign-lookup/backends (ex: "cache,qrz|uls")
+void backends_init(const char *chain) {
+   char buf[256], *tier_sp = NULL;
+
+   backend_register(&backend_cache);
+   backend_register(&backend_qrz);
+   backend_register(&backend_uls);
+   hamqth_register();
+
+   if (chain == NULL || *chain == '\0') {
+      chain = BACKEND_DEFAULT_CHAIN;
+   }
+   snprintf(buf, sizeof(buf), "%s", chain);
+   memset(tiers, 0, sizeof(tiers));
+   n_tiers = 0;
+
+   for (char *t = strtok_r(buf, ",", &tier_sp); t != NULL && n_tiers < BACKEND_TIER_MAX; t = strtok_r(NULL, ",", &tier_sp)) {
+      backend_tier_t *tier = &tiers[n_tiers];
+      char *sp = NULL;
+
+      for (char *name = strtok_r(t, "| \t", &sp); name != NULL; name = strtok_r(NULL, "| \t", &sp)) {
+         lookup_backend_t *b = backend_find(name);
+         char key[128];
+
+         if (b == NULL) {
+            log_send(mainlog, LOG_WARNING, "backend: unknown backend %s in callsign-lookup/backends, ignoring it", name);
+            continue;
+         }
+
+         if (tier->n >= BACKEND_MAX) {
+            break;
+         }
+
+         snprintf(key, sizeof(key), "callsign-lookup/backend-timeouts/%s", b->name);
+         b->timeout_ms = cfg_get_int(cfg, key);
+         if (b->timeout_ms <= 0) {
+            b->timeout_ms = b->default_timeout_ms;
+         }
+         b->tier = n_tiers;
+         tier->backend[tier->n++] = b;
+      }
+
+      if (tier->n > 0) {
+         n_tiers++;
+      }
+   }
+
+   for (int i = 0; i < n_tiers; i++) {
+      char line[256];
+      size_t len = 0;
+
+      line[0] = '\0';
+      for (int j = 0; j < tiers[i].n; j++) {
+         len += snprintf(line + len, sizeof(line) - len, "%s%s(%dms)", (j > 0 ? " | " : ""), tiers[i].backend[j]->name, tiers[i].backend[j]->timeout_ms);
+         if (len >= sizeof(line)) {
+            break;
+         }
+      }
+      log_send(mainlog, LOG_INFO, "backend: tier %d: %s", i + 1, line);
+   }
+}
+
+int backend_tiers(void) {
+   return n_tiers;
+}
+
+const backend_tier_t *backend_tier(int tier) {
+   return (tier >= 0 && tier < n_tiers ? &tiers[tier] : NULL);
+}
+
+// an online session changed state: we're only offline if none of the online backends can answer
+void backends_online_changed(void) {
+   bool any = false;
+
+   for (int i = 0; i < n_backends; i++) {
+      if (backends[i]->online && backends[i]->usable()) {
+         any = true;
+         break;
+      }
+   }
+   Config.offline = !any;
+}
+
+// for /STATS
+void backends_dump(outbuf_t *ob) {
+   for (int i = 0; i < n_tiers; i++) {
+      for (int j = 0; j < tiers[i].n; j++) {
+         lookup_backend_t *b = tiers[i].backend[j];
+
+         outbuf_printf(ob, "Backend-%s: tier %d, %d ms budget, %lu asked, %lu answered, %lu missed, %lu timed out, %lu cancelled\n",
+               b->name, i + 1, b->timeout_ms, atomic_load(&b->asked), atomic_load(&b->answered), atomic_load(&b->missed),
+               atomic_load(&b->timeouts), atomic_load(&b->cancelled));
+      }
+   }
+}
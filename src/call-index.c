@@ -0,0 +1,887 @@
+/*
+ * Callsign index for /SEARCH: every call we know of, sorted
+ *
+ * The union of the sqlite cache, the ULS and the LoTW user list, as one
+ * sorted array (offsets into a string blob, 8 bytes a call plus the call
+ * itself). Each call remembers which of those it came from.
+ *
+ * Queries:
+ *	K1A*	prefix, a binary search and a scan of just that range
+ *	K1AB?	wildcards (? one character, * any number), the literal part in
+ *		front of the first wildcard narrows the range the same way
+ *	K1ABX	exact, plus every call one edit away (deletion, insertion,
+ *		substitution or swap of neighbours), each candidate is a binary
+ *		search, so fixing a busted decode takes microseconds
+ *
+ * Results are ranked by edit distance, then how many sources know the call
+ * (a call in the ULS and on LoTW is more likely real than one seen once),
+ * then length, then alphabetically.
+ *
+ * It's rebuilt on a worker at startup, every search-index-refresh and when
+ * the LoTW list is reloaded, and swapped in under a rwlock like lotw.c.
+ *
+ * Busted calls: FT8 decodes now and then come out one character off, and
+ * then they miss every backend. With correct-misses on, a 404 suggests the
+ * known calls one edit away. That needs to be cheap enough to do for every
+ * miss in a decode cycle, so the build also makes a SymSpell style deletion
+ * index: the hash of every call and of every call with one character
+ * deleted, sorted. Any call within one edit of a query shares one of those
+ * with it, so a query is len+1 binary searches, then each hit is checked
+ * for real. Calls we've answered lately (not in the index until the next
+ * rebuild) are checked by a scan of the heard table (heard.c), and
+ * suggestions must have a prefix cty.dat knows (if it's loaded).
+ */
+#define	_GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <ev.h>
+#include <libied/cfg.h>
+#include <libied/debuglog.h>
+#include <libied/util.h>
+#include "ft8goblin_types.h"
+#include "callsign-lookup.h"
+#include "fcc-db.h"
+#include "lotw.h"
+#include "cty.h"
+#include "callsign-norm.h"
+#include "stats.h"
+#include "workers.h"
+#include "client.h"
+#include "heard.h"
+#include "call-index.h"
+
+#define	CALLIDX_DEFAULT_RESULTS	20		// cfg:callsign-lookup/search-max-results
+#define	CALLIDX_ALPHABET	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ/"
+#define	CALLIDX_FIX_DEFAULT	3		// cfg:callsign-lookup/correct-max
+
+// kinds of edit, the first ones are the likelier decode errors
+typedef enum callidx_edit {
+   EDIT_NONE = 0,
+   EDIT_SUBST,
+   EDIT_SWAP,
+   EDIT_INDEL,
+   EDIT_FAR				// more than one edit
+} callidx_edit_t;
+
+typedef struct callidx_del {
+   uint32_t	hash;			// of a call, or a call with one character deleted
+   uint32_t	entry;
+} callidx_del_t;
+
+typedef struct callidx_entry {
+   uint32_t	off;			// into blob
+   uint8_t	len;
+   uint8_t	src;			// CALLIDX_SRC_*
+} callidx_entry_t;
+
+typedef struct callidx {
+   char			*blob;
+   size_t		blob_len, blob_size;
+   callidx_entry_t	*e;
+   uint32_t		n, size;
+   uint32_t		from[3];	// how many came from cache, uls, lotw
+   callidx_del_t	*dels;		// deletion index, sorted by hash (only with correct-misses)
+   uint32_t		ndels;
+   uint64_t		build_usec;
+} callidx_t;
+
+typedef struct callidx_build {
+   work_t	work;			// must be first
+   callidx_t	*idx;
+   uint8_t	src;			// source being added
+} callidx_build_t;
+
+extern struct Config Config;	// in callsign-lookup.c
+static callidx_t *callidx_cur = NULL;
+static pthread_rwlock_t callidx_lock = PTHREAD_RWLOCK_INITIALIZER;	// protects callidx_cur, the index itself is read-only
+static time_t callidx_built = 0;
+static callidx_build_t *callidx_busy = NULL;	// loop thread only
+static bool callidx_again = false;		// asked to rebuild while one was running
+static struct ev_loop *callidx_loop = NULL;
+static ev_timer callidx_timer;
+static bool callidx_fix_on = false;		// cfg:callsign-lookup/correct-misses
+static int callidx_fix_max = CALLIDX_FIX_DEFAULT;
+static uint64_t callidx_fixes = 0, callidx_fixed = 0, callidx_fix_usec = 0;
+
+static void callidx_free(callidx_t *idx) {
+   if (idx == NULL) {
+      return;
+   }
+   free(idx->blob);
+   free(idx->e);
+   free(idx->dels);
+   free(idx);
+}
+
+static const char *callidx_str(const callidx_t *idx, const callidx_entry_t *e) {
+   return idx->blob + e->off;
+}
+
+// same order as strcmp(), for a key that isn't NUL terminated
+static int callidx_cmp_key(const callidx_t *idx, const callidx_entry_t *e, const char *key, size_t klen) {
+   size_t n = (e->len < klen ? e->len : klen);
+   int rc = memcmp(callidx_str(idx, e), key, n);
+
+   if (rc != 0) {
+      return rc;
+   }
+   return (int)e->len - (int)klen;
+}
+
+static int callidx_cmp_entry(const void *a, const void *b, void *priv) {
+   const callidx_t *idx = (const callidx_t *)priv;
+   const callidx_entry_t *eb = (const callidx_entry_t *)b;
+
+   return callidx_cmp_key(idx, (const callidx_entry_t *)a, callidx_str(idx, eb), eb->len);
+}
+
+// first entry >= key
+static uint32_t callidx_lower_bound(const callidx_t *idx, const char *key, size_t klen) {
+   uint32_t lo = 0, hi = idx->n;
+
+   while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (callidx_cmp_key(idx, &idx->e[mid], key, klen) < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+static int64_t callidx_find(const callidx_t *idx, const char *key, size_t klen) {
+   uint32_t i = callidx_lower_bound(idx, key, klen);
+
+   if (i < idx->n && callidx_cmp_key(idx, &idx->e[i], key, klen) == 0) {
+      return i;
+   }
+   return -1;
+}
+
+///////////
+// build //
+///////////
+static void callidx_add(const char *callsign, void *priv) {
+   callidx_build_t *b = (callidx_build_t *)priv;
+   callidx_t *idx = b->idx;
+   size_t len = strlen(callsign);
+
+   if (len == 0 || len >= MAX_CALLSIGN) {
+      return;
+   }
+
+   if (idx->n == idx->size) {
+      idx->size = (idx->size ? idx->size * 2 : 65536);
+      if ((idx->e = realloc(idx->e, idx->size * sizeof(callidx_entry_t))) == NULL) {
+         fprintf(stderr, "+ERROR callidx_add: out of memory!\n");
+         exit(ENOMEM);
+      }
+   }
+
+   if (idx->blob_len + len + 1 > idx->blob_size) {
+      idx->blob_size = (idx->blob_size ? idx->blob_size * 2 : 1024 * 1024);
+      if ((idx->blob = realloc(idx->blob, idx->blob_size)) == NULL) {
+         fprintf(stderr, "+ERROR callidx_add: out of memory!\n");
+         exit(ENOMEM);
+      }
+   }
+
+   // only calls we could match a query against
+   char *s = idx->blob + idx->blob_len;
+   for (size_t i = 0; i < len; i++) {
+      s[i] = toupper((unsigned char)callsign[i]);
+
+      if (strchr(CALLIDX_ALPHABET, s[i]) == NULL) {
+         return;
+      }
+   }
+   s[len] = '\0';
+
+   idx->e[idx->n].off = idx->blob_len;
+   idx->e[idx->n].len = len;
+   idx->e[idx->n].src = b->src;
+   idx->n++;
+   idx->blob_len += len + 1;
+}
+
+// FNV-1a of s, leaving out the character at skip (-1 for none)
+static uint32_t callidx_del_hash(const char *s, size_t len, int skip) {
+   uint32_t h = 2166136261u;
+
+   for (size_t i = 0; i < len; i++) {
+      if ((int)i != skip) {
+         h ^= (uint8_t)s[i];
+         h *= 16777619u;
+      }
+   }
+   // keep the length in, so K1AB with a deletion isn't K1AB
+   h ^= (uint32_t)(len - (skip >= 0 ? 1 : 0));
+   h *= 16777619u;
+   return h;
+}
+
+static int callidx_cmp_del(const void *a, const void *b) {
+   uint32_t ha = ((const callidx_del_t *)a)->hash, hb = ((const callidx_del_t *)b)->hash;
+
+   return (ha > hb) - (ha < hb);
+}
+
+// every call, and every call missing one character
+static void callidx_build_dels(callidx_t *idx) {
+   size_t total = 0, n = 0;
+
+   if (idx->n == 0) {
+      return;
+   }
+
+   for (uint32_t i = 0; i < idx->n; i++) {
+      total += idx->e[i].len + 1;
+   }
+
+   if ((idx->dels = malloc(total * sizeof(callidx_del_t))) == NULL) {
+      fprintf(stderr, "+ERROR callidx_build_dels: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   for (uint32_t i = 0; i < idx->n; i++) {
+      const char *s = callidx_str(idx, &idx->e[i]);
+      size_t len = idx->e[i].len;
+
+      for (int skip = -1; skip < (int)len; skip++) {
+         idx->dels[n].hash = callidx_del_hash(s, len, skip);
+         idx->dels[n].entry = i;
+         n++;
+      }
+   }
+   qsort(idx->dels, n, sizeof(callidx_del_t), callidx_cmp_del);
+   idx->ndels = n;
+}
+
+// worker thread: gather every call, sort them and merge the duplicates
+static void callidx_build_run(work_t *w) {
+   callidx_build_t *b = (callidx_build_t *)w;
+   callidx_t *idx = b->idx;
+   uint64_t t_start = stats_now();
+   uint32_t mark = 0;
+
+   b->src = CALLIDX_SRC_CACHE;
+   callsign_cache_each(callidx_add, b);
+   idx->from[0] = idx->n - mark;
+   mark = idx->n;
+
+   b->src = CALLIDX_SRC_ULS;
+   if (Config.use_uls) {
+      uls_each_callsign(callidx_add, b);
+   }
+   idx->from[1] = idx->n - mark;
+   mark = idx->n;
+
+   b->src = CALLIDX_SRC_LOTW;
+   lotw_each_callsign(callidx_add, b);
+   idx->from[2] = idx->n - mark;
+
+   if (idx->n > 0) {
+      qsort_r(idx->e, idx->n, sizeof(callidx_entry_t), callidx_cmp_entry, idx);
+   }
+
+   uint32_t out = 0;
+   for (uint32_t i = 0; i < idx->n; i++) {
+      if (out > 0 && callidx_cmp_entry(&idx->e[out - 1], &idx->e[i], idx) == 0) {
+         idx->e[out - 1].src |= idx->e[i].src;
+      } else {
+         idx->e[out++] = idx->e[i];
+      }
+   }
+   idx->n = out;
+
+   if (callidx_fix_on) {
+      callidx_build_dels(idx);
+   }
+   idx->build_usec = (stats_now() - t_start) / 1000;
+}
+
+// loop thread: swap it in
+static void callidx_build_done(work_t *w) {
+   callidx_build_t *b = (callidx_build_t *)w;
+
+   pthread_rwlock_wrlock(&callidx_lock);
+   callidx_t *old = callidx_cur;
+   callidx_cur = b->idx;
+   pthread_rwlock_unlock(&callidx_lock);
+
+   callidx_free(old);
+   callidx_built = time(NULL);
+   log_send(mainlog, LOG_INFO, "search: indexed %u callsigns (%u cache, %u uls, %u lotw) in %lu ms",
+         b->idx->n, b->idx->from[0], b->idx->from[1], b->idx->from[2], (unsigned long)(b->idx->build_usec / 1000));
+
+   free(b);
+   callidx_busy = NULL;
+
+   if (callidx_again) {
+      callidx_again = false;
+      callidx_rebuild();
+   }
+}
+
+// loop thread: (re)build the index in the background
+void callidx_rebuild(void) {
+   callidx_build_t *b;
+
+   if (callidx_loop == NULL) {
+      return;
+   }
+
+   if (callidx_busy != NULL) {
+      callidx_again = true;
+      return;
+   }
+
+   if ((b = calloc(1, sizeof(callidx_build_t))) == NULL || (b->idx = calloc(1, sizeof(callidx_t))) == NULL) {
+      fprintf(stderr, "+ERROR callidx_rebuild: out of memory!\n");
+      exit(ENOMEM);
+   }
+   b->work.prio = WORK_PRIO_MAX - 1;
+   b->work.run = callidx_build_run;
+   b->work.done = callidx_build_done;
+   callidx_busy = b;
+   workers_submit(&b->work);
+}
+
+static void callidx_timer_cb(EV_P_ ev_timer *w, int revents) {
+   callidx_rebuild();
+}
+
+// call after workers_init() and uls_init()
+void callidx_start(struct ev_loop *loop) {
+   time_t interval = timestr2time_t(cfg_get_str(cfg, "callsign-lookup/search-index-refresh"));
+
+   if (interval <= 0) {
+      interval = 3600;
+   }
+
+   callidx_fix_on = str2bool(cfg_get_str(cfg, "callsign-lookup/correct-misses"), false);
+   if ((callidx_fix_max = cfg_get_int(cfg, "callsign-lookup/correct-max")) <= 0) {
+      callidx_fix_max = CALLIDX_FIX_DEFAULT;
+   } else if (callidx_fix_max > CALLIDX_MAX_RESULTS) {
+      callidx_fix_max = CALLIDX_MAX_RESULTS;
+   }
+
+   callidx_loop = loop;
+   ev_timer_init(&callidx_timer, callidx_timer_cb, interval, interval);
+   ev_timer_start(loop, &callidx_timer);
+   callidx_rebuild();
+}
+
+// call after workers_stop(), a build still in flight never got to callidx_build_done()
+void callidx_stop(void) {
+   if (callidx_loop != NULL) {
+      ev_timer_stop(callidx_loop, &callidx_timer);
+      callidx_loop = NULL;
+   }
+
+   if (callidx_busy != NULL) {
+      callidx_free(callidx_busy->idx);
+      free(callidx_busy);
+      callidx_busy = NULL;
+   }
+
+   pthread_rwlock_wrlock(&callidx_lock);
+   callidx_free(callidx_cur);
+   callidx_cur = NULL;
+   pthread_rwlock_unlock(&callidx_lock);
+}
+
+////////////
+// search //
+////////////
+// ? is any one character, * any run of them
+static bool callidx_glob(const char *pat, const char *s) {
+   const char *star = NULL, *resume = NULL;
+
+   while (*s != '\0') {
+      if (*pat == '?' || *pat == *s) {
+         pat++;
+         s++;
+      } else if (*pat == '*') {
+         star = pat++;
+         resume = s;
+      } else if (star != NULL) {
+         pat = star + 1;
+         s = ++resume;
+      } else {
+         return false;
+      }
+   }
+
+   while (*pat == '*') {
+      pat++;
+   }
+   return (*pat == '\0');
+}
+
+// is a ranked ahead of b?
+static bool callidx_better(const callidx_match_t *a, const callidx_match_t *b) {
+   int sa = __builtin_popcount(a->src), sb = __builtin_popcount(b->src);
+   size_t la = strlen(a->callsign), lb = strlen(b->callsign);
+
+   if (a->dist != b->dist) {
+      return (a->dist < b->dist);
+   }
+
+   if (sa != sb) {
+      return (sa > sb);
+   }
+
+   if (la != lb) {
+      return (la < lb);
+   }
+   return (strcmp(a->callsign, b->callsign) < 0);
+}
+
+// keep the best `limit` matches, in order
+static void callidx_keep(callidx_result_t *res, int limit, const callidx_t *idx, uint32_t i, uint8_t dist) {
+   callidx_match_t m;
+   int pos;
+
+   res->total++;
+
+   memcpy(m.callsign, callidx_str(idx, &idx->e[i]), idx->e[i].len + 1);
+   m.src = idx->e[i].src;
+   m.dist = dist;
+
+   if (res->n == limit && !callidx_better(&m, &res->match[res->n - 1])) {
+      return;
+   }
+
+   for (pos = (res->n < limit ? res->n : limit - 1); pos > 0 && callidx_better(&m, &res->match[pos - 1]); pos--) {
+      res->match[pos] = res->match[pos - 1];
+   }
+   res->match[pos] = m;
+
+   if (res->n < limit) {
+      res->n++;
+   }
+}
+
+// the edit distance 1 neighbours of q that are in the index
+static void callidx_neighbours(const callidx_t *idx, const char *q, size_t qlen, int limit, callidx_result_t *res) {
+   static const char alphabet[] = CALLIDX_ALPHABET;
+   uint32_t seen[(MAX_CALLSIGN * 2 + 1) * (sizeof(alphabet) - 1) + MAX_CALLSIGN * 2];
+   int nseen = 0;
+   char cand[MAX_CALLSIGN + 1];
+
+   #define	TRY(len) do {								\
+      int64_t hit = callidx_find(idx, cand, (len));				\
+      bool dupe = false;							\
+      if (hit < 0 || ((len) == qlen && memcmp(cand, q, qlen) == 0)) {		\
+         break;									\
+      }										\
+      for (int s = 0; s < nseen; s++) {						\
+         if (seen[s] == (uint32_t)hit) {					\
+            dupe = true;							\
+            break;								\
+         }									\
+      }										\
+      if (!dupe) {								\
+         seen[nseen++] = hit;							\
+         callidx_keep(res, limit, idx, hit, 1);					\
+      }										\
+   } while (0)
+
+   // deletions
+   for (size_t i = 0; i < qlen; i++) {
+      memcpy(cand, q, i);
+      memcpy(cand + i, q + i + 1, qlen - i - 1);
+      TRY(qlen - 1);
+   }
+
+   // swaps of neighbours
+   for (size_t i = 0; i + 1 < qlen; i++) {
+      memcpy(cand, q, qlen);
+      cand[i] = q[i + 1];
+      cand[i + 1] = q[i];
+      TRY(qlen);
+   }
+
+   // substitutions
+   for (size_t i = 0; i < qlen; i++) {
+      memcpy(cand, q, qlen);
+      for (const char *a = alphabet; *a != '\0'; a++) {
+         if (*a != q[i]) {
+            cand[i] = *a;
+            TRY(qlen);
+         }
+      }
+   }
+
+   // insertions
+   if (qlen + 1 < MAX_CALLSIGN) {
+      for (size_t i = 0; i <= qlen; i++) {
+         memcpy(cand, q, i);
+         memcpy(cand + i + 1, q + i, qlen - i);
+         for (const char *a = alphabet; *a != '\0'; a++) {
+            cand[i] = *a;
+            TRY(qlen + 1);
+         }
+      }
+   }
+   #undef	TRY
+}
+
+// false if the query isn't something we can search for, or there's no index yet
+bool callidx_search(const char *query, int limit, callidx_result_t *res) {
+   char q[MAX_CALLSIGN];
+   size_t qlen = 0, literal;
+
+   memset(res, 0, sizeof(*res));
+
+   if (limit <= 0) {
+      limit = CALLIDX_DEFAULT_RESULTS;
+   } else if (limit > CALLIDX_MAX_RESULTS) {
+      limit = CALLIDX_MAX_RESULTS;
+   }
+
+   for (; query != NULL && *query != '\0' && !isspace((unsigned char)*query); query++) {
+      char c = toupper((unsigned char)*query);
+
+      if (qlen + 1 >= sizeof(q) || (strchr(CALLIDX_ALPHABET "*?", c) == NULL)) {
+         return false;
+      }
+      q[qlen++] = c;
+   }
+   q[qlen] = '\0';
+
+   if (qlen == 0) {
+      return false;
+   }
+   literal = strcspn(q, "*?");
+
+   pthread_rwlock_rdlock(&callidx_lock);
+   const callidx_t *idx = callidx_cur;
+
+   if (idx == NULL) {
+      pthread_rwlock_unlock(&callidx_lock);
+      return false;
+   }
+
+   if (literal < qlen) {
+      // everything that starts with the literal part is one range
+      for (uint32_t i = callidx_lower_bound(idx, q, literal); i < idx->n; i++) {
+         const callidx_entry_t *e = &idx->e[i];
+
+         if (e->len < literal || memcmp(callidx_str(idx, e), q, literal) != 0) {
+            break;
+         }
+
+         if (callidx_glob(q, callidx_str(idx, e))) {
+            callidx_keep(res, limit, idx, i, 0);
+         }
+      }
+   } else {
+      int64_t hit = callidx_find(idx, q, qlen);
+
+      if (hit >= 0) {
+         callidx_keep(res, limit, idx, hit, 0);
+      }
+      callidx_neighbours(idx, q, qlen, limit, res);
+   }
+   pthread_rwlock_unlock(&callidx_lock);
+   return true;
+}
+
+// /SEARCH <query> [limit]
+void callidx_search_dump(const char *query, int limit, outbuf_t *ob) {
+   callidx_result_t *res;
+   uint64_t t_start = stats_now();
+
+   if ((res = malloc(sizeof(callidx_result_t))) == NULL) {
+      fprintf(stderr, "+ERROR callidx_search_dump: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   if (!callidx_search(query, limit, res)) {
+      pthread_rwlock_rdlock(&callidx_lock);
+      bool ready = (callidx_cur != NULL);
+      pthread_rwlock_unlock(&callidx_lock);
+
+      if (!ready) {
+         outbuf_printf(ob, "503 Service Unavailable - The search index isn't ready yet\n");
+      } else {
+         outbuf_printf(ob, "400 Bad Request - Search for a callsign (K1ABX), prefix (K1A*) or pattern (K1AB?), letters, digits and / only\n");
+      }
+      free(res);
+      return;
+   }
+
+   outbuf_printf(ob, "200 OK SEARCH %.*s %d matches, %d shown, %lu us\n", (int)strcspn(query, " \t"), query,
+         res->total, res->n, (unsigned long)((stats_now() - t_start) / 1000));
+
+   for (int i = 0; i < res->n; i++) {
+      const callidx_match_t *m = &res->match[i];
+      char src[32] = "";
+
+      if (m->src & CALLIDX_SRC_CACHE) {
+         strcat(src, ",CACHE");
+      }
+
+      if (m->src & CALLIDX_SRC_ULS) {
+         strcat(src, ",ULS");
+      }
+
+      if (m->src & CALLIDX_SRC_LOTW) {
+         strcat(src, ",LOTW");
+      }
+      outbuf_printf(ob, "%s %d %s\n", m->callsign, m->dist, src + 1);
+   }
+   outbuf_printf(ob, "+EOR\n\n");
+   free(res);
+}
+
+/////////////////
+// busted calls //
+/////////////////
+// how far apart are a and b, if it's one edit or less?
+static callidx_edit_t callidx_edit(const char *a, size_t la, const char *b, size_t lb) {
+   size_t i = 0;
+
+   if (la == lb) {
+      while (i < la && a[i] == b[i]) {
+         i++;
+      }
+
+      if (i == la) {
+         return EDIT_NONE;
+      }
+
+      if (memcmp(a + i + 1, b + i + 1, la - i - 1) == 0) {
+         return EDIT_SUBST;
+      }
+
+      if (i + 1 < la && a[i] == b[i + 1] && a[i + 1] == b[i] && memcmp(a + i + 2, b + i + 2, la - i - 2) == 0) {
+         return EDIT_SWAP;
+      }
+      return EDIT_FAR;
+   }
+
+   // make a the shorter one
+   if (la > lb) {
+      const char *t = a;
+      size_t tl = la;
+
+      a = b;
+      la = lb;
+      b = t;
+      lb = tl;
+   }
+
+   if (lb - la != 1) {
+      return EDIT_FAR;
+   }
+
+   while (i < la && a[i] == b[i]) {
+      i++;
+   }
+   return (memcmp(a + i, b + i + 1, la - i) == 0 ? EDIT_INDEL : EDIT_FAR);
+}
+
+// 0-100: a likely edit to a call lots of sources know (and we've heard lately) scores highest
+static uint8_t callidx_score(callidx_edit_t edit, uint8_t src) {
+   static const int edit_w[] = { 10, 10, 8, 6, 0 };
+   int w = 0;
+
+   w += ((src & CALLIDX_SRC_HEARD) ? 4 : 0);
+   w += ((src & CALLIDX_SRC_CACHE) ? 3 : 0);
+   w += ((src & CALLIDX_SRC_LOTW) ? 2 : 0);
+   w += ((src & CALLIDX_SRC_ULS) ? 1 : 0);
+
+   // both are out of 10
+   return (uint8_t)(edit_w[edit] * w);
+}
+
+// a suggestion, if it's new and it's prefix is real, highest score first
+static void callidx_fix_add(callidx_result_t *res, int limit, const char *callsign, size_t len, uint8_t src, callidx_edit_t edit) {
+   callidx_match_t m;
+   int pos;
+
+   for (int i = 0; i < res->n; i++) {
+      if (strcmp(res->match[i].callsign, callsign) == 0) {
+         res->match[i].src |= src;
+         res->match[i].score = callidx_score(edit, res->match[i].src);
+
+         // it may have moved up
+         for (pos = i; pos > 0 && res->match[pos].score > res->match[pos - 1].score; pos--) {
+            m = res->match[pos];
+            res->match[pos] = res->match[pos - 1];
+            res->match[pos - 1] = m;
+         }
+         return;
+      }
+   }
+
+   memcpy(m.callsign, callsign, len);
+   m.callsign[len] = '\0';
+
+   if (cty_loaded() && cty_find(m.callsign) == NULL) {
+      return;
+   }
+   m.src = src;
+   m.dist = 1;
+   m.score = callidx_score(edit, src);
+   res->total++;
+
+   if (res->n == limit && m.score <= res->match[res->n - 1].score) {
+      return;
+   }
+
+   for (pos = (res->n < limit ? res->n : limit - 1); pos > 0 && m.score > res->match[pos - 1].score; pos--) {
+      res->match[pos] = res->match[pos - 1];
+   }
+   res->match[pos] = m;
+
+   if (res->n < limit) {
+      res->n++;
+   }
+}
+
+typedef struct callidx_fix_query {
+   const char		*q;
+   size_t		qlen;
+   callidx_result_t	*res;
+} callidx_fix_query_t;
+
+// loop thread: a heard station we've found before, the index won't have it until the next rebuild
+static void callidx_fix_heard(const heard_entry_t *e, void *priv) {
+   callidx_fix_query_t *fq = priv;
+   size_t len;
+   callidx_edit_t edit;
+
+   if (e->found == 0) {
+      return;
+   }
+   len = strlen(e->callsign);
+
+   if ((len > fq->qlen ? len - fq->qlen : fq->qlen - len) > 1) {
+      return;
+   }
+
+   if ((edit = callidx_edit(fq->q, fq->qlen, e->callsign, len)) != EDIT_NONE && edit != EDIT_FAR) {
+      callidx_fix_add(fq->res, callidx_fix_max, e->callsign, len, CALLIDX_SRC_HEARD, edit);
+   }
+}
+
+// loop thread: known calls one edit away from a call nobody had, best first
+bool callidx_correct(const char *callsign, callidx_result_t *res) {
+   char q[MAX_CALLSIGN];
+   size_t qlen = 0;
+   uint64_t t_start = stats_now();
+   callsign_parts_t parts;
+
+   memset(res, 0, sizeof(*res));
+
+   if (!callidx_fix_on || callsign == NULL) {
+      return false;
+   }
+
+   // VE3/K1ABX/P: fix the K1ABX part
+   if (callsign_normalize(callsign, &parts)) {
+      callsign = parts.base;
+   }
+
+   for (; *callsign != '\0' && qlen + 1 < sizeof(q); callsign++) {
+      q[qlen] = toupper((unsigned char)*callsign);
+
+      if (strchr(CALLIDX_ALPHABET, q[qlen]) == NULL) {
+         return false;
+      }
+      qlen++;
+   }
+   q[qlen] = '\0';
+
+   if (qlen < 3) {
+      return false;
+   }
+
+   pthread_rwlock_rdlock(&callidx_lock);
+   const callidx_t *idx = callidx_cur;
+
+   // the query, and it with each character deleted: any call within one edit shares one of them
+   for (int skip = -1; idx != NULL && idx->dels != NULL && skip < (int)qlen; skip++) {
+      uint32_t h = callidx_del_hash(q, qlen, skip), lo = 0, hi = idx->ndels;
+
+      while (lo < hi) {
+         uint32_t mid = lo + (hi - lo) / 2;
+
+         if (idx->dels[mid].hash < h) {
+            lo = mid + 1;
+         } else {
+            hi = mid;
+         }
+      }
+
+      for (; lo < idx->ndels && idx->dels[lo].hash == h; lo++) {
+         const callidx_entry_t *e = &idx->e[idx->dels[lo].entry];
+         callidx_edit_t edit = callidx_edit(q, qlen, callidx_str(idx, e), e->len);
+
+         if (edit != EDIT_NONE && edit != EDIT_FAR) {
+            callidx_fix_add(res, callidx_fix_max, callidx_str(idx, e), e->len, e->src, edit);
+         }
+      }
+   }
+   pthread_rwlock_unlock(&callidx_lock);
+
+   // and what we've answered lately (the /HEARD table)
+   callidx_fix_query_t fq = { q, qlen, res };
+   heard_each(callidx_fix_heard, &fq);
+
+   callidx_fixes++;
+   if (res->n > 0) {
+      callidx_fixed++;
+   }
+   callidx_fix_usec += (stats_now() - t_start) / 1000;
+   return (res->n > 0);
+}
+
+// "K1ABC:80,K1ABD:40" for replies
+size_t callidx_correct_str(const callidx_result_t *res, char *buf, size_t bufsz) {
+   size_t len = 0;
+
+   buf[0] = '\0';
+   for (int i = 0; i < res->n && len < bufsz; i++) {
+      len += snprintf(buf + len, bufsz - len, "%s%s:%d", (i > 0 ? "," : ""), res->match[i].callsign, res->match[i].score);
+   }
+   return (len < bufsz ? len : bufsz - 1);
+}
+
+// for /STATS
+void callidx_dump(outbuf_t *ob) {
+   if (callidx_loop == NULL) {
+      return;
+   }
+
+   pthread_rwlock_rdlock(&callidx_lock);
+   if (callidx_cur != NULL) {
+      outbuf_printf(ob, "Search-index: %u callsigns, %lu KB, built in %lu ms, %ld sec ago%s\n", callidx_cur->n,
+            (unsigned long)((callidx_cur->n * sizeof(callidx_entry_t) + callidx_cur->blob_len) / 1024),
+            (unsigned long)(callidx_cur->build_usec / 1000), (long)(time(NULL) - callidx_built),
+            (callidx_busy != NULL ? ", rebuilding" : ""));
+   } else {
+      outbuf_printf(ob, "Search-index: building\n");
+   }
+
+   if (callidx_fix_on) {
+      outbuf_printf(ob, "Corrections: %u deletion keys (%lu KB), %lu misses checked, %lu with suggestions, %.1f us each\n",
+            (callidx_cur != NULL ? callidx_cur->ndels : 0),
+            (unsigned long)((callidx_cur != NULL ? callidx_cur->ndels : 0) * sizeof(callidx_del_t) / 1024),
+            (unsigned long)callidx_fixes, (unsigned long)callidx_fixed,
+            (callidx_fixes > 0 ? (double)callidx_fix_usec / callidx_fixes : 0.0));
+   }
+   pthread_rwlock_unlock(&callidx_lock);
+}
@@ -0,0 +1,306 @@
+/*
+ * Compact calldata records (see callrec.h) and the string intern table
+ *
+ * Interned strings are never freed, there are only so many countries, states
+ * and license classes. The table is fixed size so readers never see it move:
+ * interned_string() doesn't need a lock, only adding a new string does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "callrec.h"
+#include "pool.h"
+
+#define	INTERN_MAX		65535			// ids are uint16_t, 0 means unset
+#define	INTERN_HASH_SIZE	131072			// power of 2, at most half full
+
+static const char *intern_strings[INTERN_MAX + 1];	// by id
+static uint16_t intern_hash[INTERN_HASH_SIZE];		// open addressing, 0 = empty slot
+static _Atomic int intern_next = 1;
+static _Atomic size_t intern_total_bytes = 0;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a
+static uint32_t intern_hash_str(const char *s) {
+   uint32_t h = 2166136261u;
+
+   while (*s != '\0') {
+      h ^= (uint8_t)*s++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+// Returns the id for s, adding it if needed. 0 for empty strings, or if the table is full.
+uint16_t intern_string(const char *s) {
+   uint32_t slot;
+   uint16_t id = 0;
+
+   if (s == NULL || *s == '\0') {
+      return 0;
+   }
+
+   pthread_mutex_lock(&intern_lock);
+   slot = intern_hash_str(s) & (INTERN_HASH_SIZE - 1);
+
+   while (intern_hash[slot] != 0) {
+      if (strcmp(intern_strings[intern_hash[slot]], s) == 0) {
+         id = intern_hash[slot];
+         pthread_mutex_unlock(&intern_lock);
+         return id;
+      }
+      slot = (slot + 1) & (INTERN_HASH_SIZE - 1);
+   }
+
+   int next = atomic_load_explicit(&intern_next, memory_order_relaxed);
+   if (next > INTERN_MAX) {
+      pthread_mutex_unlock(&intern_lock);
+      log_send(mainlog, LOG_WARNING, "intern_string: table full, not interning %s", s);
+      return 0;
+   }
+
+   char *copy = strdup(s);
+   if (copy == NULL) {
+      fprintf(stderr, "+ERROR intern_string: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   id = next;
+   intern_strings[id] = copy;
+   intern_hash[slot] = id;
+   atomic_fetch_add_explicit(&intern_total_bytes, strlen(copy) + 1, memory_order_relaxed);
+   // publish the string before the id can be used by other threads
+   atomic_store_explicit(&intern_next, next + 1, memory_order_release);
+   pthread_mutex_unlock(&intern_lock);
+   return id;
+}
+
+const char *interned_string(uint16_t id) {
+   if (id == 0 || id >= atomic_load_explicit(&intern_next, memory_order_acquire)) {
+      return "";
+   }
+   return intern_strings[id];
+}
+
+int intern_count(void) {
+   return atomic_load_explicit(&intern_next, memory_order_relaxed) - 1;
+}
+
+size_t intern_bytes(void) {
+   return atomic_load_explicit(&intern_total_bytes, memory_order_relaxed);
+}
+
+// where each blob string lives in a calldata_t
+#define	CD_FIELD(f)	{ offsetof(calldata_t, f), sizeof(((calldata_t *)0)->f) }
+static const struct {
+   size_t	off, size;
+} calldata_str_field[CR_STR_MAX] = {
+   [CR_CALLSIGN]	= CD_FIELD(callsign),
+   [CR_ALIASES]		= CD_FIELD(aliases),
+   [CR_FIRST_NAME]	= CD_FIELD(first_name),
+   [CR_LAST_NAME]	= CD_FIELD(last_name),
+   [CR_ADDRESS1]	= CD_FIELD(address1),
+   [CR_ADDRESS2]	= CD_FIELD(address2),
+   [CR_ADDRESS_ATTN]	= CD_FIELD(address_attn),
+   [CR_ZIP]		= CD_FIELD(zip),
+   [CR_GRID]		= CD_FIELD(grid),
+   [CR_FIPS]		= CD_FIELD(fips),
+   [CR_PREVIOUS_CALL]	= CD_FIELD(previous_call),
+   [CR_EMAIL]		= CD_FIELD(email),
+   [CR_URL]		= CD_FIELD(url),
+   [CR_IMAGE_URL]	= CD_FIELD(image_url),
+   [CR_QSL_MSG]		= CD_FIELD(qsl_msg),
+   [CR_NICKNAME]	= CD_FIELD(nickname)
+};
+
+static const char *calldata_str(const calldata_t *cd, callrec_str_t which) {
+   return (const char *)cd + calldata_str_field[which].off;
+}
+
+// ... and each interned one
+static const struct {
+   size_t	off, size;
+} calldata_interned_field[CR_INTERN_MAX] = {
+   [CR_COUNTRY]		= CD_FIELD(country),
+   [CR_STATE]		= CD_FIELD(state),
+   [CR_CLASS]		= CD_FIELD(opclass),
+   [CR_CODES]		= CD_FIELD(codes),
+   [CR_LAND]		= CD_FIELD(land),
+   [CR_COUNTY]		= CD_FIELD(county),
+   [CR_GMT_OFFSET]	= CD_FIELD(gmt_offset)
+};
+
+// strnlen, since calldata_t strings are fixed size arrays that may not be terminated
+static size_t calldata_strlen(const char *s, size_t max) {
+   const char *nul = memchr(s, '\0', max);
+   return (nul != NULL ? (size_t)(nul - s) : max);
+}
+
+// Build a compact record from a calldata_t, with one reference held by the caller
+callrec_t *callrec_pack(const calldata_t *cd) {
+   size_t lens[CR_STR_MAX];
+   size_t blob_len = 1;		// blob[0] is the shared empty string
+   callrec_t *rec = NULL;
+
+   if (cd == NULL) {
+      return NULL;
+   }
+
+   for (int i = 0; i < CR_STR_MAX; i++) {
+      lens[i] = calldata_strlen(calldata_str(cd, i), calldata_str_field[i].size);
+
+      if (lens[i] > 0) {
+         blob_len += lens[i] + 1;
+      }
+   }
+
+   // can't happen with calldata_t's field sizes, but offsets are 16 bits
+   if (blob_len > UINT16_MAX) {
+      log_send(mainlog, LOG_CRIT, "callrec_pack: record for %s is too big (%zu)", cd->callsign, blob_len);
+      return NULL;
+   }
+
+   if ((rec = malloc(sizeof(callrec_t) + blob_len)) == NULL) {
+      fprintf(stderr, "+ERROR callrec_pack: out of memory!\n");
+      exit(ENOMEM);
+   }
+   memset(rec, 0, sizeof(callrec_t));
+   atomic_init(&rec->refs, 1);
+
+   rec->origin = cd->origin;
+   rec->cached = cd->cached;
+   rec->mi = cd->mi;
+   rec->cq_zone = cd->cq_zone;
+   rec->itu_zone = cd->itu_zone;
+   rec->alias_count = cd->alias_count;
+   rec->dxcc = cd->dxcc;
+   rec->country_code = cd->country_code;
+   rec->latitude = cd->latitude;
+   rec->longitude = cd->longitude;
+   rec->cache_fetched = cd->cache_fetched;
+   rec->cache_expiry = cd->cache_expiry;
+   rec->license_effective = cd->license_effective;
+   rec->license_expiry = cd->license_expiry;
+   rec->bio_updated = cd->bio_updated;
+   rec->qrz_views = cd->qrz_views;
+   rec->qrz_serial = cd->qrz_serial;
+   rec->flags = (cd->observes_dst ? CR_FLAG_DST : 0) |
+                (cd->accepts_esql ? CR_FLAG_EQSL : 0) |
+                (cd->accepts_paper_qsl ? CR_FLAG_PAPER_QSL : 0);
+
+   for (int i = 0; i < CR_INTERN_MAX; i++) {
+      const char *src = (const char *)cd + calldata_interned_field[i].off;
+      size_t len = calldata_strlen(src, calldata_interned_field[i].size);
+      char tmp[len + 1];
+
+      // state is char[3] and not always terminated, so copy them out first
+      memcpy(tmp, src, len);
+      tmp[len] = '\0';
+      rec->interned[i] = intern_string(tmp);
+   }
+
+   rec->blob[0] = '\0';
+   rec->blob_len = 1;
+
+   for (int i = 0; i < CR_STR_MAX; i++) {
+      if (lens[i] == 0) {
+         continue;
+      }
+
+      rec->str[i].off = rec->blob_len;
+      rec->str[i].len = lens[i];
+      memcpy(rec->blob + rec->blob_len, calldata_str(cd, i), lens[i]);
+      rec->blob[rec->blob_len + lens[i]] = '\0';
+      rec->blob_len += lens[i] + 1;
+   }
+   return rec;
+}
+
+// Expand back into a calldata_t (calldata_free() it when done), ex: to save it to the sqlite cache
+calldata_t *callrec_unpack(const callrec_t *rec) {
+   calldata_t *cd = NULL;
+
+   if (rec == NULL) {
+      return NULL;
+   }
+
+   cd = calldata_alloc();
+
+   cd->origin = rec->origin;
+   cd->cached = rec->cached;
+   cd->mi = rec->mi;
+   cd->cq_zone = rec->cq_zone;
+   cd->itu_zone = rec->itu_zone;
+   cd->alias_count = rec->alias_count;
+   cd->dxcc = rec->dxcc;
+   cd->country_code = rec->country_code;
+   cd->latitude = rec->latitude;
+   cd->longitude = rec->longitude;
+   cd->cache_fetched = rec->cache_fetched;
+   cd->cache_expiry = rec->cache_expiry;
+   cd->license_effective = rec->license_effective;
+   cd->license_expiry = rec->license_expiry;
+   cd->bio_updated = rec->bio_updated;
+   cd->qrz_views = rec->qrz_views;
+   cd->qrz_serial = rec->qrz_serial;
+   cd->observes_dst = (rec->flags & CR_FLAG_DST) != 0;
+   cd->accepts_esql = (rec->flags & CR_FLAG_EQSL) != 0;
+   cd->accepts_paper_qsl = (rec->flags & CR_FLAG_PAPER_QSL) != 0;
+
+   for (int i = 0; i < CR_STR_MAX; i++) {
+      snprintf((char *)cd + calldata_str_field[i].off, calldata_str_field[i].size, "%s", callrec_get(rec, i));
+   }
+
+   for (int i = 0; i < CR_INTERN_MAX; i++) {
+      const char *str = callrec_get_interned(rec, i);
+      size_t size = calldata_interned_field[i].size;
+
+      // may exactly fill the field, as state does
+      memcpy((char *)cd + calldata_interned_field[i].off, str, strnlen(str, size));
+   }
+   return cd;
+}
+
+// never NULL, unset strings are ""
+const char *callrec_get(const callrec_t *rec, callrec_str_t which) {
+   if (which < 0 || which >= CR_STR_MAX) {
+      return "";
+   }
+   return rec->blob + rec->str[which].off;
+}
+
+const char *callrec_get_interned(const callrec_t *rec, callrec_interned_t which) {
+   if (which < 0 || which >= CR_INTERN_MAX) {
+      return "";
+   }
+   return interned_string(rec->interned[which]);
+}
+
+callrec_t *callrec_ref(callrec_t *rec) {
+   if (rec != NULL) {
+      atomic_fetch_add_explicit(&rec->refs, 1, memory_order_relaxed);
+   }
+   return rec;
+}
+
+void callrec_put(callrec_t *rec) {
+   if (rec == NULL) {
+      return;
+   }
+
+   if (atomic_fetch_sub_explicit(&rec->refs, 1, memory_order_acq_rel) == 1) {
+      free(rec);
+   }
+}
+
+size_t callrec_size(const callrec_t *rec) {
+   return sizeof(callrec_t) + rec->blob_len;
+}
@@ -4,12 +4,9 @@
  * Here we lookup callsigns using FCC ULS and QRZ XML API to fill our cache
  */
 
-// XXX: Here we need to try looking things up in the following order:
-//	Cache
-//	FCC ULS Database
-//	QRZ XML API
-//
-// We then need to save it to the cache (if it didn't come from there already)
+// Where answers come from, and in what order, is the backend chain (backend.c,
+// cfg:callsign-lookup/backends), by default the cache, then QRZ, then the ULS.
+// Answers are saved to the cache (if they didn't come from there already).
 // XXX: We need to make this capable of talking on stdio or via a socket
 #include <stdbool.h>
 #include <stdint.h>
@@ -28,16 +25,30 @@
 #include "gnis-lookup.h"
 #include "fcc-db.h"
 #include "qrz-xml.h"
+#include "qrz-ratelimit.h"
+#include "hamqth.h"
+#include "lotw.h"
+#include "call-index.h"
+#include "heard.h"
+#include "workers.h"
+#include "callsign-lookup.h"
+#include "stats.h"
+#include "metrics-http.h"
+#include "shm-server.h"
+#include "snapshot.h"
+#include "geo.h"
+#include "grid.h"
+#include "grid-batch.h"
+#include "proto.h"
+#include "client.h"
+#include "callrec.h"
+#include "memcache.h"
+#include "pool.h"
+#include "watch.h"
+#include "cty.h"
+#include "callsign-norm.h"
 #define	PROTO_VER	1
 
-// Local types.. Gross!
-#define BUFFER_SIZE 1024
-typedef struct {
-   char		buffer[BUFFER_SIZE];
-   size_t 	length;
-   int		fd;
-} InputBuffer;
-
 struct Config Config = {
   .cache_default_expiry = 86400 * 3,	// 3 days
   .offline = true,
@@ -46,49 +57,157 @@ struct Config Config = {
 
 // globals.. yuck ;)
 static const char *callsign_cache_db = NULL;
-static bool callsign_keep_stale_offline = false, qrz_active = false;
-static Database *calldata_cache = NULL, *calldata_uls = NULL;
+static bool callsign_keep_stale_offline = false;
+static int search_max_results = 0;		// cfg:callsign-lookup/search-max-results
 static int callsign_max_requests = 0, callsign_ttl_requests = 0;
 static const char *my_grid = NULL;
 static Coordinates my_coords = { 0, 0 };
-static sqlite3_stmt *cache_insert_stmt = NULL;
-static sqlite3_stmt *cache_select_stmt = NULL;
-static sqlite3_stmt *cache_expire_stmt = NULL;
+static client_t stdio_client;		// our only client, for now
+
+// every thread (the loop and each worker) gets it's own database connections and statements
+static __thread Database *calldata_cache = NULL;
+static __thread sqlite3_stmt *cache_insert_stmt = NULL;
+static __thread sqlite3_stmt *cache_select_stmt = NULL;
+static __thread sqlite3_stmt *cache_expire_stmt = NULL;
+
+// lookups waiting to reply, in the order they were asked
+static lookup_req_t *pending_head = NULL, *pending_tail = NULL;
+static int pending_count = 0;
+static bool exit_when_idle = false;		// exit once all pending lookups have replied
+
+// requests are only allocated and freed on the loop thread
+static pool_stats_t req_pool_stats = POOL_STATS_INIT("request", sizeof(lookup_req_t));
+static pool_t req_pool = POOL_INIT(&req_pool_stats, 1024);
+static proto_buf_t reply_buf = { NULL, 0, 0 };	// call_reply()'s scratch space
+
+// one backend working on a request
+typedef struct lookup_job {
+   work_t		work;			// must be first
+   lookup_req_t		*req;
+   lookup_backend_t	*backend;
+   int			slot;			// in req->jobs[]
+   char			callsign[MAX_CALLSIGN];	// req->base, so the worker never touches req
+   qrz_prio_t		prio;
+   atomic_bool		cancelled;		// answered elsewhere or out of time, don't bother
+   ev_timer		timer;			// the backend's latency budget
+   callrec_t		*result;
+} lookup_job_t;
+static pool_stats_t job_pool_stats = POOL_STATS_INIT("backend-job", sizeof(lookup_job_t));
+static pool_t job_pool = POOL_INIT(&job_pool_stats, 1024);
+static struct ev_loop *lookup_loop = NULL;
+static void lookup_finish(lookup_req_t *req);
+static void lookup_flush(void);
+static void shutdown_now(void);
+static void job_done(work_t *w);
+static void job_timeout_cb(EV_P_ ev_timer *w, int revents);
+
+// distance/bearing for a run of replies, done in one batch by heading_prefetch()
+#define	HEADING_BATCH	64
+typedef struct heading {
+   const callrec_t	*rec;			// NULL if we couldn't
+   double		distance, bearing;
+} heading_t;
+static heading_t heading_batch[HEADING_BATCH];
+static heading_t *heading_current = NULL;	// the reply being written right now
+static int heading_prefetch(lookup_req_t *req);
 
 // common shared things for our library
 const char *progname = "callsign-lookup";
 bool dying = 0;
 time_t now = -1;
 
-static void sql_fini(void) {
+// close this thread's database connections
+static void callsign_cache_close(void) {
    if (cache_insert_stmt != NULL) {
       sqlite3_finalize(cache_insert_stmt);
+      cache_insert_stmt = NULL;
    }
 
    if (cache_select_stmt != NULL) {
       sqlite3_finalize(cache_select_stmt);
+      cache_select_stmt = NULL;
    }
 
    if (cache_expire_stmt != NULL) {
       sqlite3_finalize(cache_expire_stmt);
+      cache_expire_stmt = NULL;
    }
 
    if (calldata_cache != NULL) {
       sql_close(calldata_cache);
       calldata_cache = NULL;
    }
+}
+
+// every callsign in the sqlite cache, for the search index (own connection, any thread)
+bool callsign_cache_each(void (*cb)(const char *callsign, void *priv), void *priv) {
+   Database *db = NULL;
+   sqlite3_stmt *stmt = NULL;
+
+   if (!Config.use_cache || callsign_cache_db == NULL || (db = sql_open(callsign_cache_db)) == NULL) {
+      return false;
+   }
+   sqlite3_busy_timeout(db->hndl.sqlite3, 2000);
+
+   if (sqlite3_prepare_v2(db->hndl.sqlite3, "SELECT callsign FROM cache;", -1, &stmt, NULL) != SQLITE_OK) {
+      log_send(mainlog, LOG_WARNING, "cache: can't list callsigns: %s", sqlite3_errmsg(db->hndl.sqlite3));
+      sql_close(db);
+      return false;
+   }
+
+   while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *callsign = (const char *)sqlite3_column_text(stmt, 0);
+
+      if (callsign != NULL && *callsign != '\0') {
+         cb(callsign, priv);
+      }
+   }
+   sqlite3_finalize(stmt);
+   sql_close(db);
+   return true;
+}
 
-   if (calldata_uls != NULL) {
-      sql_close(calldata_uls);
-      calldata_uls = NULL;
+// open this thread's connection to the cache database
+static bool callsign_cache_open(void) {
+   if (calldata_cache != NULL) {
+      return true;
    }
 
-   exit(0);
+   if ((calldata_cache = sql_open(callsign_cache_db)) == NULL) {
+      return false;
+   }
+
+   // several threads share the file now, so wait on locks instead of failing
+   sqlite3_busy_timeout(calldata_cache->hndl.sqlite3, 2000);
+   sqlite3_exec(calldata_cache->hndl.sqlite3, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+   return true;
+}
+
+static void worker_thread_init(int id) {
+   if (Config.use_cache && !callsign_cache_open()) {
+      log_send(mainlog, LOG_CRIT, "worker %d: failed opening cache %s", id, callsign_cache_db);
+   }
+}
+
+static void worker_thread_fini(int id) {
+   callsign_cache_close();
+   uls_close();
+   calldata_pool_drain();
+}
+
+static void sql_fini(void) {
+   workers_stop();
+   callsign_cache_close();
+   uls_close();
 }
 
-char expiry_sql[256];
 void run_sql_expire(void) {
    int rc = 0;
+   char expiry_sql[256];
+
+   if (calldata_cache == NULL) {
+      return;
+   }
 
    if (cache_expire_stmt == NULL) {
       memset(expiry_sql, 0, 256);
@@ -138,6 +257,15 @@ static void callsign_lookup_setup(void) {
       Config.use_qrz = false;
    }
 
+   // use HamQTH XML API?
+   Config.use_hamqth = str2bool(cfg_get_str(cfg, "callsign-lookup/use-hamqth"), false);
+
+   // how many /SEARCH results by default (0 = CALLIDX_DEFAULT_RESULTS)
+   search_max_results = cfg_get_int(cfg, "callsign-lookup/search-max-results");
+
+   // annotate replies with LoTW last upload dates?
+   use_lotw = str2bool(cfg_get_str(cfg, "callsign-lookup/use-lotw-activity"), false);
+
    // Use local cache db?
    s = cfg_get_str(cfg, "callsign-lookup/use-cache");
 
@@ -164,7 +292,13 @@ static void callsign_lookup_setup(void) {
          }
          callsign_keep_stale_offline = str2bool(cfg_get_str(cfg, "callsign-lookup/cache-keep-stale-if-offline"), true);
 
-         if ((calldata_cache = sql_open(callsign_cache_db)) == NULL) {
+         // how old can a record get before we refresh it in the background? (0 = never)
+         s = cfg_get_str(cfg, "callsign-lookup/cache-refresh");
+         if (s != NULL) {
+            Config.cache_refresh_time = timestr2time_t(s);
+         }
+
+         if (!callsign_cache_open()) {
             log_send(mainlog, LOG_CRIT, "callsign_lookup_setup: failed opening cache %s! Disabling caching!", callsign_cache_db);
             Config.use_cache = false;
             calldata_cache = NULL;
@@ -173,10 +307,17 @@ static void callsign_lookup_setup(void) {
             // XXX: Detect if we need to initialize it -- does table cache exist?
             // XXX: Initialize the tables using sql in sql/cache.sql
             log_send(mainlog, LOG_INFO, "calldata cache database opened");
+
+            // keep recent answers in memory too? (0 = no)
+            s = cfg_get_str(cfg, "callsign-lookup/memcache-entries");
+            memcache_init(s != NULL ? atoi(s) : 100000);
          }
       }
    }
 
+   // QRZ request rate limits and daily budget
+   qrz_ratelimit_init();
+
    // after X requests, should we exit with 0 status and restart?
    callsign_max_requests = cfg_get_int(cfg, "callsign-lookup/respawn-after-requests");
 
@@ -214,7 +355,7 @@ bool callsign_cache_save(calldata_t *cp) {
 
    // initialize or reset prepared statement as needed
    if (cache_insert_stmt == NULL) {
-      const char *sql = "INSERT INTO cache "
+      const char *sql = "INSERT OR REPLACE INTO cache "
          "(callsign, dxcc, aliases, first_name, last_name, addr1, addr2,"
          "state, zip, grid, country, latitude, longitude, county, class,"
          "codes, email, u_views, effective, expires, cache_expires,"
@@ -311,12 +452,8 @@ calldata_t *callsign_cache_find(const char *callsign) {
       return NULL;
       }
 
-   // try to allocate memory for the calldata_t structure
-   if ((cd = malloc(sizeof(calldata_t))) == NULL) {
-      fprintf(stderr, "+ERROR callsign_cache_find: out of memory!\n");
-      exit(ENOMEM);
-   }
-   memset(cd, 0, sizeof(calldata_t));
+   // grab a (zeroed) calldata_t from this thread's pool
+   cd = calldata_alloc();
 
    // prepare the statement if it's not been done yet
    if (cache_select_stmt == NULL) {
@@ -329,12 +466,12 @@ calldata_t *callsign_cache_find(const char *callsign) {
 //            log_send(mainlog, LOG_DEBUG, "prepared cache SELECT statement succesfully");
          } else {
             log_send(mainlog, LOG_WARNING, "sqlite3_bind_text cache select callsign failed: %s", sqlite3_errmsg(calldata_cache->hndl.sqlite3));
-            free(cd);
+            calldata_free(cd);
             return NULL;
          }
       } else {
          log_send(mainlog, LOG_WARNING, "Error preparing statement for cache select of record for %s: %s\n", callsign, sqlite3_errmsg(calldata_cache->hndl.sqlite3));
-         free(cd);
+         calldata_free(cd);
          return NULL;
       }
    } else {	// reset the statement for reuse
@@ -343,7 +480,7 @@ calldata_t *callsign_cache_find(const char *callsign) {
       rc = sqlite3_bind_text(cache_select_stmt, 1, callsign, -1, SQLITE_TRANSIENT);
       if (rc != SQLITE_OK) {
          log_send(mainlog, LOG_WARNING, "sqlite3_bind_text reset cache select callsign failed: %s", sqlite3_errmsg(calldata_cache->hndl.sqlite3));
-         free(cd);
+         calldata_free(cd);
          return NULL;
       } else {
          log_send(mainlog, LOG_DEBUG, "reset cache SELECT statement succesfully");
@@ -413,7 +550,7 @@ calldata_t *callsign_cache_find(const char *callsign) {
       cd->cached = true;
       const unsigned char *cs = sqlite3_column_text(cache_select_stmt, idx_callsign);
       if (cs == NULL) {
-         free(cd);
+         calldata_free(cd);
          return NULL;
       }
       snprintf(cd->callsign, MAX_CALLSIGN, "%s", cs);
@@ -440,7 +577,7 @@ calldata_t *callsign_cache_find(const char *callsign) {
       cd->cache_fetched = sqlite3_column_int64(cache_select_stmt, idx_cache_fetched);
    } else {
       log_send(mainlog, LOG_DEBUG, "no rows - step: %d", step);
-      free(cd);
+      calldata_free(cd);
       return NULL;
    }
 
@@ -456,79 +593,137 @@ calldata_t *callsign_cache_find(const char *callsign) {
             run_sql_expire();
 
             // free the data structure before returning, so will look it up
-            free(cd);
+            calldata_free(cd);
             cd = NULL;
          } else {	// 
             log_send(mainlog, LOG_WARNING, "returning stale result for %s (%lu old)", cd->callsign, (cd->cache_expiry - now));
          }
       } else {         // we are online, so if it's expired, force a lookup
-         free(cd);
+         calldata_free(cd);
          cd = NULL;
       }
    } // expired?
    return cd;
 }
 
-calldata_t *callsign_lookup(const char *callsign) {
-   bool from_cache = false;
-   bool res = false;
-   calldata_t *qr = NULL;
+// loop thread (from lookup_submit()): check the in-memory cache, NULL if it's not there (or too old to use)
+static callrec_t *memcache_lookup(const char *callsign) {
+   callrec_t *rec = NULL;
 
-   // has callsign_lookup_setup() been called yet?
-   if (!Config.initialized) {
-      callsign_lookup_setup();
+   if (!Config.use_cache) {
+      return NULL;
    }
 
-   // If enabled, Look in cache first
-   if (Config.use_cache && (qr = callsign_cache_find(callsign)) != NULL) {
-      log_send(mainlog, LOG_DEBUG, "got cached calldata for %s", callsign);
-      from_cache = true;
+   uint64_t t_stage = stats_now();
+   if ((rec = memcache_find(callsign)) == NULL) {
+      return NULL;		// the cache backend's job (job_run()) will count the sqlite cache's answer
    }
 
-   // XXX: If offline, check last Config.online_last_retry and if it's been long
-   // XXX: enough, try to reconnect before the QRZ check
-   if (Config.offline) {
-      if (Config.online_last_retry == 0 || (Config.online_last_retry + Config.online_mode_retry <= now)) {
-         if (Config.use_qrz && !qrz_active) {
-            res = qrz_start_session();
-            qrz_active = true;
-            Config.online_last_retry = now;
-
-            // if logging into qrz failed, set offline mode
-            if (res == false) {
-               log_send(mainlog, LOG_CRIT, "Failed logging into QRZ, setting offline mode!");
-               Config.offline = true;
-            } else {	// if we logged in, clear offline mode
-               Config.offline = false;
-            }
-         }
+   // same rules as callsign_cache_find(): only use expired records if offline and keeping stale
+   if (rec->cache_expiry <= now) {
+      if (!Config.offline || !callsign_keep_stale_offline) {
+         memcache_remove(callsign);
+         callrec_put(rec);
+         return NULL;
       }
+      stats_count_cache(STAT_CACHE_STALE);
+   } else {
+      stats_count_cache(STAT_CACHE_HIT);
    }
-   // nope, check QRZ XML API, if the user has an account
-   if (!Config.offline && Config.use_qrz && qr == NULL) {
-      if ((qr = qrz_lookup_callsign(callsign)) != NULL) {
-         log_send(mainlog, LOG_DEBUG, "got qrz calldata for %s", callsign);
-      }
+   stats_record(STAT_CACHE_FIND, t_stage);
+
+   if (!Config.offline && Config.use_qrz && Config.cache_refresh_time > 0 &&
+       rec->origin != DATASRC_ULS && (rec->cache_fetched + Config.cache_refresh_time) <= now) {
+      qrz_sched_enqueue(callsign, QRZ_PRIO_PREFETCH);
    }
+   return rec;
+}
 
-   // nope, check FCC ULS next since it's available offline
-   if (Config.use_uls && qr == NULL) {
-      if ((qr = uls_lookup_callsign(callsign)) != NULL) {
-         log_send(mainlog, LOG_DEBUG, "got uls calldata for %s", callsign);
-      }
+// worker thread: remember an answer, as the cache would give it back next time
+static void memcache_save(calldata_t *cd) {
+   if (!Config.use_cache) {
+      return;
    }
 
-   // no results :(
-   if (qr == NULL) {
-      log_send(mainlog, LOG_WARNING, "no matches found for callsign %s", callsign);
-      return NULL;
+   // ULS isn't cached in sqlite either, so it keeps it's origin
+   if (cd->origin != DATASRC_ULS) {
+      cd->origin = DATASRC_CACHE;
+      cd->cached = true;
    }
 
-   // only save it in cache if it did not come from there already
-   if (!from_cache) {
-      log_send(mainlog, LOG_DEBUG, "adding new item (%s) to cache", callsign);
-      callsign_cache_save(qr);
+   if (cd->cache_expiry == 0) {
+      cd->cache_fetched = now;
+      cd->cache_expiry = now + Config.cache_default_expiry;
+   }
+   memcache_insert(callrec_pack(cd));
+}
+
+// worker thread: ask one backend, a late answer still goes in the caches for next time
+static void job_run(work_t *w) {
+   lookup_job_t *job = (lookup_job_t *)w;
+   calldata_t *cd = NULL;
+
+   // answered by someone else, or out of time, before we got to it
+   if (atomic_load(&job->cancelled)) {
+      return;
+   }
+
+   if ((cd = job->backend->lookup(job->callsign, job->prio, &job->cancelled)) == NULL || cd->callsign[0] == '\0') {
+      atomic_fetch_add_explicit(&job->backend->missed, 1, memory_order_relaxed);
+      calldata_free(cd);
+      return;
+   }
+   atomic_fetch_add_explicit(&job->backend->answered, 1, memory_order_relaxed);
+
+   if (job->backend->origin != DATASRC_CACHE) {
+      uint64_t t_stage = stats_now();
+      callsign_cache_save(cd);
+      stats_record(STAT_CACHE_SAVE, t_stage);
+   }
+   job->result = callrec_pack(cd);
+   memcache_save(cd);
+   calldata_free(cd);
+}
+
+// loop thread: the request can go back in the pool once it's replied and every job is back
+static void lookup_release(lookup_req_t *req) {
+   if (req->replied && req->jobs_out == 0) {
+      pool_put(&req_pool, req);
+   }
+}
+
+// loop thread: stop waiting on a job, it's done, out of time or lost the race
+static void job_forget(lookup_job_t *job) {
+   lookup_req_t *req = job->req;
+
+   ev_timer_stop(lookup_loop, &job->timer);
+   if (req->jobs[job->slot] == job) {
+      req->jobs[job->slot] = NULL;
+      req->waiting--;
+   }
+}
+
+// loop thread: reply to a finished lookup and retire it
+static void lookup_finish(lookup_req_t *req) {
+   pending_count--;
+
+   if (req->reply != NULL) {
+      uint64_t t_write = stats_now();
+      req->reply(req);
+      stats_record(STAT_RESPONSE_WRITE, t_write);
    }
+   stats_record(STAT_REQUEST, req->submitted);
+   stats_count_origin(req->result == NULL ? STAT_ORIGIN_NOTFOUND : req->result->origin);
+
+   // a call that's real, for correcting busted ones before the search index has it
+   if (req->result != NULL) {
+      heard_found(req->base);
+   }
+
+   callrec_put(req->result);
+   req->result = NULL;
+   req->replied = true;
+   lookup_release(req);
 
    // increment total requests counter
    callsign_ttl_requests++;
@@ -538,12 +733,214 @@ calldata_t *callsign_lookup(const char *callsign) {
       // have we met/exceeded it?
       if (callsign_ttl_requests >= callsign_max_requests) {
          log_send(mainlog, LOG_CRIT, "answered %d of %d allowed requests, exiting", callsign_ttl_requests, callsign_max_requests);
-         // XXX: Dump CPU and memory statistics to the log, so we can look for leaks and profile
-         // XXX: req/sec, etc too
-         fini(0);
+         // leave some numbers in the log, so we can look for leaks and profile
+         stats_log();
+         clients_drain();
+         shutdown_now();
+      }
+   }
+}
+
+// leave the main loop, so main() can stop the workers and free everything on the way out
+static void shutdown_now(void) {
+   dying = true;
+   ev_break(lookup_loop, EVBREAK_ALL);
+}
+
+// loop thread: send replies for every finished lookup at the head of the line
+static void lookup_flush(void) {
+   int batched = 0, batch_pos = 0;
+
+   while (pending_head != NULL && pending_head->complete) {
+      lookup_req_t *req = pending_head;
+
+      // distance and bearing for the next run of replies, all at once
+      if (batch_pos == batched) {
+         batched = heading_prefetch(pending_head);
+         batch_pos = 0;
+      }
+      heading_current = &heading_batch[batch_pos++];
+
+      pending_head = req->next_pending;
+      if (pending_head == NULL) {
+         pending_tail = NULL;
       }
+      lookup_finish(req);
+      heading_current = NULL;
+   }
+
+   // got EOF or /EXIT while lookups were still out, we can go now
+   if (exit_when_idle && pending_count == 0) {
+      client_printf(&stdio_client, "+GOODBYE Hope you had a nice session! Exiting.\n");
+      clients_drain();
+      shutdown_now();
+   }
+
+   // one write per client for this batch of replies
+   clients_flush();
+}
+
+// loop thread: we have the answer (or nobody had one), let the rest of the tier go
+static void lookup_answer(lookup_req_t *req) {
+   req->answered = true;
+
+   for (int i = 0; i < BACKEND_MAX; i++) {
+      lookup_job_t *job = req->jobs[i];
+
+      if (job != NULL) {
+         atomic_store(&job->cancelled, true);
+         atomic_fetch_add_explicit(&job->backend->cancelled, 1, memory_order_relaxed);
+         job_forget(job);
+      }
+   }
+
+   // tagged requests don't wait their turn, the client can match them up
+   if (req->tag[0] != '\0') {
+      lookup_finish(req);
+   } else {
+      req->complete = true;
    }
-   return qr;
+   lookup_flush();
+}
+
+// loop thread: ask the next tier of backends, all at once, or give up if there are no more
+static void lookup_next_tier(lookup_req_t *req) {
+   while (!req->answered) {
+      const backend_tier_t *tier = backend_tier(req->tier++);
+
+      if (tier == NULL) {
+         lookup_answer(req);
+         return;
+      }
+
+      for (int i = 0; i < tier->n; i++) {
+         lookup_backend_t *b = tier->backend[i];
+         lookup_job_t *job = NULL;
+
+         if (!b->usable()) {
+            continue;
+         }
+
+         job = pool_get(&job_pool);
+         memset(job, 0, sizeof(lookup_job_t));
+         job->req = req;
+         job->backend = b;
+         job->slot = i;
+         job->prio = req->prio;
+         snprintf(job->callsign, sizeof(job->callsign), "%s", req->base);
+         job->work.prio = req->prio;
+         job->work.run = job_run;
+         job->work.done = job_done;
+         ev_timer_init(&job->timer, job_timeout_cb, b->timeout_ms / 1000.0, 0);
+         job->timer.data = job;
+         ev_timer_start(lookup_loop, &job->timer);
+
+         req->jobs[i] = job;
+         req->waiting++;
+         req->jobs_out++;
+         atomic_fetch_add_explicit(&b->asked, 1, memory_order_relaxed);
+         workers_submit(&job->work);
+      }
+
+      if (req->waiting > 0) {
+         return;
+      }
+   }
+}
+
+// loop thread: a backend used up it's latency budget, move on without it
+static void job_timeout_cb(EV_P_ ev_timer *w, int revents) {
+   lookup_job_t *job = (lookup_job_t *)w->data;
+   lookup_req_t *req = job->req;
+
+   atomic_store(&job->cancelled, true);
+   atomic_fetch_add_explicit(&job->backend->timeouts, 1, memory_order_relaxed);
+   log_send(mainlog, LOG_INFO, "backend %s took more than %d ms for %s, not waiting on it", job->backend->name, job->backend->timeout_ms, job->callsign);
+   job_forget(job);
+
+   if (!req->answered && req->waiting == 0) {
+      lookup_next_tier(req);
+   }
+}
+
+// loop thread: a worker finished asking a backend, first answer wins
+static void job_done(work_t *w) {
+   lookup_job_t *job = (lookup_job_t *)w;
+   lookup_req_t *req = job->req;
+
+   job_forget(job);
+
+   // even one we'd stopped waiting on is better than nothing
+   if (job->result != NULL && !req->answered) {
+      req->result = job->result;
+      job->result = NULL;
+      lookup_answer(req);
+   } else if (!req->answered && req->waiting == 0) {
+      lookup_next_tier(req);
+   }
+
+   callrec_put(job->result);
+   pool_put(&job_pool, job);
+   req->jobs_out--;
+   lookup_release(req);
+}
+
+// Queue a lookup for the backend chain. reply() is called on the loop thread once
+// it's finished and every lookup submitted before it has replied, or as soon
+// as it's finished if it has a tag. Memory cache hits are answered right here,
+// so reply() may be called before this returns.
+bool lookup_submit(const char *callsign, qrz_prio_t prio, const char *tag, proto_format_t format, lookup_reply_cb_t reply, void *priv) {
+   lookup_req_t *req = NULL;
+   callsign_parts_t parts;
+   bool valid, answered;
+
+   if (callsign == NULL) {
+      return false;
+   }
+
+   req = pool_get(&req_pool);
+   memset(req, 0, sizeof(lookup_req_t));
+
+   // K1ABC/P, ve3/k1abc... are all K1ABC as far as the databases and caches go
+   if ((valid = callsign_normalize(callsign, &parts))) {
+      snprintf(req->callsign, MAX_CALLSIGN, "%s", parts.full);
+      snprintf(req->base, MAX_CALLSIGN, "%s", parts.base);
+   } else {
+      snprintf(req->callsign, MAX_CALLSIGN, "%s", callsign);
+   }
+   req->prio = prio;
+   req->format = format;
+   req->reply = reply;
+   req->priv = priv;
+   req->submitted = stats_now();
+   pending_count++;
+
+   // a memory cache hit is a hash probe, not worth the trip through the workers,
+   // and something that can't be a callsign doesn't need one at all
+   req->result = (valid ? memcache_lookup(req->base) : NULL);
+   answered = (!valid || req->result != NULL);
+
+   if (tag != NULL && *tag != '\0') {
+      snprintf(req->tag, sizeof(req->tag), "%s", tag);
+   } else {
+      if (pending_tail != NULL) {
+         pending_tail->next_pending = req;
+      } else {
+         pending_head = req;
+      }
+      pending_tail = req;
+   }
+
+   if (answered) {
+      lookup_answer(req);
+   } else {
+      lookup_next_tier(req);
+   }
+   return true;
+}
+
+int lookup_pending(void) {
+   return pending_count;
 }
 
 static void exit_fix_config(void) {
@@ -551,7 +948,7 @@ static void exit_fix_config(void) {
    exit(255);
 }
 
-static const char *origin_name[5] = { "NONE", "ULS", "QRZ", "CACHE", NULL };
+const char *origin_name[DATASRC_MAX + 1] = { "NONE", "ULS", "QRZ", "CACHE", "HAMQTH", NULL };
 
 static void init_my_coords(void) {
    const char *coords = cfg_get_str(cfg, "site/coordinates");
@@ -577,29 +974,175 @@ static void init_my_coords(void) {
          my_coords.latitude = lat;
          my_coords.longitude = lon;
       }
-   } else {	// site/coordinates overrides calculation from site/gridsquare, unless it isn't set...
-      my_coords = maidenhead2latlon(my_grid);
+   } else if (my_grid != NULL) {	// site/coordinates overrides calculation from site/gridsquare, unless it isn't set...
+      double lat, lon;
+
+      if (grid_decode(my_grid, &lat, &lon, NULL)) {
+         my_coords.latitude = lat;
+         my_coords.longitude = lon;
+      } else {
+         log_send(mainlog, LOG_CRIT, "cfg:site/gridsquare '%s' is not a valid grid square!", my_grid);
+      }
    }
    log_send(mainlog, LOG_DEBUG, "configured mygrid: %s, lat: %f, lon: %f", my_grid, my_coords.latitude, my_coords.longitude);
+
+   if (my_coords.latitude != 0 || my_coords.longitude != 0) {
+      grid_heading_init(my_coords.latitude, my_coords.longitude);
+   }
 }
 
-// dump all the set attributes of a calldata to the screen
-bool calldata_dump(calldata_t *calldata, const char *callsign) {
-   if (calldata == NULL) {
+// Parse out US callsign classes to names, others are passed through (NULL if unset)
+const char *calldata_opclass(const callrec_t *calldata) {
+   const char *opclass = callrec_get_interned(calldata, CR_CLASS);
+
+   if (opclass[0] == '\0') {
+      return NULL;
+   }
+
+   if (strcasecmp(callrec_get_interned(calldata, CR_COUNTRY), "United States") != 0) {
+      return opclass;
+   }
+
+   switch(opclass[0]) {
+      case 'N':
+         return "Novice";
+      case 'A':
+         return "Advanced";
+      case 'T':
+         return "Technician";
+      case 'G':
+         return "General";
+      case 'E':
+         return "Extra";
+      default:
+         return NULL;
+   }
+}
+
+// where a station is, from QRZ's lat/lon or it's grid, false if we can't tell
+static bool calldata_coords(const callrec_t *calldata, Coordinates *coord) {
+   const char *grid = callrec_get(calldata, CR_GRID);
+
+   coord->latitude = coord->longitude = 0;
+
+   // did QRZ provide lat / lon?
+   if (calldata->latitude != 0 && calldata->longitude != 0) {
+      coord->latitude = calldata->latitude;
+      coord->longitude = calldata->longitude;
+   } else if (grid[0] != '\0') {		// nope, convert the grid
+      double lat, lon;
+
+      if (grid_decode(grid, &lat, &lon, NULL)) {
+         coord->latitude = lat;
+         coord->longitude = lon;
+      }
+   }
+
+   return (coord->latitude != 0 || coord->longitude != 0);
+}
+
+// distance (km) and bearing from our station, false if we don't know where one of us is
+bool calldata_heading(const callrec_t *calldata, double *distance, double *bearing) {
+   Coordinates call_coord = { 0, 0 };
+
+   if (my_grid == NULL) {
+      return false;
+   }
+
+   // worked out with the rest of the batch it's going out with?
+   if (heading_current != NULL && heading_current->rec == calldata) {
+      *distance = heading_current->distance;
+      *bearing = heading_current->bearing;
+      return (*distance > 0 && *bearing > 0);
+   }
+
+   if (my_coords.latitude == 0 && my_coords.longitude == 0) {
+      init_my_coords();
+   }
+
+   // only a 4 character grid? we already know how far that is
+   if ((calldata->latitude == 0 || calldata->longitude == 0) && grid_heading(callrec_get(calldata, CR_GRID), distance, bearing)) {
+      return (*distance > 0 && *bearing > 0);
+   }
+
+   if (!calldata_coords(calldata, &call_coord)) {
       return false;
    }
 
+   *distance = calculateDistance(my_coords.latitude, my_coords.longitude, call_coord.latitude, call_coord.longitude);
+   *bearing = calculateBearing(my_coords.latitude, my_coords.longitude, call_coord.latitude, call_coord.longitude);
+   return (*distance > 0 && *bearing > 0);
+}
+
+// Work out distance and bearing for up to HEADING_BATCH finished lookups
+// starting at req, in one pass, before their replies are written. Returns how
+// many requests it covered (heading_batch[i] goes with the i'th).
+static int heading_prefetch(lookup_req_t *first) {
+   lookup_req_t *req = NULL;
+   double lat[HEADING_BATCH], lon[HEADING_BATCH], distance[HEADING_BATCH], bearing[HEADING_BATCH];
+   int slot[HEADING_BATCH];
+   int n = 0, npts = 0;
+
+   if (my_grid != NULL && my_coords.latitude == 0 && my_coords.longitude == 0) {
+      init_my_coords();
+   }
+
+   for (req = first; req != NULL && req->complete && n < HEADING_BATCH; req = req->next_pending, n++) {
+      Coordinates coord;
+
+      const callrec_t *rec = req->result;
+
+      heading_batch[n].rec = NULL;
+      if (my_grid == NULL || rec == NULL) {
+         continue;
+      }
+
+      // calldata_heading() finds 4 character grids in grid_heading()'s table
+      if ((rec->latitude == 0 || rec->longitude == 0) && strlen(callrec_get(rec, CR_GRID)) == 4) {
+         continue;
+      }
+
+      if (!calldata_coords(rec, &coord)) {
+         continue;
+      }
+      lat[npts] = coord.latitude;
+      lon[npts] = coord.longitude;
+      slot[npts++] = n;
+   }
+
+   // less than a vector's worth, calldata_heading() can do them one at a time
+   if (npts < 4) {
+      return n;
+   }
+
+   geo_heading_batch(my_coords.latitude, my_coords.longitude, lat, lon, npts, distance, bearing);
+
+   req = first;
+   for (int i = 0, k = 0; i < n; i++, req = req->next_pending) {
+      if (k < npts && slot[k] == i) {
+         heading_batch[i].rec = req->result;
+         heading_batch[i].distance = distance[k];
+         heading_batch[i].bearing = bearing[k];
+         k++;
+      }
+   }
+   return n;
+}
+
+// dump all the set attributes of a calldata to the client
+bool calldata_dump(client_t *cl, const callrec_t *calldata, const char *callsign) {
    const char *online = (Config.offline ? "OFFLINE" : "ONLINE");
 
-   if (calldata->callsign[0] == '\0') {
-      if (calldata->query_callsign[0] != '\0') {
-         fprintf(stdout, "404 NOT FOUND %s %s %lu\n", calldata->query_callsign, online, now);
-         log_send(mainlog, LOG_DEBUG, "Lookup for %s failed, not found!\n", calldata->query_callsign);
-      } else if (callsign != NULL) {
-         fprintf(stdout, "404 NOT FOUND %s %s %lu\n", callsign, online, now);
+   if (calldata == NULL) {
+      callidx_result_t fix;
+      char fixes[256];
+
+      // busted decode? what they probably meant: 404 NOT FOUND K1ABX ONLINE 1683541080 DIDYOUMEAN K1ABC:80,K1ABD:40
+      if (callsign != NULL && callidx_correct(callsign, &fix)) {
+         callidx_correct_str(&fix, fixes, sizeof(fixes));
+         client_printf(cl, "404 NOT FOUND %s %s %lu DIDYOUMEAN %s\n", callsign, online, now, fixes);
       } else {
-         log_send(mainlog, LOG_DEBUG, "Lookup failed: query_callsign unset!");
-         fprintf(stdout, "404 NOT FOUND (unknown) %s %lu\n", online, now);
+         client_printf(cl, "404 NOT FOUND %s %s %lu\n", (callsign != NULL ? callsign : "(unknown)"), online, now);
       }
       return false;
    }
@@ -611,10 +1154,21 @@ bool calldata_dump(calldata_t *calldata, const char *callsign) {
    // Lookup for N0CALL was answered by the cache.
    // The answer originally came from QRZ at Mon May  8 06:18:00 AM EDT 2023
    // and will expire (if we go online) at Thu May 11 06:18:00 AM EDT 2023.
-   fprintf(stdout, "200 OK %s %s %lu %s\n", calldata->callsign, online, time(NULL), origin_name[calldata->origin]);
-   fprintf(stdout, "Callsign: %s\n", calldata->callsign);
+   client_printf(cl, "200 OK %s %s %lu %s\n", callrec_get(calldata, CR_CALLSIGN), online, time(NULL), origin_name[calldata->origin]);
+   client_printf(cl, "Callsign: %s\n", callrec_get(calldata, CR_CALLSIGN));
 
-   fprintf(stdout, "Cached: %s\n", (calldata->cached ? "true" : "false"));
+   // asked for VE3/K1ABC/P? say where they're operating from, not just who they are
+   callsign_parts_t parts;
+   if (callsign != NULL && callsign_normalize(callsign, &parts) && parts.portable) {
+      client_printf(cl, "Operating As: %s\n", parts.full);
+
+      if (parts.entity != NULL) {
+         client_printf(cl, "Operating Entity: %s (%s) %s CQ %d ITU %d\n", parts.entity->entity->name, parts.entity->entity->prefix,
+               parts.entity->continent, parts.entity->cq_zone, parts.entity->itu_zone);
+      }
+   }
+
+   client_printf(cl, "Cached: %s\n", (calldata->cached ? "true" : "false"));
 
    struct tm *cache_fetched_tm;
    struct tm *cache_expiry_tm;
@@ -651,130 +1205,72 @@ bool calldata_dump(calldata_t *calldata, const char *callsign) {
          exit(254);
       }
 
-      fprintf(stdout, "Cache-Fetched: %s\n", fetched);
-      fprintf(stdout, "Cache-Expiry: %s\n", expiry);
-   }
-
-   if (calldata->first_name[0] != '\0') {
-      fprintf(stdout, "Name: %s %s\n", calldata->first_name, calldata->last_name);
-   }
-
-   char *opclass = NULL;
-   if (calldata->opclass[0] != '\0') {
-      // Parse out US callsign classes to names
-      if (strcasecmp(calldata->country, "United States") == 0) {
-         switch(calldata->opclass[0]) {
-            case 'N':
-               opclass = "Novice";
-               break;
-            case 'A':
-               opclass = "Advanced";
-               break;
-            case 'T':
-               opclass = "Technician";
-               break;
-            case 'G':
-               opclass = "General";
-               break;
-            case 'E':
-               opclass = "Extra";
-               break;
-            default:
-               break;
-         }
-      } else {
-         opclass = calldata->opclass;
-      }
+      client_printf(cl, "Cache-Fetched: %s\n", fetched);
+      client_printf(cl, "Cache-Expiry: %s\n", expiry);
+   }
 
-      // is it a valid pointer with non-empty content?
-      if (opclass != NULL && opclass[0] != '\0') {
-         fprintf(stdout, "Class: %s\n", opclass);
-      }
+   if (callrec_get(calldata, CR_FIRST_NAME)[0] != '\0') {
+      client_printf(cl, "Name: %s %s\n", callrec_get(calldata, CR_FIRST_NAME), callrec_get(calldata, CR_LAST_NAME));
+   }
+
+   const char *opclass = calldata_opclass(calldata);
+   if (opclass != NULL) {
+      client_printf(cl, "Class: %s\n", opclass);
    }
 
-   if (calldata->grid[0] != 0) {
-      fprintf(stdout, "Grid: %s\n", calldata->grid);
+   if (callrec_get(calldata, CR_GRID)[0] != 0) {
+      client_printf(cl, "Grid: %s\n", callrec_get(calldata, CR_GRID));
    }
 
    if (calldata->latitude != 0 && calldata->longitude != 0) {
-      fprintf(stdout, "WGS-84: %.3f, %.3f\n", calldata->latitude, calldata->longitude);
+      client_printf(cl, "WGS-84: %.3f, %.3f\n", calldata->latitude, calldata->longitude);
    }
 
    // get distance and bearing
-   if (my_grid != NULL) {
-      if (my_coords.latitude == 0 && my_coords.longitude == 0) {
-         init_my_coords();
-      }
-
-      // did QRZ provide lat / lon?
-      if (calldata->latitude != 0 && calldata->longitude != 0) {
-         double distance = calculateDistance(my_coords.latitude, my_coords.longitude, calldata->latitude, calldata->longitude);
-         double bearing = calculateBearing(my_coords.latitude, my_coords.longitude, calldata->latitude, calldata->longitude);
-
-         if (distance > 0 && bearing > 0) {
-            float heading_miles = distance * 0.6214;
-            fprintf(stdout, "Heading: %.1f mi / %.1f km at %.0f degrees\n", heading_miles, distance, bearing);
-         }
-      } else {		// nope, convert the grid
-         Coordinates call_coord = { 0, 0 };
-
-         if (calldata->grid[0] != '\0') {
-            call_coord = maidenhead2latlon(calldata->grid);
-            log_send(mainlog, LOG_DEBUG, "call grid: %s => lat/lon: %.4f, %.4f", calldata->grid, call_coord.latitude, call_coord.longitude);
-         }
-
-         if (call_coord.latitude == 0 && call_coord.longitude == 0) {
-            return false;
-         } else {
-            double distance = calculateDistance(my_coords.latitude, my_coords.longitude, call_coord.latitude, call_coord.longitude);
-            double bearing = calculateBearing(my_coords.latitude, my_coords.longitude, call_coord.latitude, call_coord.longitude);
-
-            if (distance > 0 && bearing > 0) {
-               float heading_miles = distance * 0.6214;
-               fprintf(stdout, "Heading: %.1f mi / %.1f km at %.0f degrees\n", heading_miles, distance, bearing);
-            }
-         }
-      }
+   double distance = 0, bearing = 0;
+   if (calldata_heading(calldata, &distance, &bearing)) {
+      float heading_miles = distance * 0.6214;
+      client_printf(cl, "Heading: %.1f mi / %.1f km at %.0f degrees\n", heading_miles, distance, bearing);
    }
 
-   if (calldata->alias_count > 0 && (calldata->aliases[0] != '\0')) {
-      fprintf(stdout, "Aliases: %d: %s\n", calldata->alias_count, calldata->aliases);
+   if (calldata->alias_count > 0 && (callrec_get(calldata, CR_ALIASES)[0] != '\0')) {
+      client_printf(cl, "Aliases: %d: %s\n", calldata->alias_count, callrec_get(calldata, CR_ALIASES));
    }
 
    if (calldata->dxcc != 0) {
-      fprintf(stdout, "DXCC: %d\n", calldata->dxcc);
+      client_printf(cl, "DXCC: %d\n", calldata->dxcc);
    }
 
-   if (calldata->email[0] != '\0') {
-      fprintf(stdout, "Email: %s\n", calldata->email);
+   if (callrec_get(calldata, CR_EMAIL)[0] != '\0') {
+      client_printf(cl, "Email: %s\n", callrec_get(calldata, CR_EMAIL));
    }
 
-   if (calldata->address1[0] != '\0') {
-      fprintf(stdout, "Address1: %s\n", calldata->address1);
+   if (callrec_get(calldata, CR_ADDRESS1)[0] != '\0') {
+      client_printf(cl, "Address1: %s\n", callrec_get(calldata, CR_ADDRESS1));
    }
 
-   if (calldata->address_attn[0] != '\0') {
-      fprintf(stdout, "Attn: %s\n", calldata->address_attn);
+   if (callrec_get(calldata, CR_ADDRESS_ATTN)[0] != '\0') {
+      client_printf(cl, "Attn: %s\n", callrec_get(calldata, CR_ADDRESS_ATTN));
    }
 
-   if (calldata->address2[0] != '\0') {
-      fprintf(stdout, "Address2: %s\n", calldata->address2);
+   if (callrec_get(calldata, CR_ADDRESS2)[0] != '\0') {
+      client_printf(cl, "Address2: %s\n", callrec_get(calldata, CR_ADDRESS2));
    }
 
-   if (calldata->state[0] != '\0') {
-      fprintf(stdout, "State: %s\n", calldata->state);
+   if (callrec_get_interned(calldata, CR_STATE)[0] != '\0') {
+      client_printf(cl, "State: %s\n", callrec_get_interned(calldata, CR_STATE));
    }
 
-   if (calldata->zip[0] != '\0') {
-      fprintf(stdout, "Zip: %s\n", calldata->zip);
+   if (callrec_get(calldata, CR_ZIP)[0] != '\0') {
+      client_printf(cl, "Zip: %s\n", callrec_get(calldata, CR_ZIP));
    }
 
-   if (calldata->county[0] != '\0') {
-      fprintf(stdout, "County: %s\n", calldata->county);
+   if (callrec_get_interned(calldata, CR_COUNTY)[0] != '\0') {
+      client_printf(cl, "County: %s\n", callrec_get_interned(calldata, CR_COUNTY));
    }
 
-   if (calldata->fips[0] != '\0') {
-      fprintf(stdout, "FIPS: %s\n", calldata->fips);
+   if (callrec_get(calldata, CR_FIPS)[0] != '\0') {
+      client_printf(cl, "FIPS: %s\n", callrec_get(calldata, CR_FIPS));
    }
 
    if (calldata->license_effective > 0) {
@@ -792,11 +1288,11 @@ bool calldata_dump(calldata_t *calldata, const char *callsign) {
                log_send(mainlog, LOG_DEBUG, "calldata_dump: strfime license effective failed: %d: %s", errno, strerror(errno));
             }
          } else {
-            fprintf(stdout, "License Effective: %s\n", eff_buf);
+            client_printf(cl, "License Effective: %s\n", eff_buf);
          }
       }
    } else {
-      fprintf(stdout, "License Effective: UNKNOWN\n");
+      client_printf(cl, "License Effective: UNKNOWN\n");
    }
 
    if (calldata->license_expiry > 0) {
@@ -814,85 +1310,389 @@ bool calldata_dump(calldata_t *calldata, const char *callsign) {
                log_send(mainlog, LOG_DEBUG, "calldata_dump: strfime license expiry failed: %d: %s", errno, strerror(errno));
             }
          } else {
-            fprintf(stdout, "License Expires: %s\n", exp_buf);
+            client_printf(cl, "License Expires: %s\n", exp_buf);
          }
       }
    } else {
-      fprintf(stdout, "License Expires: UNKNOWN\n");
+      client_printf(cl, "License Expires: UNKNOWN\n");
    }
 
-   if (calldata->country[0] != '\0') {
-      fprintf(stdout, "Country: %s (%d)\n", calldata->country, calldata->country_code);
+   if (callrec_get_interned(calldata, CR_COUNTRY)[0] != '\0') {
+      client_printf(cl, "Country: %s (%d)\n", callrec_get_interned(calldata, CR_COUNTRY), calldata->country_code);
+   }
+
+   time_t lotw = lotw_last_upload(callrec_get(calldata, CR_CALLSIGN));
+   if (lotw > 0) {
+      char lotw_buf[32];
+      struct tm lotw_tm;
+
+      if (gmtime_r(&lotw, &lotw_tm) != NULL && strftime(lotw_buf, sizeof(lotw_buf), "%Y-%m-%d %H:%M:%S UTC", &lotw_tm) > 0) {
+         client_printf(cl, "LoTW Last Upload: %s\n", lotw_buf);
+      }
+   }
+
+   const heard_entry_t *heard = heard_find(callrec_get(calldata, CR_CALLSIGN));
+   if (heard != NULL) {
+      char heard_buf[32];
+      struct tm heard_tm;
+
+      if (gmtime_r(&heard->last, &heard_tm) != NULL && strftime(heard_buf, sizeof(heard_buf), "%Y-%m-%d %H:%M:%S UTC", &heard_tm) > 0) {
+         client_printf(cl, "Last Heard: %s (%u requests, %.1f/hr)\n", heard_buf, heard->total, heard_rate(heard));
+      }
    }
 
    // end of record marker, optional, don't rely on it's presence!
-   fprintf(stdout, "+EOR\n\n");
+   client_printf(cl, "+EOR\n\n");
    return true;
 }
 
-// XXX: Create a socket IO type to pass around here
-typedef struct sockio {
-  char readbuf[16384];
-  char writebuf[32768];
-} sockio_t;
+// send the answer to a lookup back to the client
+static void call_reply(lookup_req_t *req) {
+   client_t *cl = (client_t *)req->priv;
+   const char *online = (Config.offline ? "OFFLINE" : "ONLINE");
+
+   if (req->result == NULL) {
+      log_send(mainlog, LOG_NOTICE, "Callsign %s was not found in enabled databases (%s).", req->callsign, online);
+   }
+
+   // client asked for JSON or binary, encode the whole record at once
+   if (req->format != PROTO_FMT_TEXT) {
+      proto_buf_reset(&reply_buf);
+
+      if (proto_encode_calldata(&reply_buf, req->format, req->result, req->callsign, req->tag)) {
+         client_write(cl, reply_buf.data, reply_buf.len);
+      }
+      return;
+   }
+
+   // tagged replies can come back in any order, so lead with the tag: #17 200 OK ...
+   if (req->tag[0] != '\0') {
+      client_printf(cl, "#%s ", req->tag);
+   }
+
+   // (404s too, so they get the same suggestions)
+   calldata_dump(cl, req->result, req->callsign);
+}
+
+// a watched lookup finished: push it if we found something
+static void watch_reply(lookup_req_t *req) {
+   client_t *cl = (client_t *)req->priv;
+   watch_t *w = cl->watch;
+   watch_entry_t *e = (w != NULL ? watch_find(w, req->callsign) : NULL);
+
+   // ULS only has the basics, so keep an eye out for QRZ data too
+   if (e != NULL) {
+      e->state = ((req->result == NULL || req->result->origin == DATASRC_ULS) ? WATCH_UNRESOLVED : WATCH_ANSWERED);
+   }
+
+   // the client only wants to hear about what we find, not every miss
+   if (req->result == NULL) {
+      return;
+   }
+
+   call_reply(req);
+   if (w != NULL) {
+      w->pushed++;
+   }
+}
+
+// a deferred QRZ lookup came back, send it to anyone who decoded it and didn't get a good answer
+static void watch_enrich(const char *callsign, callrec_t *rec) {
+   for (watch_t *w = watch_list(); w != NULL; w = w->next) {
+      watch_entry_t *e = watch_find(w, callsign);
+      lookup_req_t push;
+
+      if (e == NULL || e->state != WATCH_UNRESOLVED) {
+         continue;
+      }
+
+      memset(&push, 0, sizeof(push));
+      snprintf(push.callsign, sizeof(push.callsign), "%s", callsign);
+      snprintf(push.tag, sizeof(push.tag), "%s", WATCH_TAG);
+      push.format = w->cl->format;
+      push.result = rec;
+      push.priv = w->cl;
+      call_reply(&push);
+
+      e->state = WATCH_ANSWERED;
+      w->enriched++;
+   }
+   clients_flush();
+}
+
+// a line of decoded callsigns from a client in /WATCH mode: K1ABC W1AW, or BAND=20m K1ABC:-12 W1AW:-3
+static void watch_line(client_t *cl, const char *line) {
+   char buf[CLIENT_INBUF_SIZE], *sp = NULL;
+   int band = HEARD_BAND_NONE;
+
+   snprintf(buf, sizeof(buf), "%s", line);
+
+   for (char *call = strtok_r(buf, " \t,", &sp); call != NULL; call = strtok_r(NULL, " \t,", &sp)) {
+      char *snr = NULL;
+      watch_entry_t *e = NULL;
+
+      // the band goes for the rest of the line
+      if (strncasecmp(call, "BAND=", 5) == 0) {
+         band = heard_band_parse(call + 5);
+         continue;
+      }
+
+      if ((snr = strchr(call, ':')) != NULL) {
+         *snr++ = '\0';
+      }
+
+      // every decode counts as activity, even the ones dedup drops
+      heard_record(call, band, (snr != NULL && *snr != '\0' ? atoi(snr) : HEARD_SNR_NONE));
+      e = watch_decode(cl->watch, call);
+
+      // new (or not seen for a while), tagged so cache hits go out as soon as they're done
+      if (e != NULL) {
+         lookup_submit(e->query, QRZ_PRIO_BATCH, WATCH_TAG, cl->format, watch_reply, cl);
+      }
+   }
+}
+
+// where we are, for /GRIDS, false if site/gridsquare and site/coordinates aren't set
+static bool my_position(double *lat, double *lon) {
+   if (my_coords.latitude == 0 && my_coords.longitude == 0) {
+      init_my_coords();
+   }
+   *lat = my_coords.latitude;
+   *lon = my_coords.longitude;
+   return (my_coords.latitude != 0 || my_coords.longitude != 0);
+}
+
+static bool parse_request(client_t *cl, const char *line) {
+   // in the middle of a /GRIDS request? every line is points, until "."
+   if (cl->grids != NULL) {
+      if (strcmp(line, ".") == 0) {
+         double lat, lon;
+         bool have_coords = my_position(&lat, &lon);
+
+         grid_batch_run(cl->grids, have_coords, lat, lon, &cl->out);
+         grid_batch_free(cl->grids);
+         cl->grids = NULL;
+      } else {
+         grid_batch_line(cl->grids, line);
+      }
+      return true;
+   }
+
+   // watching? anything that isn't a command is decoded callsigns
+   if (cl->watch != NULL && line[0] != '/' && line[0] != '\0') {
+      watch_line(cl, line);
+      return true;
+   }
 
-static bool parse_request(const char *line) {
    if (strlen(line) == 0) {
       return true;
    } else if (strncasecmp(line, "/HELP", 5) == 0) {
-      fprintf(stdout, "200 OK Help Text\n");
-      fprintf(stdout, "*** HELP ***\n");
+      client_printf(cl, "200 OK Help Text\n");
+      client_printf(cl, "*** HELP ***\n");
       // XXX: Implement NOCACHE
-      fprintf(stdout, "/CALL <CALLSIGN> [NOCACHE]\tLookup a callsign\n");
+      client_printf(cl, "/CALL[#TAG] <CALLSIGN> [NOCACHE] [BAND=20m] [SNR=-12]\tLookup a callsign (tagged replies come back as soon as they're ready)\n");
       // XXX: Implement optional password
-      fprintf(stdout, "/EXIT\t\t\t\tShutdown the service\n");
-      fprintf(stdout, "/GOODBYE\t\t\tDisconnect from the service, leaving it running\n");
-      fprintf(stdout, "/GRID [GRID|COORD]\t\tGet information about a grid square or lat/lon\n");
-      fprintf(stdout, "/HELP\t\t\t\tThis message\n");
-      fprintf(stdout, "/ONLINE\t\t\t\tSet online mode\n");
-      fprintf(stdout, "/OFFLINE\t\t\tSet offline mode\n");
-
-      fprintf(stdout, "*** Planned ***\n");
-      fprintf(stdout, "/GNIS <GRID|COORDS>\t\tLook up the place name for a grid or WGS-84 coordinate\n");
-      fprintf(stdout, "+OK\n\n");
+      client_printf(cl, "/EXIT\t\t\t\tShutdown the service\n");
+      client_printf(cl, "/GOODBYE\t\t\tDisconnect from the service, leaving it running\n");
+      client_printf(cl, "/GRID [GRID|COORD]\t\tGet information about a grid square or lat/lon\n");
+      client_printf(cl, "/GRIDS [POINTS...]\t\tDistance and bearing to many grids or lat,lon at once (no points: one or more lines of them, then .)\n");
+      client_printf(cl, "/HEARD [CALL|BAND] [MAX]\tShow activity per band and the busiest stations, or one station's history\n");
+      client_printf(cl, "/HELP\t\t\t\tThis message\n");
+      client_printf(cl, "/ONLINE\t\t\t\tSet online mode\n");
+      client_printf(cl, "/OFFLINE\t\t\tSet offline mode\n");
+      client_printf(cl, "/PROTO [TEXT|JSON|BINARY]\tShow or set the format of lookup replies\n");
+      client_printf(cl, "/QUOTA\t\t\t\tShow QRZ rate limit, daily budget, queue depth and online sessions\n");
+      client_printf(cl, "/SEARCH <CALL|PATTERN> [MAX]\tFind known calls: K1A* (prefix), K1AB? (wildcards) or K1ABX (and calls one typo away)\n");
+      client_printf(cl, "/STATS\t\t\t\tShow request counts, latency percentiles and memory use\n");
+      client_printf(cl, "/WATCH [WINDOW|OFF]\t\tStream decoded callsigns, one or more per line, answers are pushed\n");
+
+      client_printf(cl, "*** Planned ***\n");
+      client_printf(cl, "/GNIS <GRID|COORDS>\t\tLook up the place name for a grid or WGS-84 coordinate\n");
+      client_printf(cl, "+OK\n\n");
    } else if (strncasecmp(line, "/ONLINE", 7) == 0) {
-      Config.offline = false;
-      fprintf(stdout, "+ONLINE\n\n");
+      if (Config.use_qrz || Config.use_hamqth) {
+         // the session managers will clear offline once we're logged in
+         if (Config.use_qrz) {
+            qrz_set_online(true);
+         }
+
+         if (Config.use_hamqth) {
+            hamqth_set_online(true);
+         }
+      } else {
+         Config.offline = false;
+      }
+      client_printf(cl, "+ONLINE\n\n");
    } else if (strncasecmp(line, "/OFFLINE", 8) == 0) {
+      if (Config.use_qrz) {
+         qrz_set_online(false);
+      }
+
+      if (Config.use_hamqth) {
+         hamqth_set_online(false);
+      }
       Config.offline = true;
-      fprintf(stdout, "+OFFLINE\n\n");
-   } else if (strncasecmp(line, "/CALL", 5) == 0) {
-      const char *callsign = line + 6;
+      client_printf(cl, "+OFFLINE\n\n");
+   } else if (strncasecmp(line, "/PROTO", 6) == 0) {
+      const char *fmt = line + 6;
+
+      while (*fmt == ' ') {
+         fmt++;
+      }
 
-      calldata_t *calldata = callsign_lookup(callsign);
+      if (*fmt != '\0') {
+         int f = proto_parse_format(fmt);
+
+         if (f < 0) {
+            client_printf(cl, "400 Bad Request - Unknown format %s, try TEXT, JSON or BINARY\n", fmt);
+            return false;
+         }
+         cl->format = f;
+      }
+      client_printf(cl, "200 OK PROTO %s\n", proto_format_name[cl->format]);
+   } else if (strncasecmp(line, "/QUOTA", 6) == 0) {
+      client_printf(cl, "200 OK QRZ quota\n");
+      qrz_session_dump(&cl->out);
+      qrz_ratelimit_dump(&cl->out);
+      hamqth_session_dump(&cl->out);
+      client_printf(cl, "+EOR\n\n");
+   } else if (strncasecmp(line, "/SEARCH", 7) == 0) {
+      const char *query = line + 7;
+      const char *max = NULL;
+      int limit = search_max_results;
+
+      while (*query == ' ' || *query == '\t') {
+         query++;
+      }
 
-      const char *online = (Config.offline ? "OFFLINE" : "ONLINE");
+      if ((max = strpbrk(query, " \t")) != NULL && atoi(max) > 0) {
+         limit = atoi(max);
+      }
+      callidx_search_dump(query, limit, &cl->out);
+   } else if (strncasecmp(line, "/HEARD", 6) == 0) {
+      heard_query_dump(line + 6, &cl->out);
+   } else if (strncasecmp(line, "/STATS", 6) == 0) {
+      client_printf(cl, "200 OK Statistics\n");
+      stats_dump(&cl->out);
+      memcache_dump(&cl->out);
+      snapshot_dump(&cl->out);
+      uls_dump(&cl->out);
+      lotw_dump(&cl->out);
+      callidx_dump(&cl->out);
+      heard_dump(&cl->out);
+      backends_dump(&cl->out);
+      pools_dump(&cl->out);
+      client_printf(cl, "+EOR\n\n");
+   } else if (strncasecmp(line, "/WATCH", 6) == 0) {
+      const char *arg = line + 6;
+
+      while (*arg == ' ') {
+         arg++;
+      }
 
-      if (calldata == NULL) {
-         fprintf(stdout, "404 NOT FOUND %s %s %lu\n", callsign, online, now);
-         log_send(mainlog, LOG_NOTICE, "Callsign %s was not found in enabled databases.", callsign);
+      if (strcasecmp(arg, "OFF") == 0) {
+         if (cl->watch == NULL) {
+            client_printf(cl, "400 Bad Request - Not watching\n");
+            return false;
+         }
+         client_printf(cl, "200 OK UNWATCH ");
+         watch_dump(cl->watch, &cl->out);
+         watch_stop(cl->watch);
+         cl->watch = NULL;
+      } else if (cl->watch != NULL && *arg == '\0') {
+         client_printf(cl, "200 OK WATCH ");
+         watch_dump(cl->watch, &cl->out);
       } else {
-         // Send the result
-         calldata_dump(calldata, callsign);
-         free(calldata);
-         calldata = NULL;
+         // how long to ignore repeats? (cfg:callsign-lookup/watch-dedup)
+         const char *window_str = (*arg != '\0' ? arg : cfg_get_str(cfg, "callsign-lookup/watch-dedup"));
+         time_t window = (window_str != NULL ? timestr2time_t(window_str) : 0);
+
+         if (window <= 0) {
+            window = 600;
+         }
+
+         if (cl->watch != NULL) {
+            cl->watch->window = window;
+         } else {
+            cl->watch = watch_start(cl, window);
+         }
+         client_printf(cl, "200 OK WATCH window=%lu\n", window);
+      }
+   } else if (strncasecmp(line, "/CALL", 5) == 0) {
+      const char *callsign = line + 5;
+      char tag[LOOKUP_TAG_LEN + 1] = "", call[MAX_CALLSIGN], *opt = NULL, *sp = NULL;
+      char buf[CLIENT_INBUF_SIZE];
+      int band = HEARD_BAND_NONE, snr = HEARD_SNR_NONE;
+
+      // tagged? (/CALL#17 K1ABC) the reply can come back as soon as it's ready
+      if (*callsign == '#') {
+         size_t tag_len = strspn(callsign + 1, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_");
+
+         if (tag_len == 0 || tag_len > LOOKUP_TAG_LEN || (callsign[tag_len + 1] != ' ' && callsign[tag_len + 1] != '\0')) {
+            client_printf(cl, "400 Bad Request - Tags are 1-%d letters, digits, - or _\n", LOOKUP_TAG_LEN);
+            return false;
+         }
+         memcpy(tag, callsign + 1, tag_len);
+         tag[tag_len] = '\0';
+         callsign += tag_len + 1;
+      }
+
+      while (*callsign == ' ') {
+         callsign++;
       }
+
+      // the call, then options: /CALL K1ABC BAND=20m SNR=-12
+      snprintf(call, sizeof(call), "%.*s", (int)strcspn(callsign, " \t"), callsign);
+      snprintf(buf, sizeof(buf), "%s", callsign + strcspn(callsign, " \t"));
+
+      for (opt = strtok_r(buf, " \t", &sp); opt != NULL; opt = strtok_r(NULL, " \t", &sp)) {
+         if (strncasecmp(opt, "BAND=", 5) == 0) {
+            if ((band = heard_band_parse(opt + 5)) < 0) {
+               client_printf(cl, "400 Bad Request - Unknown band %s, try 20m or a frequency in MHz\n", opt + 5);
+               return false;
+            }
+         } else if (strncasecmp(opt, "SNR=", 4) == 0) {
+            snr = atoi(opt + 4);
+         }
+      }
+      heard_record(call, band, snr);
+
+      // the answer comes back from the worker pool, see call_reply()
+      lookup_submit(call, QRZ_PRIO_INTERACTIVE, tag, cl->format, call_reply, cl);
    } else if (strncasecmp(line, "/GNIS", 5) == 0) {
      const char *point = line + 6;
 
      if (*point == '\0') {
-        fprintf(stdout, "You must specify a WGS-84 coordinate or a 4-10 digit grid square.\n");
+        client_printf(cl, "You must specify a WGS-84 coordinate or a 4-10 digit grid square.\n");
         return false;
      }
+   } else if (strncasecmp(line, "/GRIDS", 6) == 0 || strncasecmp(line, "/DIST", 5) == 0) {
+      const char *arg = line + (toupper((unsigned char)line[1]) == 'G' ? 6 : 5);
+
+      while (*arg == ' ' || *arg == '\t') {
+         arg++;
+      }
+      cl->grids = grid_batch_start();
+
+      // points on the command line? that's all of them
+      if (*arg != '\0') {
+         double lat, lon;
+         bool have_coords = my_position(&lat, &lon);
+
+         grid_batch_line(cl->grids, arg);
+         grid_batch_run(cl->grids, have_coords, lat, lon, &cl->out);
+         grid_batch_free(cl->grids);
+         cl->grids = NULL;
+      }
    } else if (strncasecmp(line, "/GRID", 5) == 0) {
      Coordinates coord = { 0, 0 };
      const char *point = line + 6;
      const char *comma = NULL;
-     char dupe_point[11];
-     const char *their_grid = NULL;
+     char dupe_point[GRID_MAX_LEN + 1];
+     char their_grid[GRID_MAX_LEN + 1];
 
      if (*(line + 6) == '\0') {
-        fprintf(stdout, "You must specify a WGS-84 coordinate or a 4-10 digit grid square.\n");
+        client_printf(cl, "You must specify a WGS-84 coordinate or a 4-10 digit grid square.\n");
         return false;
      }
 
@@ -907,26 +1707,16 @@ static bool parse_request(const char *line) {
         comma = strchr(p, ',');
 
         if (comma == NULL) {
-           // skip leading spaces
-           size_t point_len = strlen(p);
-           // is it too long?
-           if (point_len > 10) {
-              fprintf(stderr, "+ERROR Invalid grid square '%s' (over 10 characters)\n", point);
+           double lat, lon;
+
+           // checks it and gives it back in the usual case (FN31pr)
+           if (!grid_decode(p, &lat, &lon, dupe_point)) {
+              client_printf(cl, "+ERROR Invalid grid square '%s' (should be 2, 4, 6, 8 or 10 characters, ex: FN31pr)\n", p);
               return false;
            }
-           memset(dupe_point, 0, 11);
-           memcpy(dupe_point, p, point_len);
-          
-           // upper case it, for readability
-           for (int i = 0; i < point_len; i++) {
-              // upper case all letters
-              if (!isdigit(dupe_point[i])) {
-                 dupe_point[i] = toupper(point[i]);
-              } else {
-                 dupe_point[i] = p[i];
-              }
-           }
-           coord = maidenhead2latlon(dupe_point);
+           coord.latitude = lat;
+           coord.longitude = lon;
+           coord.precision = strlen(dupe_point) / 2;
         } else {
            // skip leading white space
            const char *p = point;
@@ -946,7 +1736,7 @@ static bool parse_request(const char *line) {
               lon_digits = (int)(lon_end - (lon_dot + 1));		// figure out lon length
 //              log_send(mainlog, LOG_DEBUG, "precision: lat_digits: %lu, lon_digits: %lu", lat_digits, lon_digits);
            } else {
-              fprintf(stdout, "+ERROR: You must specify at least one decimal place for each coordinate\n");
+              client_printf(cl, "+ERROR: You must specify at least one decimal place for each coordinate\n");
               return false;
            }
 
@@ -974,7 +1764,12 @@ static bool parse_request(const char *line) {
            float lon = atof(comma);	// this stops at any text after longitude
            coord.latitude = lat;
            coord.longitude = lon;
-           their_grid = latlon2maidenhead(&coord);
+
+           // as many characters as the coordinates are good for
+           if (!grid_encode(lat, lon, (coord.precision >= 5 ? GRID_MAX_LEN : coord.precision * 2), their_grid)) {
+              client_printf(cl, "+ERROR Invalid coordinates '%s'\n", p);
+              return false;
+           }
         }
      }
 
@@ -983,93 +1778,135 @@ static bool parse_request(const char *line) {
      }
 
      if (comma == NULL) {
-        fprintf(stdout, "Grid: %s\n", dupe_point);
+        client_printf(cl, "Grid: %s\n", dupe_point);
      } else {
-        fprintf(stdout, "Grid: %s\n", their_grid);
+        client_printf(cl, "Grid: %s\n", their_grid);
      }
 
      // XXX: this is ugly, can we make it more compact?
-//     fprintf(stdout, "WGS-84: %*f, %*f\n", coord.precision, coord.latitude, coord.precision, coord.longitude);
+//     client_printf(cl, "WGS-84: %*f, %*f\n", coord.precision, coord.latitude, coord.precision, coord.longitude);
      if (coord.precision >= 5) {
-        fprintf(stdout, "WGS-84: %.5f, %.5f\n", coord.latitude, coord.longitude);
+        client_printf(cl, "WGS-84: %.5f, %.5f\n", coord.latitude, coord.longitude);
      } else if (coord.precision <= 4) {
-        fprintf(stdout, "WGS-84: %.4f, %.4f\n", coord.latitude, coord.longitude);
+        client_printf(cl, "WGS-84: %.4f, %.4f\n", coord.latitude, coord.longitude);
      } else if (coord.precision <= 3) {
-        fprintf(stdout, "WGS-84: %.3f, %.3f\n", coord.latitude, coord.longitude);
+        client_printf(cl, "WGS-84: %.3f, %.3f\n", coord.latitude, coord.longitude);
      } else if (coord.precision <= 2) {
-        fprintf(stdout, "WGS-84: %.2f, %.2f\n", coord.latitude, coord.longitude);
+        client_printf(cl, "WGS-84: %.2f, %.2f\n", coord.latitude, coord.longitude);
      } else if (coord.precision <= 1) {
-        fprintf(stdout, "WGS-84: %.1f, %.1f\n", coord.latitude, coord.longitude);
+        client_printf(cl, "WGS-84: %.1f, %.1f\n", coord.latitude, coord.longitude);
      }
 
-     double distance = calculateDistance(my_coords.latitude, my_coords.longitude, coord.latitude, coord.longitude);
-     double bearing = calculateBearing(my_coords.latitude, my_coords.longitude, coord.latitude, coord.longitude);
+     double distance, bearing;
+
+     if (comma != NULL || !grid_heading(dupe_point, &distance, &bearing)) {
+        distance = calculateDistance(my_coords.latitude, my_coords.longitude, coord.latitude, coord.longitude);
+        bearing = calculateBearing(my_coords.latitude, my_coords.longitude, coord.latitude, coord.longitude);
+     }
 
      float heading_miles = distance * 0.6214;
-     fprintf(stdout, "Heading: %.1f mi / %.1f km at %.0f degrees\n", heading_miles, distance, bearing);
-     fprintf(stdout, "+EOR\n\n");
+     client_printf(cl, "Heading: %.1f mi / %.1f km at %.0f degrees\n", heading_miles, distance, bearing);
+     client_printf(cl, "+EOR\n\n");
    } else if (strncasecmp(line, "/EXIT", 5) == 0) {
       log_send(mainlog, LOG_CRIT, "Got EXIT from client. Goodbye!");
-      fprintf(stdout, "+GOODBYE Hope you had a nice session! Exiting.\n");
-      fini(0);
+
+      // let any lookups still in the workers answer first
+      if (lookup_pending() > 0) {
+         exit_when_idle = true;
+         return false;
+      }
+      client_printf(cl, "+GOODBYE Hope you had a nice session! Exiting.\n");
+      clients_drain();
+      shutdown_now();
    } else if (strncasecmp(line, "/GOODBYE", 8) == 0) {
       log_send(mainlog, LOG_NOTICE, "Got GOODBYE from client. Disconnecting it.");
-      fprintf(stdout, "+GOODBYE Hope you had a nice session!\n");
+      client_printf(cl, "+GOODBYE Hope you had a nice session!\n");
       // XXX: Disconnect client
       // XXX: Free the client
    } else {
       // XXX: Someday we should implement a read-line interface and treat this as a callsign lookup ;)
-      fprintf(stdout, "400 Bad Request - Your client sent a request I do not understand... Try /HELP for commands!\n");
+      client_printf(cl, "400 Bad Request - Your client sent a request I do not understand... Try /HELP for commands!\n");
    }
    
    return false;
 }
 
-static void stdin_cb(EV_P_ ev_io *w, int revents) {
-    if (EV_ERROR & revents) {
-       fprintf(stderr, "+ERROR Error event in stdin watcher\n");
-       return;
-    }
-
-    InputBuffer *input = (InputBuffer *)w->data;
-    ssize_t bytesRead = read(STDIN_FILENO, input->buffer + input->length, BUFFER_SIZE - input->length);
-
-    if (bytesRead < 0) {
-        perror("read");
-        return;
-    }
-
-    if (bytesRead == 0) {
-       // End of file (Ctrl+D pressed)
-       ev_io_stop(EV_A, w);
-       free(input);
-       log_send(mainlog, LOG_CRIT, "got ^D (EOF), exiting!");
-       fprintf(stdout, "+GOODBYE Hope you had a nice session! Exiting.\n");
-       fini(0);
-       return;
-    }
-
-    input->length += bytesRead;
-
-    // Process complete lines
-    char *newline;
-    while ((newline = strchr(input->buffer, '\n')) != NULL) {
-       *newline = '\0';  // Replace newline character with null terminator
-       parse_request(input->buffer);
-       memmove(input->buffer, newline + 1, input->length - (newline - input->buffer));
-       input->length -= (newline - input->buffer) + 1;
-    }
-
-    // If buffer is full and no newline is found, consider it an incomplete line
-    if (input->length == BUFFER_SIZE) {
-       fprintf(stdout, "+ERROR Input buffer full, discarding incomplete line: %s\n", input->buffer);
-       input->length = 0;  // Discard the incomplete line
-    }
+static void parse_request_cb(client_t *cl, const char *line) {
+   // on our way out, ignore anything sent after /EXIT
+   if (!dying) {
+      parse_request(cl, line);
+   }
+}
+
+static void stdio_eof_cb(client_t *cl) {
+   // End of file (Ctrl+D pressed)
+   log_send(mainlog, LOG_CRIT, "got ^D (EOF), exiting!");
+
+   // wait for lookups still in the workers to answer
+   if (lookup_pending() > 0) {
+      exit_when_idle = true;
+      return;
+   }
+   client_printf(cl, "+GOODBYE Hope you had a nice session! Exiting.\n");
+   clients_drain();
+   shutdown_now();
+}
+
+// worker thread: send a deferred QRZ request (it already has it's token) and cache the answer
+static void qrz_refresh_run(work_t *w) {
+   lookup_req_t *req = (lookup_req_t *)w;
+   calldata_t *qr = NULL;
+
+   if ((qr = qrz_lookup_callsign(req->callsign, req->prio)) != NULL) {
+      log_send(mainlog, LOG_DEBUG, "got deferred (%s) qrz calldata for %s", qrz_prio_name[req->prio], req->callsign);
+      callsign_cache_save(qr);
+      req->result = callrec_pack(qr);
+      memcache_save(qr);
+      calldata_free(qr);
+   }
+}
+
+static void qrz_refresh_done(work_t *w) {
+   lookup_req_t *req = (lookup_req_t *)w;
+
+   // someone watching for this one?
+   if (req->result != NULL && watch_list() != NULL) {
+      watch_enrich(req->callsign, req->result);
+   }
+   callrec_put(req->result);
+   pool_put(&req_pool, req);
+}
+
+// a deferred QRZ request got a token, hand it to a worker
+static void qrz_sched_cb(const char *callsign, qrz_prio_t prio) {
+   lookup_req_t *req = NULL;
+
+   if (!Config.use_qrz || !qrz_usable()) {
+      return;
+   }
+
+   req = pool_get(&req_pool);
+   memset(req, 0, sizeof(lookup_req_t));
+   snprintf(req->callsign, MAX_CALLSIGN, "%s", callsign);
+   req->prio = prio;
+   req->work.prio = prio;
+   req->work.run = qrz_refresh_run;
+   req->work.done = qrz_refresh_done;
+   workers_submit(&req->work);
+}
+
+static void stats_log_cb(EV_P_ ev_timer *w, int revents) {
+   stats_log();
 }
 
 static void periodic_cb(EV_P_ ev_timer *w, int revents) {
    now = time(NULL);			   // update our shared timestamp
 
+   // send any QRZ requests that were waiting on the rate limiter
+   if (Config.use_qrz && qrz_usable()) {
+      qrz_sched_run(qrz_sched_cb);
+   }
+
    // every 3 hours, expire old cache data entries
    if ((now % 10800) == 0) {
       run_sql_expire();
@@ -1078,10 +1915,10 @@ static void periodic_cb(EV_P_ ev_timer *w, int revents) {
 
 int main(int argc, char **argv) {
    struct ev_loop *loop = EV_DEFAULT;
-   struct ev_io stdin_watcher;
+   lookup_loop = loop;
    struct ev_timer periodic_watcher;
+   struct ev_timer stats_watcher;
    bool res = false;
-   InputBuffer *input = NULL;
 
 #if	defined(DEBUG)
    // setup logging for address sanitizers early
@@ -1091,6 +1928,7 @@ int main(int argc, char **argv) {
 
    // start our clock, periodic_cb will refresh in once a second
    now = time(NULL);
+   stats_init();
 
    // This can't work without a valid configuration...
    if (!(cfg = load_config()))
@@ -1115,16 +1953,8 @@ int main(int argc, char **argv) {
    // initialize site location data
    init_my_coords();
 
-   // setup stdin
-   if ((input = malloc(sizeof(InputBuffer))) == NULL) {
-      fprintf(stderr, "out of memory!\n");
-      log_send(mainlog, LOG_CRIT, "malloc(InputBuffer): out of memory!");
-      exit(ENOMEM);
-   }
-   memset(input, 0, sizeof(InputBuffer));
-   ev_io_init(&stdin_watcher, stdin_cb, STDIN_FILENO, EV_READ);
-   stdin_watcher.data = input;
-   ev_io_start(loop, &stdin_watcher);
+   // setup stdio, we don't take requests from stdin if called with callsigns to look up
+   client_init(&stdio_client, loop, (argc > 1 ? -1 : STDIN_FILENO), STDOUT_FILENO, parse_request_cb, stdio_eof_cb);
 
    // start our once a second periodic timer (used for housekeeping)
    ev_timer_init(&periodic_watcher, periodic_cb, 0, 1);
@@ -1133,47 +1963,128 @@ int main(int argc, char **argv) {
    // initialize things
    callsign_lookup_setup();
 
+   // log a stats summary line every so often? (cfg:callsign-lookup/stats-log-interval, 0 = never)
+   time_t stats_interval = timestr2time_t(cfg_get_str(cfg, "callsign-lookup/stats-log-interval"));
+   if (stats_interval > 0) {
+      ev_timer_init(&stats_watcher, stats_log_cb, stats_interval, stats_interval);
+      ev_timer_start(loop, &stats_watcher);
+   }
+
+   // include requests in the /STATS pool report
+   pool_stats_register(&req_pool_stats);
+   pool_stats_register(&job_pool_stats);
+
+   // where answers come from, in what order (cfg:callsign-lookup/backends, ex: "cache,qrz|uls")
+   backends_init(cfg_get_str(cfg, "callsign-lookup/backends"));
+
+   // DXCC prefixes, to tell where portable stations are (cfg:callsign-lookup/cty-dat, ex: "/usr/share/wsjtx/cty.dat")
+   const char *cty_dat = cfg_get_str(cfg, "callsign-lookup/cty-dat");
+   if (cty_dat != NULL && *cty_dat != '\0') {
+      cty_load(cty_dat);
+   }
+
+   // index the ULS callsigns, so misses don't cost a query (cfg:callsign-lookup/fcc-uls-db)
+   if (Config.use_uls) {
+      uls_init(cfg_get_str(cfg, "callsign-lookup/fcc-uls-db"));
+   }
+
+   // start the lookup workers, each opens it's own connection to the cache
+   int nworkers = cfg_get_int(cfg, "callsign-lookup/worker-threads");
+   if (nworkers <= 0) {
+      nworkers = 4;
+   }
+
+   if (!workers_init(loop, nworkers, worker_thread_init, worker_thread_fini)) {
+      log_send(mainlog, LOG_CRIT, "failed starting lookup workers, exiting!");
+      fprintf(stderr, "+ERROR failed starting lookup workers, exiting!\n");
+      exit(255);
+   }
+
+   // start the QRZ session, the login itself happens on a worker
+   if (Config.use_qrz && !qrz_start_session(loop)) {
+      log_send(mainlog, LOG_CRIT, "QRZ is enabled but not configured, disabling QRZ lookups");
+      Config.use_qrz = false;
+   }
+
+   // when did they last upload to LoTW? (cfg:callsign-lookup/lotw-url, refreshed every lotw-activity-download)
+   // Not for one-shot lookups from the command line, we'd be gone long before the list is.
+   if (use_lotw && argc > 1) {
+      use_lotw = false;
+   } else if (use_lotw) {
+      lotw_start(loop);
+   }
+
+   // who's been asked about lately, for /HEARD and the Last Heard lines
+   heard_start();
+
+   // every call we know of, for /SEARCH (rebuilt every cfg:callsign-lookup/search-index-refresh)
+   // One-shot lookups don't stay around long enough to use it.
+   if (argc <= 1) {
+      callidx_start(loop);
+   }
+
+   // and HamQTH, if it's enabled too
+   if (Config.use_hamqth && !hamqth_start_session(loop)) {
+      log_send(mainlog, LOG_CRIT, "HamQTH is enabled but not configured, disabling HamQTH lookups");
+      Config.use_hamqth = false;
+   }
 
-   printf("+NOTICE This server is experimental. Please feel free to suggest improvements or send patches\n");
-   printf("+NOTICE Use /HELP to see available commands.\n");
-   printf("+PROTO %d mytime=%lu\n", PROTO_VER, now);
-   printf("+OK %s/%s ready to answer requests. QRZ: %s%s, ULS: %s, GNIS: %s, Cache: %s\n",
+   client_printf(&stdio_client, "+NOTICE This server is experimental. Please feel free to suggest improvements or send patches\n");
+   client_printf(&stdio_client, "+NOTICE Use /HELP to see available commands.\n");
+   client_printf(&stdio_client, "+PROTO %d mytime=%lu formats=TEXT,JSON,BINARY\n", PROTO_VER, now);
+   client_printf(&stdio_client, "+OK %s/%s ready to answer requests. QRZ: %s%s, HamQTH: %s, ULS: %s, GNIS: %s, LoTW: %s, Cache: %s\n",
          progname, VERSION,
          (Config.use_qrz ? "On" : "Off"), (Config.offline ? " (offline)" : ""),
-         (Config.use_uls ? "On" : "Off"), (use_gnis ? "On" : "Off"),
+         (Config.use_hamqth ? "On" : "Off"),
+         (Config.use_uls ? "On" : "Off"), (use_gnis ? "On" : "Off"), (use_lotw ? "On" : "Off"),
          (Config.use_cache ? "On" : "Off"));
+   client_flush(&stdio_client);
 
    // run expires at startup (useful for non-daemon users)
    run_sql_expire();
 
    // if called with callsign(s) as args, look them up, return the parsed output and exit
    if (argc > 1) {
-      for (int i = 1; i <= (argc - 1); i++) {
-         char *callsign = argv[i];
-         calldata_t *calldata = NULL;
+      // give the QRZ session a chance to log in before we start
+      while ((Config.use_qrz && qrz_login_pending()) || (Config.use_hamqth && hamqth_login_pending())) {
+         ev_run(loop, EVRUN_ONCE);
+      }
 
-         if (argv[i] != NULL) {
-            calldata = callsign_lookup(callsign);
-         } else {
+      for (int i = 1; i <= (argc - 1); i++) {
+         if (argv[i] == NULL) {
             break;
          }
+         lookup_submit(argv[i], QRZ_PRIO_BATCH, NULL, PROTO_FMT_TEXT, call_reply, &stdio_client);
+      }
 
-         const char *online = (Config.offline ? "OFFLINE" : "ONLINE");
-
-         if (calldata == NULL) {
-            fprintf(stdout, "404 NOT FOUND %s %s %lu\n", callsign, online, now);
-            log_send(mainlog, LOG_NOTICE, "Callsign %s was not found in enabled databases (%s).", callsign, online);
-         } else {
-            calldata_dump(calldata, callsign);
-            free(calldata);
-            calldata = NULL;
-         }
+      // wait for all the answers to come back
+      while (lookup_pending() > 0) {
+         ev_run(loop, EVRUN_ONCE);
       }
-      fprintf(stdout, "+GOODBYE Hope you had a nice session! Exiting.\n");
+      client_printf(&stdio_client, "+GOODBYE Hope you had a nice session! Exiting.\n");
 
       dying = true;
    } else {
       log_send(mainlog, LOG_INFO, "%s/%s ready to answer requests. QRZ: %s, ULS: %s, GNIS: %s, Cache: %s", progname, VERSION, (Config.use_qrz ? "On" : "Off"), (Config.use_uls ? "On" : "Off"), (use_gnis ? "On" : "Off"), (Config.use_cache ? "On" : "Off"));
+
+      // prometheus scrape endpoint? (cfg:callsign-lookup/metrics-listen, ex: "127.0.0.1:9464")
+      const char *metrics_listen = cfg_get_str(cfg, "callsign-lookup/metrics-listen");
+      if (metrics_listen != NULL && *metrics_listen != '\0' && !metrics_http_init(loop, metrics_listen)) {
+         log_send(mainlog, LOG_WARNING, "couldn't start metrics listener on %s, continuing without it", metrics_listen);
+      }
+
+      // shared memory channel for local clients? (cfg:callsign-lookup/shm-listen, ex: "/run/user/1000/callsign-lookup.sock")
+      const char *shm_listen = cfg_get_str(cfg, "callsign-lookup/shm-listen");
+      if (shm_listen != NULL && *shm_listen != '\0' && !shm_server_init(loop, shm_listen)) {
+         log_send(mainlog, LOG_WARNING, "couldn't start shm listener on %s, continuing without it", shm_listen);
+      }
+
+      // snapshot the memory cache for local tools? (cfg:callsign-lookup/snapshot-file, ex: "/run/user/1000/callsign-lookup.snap")
+      const char *snapshot_file = cfg_get_str(cfg, "callsign-lookup/snapshot-file");
+      if (snapshot_file != NULL && *snapshot_file != '\0') {
+         time_t snapshot_interval = timestr2time_t(cfg_get_str(cfg, "callsign-lookup/snapshot-interval"));
+         snapshot_init(loop, snapshot_file, (snapshot_interval > 0 ? snapshot_interval : 300));
+      }
    }
 
    // run the EV main loop...
@@ -1181,13 +2092,33 @@ int main(int argc, char **argv) {
       ev_run(loop, 0);
    }
 
-   // Close the database(s)
-   sql_fini();
+   metrics_http_fini();
+   shm_server_fini();
 
-   // XXX: get rid of this in favor of per-socket buffers, if we go that route...
-   if (input != NULL) {
-      free(input);
-      input = NULL;
+   // make sure the client gets everything before we go
+   clients_drain();
+   if (stdio_client.watch != NULL) {
+      watch_stop(stdio_client.watch);
    }
+   grid_batch_free(stdio_client.grids);
+
+   // Stop the workers and close the database(s). Nothing a job might still be reading gets freed before this
+   lotw_cancel();
+   sql_fini();
+
+   snapshot_fini();
+   cty_unload();
+   uls_fini();
+   lotw_stop();
+   callidx_stop();
+   heard_stop();
+   client_fini(&stdio_client);
+   clients_fini();
+   memcache_fini();
+   proto_buf_free(&reply_buf);
+   proto_fini();
+   pool_drain(&req_pool);
+   calldata_pool_drain();
+   fini(0);
    return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * Callsign normalization
+ *
+ * Clients send whatever they decoded or the user typed: k1abc, "K1ABC ",
+ * K1ABC/P, VE3/K1ABC, VE3/K1ABC/M. QRZ, the ULS and our caches only know
+ * K1ABC, so everything is keyed on the base call and the rest only decides
+ * where the station is operating from (cty.dat).
+ *
+ * Which part of A/B is the call: a known suffix (P, M, QRP, a call area
+ * digit...) after it, otherwise the shorter part is the prefix or location
+ * (VE3/K1ABC, K1ABC/VE3), otherwise whichever looks like a call.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "ft8goblin_types.h"
+#include "cty.h"
+#include "callsign-norm.h"
+
+// character -> upper case, 0 = can't be in a callsign
+#define	CU(c)		[c] = c, [(c) + ('a' - 'A')] = c
+static const char call_char[256] = {
+   CU('A'), CU('B'), CU('C'), CU('D'), CU('E'), CU('F'), CU('G'), CU('H'), CU('I'),
+   CU('J'), CU('K'), CU('L'), CU('M'), CU('N'), CU('O'), CU('P'), CU('Q'), CU('R'),
+   CU('S'), CU('T'), CU('U'), CU('V'), CU('W'), CU('X'), CU('Y'), CU('Z'),
+   ['0'] = '0', ['1'] = '1', ['2'] = '2', ['3'] = '3', ['4'] = '4',
+   ['5'] = '5', ['6'] = '6', ['7'] = '7', ['8'] = '8', ['9'] = '9',
+   ['/'] = '/'
+};
+#undef	CU
+
+// suffixes that say how they're operating, not where
+static const char *call_modifiers[] = {
+   "P", "M", "MM", "AM", "A", "B", "J", "R", "QRP", "QRPP", "LH", NULL
+};
+
+static bool call_is_modifier(const char *s) {
+   // a call area: K1ABC/4
+   if (s[0] >= '0' && s[0] <= '9' && s[1] == '\0') {
+      return true;
+   }
+
+   for (int i = 0; call_modifiers[i] != NULL; i++) {
+      if (strcmp(s, call_modifiers[i]) == 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+// a digit with a letter somewhere after it, and at least 3 characters: K1ABC, 2E0XYZ, 4U1UN
+static bool call_looks_valid(const char *s) {
+   const char *digit = strpbrk(s, "0123456789");
+
+   return (strlen(s) >= 3 && digit != NULL && strpbrk(digit, "ABCDEFGHIJKLMNOPQRSTUVWXYZ") != NULL);
+}
+
+bool callsign_normalize(const char *raw, callsign_parts_t *parts) {
+   char tmp[MAX_CALLSIGN], *part[3];
+   const char *end = NULL;
+   int nparts = 1;
+   size_t len;
+
+   memset(parts, 0, sizeof(*parts));
+
+   if (raw == NULL) {
+      return false;
+   }
+
+   while (*raw == ' ' || *raw == '\t') {
+      raw++;
+   }
+   end = raw + strlen(raw);
+   while (end > raw && isspace((unsigned char)end[-1])) {
+      end--;
+   }
+
+   if ((len = end - raw) == 0 || len >= MAX_CALLSIGN) {
+      return false;
+   }
+
+   for (size_t i = 0; i < len; i++) {
+      if ((parts->full[i] = call_char[(uint8_t)raw[i]]) == '\0') {
+         return false;
+      }
+   }
+   parts->full[len] = '\0';
+
+   // split on /, no empty pieces
+   memcpy(tmp, parts->full, len + 1);
+   part[0] = tmp;
+   for (char *s = tmp; *s != '\0'; s++) {
+      if (*s == '/') {
+         if (nparts == 3) {
+            return false;
+         }
+         *s = '\0';
+         part[nparts++] = s + 1;
+      }
+   }
+
+   for (int i = 0; i < nparts; i++) {
+      if (part[i][0] == '\0') {
+         return false;
+      }
+   }
+
+   if (nparts == 1) {
+      snprintf(parts->base, sizeof(parts->base), "%s", part[0]);
+   } else if (nparts == 3) {
+      snprintf(parts->prefix, sizeof(parts->prefix), "%s", part[0]);
+      snprintf(parts->base, sizeof(parts->base), "%s", part[1]);
+      snprintf(parts->suffix, sizeof(parts->suffix), "%s", part[2]);
+   } else {
+      size_t l0 = strlen(part[0]), l1 = strlen(part[1]);
+      bool prefixed;
+
+      if (call_is_modifier(part[1])) {
+         prefixed = false;
+      } else if (l0 != l1) {
+         prefixed = (l0 < l1);
+      } else {
+         prefixed = (call_looks_valid(part[1]) && !call_looks_valid(part[0]));
+      }
+
+      if (prefixed) {
+         snprintf(parts->prefix, sizeof(parts->prefix), "%s", part[0]);
+         snprintf(parts->base, sizeof(parts->base), "%s", part[1]);
+      } else {
+         snprintf(parts->base, sizeof(parts->base), "%s", part[0]);
+         snprintf(parts->suffix, sizeof(parts->suffix), "%s", part[1]);
+      }
+   }
+
+   if (!call_looks_valid(parts->base)) {
+      return false;
+   }
+   parts->portable = (nparts > 1);
+
+   if (!cty_loaded()) {
+      return true;
+   }
+
+   // where are they? some odd ones are listed in full (=VP2E/K1ABC), then the prefix, location suffix or the call itself
+   if ((parts->entity = cty_find_exact(parts->full)) != NULL) {
+      return true;
+   }
+
+   if (parts->prefix[0] != '\0') {
+      parts->entity = cty_find(parts->prefix);
+   } else if (parts->suffix[0] != '\0' && !call_is_modifier(parts->suffix)) {
+      parts->entity = cty_find(parts->suffix);
+   } else if (strcmp(parts->suffix, "MM") != 0 && strcmp(parts->suffix, "AM") != 0) {
+      parts->entity = cty_find(parts->base);
+   }
+   return true;
+}
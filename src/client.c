@@ -0,0 +1,404 @@
+/*
+ * Per-client buffered output and line oriented input
+ *
+ * Replies are formatted into a chain of chunks and handed to the kernel with
+ * one writev() per request (or per batch of replies from the workers), rather
+ * than dribbling out through stdio. The output fd is non-blocking (unless it's
+ * a terminal), so a slow client can't stall the event loop: whatever doesn't
+ * fit waits for EV_WRITE, and if more than CLIENT_HIGH_WATER bytes back up we
+ * stop reading that client's requests until it drains below CLIENT_LOW_WATER.
+ *
+ * Everything here belongs to the loop thread, workers must not touch clients.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <ev.h>
+#include <libied/debuglog.h>
+#include "client.h"
+#include "pool.h"
+
+#define	OUTBUF_CHUNK_SIZE	8192		// most replies fit in one
+#define	OUTBUF_MAX_IOV		64		// chunks per writev()
+#define	OUTBUF_POOL_MAX		64		// spare chunks to keep, 512KB
+
+static client_t *clients = NULL;
+
+// standard size chunks are recycled, anything bigger comes from the heap
+static pool_stats_t chunk_pool_stats = POOL_STATS_INIT("outbuf-chunk", sizeof(outbuf_chunk_t) + OUTBUF_CHUNK_SIZE);
+static pool_t chunk_pool = POOL_INIT(&chunk_pool_stats, OUTBUF_POOL_MAX);
+
+static void outbuf_free_chunk(outbuf_chunk_t *c) {
+   if (c->size == OUTBUF_CHUNK_SIZE) {
+      pool_put(&chunk_pool, c);
+   } else {
+      free(c);
+   }
+}
+
+static outbuf_chunk_t *outbuf_new_chunk(outbuf_t *ob, size_t need) {
+   size_t size = (need > OUTBUF_CHUNK_SIZE ? need : OUTBUF_CHUNK_SIZE);
+   outbuf_chunk_t *c = NULL;
+
+   if (size == OUTBUF_CHUNK_SIZE) {
+      c = pool_get(&chunk_pool);
+   } else if ((c = malloc(sizeof(outbuf_chunk_t) + size)) == NULL) {
+      fprintf(stderr, "+ERROR outbuf_new_chunk: out of memory!\n");
+      exit(ENOMEM);
+   }
+   c->next = NULL;
+   c->len = c->off = 0;
+   c->size = size;
+
+   if (ob->tail != NULL) {
+      ob->tail->next = c;
+   } else {
+      ob->head = c;
+   }
+   ob->tail = c;
+   return c;
+}
+
+void outbuf_append(outbuf_t *ob, const void *data, size_t len) {
+   outbuf_chunk_t *c = ob->tail;
+
+   if (len == 0) {
+      return;
+   }
+
+   if (c == NULL || (c->size - c->len) < len) {
+      c = outbuf_new_chunk(ob, len);
+   }
+
+   memcpy(c->data + c->len, data, len);
+   c->len += len;
+   ob->pending += len;
+}
+
+void outbuf_vprintf(outbuf_t *ob, const char *fmt, va_list ap) {
+   outbuf_chunk_t *c = ob->tail;
+   va_list ap2;
+   int len;
+
+   if (c == NULL || c->len == c->size) {
+      c = outbuf_new_chunk(ob, 0);
+   }
+
+   // try formatting straight into the free space at the end of the last chunk
+   va_copy(ap2, ap);
+   len = vsnprintf(c->data + c->len, c->size - c->len, fmt, ap2);
+   va_end(ap2);
+
+   if (len < 0) {
+      log_send(mainlog, LOG_WARNING, "outbuf_vprintf: bad format string: %s", fmt);
+      return;
+   }
+
+   // didn't fit, so start a new chunk big enough for it
+   if ((size_t)len >= c->size - c->len) {
+      c = outbuf_new_chunk(ob, len + 1);
+      vsnprintf(c->data, c->size, fmt, ap);
+   }
+
+   c->len += len;
+   ob->pending += len;
+}
+
+void outbuf_printf(outbuf_t *ob, const char *fmt, ...) {
+   va_list ap;
+
+   va_start(ap, fmt);
+   outbuf_vprintf(ob, fmt, ap);
+   va_end(ap);
+}
+
+// Write as much as the fd will take. Returns bytes written, 0 if it would
+// block and -1 on errors (other than EAGAIN/EINTR)
+ssize_t outbuf_writev(outbuf_t *ob, int fd) {
+   ssize_t total = 0;
+
+   while (ob->pending > 0) {
+      struct iovec iov[OUTBUF_MAX_IOV];
+      int iovcnt = 0;
+
+      for (outbuf_chunk_t *c = ob->head; c != NULL && iovcnt < OUTBUF_MAX_IOV; c = c->next) {
+         if (c->len > c->off) {
+            iov[iovcnt].iov_base = c->data + c->off;
+            iov[iovcnt].iov_len = c->len - c->off;
+            iovcnt++;
+         }
+      }
+
+      ssize_t n = writev(fd, iov, iovcnt);
+
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+         }
+         return -1;
+      }
+
+      total += n;
+      ob->pending -= n;
+
+      // release the chunks that are completely written
+      while (n > 0 && ob->head != NULL) {
+         outbuf_chunk_t *c = ob->head;
+         size_t left = c->len - c->off;
+
+         if ((size_t)n < left) {
+            c->off += n;
+            break;
+         }
+
+         n -= left;
+         ob->head = c->next;
+         if (ob->head == NULL) {
+            ob->tail = NULL;
+         }
+         outbuf_free_chunk(c);
+      }
+   }
+   return total;
+}
+
+void outbuf_free(outbuf_t *ob) {
+   outbuf_chunk_t *c = ob->head;
+
+   while (c != NULL) {
+      outbuf_chunk_t *next = c->next;
+      outbuf_free_chunk(c);
+      c = next;
+   }
+   ob->head = ob->tail = NULL;
+   ob->pending = 0;
+}
+
+// stop/start reading requests as the output backs up and drains
+static void client_check_water(client_t *cl) {
+   if (cl->in_fd < 0 || cl->eof) {
+      return;
+   }
+
+   if (!cl->paused && cl->out.pending > CLIENT_HIGH_WATER) {
+      log_send(mainlog, LOG_NOTICE, "client on fd %d is slow (%zu bytes queued), pausing requests", cl->out_fd, cl->out.pending);
+      ev_io_stop(cl->loop, &cl->read_watcher);
+      cl->paused = true;
+   } else if (cl->paused && cl->out.pending < CLIENT_LOW_WATER) {
+      log_send(mainlog, LOG_NOTICE, "client on fd %d caught up, resuming requests", cl->out_fd);
+      ev_io_start(cl->loop, &cl->read_watcher);
+      cl->paused = false;
+   }
+}
+
+// Send whatever's queued without blocking, returns false if the client is gone
+bool client_flush(client_t *cl) {
+   if (cl->out.pending == 0) {
+      return true;
+   }
+
+   if (outbuf_writev(&cl->out, cl->out_fd) < 0) {
+      log_send(mainlog, LOG_WARNING, "client on fd %d: write failed: %s, discarding %zu bytes of output", cl->out_fd, strerror(errno), cl->out.pending);
+      outbuf_free(&cl->out);
+      ev_io_stop(cl->loop, &cl->write_watcher);
+      return false;
+   }
+
+   // couldn't get it all out, let libev tell us when there's room
+   if (cl->out.pending > 0) {
+      ev_io_start(cl->loop, &cl->write_watcher);
+   } else {
+      ev_io_stop(cl->loop, &cl->write_watcher);
+   }
+   client_check_water(cl);
+   return true;
+}
+
+// Block until everything queued has been written (we're about to exit)
+void client_drain(client_t *cl) {
+   while (cl->out.pending > 0) {
+      struct pollfd pfd = { .fd = cl->out_fd, .events = POLLOUT };
+
+      if (outbuf_writev(&cl->out, cl->out_fd) < 0) {
+         outbuf_free(&cl->out);
+         break;
+      }
+
+      if (cl->out.pending > 0 && poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+         break;
+      }
+   }
+}
+
+static void client_write_cb(EV_P_ ev_io *w, int revents) {
+   client_t *cl = (client_t *)w->data;
+
+   client_flush(cl);
+}
+
+static void client_read_cb(EV_P_ ev_io *w, int revents) {
+   client_t *cl = (client_t *)w->data;
+   char *newline = NULL;
+
+   if (EV_ERROR & revents) {
+      fprintf(stderr, "+ERROR Error event in client watcher\n");
+      return;
+   }
+
+   ssize_t n = read(cl->in_fd, cl->inbuf + cl->in_len, sizeof(cl->inbuf) - 1 - cl->in_len);
+
+   if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+         log_send(mainlog, LOG_WARNING, "client on fd %d: read failed: %s", cl->in_fd, strerror(errno));
+      }
+      return;
+   }
+
+   if (n == 0) {
+      ev_io_stop(EV_A, w);
+      cl->eof = true;
+
+      if (cl->on_eof != NULL) {
+         cl->on_eof(cl);
+      }
+      client_flush(cl);
+      return;
+   }
+
+   cl->in_len += n;
+   cl->inbuf[cl->in_len] = '\0';
+
+   // Process complete lines
+   while ((newline = memchr(cl->inbuf, '\n', cl->in_len)) != NULL) {
+      size_t line_len = (newline - cl->inbuf) + 1;
+
+      *newline = '\0';
+      if (newline > cl->inbuf && *(newline - 1) == '\r') {
+         *(newline - 1) = '\0';
+      }
+
+      if (cl->on_line != NULL) {
+         cl->on_line(cl, cl->inbuf);
+      }
+
+      memmove(cl->inbuf, cl->inbuf + line_len, cl->in_len - line_len);
+      cl->in_len -= line_len;
+      cl->inbuf[cl->in_len] = '\0';
+   }
+
+   // If buffer is full and no newline is found, consider it an incomplete line
+   if (cl->in_len >= sizeof(cl->inbuf) - 1) {
+      client_printf(cl, "+ERROR Input buffer full, discarding incomplete line: %s\n", cl->inbuf);
+      cl->in_len = 0;
+   }
+
+   // one write for everything this batch of requests produced
+   client_flush(cl);
+}
+
+void client_init(client_t *cl, struct ev_loop *loop, int in_fd, int out_fd, client_line_cb_t on_line, client_eof_cb_t on_eof) {
+   static bool registered = false;
+
+   if (!registered) {
+      pool_stats_register(&chunk_pool_stats);
+      registered = true;
+   }
+
+   memset(cl, 0, sizeof(client_t));
+   cl->loop = loop;
+   cl->in_fd = in_fd;
+   cl->out_fd = out_fd;
+   cl->on_line = on_line;
+   cl->on_eof = on_eof;
+   cl->format = PROTO_FMT_TEXT;
+
+   // don't let a full pipe block the loop (but leave terminals alone, the shell shares them)
+   if (!isatty(out_fd)) {
+      int flags = fcntl(out_fd, F_GETFL);
+
+      if (flags >= 0) {
+         fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
+      }
+   }
+
+   ev_io_init(&cl->write_watcher, client_write_cb, out_fd, EV_WRITE);
+   cl->write_watcher.data = cl;
+
+   if (in_fd >= 0) {
+      ev_io_init(&cl->read_watcher, client_read_cb, in_fd, EV_READ);
+      cl->read_watcher.data = cl;
+      ev_io_start(loop, &cl->read_watcher);
+   }
+
+   cl->next = clients;
+   clients = cl;
+}
+
+void client_fini(client_t *cl) {
+   client_t **pp = &clients;
+
+   if (cl->in_fd >= 0) {
+      ev_io_stop(cl->loop, &cl->read_watcher);
+   }
+   ev_io_stop(cl->loop, &cl->write_watcher);
+   outbuf_free(&cl->out);
+
+   while (*pp != NULL) {
+      if (*pp == cl) {
+         *pp = cl->next;
+         break;
+      }
+      pp = &(*pp)->next;
+   }
+}
+
+void client_printf(client_t *cl, const char *fmt, ...) {
+   va_list ap;
+
+   va_start(ap, fmt);
+   outbuf_vprintf(&cl->out, fmt, ap);
+   va_end(ap);
+}
+
+void client_write(client_t *cl, const void *data, size_t len) {
+   outbuf_append(&cl->out, data, len);
+}
+
+// tell every client something (ex: +NOTICE about the QRZ session)
+void clients_notice(const char *fmt, ...) {
+   va_list ap;
+
+   for (client_t *cl = clients; cl != NULL; cl = cl->next) {
+      va_start(ap, fmt);
+      outbuf_vprintf(&cl->out, fmt, ap);
+      va_end(ap);
+      client_flush(cl);
+   }
+}
+
+void clients_flush(void) {
+   for (client_t *cl = clients; cl != NULL; cl = cl->next) {
+      client_flush(cl);
+   }
+}
+
+void clients_drain(void) {
+   for (client_t *cl = clients; cl != NULL; cl = cl->next) {
+      client_drain(cl);
+   }
+}
+
+// give the spare output chunks back (we're exiting)
+void clients_fini(void) {
+   pool_drain(&chunk_pool);
+}
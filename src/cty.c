@@ -0,0 +1,325 @@
+/*
+ * cty.dat: which DXCC entity a callsign (or prefix) belongs to
+ *
+ * cty.dat (https://www.country-files.com/, wsjt-x ships one) lists every
+ * entity with it's zones and position, followed by the prefixes that map to
+ * it and a long list of exact callsigns (=K1ABC/KH2) that don't follow the
+ * rules. Prefixes and exact calls each go in an open addressing table, and
+ * a callsign resolves to the longest prefix of it in the table, so finding
+ * one is a handful of hash probes.
+ *
+ * Loaded once at startup, read-only after that, so any thread can use it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "cty.h"
+
+typedef struct cty_prefix {
+   char			*key;
+   cty_match_t		match;
+} cty_prefix_t;
+
+typedef struct cty_table {
+   cty_prefix_t		**slots;
+   uint32_t		size, used;		// size is a power of 2
+} cty_table_t;
+
+static cty_entity_t *entities = NULL;
+static int n_entities = 0, max_entities = 0;
+static cty_table_t prefixes = { NULL, 0, 0 }, exact_calls = { NULL, 0, 0 };
+static size_t longest_prefix = 0;
+
+static uint32_t cty_hash(const char *key, size_t len) {
+   uint32_t h = 2166136261u;
+
+   for (size_t i = 0; i < len; i++) {
+      h ^= (uint8_t)key[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static cty_prefix_t *cty_table_find(const cty_table_t *t, const char *key, size_t len) {
+   if (t->size == 0) {
+      return NULL;
+   }
+
+   for (uint32_t i = cty_hash(key, len) & (t->size - 1); t->slots[i] != NULL; i = (i + 1) & (t->size - 1)) {
+      if (strncmp(t->slots[i]->key, key, len) == 0 && t->slots[i]->key[len] == '\0') {
+         return t->slots[i];
+      }
+   }
+   return NULL;
+}
+
+static void cty_table_add(cty_table_t *t, cty_prefix_t *p) {
+   uint32_t i;
+
+   // keep it under half full
+   if ((t->used + 1) * 2 > t->size) {
+      cty_table_t bigger = { NULL, (t->size > 0 ? t->size * 2 : 1024), 0 };
+
+      if ((bigger.slots = calloc(bigger.size, sizeof(cty_prefix_t *))) == NULL) {
+         fprintf(stderr, "+ERROR cty_table_add: out of memory!\n");
+         exit(ENOMEM);
+      }
+
+      for (uint32_t j = 0; j < t->size; j++) {
+         if (t->slots[j] != NULL) {
+            cty_table_add(&bigger, t->slots[j]);
+         }
+      }
+      free(t->slots);
+      *t = bigger;
+   }
+
+   for (i = cty_hash(p->key, strlen(p->key)) & (t->size - 1); t->slots[i] != NULL; i = (i + 1) & (t->size - 1)) {
+      // listed twice? first one wins
+      if (strcmp(t->slots[i]->key, p->key) == 0) {
+         free(p->key);
+         free(p);
+         return;
+      }
+   }
+   t->slots[i] = p;
+   t->used++;
+}
+
+static void cty_table_free(cty_table_t *t) {
+   for (uint32_t i = 0; i < t->size; i++) {
+      if (t->slots[i] != NULL) {
+         free(t->slots[i]->key);
+         free(t->slots[i]);
+      }
+   }
+   free(t->slots);
+   t->slots = NULL;
+   t->size = t->used = 0;
+}
+
+static char *cty_trim(char *s) {
+   char *end = NULL;
+
+   while (isspace((unsigned char)*s)) {
+      s++;
+   }
+   end = s + strlen(s);
+   while (end > s && isspace((unsigned char)end[-1])) {
+      *--end = '\0';
+   }
+   return s;
+}
+
+// one prefix entry: [=]KEY followed by any of (cq) [itu] <lat/lon> {continent} ~utc~
+static void cty_add_prefix(char *tok, const cty_entity_t *e) {
+   cty_prefix_t *p = NULL;
+   bool exact = false;
+   size_t key_len;
+
+   tok = cty_trim(tok);
+   if (*tok == '=') {
+      exact = true;
+      tok++;
+   }
+
+   key_len = strcspn(tok, "([<{~");
+   if (key_len == 0) {
+      return;
+   }
+
+   if ((p = calloc(1, sizeof(cty_prefix_t))) == NULL || (p->key = strndup(tok, key_len)) == NULL) {
+      fprintf(stderr, "+ERROR cty_add_prefix: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   for (char *c = p->key; *c != '\0'; c++) {
+      *c = toupper((unsigned char)*c);
+   }
+
+   p->match.entity = e;
+   memcpy(p->match.continent, e->continent, sizeof(p->match.continent));
+   p->match.cq_zone = e->cq_zone;
+   p->match.itu_zone = e->itu_zone;
+   p->match.latitude = e->latitude;
+   p->match.longitude = e->longitude;
+
+   for (char *o = tok + key_len; *o != '\0'; o++) {
+      switch (*o) {
+         case '(':
+            p->match.cq_zone = atoi(o + 1);
+            break;
+         case '[':
+            p->match.itu_zone = atoi(o + 1);
+            break;
+         case '<': {
+            char *slash = strchr(o, '/');
+            p->match.latitude = atof(o + 1);
+            if (slash != NULL) {
+               p->match.longitude = -atof(slash + 1);
+            }
+            break;
+         }
+         case '{':
+            snprintf(p->match.continent, sizeof(p->match.continent), "%.2s", o + 1);
+            break;
+      }
+   }
+
+   if (!exact && key_len > longest_prefix) {
+      longest_prefix = key_len;
+   }
+   cty_table_add(exact ? &exact_calls : &prefixes, p);
+}
+
+bool cty_load(const char *path) {
+   FILE *fp = NULL;
+   char *buf = NULL, *p = NULL;
+   long len;
+
+   if (path == NULL || *path == '\0') {
+      return false;
+   }
+
+   if ((fp = fopen(path, "r")) == NULL) {
+      log_send(mainlog, LOG_WARNING, "cty: can't open %s: %s, operating entities won't be available", path, strerror(errno));
+      return false;
+   }
+
+   fseek(fp, 0, SEEK_END);
+   len = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+
+   if (len <= 0 || (buf = malloc(len + 1)) == NULL || fread(buf, 1, len, fp) != (size_t)len) {
+      log_send(mainlog, LOG_WARNING, "cty: can't read %s", path);
+      fclose(fp);
+      free(buf);
+      return false;
+   }
+   fclose(fp);
+   buf[len] = '\0';
+
+   cty_unload();
+
+   // two passes: count the entities, so entities[] never moves under the prefixes pointing into it, then parse
+   for (int pass = 0; pass < 2; pass++) {
+      int n = 0;
+
+      if (pass == 1) {
+         if ((entities = calloc(max_entities, sizeof(cty_entity_t))) == NULL) {
+            fprintf(stderr, "+ERROR cty_load: out of memory!\n");
+            exit(ENOMEM);
+         }
+      }
+
+      for (p = buf; *p != '\0';) {
+         char *field[8], *end = NULL;
+         int i;
+
+         while (isspace((unsigned char)*p)) {
+            p++;
+         }
+         if (*p == '\0') {
+            break;
+         }
+
+         // Name: CQ: ITU: Continent: Lat: Lon: UTC: Prefix:
+         for (i = 0; i < 8; i++) {
+            char *colon = strchr(p, ':');
+
+            if (colon == NULL) {
+               break;
+            }
+            field[i] = p;
+            p = colon + 1;
+         }
+
+         if (i < 8 || (end = strchr(p, ';')) == NULL) {
+            if (pass == 0) {
+               log_send(mainlog, LOG_WARNING, "cty: %s is truncated after %d entities", path, n);
+            }
+            break;
+         }
+
+         if (pass == 1) {
+            cty_entity_t *e = &entities[n];
+
+            for (i = 0; i < 8; i++) {
+               *strchr(field[i], ':') = '\0';
+               field[i] = cty_trim(field[i]);
+            }
+            *end = '\0';
+
+            snprintf(e->name, sizeof(e->name), "%s", field[0]);
+            e->cq_zone = atoi(field[1]);
+            e->itu_zone = atoi(field[2]);
+            snprintf(e->continent, sizeof(e->continent), "%s", field[3]);
+            e->latitude = atof(field[4]);
+            e->longitude = -atof(field[5]);
+            e->utc_offset = -atof(field[6]);
+            e->wae_only = (field[7][0] == '*');
+            snprintf(e->prefix, sizeof(e->prefix), "%s", field[7] + (e->wae_only ? 1 : 0));
+
+            char *saveptr = NULL;
+            for (char *tok = strtok_r(p, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+               cty_add_prefix(tok, e);
+            }
+         }
+         n++;
+         p = end + 1;
+      }
+
+      if (pass == 0) {
+         max_entities = n;
+      } else {
+         n_entities = n;
+      }
+   }
+   free(buf);
+
+   log_send(mainlog, LOG_INFO, "cty: loaded %d entities, %u prefixes and %u exact callsigns from %s", n_entities, prefixes.used, exact_calls.used, path);
+   return (n_entities > 0);
+}
+
+void cty_unload(void) {
+   cty_table_free(&prefixes);
+   cty_table_free(&exact_calls);
+   free(entities);
+   entities = NULL;
+   n_entities = max_entities = 0;
+   longest_prefix = 0;
+}
+
+bool cty_loaded(void) {
+   return (n_entities > 0);
+}
+
+// only if the whole (upper case) callsign is listed, ex: =VP2E/K1ABC
+const cty_match_t *cty_find_exact(const char *callsign) {
+   cty_prefix_t *p = cty_table_find(&exact_calls, callsign, strlen(callsign));
+
+   return (p != NULL ? &p->match : NULL);
+}
+
+// Entity for an (upper case) callsign: an exact listing, or the longest prefix of it we know
+const cty_match_t *cty_find(const char *callsign) {
+   cty_prefix_t *p = NULL;
+   size_t len = strlen(callsign);
+
+   if ((p = cty_table_find(&exact_calls, callsign, len)) != NULL) {
+      return &p->match;
+   }
+
+   for (len = (len < longest_prefix ? len : longest_prefix); len > 0; len--) {
+      if ((p = cty_table_find(&prefixes, callsign, len)) != NULL) {
+         return &p->match;
+      }
+   }
+   return NULL;
+}
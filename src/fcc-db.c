@@ -4,18 +4,289 @@
  * These require you to update your database from time to time...
  *
  * Hopefully I'll get around to cleaning up the scripts for that and including them soon!
+ *
+ * Most of what FT8 decodes isn't in the ULS, so at startup every callsign in
+ * uls_ham goes into a Bloom filter. A call the filter says isn't there is
+ * answered without touching sqlite. The filter is blocked: all k bits for a
+ * call live in one 64 byte block, so a miss costs one cache line. It's built
+ * on the loop thread before the workers start, read-only after that.
  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <libied/cfg.h>
 #include <libied/sql.h>
+#include <libied/debuglog.h>
 #include "ft8goblin_types.h"
+#include "fcc-db.h"
+#include "client.h"
+#include "pool.h"
+
+#define	ULS_FILTER_BITS_PER_CALL	12
+#define	ULS_FILTER_K			8		// bits set per call, all in the same block
+#define	ULS_FILTER_PROBES		100000		// non-calls tried to measure the false positive rate
+
+typedef struct uls_block {
+   uint64_t		w[8];			// 512 bits, one cache line
+} __attribute__((aligned(64))) uls_block_t;
+
+static uls_block_t *uls_filter = NULL;
+static uint32_t uls_filter_blocks = 0;		// power of 2
+static uint32_t uls_filter_calls = 0;
+static double uls_filter_fpr = 0;		// measured when it was built
+static atomic_ulong uls_skipped = 0, uls_passed = 0, uls_false = 0;
+
+static const char *uls_db_path = NULL;
+static __thread Database *uls_db = NULL;
+static __thread sqlite3_stmt *uls_select_stmt = NULL;
+
+// FNV-1a of the upper case call, then a murmur3 finish so the low bits are worth using
+static uint64_t uls_hash(const char *callsign) {
+   uint64_t h = 14695981039346656037ULL;
+
+   for (; *callsign != '\0'; callsign++) {
+      h ^= (uint8_t)toupper((unsigned char)*callsign);
+      h *= 1099511628211ULL;
+   }
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return h;
+}
+
+static void uls_filter_add(const char *callsign) {
+   uint64_t h = uls_hash(callsign);
+   uls_block_t *b = &uls_filter[(h >> 32) & (uls_filter_blocks - 1)];
+   uint32_t pos = (uint32_t)h, step = ((uint32_t)h >> 16) | 1;
+
+   for (int i = 0; i < ULS_FILTER_K; i++, pos += step) {
+      b->w[(pos >> 6) & 7] |= (1ULL << (pos & 63));
+   }
+}
+
+static bool uls_filter_maybe(const char *callsign) {
+   uint64_t h = uls_hash(callsign);
+   const uls_block_t *b = &uls_filter[(h >> 32) & (uls_filter_blocks - 1)];
+   uint32_t pos = (uint32_t)h, step = ((uint32_t)h >> 16) | 1;
+
+   for (int i = 0; i < ULS_FILTER_K; i++, pos += step) {
+      if ((b->w[(pos >> 6) & 7] & (1ULL << (pos & 63))) == 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// loop thread, before the workers start: open the ULS and put every callsign in the filter
+bool uls_init(const char *path) {
+   Database *db = NULL;
+   sqlite3_stmt *stmt = NULL;
+   uint64_t n = 0, bits;
+   int fp = 0;
+
+   uls_db_path = path;
+
+   if (path == NULL || *path == '\0' || (db = sql_open(path)) == NULL) {
+      log_send(mainlog, LOG_WARNING, "uls: can't open database %s, lookups will go straight to sqlite", (path != NULL ? path : "(null)"));
+      return false;
+   }
+
+   if (sqlite3_prepare_v2(db->hndl.sqlite3, "SELECT COUNT(*) FROM uls_ham;", -1, &stmt, NULL) != SQLITE_OK) {
+      log_send(mainlog, LOG_WARNING, "uls: can't count callsigns in %s: %s", path, sqlite3_errmsg(db->hndl.sqlite3));
+      sql_close(db);
+      return false;
+   }
+
+   if (sqlite3_step(stmt) == SQLITE_ROW) {
+      n = sqlite3_column_int64(stmt, 0);
+   }
+   sqlite3_finalize(stmt);
+
+   // round up to a power of 2 blocks, so it's a mask to pick one
+   bits = (n > 0 ? n : 1) * ULS_FILTER_BITS_PER_CALL;
+   for (uls_filter_blocks = 1; (uint64_t)uls_filter_blocks * 512 < bits; uls_filter_blocks <<= 1) {
+      ;
+   }
+
+   free(uls_filter);
+   if ((uls_filter = aligned_alloc(sizeof(uls_block_t), uls_filter_blocks * sizeof(uls_block_t))) == NULL) {
+      fprintf(stderr, "+ERROR uls_init: out of memory!\n");
+      exit(ENOMEM);
+   }
+   memset(uls_filter, 0, uls_filter_blocks * sizeof(uls_block_t));
+
+   uls_filter_calls = 0;
+   if (sqlite3_prepare_v2(db->hndl.sqlite3, "SELECT callsign FROM uls_ham WHERE callsign IS NOT NULL;", -1, &stmt, NULL) == SQLITE_OK) {
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+         const char *callsign = (const char *)sqlite3_column_text(stmt, 0);
+
+         if (callsign != NULL && *callsign != '\0') {
+            uls_filter_add(callsign);
+            uls_filter_calls++;
+         }
+      }
+      sqlite3_finalize(stmt);
+   }
+   sql_close(db);
+
+   // nothing with a # in it is a callsign, so every one that gets through is a false positive
+   for (int i = 0; i < ULS_FILTER_PROBES; i++) {
+      char probe[16];
+
+      snprintf(probe, sizeof(probe), "#%d", i);
+      if (uls_filter_maybe(probe)) {
+         fp++;
+      }
+   }
+   uls_filter_fpr = (double)fp / ULS_FILTER_PROBES;
+
+   log_send(mainlog, LOG_INFO, "uls: filter has %u callsigns in %u KB (%.1f bits each), %.3f%% false positives",
+         uls_filter_calls, (unsigned)(uls_filter_blocks * sizeof(uls_block_t) / 1024),
+         (uls_filter_calls > 0 ? (double)uls_filter_blocks * 512 / uls_filter_calls : 0), uls_filter_fpr * 100);
+   return true;
+}
+
+void uls_fini(void) {
+   free(uls_filter);
+   uls_filter = NULL;
+   uls_filter_blocks = uls_filter_calls = 0;
+}
+
+// close this thread's connection to the ULS database
+void uls_close(void) {
+   if (uls_select_stmt != NULL) {
+      sqlite3_finalize(uls_select_stmt);
+      uls_select_stmt = NULL;
+   }
+
+   if (uls_db != NULL) {
+      sql_close(uls_db);
+      uls_db = NULL;
+   }
+}
+
+static void uls_copy(char *dst, size_t len, sqlite3_stmt *stmt, int col) {
+   const char *s = (const char *)sqlite3_column_text(stmt, col);
+
+   snprintf(dst, len, "%s", (s != NULL ? s : ""));
+}
 
 calldata_t *uls_lookup_callsign(const char *callsign) {
    calldata_t *d = NULL;
+   int rc;
+
+   if (callsign == NULL || *callsign == '\0') {
+      return NULL;
+   }
+
+   // definitely not in there?
+   if (uls_filter != NULL) {
+      if (!uls_filter_maybe(callsign)) {
+         atomic_fetch_add_explicit(&uls_skipped, 1, memory_order_relaxed);
+         return NULL;
+      }
+      atomic_fetch_add_explicit(&uls_passed, 1, memory_order_relaxed);
+   }
+
+   if (uls_db == NULL) {
+      if (uls_db_path == NULL) {
+         uls_db_path = cfg_get_str(cfg, "callsign-lookup/fcc-uls-db");
+      }
+
+      if (uls_db_path == NULL || (uls_db = sql_open(uls_db_path)) == NULL) {
+         return NULL;
+      }
+      sqlite3_busy_timeout(uls_db->hndl.sqlite3, 2000);
+   }
 
-//   if ((d = malloc(sizeof(calldata_t))) == NULL) {
-//      fprintf(stderr, "uls_lookup_callsign: out of memory!\n");
-//      exit(ENOMEM);
-//   }
+   if (uls_select_stmt == NULL) {
+      // a call can have several licenses on file, the newest one wins
+      const char *sql = "SELECT h.callsign, h.operator_class, h.previous_callsign, f.first_name, f.mi, f.last_name, "
+                        "f.street_address, f.city, f.state, f.zip_code, f.email, f.attention_line "
+                        "FROM uls_ham h LEFT JOIN uls_frn f ON f.unique_id = h.unique_id "
+                        "WHERE h.callsign = ? ORDER BY h.unique_id DESC LIMIT 1;";
 
+      if (sqlite3_prepare_v2(uls_db->hndl.sqlite3, sql, -1, &uls_select_stmt, NULL) != SQLITE_OK) {
+         log_send(mainlog, LOG_WARNING, "uls: error preparing select: %s", sqlite3_errmsg(uls_db->hndl.sqlite3));
+         uls_select_stmt = NULL;
+         return NULL;
+      }
+   }
+
+   sqlite3_bind_text(uls_select_stmt, 1, callsign, -1, SQLITE_STATIC);
+
+   if ((rc = sqlite3_step(uls_select_stmt)) == SQLITE_ROW) {
+      const char *mi = (const char *)sqlite3_column_text(uls_select_stmt, 4);
+
+      d = calldata_alloc();
+      d->origin = DATASRC_ULS;
+      uls_copy(d->callsign, sizeof(d->callsign), uls_select_stmt, 0);
+      uls_copy(d->opclass, sizeof(d->opclass), uls_select_stmt, 1);
+      uls_copy(d->previous_call, sizeof(d->previous_call), uls_select_stmt, 2);
+      uls_copy(d->first_name, sizeof(d->first_name), uls_select_stmt, 3);
+      d->mi = (mi != NULL ? mi[0] : '\0');
+      uls_copy(d->last_name, sizeof(d->last_name), uls_select_stmt, 5);
+      uls_copy(d->address1, sizeof(d->address1), uls_select_stmt, 6);
+      uls_copy(d->address2, sizeof(d->address2), uls_select_stmt, 7);
+      uls_copy(d->state, sizeof(d->state), uls_select_stmt, 8);
+      uls_copy(d->zip, sizeof(d->zip), uls_select_stmt, 9);
+      uls_copy(d->email, sizeof(d->email), uls_select_stmt, 10);
+      uls_copy(d->address_attn, sizeof(d->address_attn), uls_select_stmt, 11);
+      snprintf(d->country, sizeof(d->country), "United States");
+      d->country_code = d->dxcc = 291;
+   } else if (rc != SQLITE_DONE) {
+      log_send(mainlog, LOG_WARNING, "uls: select %s failed: %s", callsign, sqlite3_errmsg(uls_db->hndl.sqlite3));
+   } else if (uls_filter != NULL) {
+      atomic_fetch_add_explicit(&uls_false, 1, memory_order_relaxed);
+   }
+
+   sqlite3_reset(uls_select_stmt);
+   sqlite3_clear_bindings(uls_select_stmt);
    return d;
 }
+
+// every callsign in the ULS, for the search index (own connection, any thread)
+bool uls_each_callsign(void (*cb)(const char *callsign, void *priv), void *priv) {
+   Database *db = NULL;
+   sqlite3_stmt *stmt = NULL;
+
+   if (uls_db_path == NULL || (db = sql_open(uls_db_path)) == NULL) {
+      return false;
+   }
+   sqlite3_busy_timeout(db->hndl.sqlite3, 2000);
+
+   if (sqlite3_prepare_v2(db->hndl.sqlite3, "SELECT callsign FROM uls_ham WHERE callsign IS NOT NULL;", -1, &stmt, NULL) != SQLITE_OK) {
+      log_send(mainlog, LOG_WARNING, "uls: can't list callsigns: %s", sqlite3_errmsg(db->hndl.sqlite3));
+      sql_close(db);
+      return false;
+   }
+
+   while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *callsign = (const char *)sqlite3_column_text(stmt, 0);
+
+      if (callsign != NULL && *callsign != '\0') {
+         cb(callsign, priv);
+      }
+   }
+   sqlite3_finalize(stmt);
+   sql_close(db);
+   return true;
+}
+
+// for /STATS
+void uls_dump(outbuf_t *ob) {
+   if (uls_filter == NULL) {
+      return;
+   }
+
+   outbuf_printf(ob, "ULS-filter: %u callsigns, %u KB, %.3f%% false positives when built, %lu skipped, %lu checked, %lu false positives\n",
+         uls_filter_calls, (unsigned)(uls_filter_blocks * sizeof(uls_block_t) / 1024), uls_filter_fpr * 100,
+         atomic_load(&uls_skipped), atomic_load(&uls_passed), atomic_load(&uls_false));
+}
@@ -0,0 +1,157 @@
+/*
+ * Batched great circle distance and bearing
+ *
+ * libied's calculateDistance/calculateBearing cost six libm trig calls per
+ * station. When a batch of replies goes out (or a watch feed dumps a whole
+ * cycle of decodes on us) we do them four at a time instead: the kernel is
+ * written with GCC vector extensions and built twice with target_clones, so
+ * it runs as AVX2 where the CPU has it and as SSE2 pairs everywhere else.
+ *
+ * sin/cos/atan are the cephes polynomials, good to a couple of ulp over the
+ * ranges we use them on (|x| <= 2pi), which is far better than the grids the
+ * coordinates usually come from.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "geo.h"
+
+#define	DEG2RAD		(M_PI / 180.0)
+#define	RAD2DEG		(180.0 / M_PI)
+
+#if	defined(__GNUC__) && defined(__x86_64__)
+typedef double v4d __attribute__((vector_size(32)));
+typedef int64_t v4i __attribute__((vector_size(32)));
+
+// mask ? a : b (the ternary only works on vectors in C++)
+#define	V4_SEL(mask, a, b)	((v4d)(((v4i)(a) & (mask)) | ((v4i)(b) & ~(mask))))
+#define	V4_SPLAT(x)		((v4d){ (x), (x), (x), (x) })
+#define	V4_ABS(x)		((v4d)((v4i)(x) & ~(v4i)V4_SPLAT(-0.0)))
+#define	V4_SQRT(x)		((v4d){ __builtin_sqrt((x)[0]), __builtin_sqrt((x)[1]), __builtin_sqrt((x)[2]), __builtin_sqrt((x)[3]) })
+#define	V4_POLY5(z, c0, c1, c2, c3, c4, c5)	(((((c0 * (z) + c1) * (z) + c2) * (z) + c3) * (z) + c4) * (z) + c5)
+
+// sin and cos of *xp, |x| <= 2pi. Vectors go by pointer, by value they'd need AVX in the caller's ABI
+static inline void v4_sincos(const v4d *xp, v4d *s, v4d *c) {
+   v4d x = *xp;
+   const double magic = 6755399441055744.0;		// 1.5 * 2^52, rounds to an integer in the low bits
+   v4d q = x * (2.0 / M_PI) + magic;
+   v4i quad = (v4i)q & 3;
+   q -= magic;
+
+   // x - q * pi/2 in three parts (Cody-Waite), so r stays accurate
+   v4d r = x - q * 1.57079632673412561417e+00;
+   r -= q * 6.07710050650619224932e-11;
+   r -= q * 2.02226624879595063154e-21;
+
+   v4d z = r * r;
+   v4d ps = r + r * z * V4_POLY5(z, 1.58962301576546568060E-10, -2.50507477628578072866E-8,
+         2.75573136213857245213E-6, -1.98412698295895385996E-4, 8.33333333332211858878E-3, -1.66666666666666307295E-1);
+   v4d pc = 1.0 - 0.5 * z + z * z * V4_POLY5(z, -1.13585365213876817300E-11, 2.08757008419747316778E-9,
+         -2.75573141792967388112E-7, 2.48015872888517045348E-5, -1.38888888888730564116E-3, 4.16666666666665929218E-2);
+
+   // quadrant 1 and 3 swap sin and cos, 2 and 3 negate sin, 1 and 2 negate cos
+   v4i swap = ((quad & 1) != 0);
+   v4i neg_s = ((quad & 2) != 0);
+   v4i neg_c = (((quad + 1) & 2) != 0);
+   v4d ss = V4_SEL(swap, pc, ps), cc = V4_SEL(swap, ps, pc);
+
+   *s = V4_SEL(neg_s, -ss, ss);
+   *c = V4_SEL(neg_c, -cc, cc);
+}
+
+// *out = atan2(y, x), in -pi..pi
+static inline void v4_atan2(const v4d *yp, const v4d *xp, v4d *out) {
+   v4d y = *yp, x = *xp;
+   v4d ay = V4_ABS(y), ax = V4_ABS(x);
+   v4i steep = (ay > ax);
+   v4d num = V4_SEL(steep, ax, ay), den = V4_SEL(steep, ay, ax);
+   v4i zero = (den == 0.0);
+   v4d t = num / V4_SEL(zero, V4_SPLAT(1.0), den);
+
+   // atan(t), t in 0..1: past tan(pi/8) use atan(t) = pi/4 + atan((t - 1) / (t + 1))
+   v4i big = (t > 0.41421356237309504880);
+   v4d base = V4_SEL(big, V4_SPLAT(M_PI / 4), V4_SPLAT(0.0));
+   t = V4_SEL(big, (t - 1.0) / (t + 1.0), t);
+
+   v4d z = t * t;
+   v4d p = (((-8.750608600031904122785E-1 * z - 1.615753718733365076637E1) * z - 7.500855792314704667340E1) * z - 1.228866684490136173410E2) * z - 6.485021904942025371773E1;
+   v4d q = ((((z + 2.485846490142306297962E1) * z + 1.650270098316988542046E2) * z + 4.328810604912902668951E2) * z + 4.853903996359136964868E2) * z + 1.945506571482613964425E2;
+   v4d r = base + t + t * z * p / q;
+
+   r = V4_SEL(steep, M_PI / 2 - r, r);
+   r = V4_SEL(x < 0.0, M_PI - r, r);
+   *out = V4_SEL(y < 0.0, -r, r);
+}
+
+__attribute__((target_clones("avx2", "default")))
+static void geo_heading_v4(double my_lat, double my_lon, const double *lat, const double *lon, int n, double *distance, double *bearing) {
+   v4d lat1 = V4_SPLAT(my_lat * DEG2RAD), s_lat1, c_lat1;
+
+   // the same sincos as lat2, so a point on top of us comes out as bearing 0 like libm, not 180
+   v4_sincos(&lat1, &s_lat1, &c_lat1);
+
+   for (int i = 0; i + 4 <= n; i += 4) {
+      v4d la, lo;
+      memcpy(&la, lat + i, sizeof(la));
+      memcpy(&lo, lon + i, sizeof(lo));
+
+      v4d lat2 = la * DEG2RAD;
+      v4d dlat = (la - my_lat) * DEG2RAD;
+      v4d dlon = (lo - my_lon) * DEG2RAD;
+      v4d s_lat2, c_lat2, s_hdlat, c_hdlat, s_hdlon, c_hdlon, s_dlon, c_dlon;
+
+      v4d hdlat = dlat * 0.5, hdlon = dlon * 0.5;
+      v4_sincos(&lat2, &s_lat2, &c_lat2);
+      v4_sincos(&hdlat, &s_hdlat, &c_hdlat);
+      v4_sincos(&hdlon, &s_hdlon, &c_hdlon);
+
+      // double angle, saves a sincos
+      s_dlon = 2.0 * s_hdlon * c_hdlon;
+      c_dlon = 1.0 - 2.0 * s_hdlon * s_hdlon;
+
+      // haversine
+      v4d a = s_hdlat * s_hdlat + c_lat1 * c_lat2 * s_hdlon * s_hdlon;
+      a = V4_SEL(a > 1.0, V4_SPLAT(1.0), a);
+      v4d sa = V4_SQRT(a), sb = 1.0 - a, d;
+      sb = V4_SQRT(sb);
+      v4_atan2(&sa, &sb, &d);
+      d *= 2.0 * GEO_EARTH_RADIUS_KM;
+
+      // initial bearing
+      v4d by = s_dlon * c_lat2, bx = c_lat1 * s_lat2 - s_lat1 * c_lat2 * c_dlon, b;
+      v4_atan2(&by, &bx, &b);
+      b *= RAD2DEG;
+      b = V4_SEL(b < 0.0, b + 360.0, b);
+
+      memcpy(distance + i, &d, sizeof(d));
+      memcpy(bearing + i, &b, sizeof(b));
+   }
+}
+#endif	// __GNUC__ && __x86_64__
+
+void geo_heading_scalar(double my_lat, double my_lon, const double *lat, const double *lon, int n, double *distance, double *bearing) {
+   double lat1 = my_lat * DEG2RAD;
+
+   for (int i = 0; i < n; i++) {
+      double lat2 = lat[i] * DEG2RAD;
+      double dlat = (lat[i] - my_lat) * DEG2RAD, dlon = (lon[i] - my_lon) * DEG2RAD;
+      double a = sin(dlat / 2) * sin(dlat / 2) + cos(lat1) * cos(lat2) * sin(dlon / 2) * sin(dlon / 2);
+
+      distance[i] = 2 * GEO_EARTH_RADIUS_KM * atan2(sqrt(a), sqrt(1 - a));
+      bearing[i] = fmod(atan2(sin(dlon) * cos(lat2), cos(lat1) * sin(lat2) - sin(lat1) * cos(lat2) * cos(dlon)) * RAD2DEG + 360, 360);
+   }
+}
+
+void geo_heading_batch(double my_lat, double my_lon, const double *lat, const double *lon, int n, double *distance, double *bearing) {
+   int done = 0;
+
+#if	defined(__GNUC__) && defined(__x86_64__)
+   done = n & ~3;
+   geo_heading_v4(my_lat, my_lon, lat, lon, done, distance, bearing);
+#endif
+
+   // the last few
+   geo_heading_scalar(my_lat, my_lon, lat + done, lon + done, n - done, distance + done, bearing + done);
+}
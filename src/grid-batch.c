@@ -0,0 +1,206 @@
+/*
+ * /GRIDS: distance and bearing to a whole band map's worth of spots at once
+ *
+ * The points (grids, or lat,lon) come in on as many lines as the client
+ * likes and are parsed as they arrive. When the "." line shows up, 4
+ * character grids come straight out of grid_heading()'s table and
+ * everything else goes through geo_heading_batch() in one call, then it's
+ * one row per point, in the order they were sent.
+ *
+ * Loop thread only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+#include "geo.h"
+#include "grid.h"
+#include "grid-batch.h"
+
+grid_batch_t *grid_batch_start(void) {
+   grid_batch_t *b = calloc(1, sizeof(grid_batch_t));
+
+   if (b == NULL) {
+      fprintf(stderr, "+ERROR grid_batch_start: out of memory!\n");
+      exit(ENOMEM);
+   }
+   return b;
+}
+
+void grid_batch_free(grid_batch_t *b) {
+   if (b == NULL) {
+      return;
+   }
+   free(b->query);
+   free(b->lat);
+   free(b->lon);
+   free(b->ok);
+   free(b);
+}
+
+static void grid_batch_grow(grid_batch_t *b) {
+   int size = (b->size > 0 ? b->size * 2 : 256);
+
+   if (size > GRID_BATCH_MAX) {
+      size = GRID_BATCH_MAX;
+   }
+
+   if ((b->query = realloc(b->query, size * sizeof(*b->query))) == NULL ||
+       (b->lat = realloc(b->lat, size * sizeof(double))) == NULL ||
+       (b->lon = realloc(b->lon, size * sizeof(double))) == NULL ||
+       (b->ok = realloc(b->ok, size * sizeof(bool))) == NULL) {
+      fprintf(stderr, "+ERROR grid_batch_grow: out of memory!\n");
+      exit(ENOMEM);
+   }
+   b->size = size;
+}
+
+// grid characters the decimals in a coordinate are good for, like /GRID does it
+static int coord_grid_len(const char *s) {
+   const char *dot = strchr(s, '.');
+   int digits = 0;
+
+   if (dot != NULL) {
+      for (dot++; *dot >= '0' && *dot <= '9'; dot++) {
+         digits++;
+      }
+   }
+   return (digits >= 3 ? GRID_MAX_LEN : (digits + 2) * 2);
+}
+
+static void grid_batch_add(grid_batch_t *b, const char *point) {
+   char norm[GRID_MAX_LEN + 1];
+   char *comma = NULL;
+   int i;
+
+   if (b->n >= GRID_BATCH_MAX) {
+      b->overflow = true;
+      return;
+   }
+
+   if (b->n >= b->size) {
+      grid_batch_grow(b);
+   }
+
+   i = b->n++;
+   snprintf(b->query[i], GRID_BATCH_QUERY_LEN, "%.*s", GRID_BATCH_QUERY_LEN - 1, point);
+   b->ok[i] = false;
+
+   // lat,lon
+   if ((comma = strchr(point, ',')) != NULL) {
+      char *end = NULL;
+      double lat = strtod(point, &end);
+      int lat_len, lon_len;
+
+      if (end != comma) {
+         return;
+      }
+      double lon = strtod(comma + 1, &end);
+      if (end == comma + 1 || *end != '\0') {
+         return;
+      }
+
+      lat_len = coord_grid_len(point);
+      lon_len = coord_grid_len(comma + 1);
+      if (grid_encode(lat, lon, (lat_len < lon_len ? lat_len : lon_len), b->query[i])) {
+         b->lat[i] = lat;
+         b->lon[i] = lon;
+         b->ok[i] = true;
+      }
+      return;
+   }
+
+   if (grid_decode(point, &b->lat[i], &b->lon[i], norm)) {
+      memcpy(b->query[i], norm, sizeof(norm));
+      b->ok[i] = true;
+   }
+}
+
+// whitespace separated points, "lat, lon" with a space is fine too
+void grid_batch_line(grid_batch_t *b, const char *line) {
+   char buf[CLIENT_INBUF_SIZE];
+   char *saveptr = NULL, *tok = NULL;
+
+   snprintf(buf, sizeof(buf), "%s", line);
+   tok = strtok_r(buf, " \t", &saveptr);
+
+   while (tok != NULL) {
+      char point[GRID_BATCH_QUERY_LEN * 2];
+      size_t len = strlen(tok);
+
+      snprintf(point, sizeof(point), "%s", tok);
+      tok = strtok_r(NULL, " \t", &saveptr);
+
+      if (len > 0 && point[len - 1] == ',' && tok != NULL) {
+         snprintf(point + len, sizeof(point) - len, "%s", tok);
+         tok = strtok_r(NULL, " \t", &saveptr);
+      }
+      grid_batch_add(b, point);
+   }
+}
+
+void grid_batch_run(grid_batch_t *b, bool have_coords, double my_lat, double my_lon, outbuf_t *ob) {
+   double *distance = NULL, *bearing = NULL, *lat = NULL, *lon = NULL, *d = NULL, *br = NULL;
+   int *slot = NULL;
+   int todo = 0, bad = 0;
+
+   if (b->n > 0) {
+      // results, then the points that still need working out
+      if ((distance = malloc(b->n * sizeof(double) * 6)) == NULL || (slot = malloc(b->n * sizeof(int))) == NULL) {
+         fprintf(stderr, "+ERROR grid_batch_run: out of memory!\n");
+         exit(ENOMEM);
+      }
+      bearing = distance + b->n;
+      lat = bearing + b->n;
+      lon = lat + b->n;
+      d = lon + b->n;
+      br = d + b->n;
+   }
+
+   for (int i = 0; i < b->n; i++) {
+      if (!b->ok[i]) {
+         bad++;
+         continue;
+      }
+
+      if (!have_coords || grid_heading(b->query[i], &distance[i], &bearing[i])) {
+         continue;
+      }
+      lat[todo] = b->lat[i];
+      lon[todo] = b->lon[i];
+      slot[todo++] = i;
+   }
+
+   if (have_coords && todo > 0) {
+      geo_heading_batch(my_lat, my_lon, lat, lon, todo, d, br);
+
+      for (int k = 0; k < todo; k++) {
+         distance[slot[k]] = d[k];
+         bearing[slot[k]] = br[k];
+      }
+   }
+
+   if (b->overflow) {
+      outbuf_printf(ob, "+NOTICE Only the first %d points were used\n", GRID_BATCH_MAX);
+   }
+   outbuf_printf(ob, "200 OK GRIDS %d points, %d invalid\n", b->n, bad);
+
+   for (int i = 0; i < b->n; i++) {
+      if (!b->ok[i]) {
+         outbuf_printf(ob, "%s INVALID\n", b->query[i]);
+      } else if (!have_coords) {
+         outbuf_printf(ob, "%s %.4f %.4f - -\n", b->query[i], b->lat[i], b->lon[i]);
+      } else {
+         outbuf_printf(ob, "%s %.4f %.4f %.1f %.0f\n", b->query[i], b->lat[i], b->lon[i], distance[i], bearing[i]);
+      }
+   }
+   outbuf_printf(ob, "+EOR\n\n");
+
+   free(distance);
+   free(slot);
+}
@@ -0,0 +1,189 @@
+/*
+ * Maidenhead grid locators
+ *
+ * A locator is up to five pairs of characters, each pair splitting the
+ * square before it: 18x18 fields (A-R), 10x10 squares (0-9), 24x24
+ * subsquares (a-x), then digits and letters again. Every pair decodes the
+ * same way, so both directions are a walk down grid_pairs with a lookup
+ * table per character instead of a tangle of range checks.
+ *
+ * FT8 only sends 4 character grids, so we see the same few thousand of
+ * them all day. Their distance and bearing from us are worked out once,
+ * in one SIMD batch, when we know where we are.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "geo.h"
+#include "grid.h"
+
+// character -> value + 1, 0 = not allowed here
+#define	GA(c, v)	[c] = (v) + 1, [(c) + ('a' - 'A')] = (v) + 1
+static const uint8_t grid_alpha[256] = {
+   GA('A', 0), GA('B', 1), GA('C', 2), GA('D', 3), GA('E', 4), GA('F', 5),
+   GA('G', 6), GA('H', 7), GA('I', 8), GA('J', 9), GA('K', 10), GA('L', 11),
+   GA('M', 12), GA('N', 13), GA('O', 14), GA('P', 15), GA('Q', 16), GA('R', 17),
+   GA('S', 18), GA('T', 19), GA('U', 20), GA('V', 21), GA('W', 22), GA('X', 23)
+};
+#undef	GA
+
+static const uint8_t grid_digit[256] = {
+   ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+   ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10
+};
+
+typedef struct grid_pair {
+   const uint8_t	*value;			// grid_alpha or grid_digit
+   const char		*chars;			// value -> canonical character
+   int			base;			// values allowed
+   double		lon_step, lat_step;	// degrees per value
+} grid_pair_t;
+
+static const grid_pair_t grid_pairs[GRID_MAX_LEN / 2] = {
+   { grid_alpha, "ABCDEFGHIJKLMNOPQR", 18, 20.0, 10.0 },
+   { grid_digit, "0123456789", 10, 2.0, 1.0 },
+   { grid_alpha, "abcdefghijklmnopqrstuvwx", 24, 2.0 / 24, 1.0 / 24 },
+   { grid_digit, "0123456789", 10, 2.0 / 240, 1.0 / 240 },
+   { grid_alpha, "abcdefghijklmnopqrstuvwx", 24, 2.0 / 5760, 1.0 / 5760 }
+};
+
+// heading to the center of every 4 character grid, by grid4_index()
+#define	GRID4_COUNT	(18 * 18 * 10 * 10)
+typedef struct grid4_heading {
+   float		distance, bearing;
+} grid4_heading_t;
+static grid4_heading_t *grid4_table = NULL;
+
+bool grid_decode(const char *grid, double *lat, double *lon, char *norm) {
+   size_t len = strnlen(grid, GRID_MAX_LEN + 1);
+   double la = -90.0, lo = -180.0;
+   int pairs = len / 2;
+
+   if (len < 2 || len > GRID_MAX_LEN || (len & 1)) {
+      return false;
+   }
+
+   for (int i = 0; i < pairs; i++) {
+      const grid_pair_t *p = &grid_pairs[i];
+      int x = p->value[(uint8_t)grid[i * 2]] - 1;
+      int y = p->value[(uint8_t)grid[i * 2 + 1]] - 1;
+
+      if (x < 0 || y < 0 || x >= p->base || y >= p->base) {
+         return false;
+      }
+      lo += x * p->lon_step;
+      la += y * p->lat_step;
+
+      if (norm != NULL) {
+         norm[i * 2] = p->chars[x];
+         norm[i * 2 + 1] = p->chars[y];
+      }
+   }
+
+   if (norm != NULL) {
+      norm[len] = '\0';
+   }
+
+   // middle of the smallest square we were given
+   *lon = lo + grid_pairs[pairs - 1].lon_step / 2;
+   *lat = la + grid_pairs[pairs - 1].lat_step / 2;
+   return true;
+}
+
+bool grid_encode(double lat, double lon, int len, char *buf) {
+   double x = lon + 180.0, y = lat + 90.0;
+
+   if (len < 2 || len > GRID_MAX_LEN || (len & 1) || !(lat >= -90.0 && lat <= 90.0) || !(lon >= -180.0 && lon <= 180.0)) {
+      return false;
+   }
+
+   for (int i = 0; i < len / 2; i++) {
+      const grid_pair_t *p = &grid_pairs[i];
+      int a = (int)(x / p->lon_step), b = (int)(y / p->lat_step);
+
+      // the date line and north pole belong to the last square
+      if (a >= p->base) {
+         a = p->base - 1;
+      }
+      if (b >= p->base) {
+         b = p->base - 1;
+      }
+      x -= a * p->lon_step;
+      y -= b * p->lat_step;
+      buf[i * 2] = p->chars[a];
+      buf[i * 2 + 1] = p->chars[b];
+   }
+   buf[len] = '\0';
+   return true;
+}
+
+// slot for a 4 character grid, -1 if it isn't one
+static int grid4_index(const char *grid) {
+   int f0, f1, d0, d1;
+
+   // check the length first, "" is often the last byte of its allocation (callrec_t)
+   if (grid == NULL || strnlen(grid, 5) != 4) {
+      return -1;
+   }
+
+   f0 = grid_alpha[(uint8_t)grid[0]] - 1;
+   f1 = grid_alpha[(uint8_t)grid[1]] - 1;
+   d0 = grid_digit[(uint8_t)grid[2]] - 1;
+   d1 = grid_digit[(uint8_t)grid[3]] - 1;
+
+   if (f0 < 0 || f1 < 0 || f0 >= 18 || f1 >= 18 || d0 < 0 || d1 < 0) {
+      return -1;
+   }
+   return ((f0 * 18 + f1) * 10 + d0) * 10 + d1;
+}
+
+void grid_heading_init(double my_lat, double my_lon) {
+   double *lat = NULL, *lon = NULL, *distance = NULL, *bearing = NULL;
+
+   if (grid4_table == NULL && (grid4_table = malloc(GRID4_COUNT * sizeof(grid4_heading_t))) == NULL) {
+      fprintf(stderr, "+ERROR grid_heading_init: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   if ((lat = malloc(GRID4_COUNT * sizeof(double) * 4)) == NULL) {
+      fprintf(stderr, "+ERROR grid_heading_init: out of memory!\n");
+      exit(ENOMEM);
+   }
+   lon = lat + GRID4_COUNT;
+   distance = lon + GRID4_COUNT;
+   bearing = distance + GRID4_COUNT;
+
+   // same order as grid4_index()
+   for (int i = 0; i < GRID4_COUNT; i++) {
+      int f0 = i / 1800, f1 = (i / 100) % 18, d0 = (i / 10) % 10, d1 = i % 10;
+
+      lon[i] = -180.0 + f0 * 20.0 + d0 * 2.0 + 1.0;
+      lat[i] = -90.0 + f1 * 10.0 + d1 * 1.0 + 0.5;
+   }
+
+   geo_heading_batch(my_lat, my_lon, lat, lon, GRID4_COUNT, distance, bearing);
+
+   for (int i = 0; i < GRID4_COUNT; i++) {
+      grid4_table[i].distance = distance[i];
+      grid4_table[i].bearing = bearing[i];
+   }
+   free(lat);
+   log_send(mainlog, LOG_DEBUG, "grid: headings to %d grids from %.4f, %.4f ready (%zu KB)", GRID4_COUNT, my_lat, my_lon, GRID4_COUNT * sizeof(grid4_heading_t) / 1024);
+}
+
+// distance and bearing to a 4 character grid, false if it isn't one (or we don't know where we are)
+bool grid_heading(const char *grid, double *distance, double *bearing) {
+   int i;
+
+   if (grid4_table == NULL || (i = grid4_index(grid)) < 0) {
+      return false;
+   }
+   *distance = grid4_table[i].distance;
+   *bearing = grid4_table[i].bearing;
+   return true;
+}
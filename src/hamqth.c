@@ -0,0 +1,424 @@
+/*
+ * Support for looking up callsigns via the HamQTH XML API.
+ *
+ * Free, but you need a HamQTH account. It's a second online source next to
+ * QRZ, using the same HTTP client (http_post() in qrz-xml.c) and login state
+ * machine (session.c). Put it in the backend chain after QRZ to fall back on
+ * it when QRZ is out of quota or down ("cache,qrz,hamqth,uls"), or next to
+ * it to take whichever answers first ("cache,qrz|hamqth,uls").
+ *
+ * HamQTH doesn't publish a quota, but lookups still go through a token bucket
+ * of their own (cfg:callsign-lookup/hamqth-rate-limit, hamqth-rate-burst) so a
+ * busy band can't hammer a free service. QRZ's limiter (qrz-ratelimit.c) is no
+ * use here, it's tied to QRZ's daily count. Prefetches leave the last token
+ * for interactive and batch lookups.
+ *
+ * cfg:callsign-lookup/hamqth-api-url can point at a local mock for testing.
+ *
+ * Reference: https://www.hamqth.com/developers.php
+ */
+#define	_GNU_SOURCE
+#include <libied/cfg.h>
+#include <libied/debuglog.h>
+#include <curl/curl.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ft8goblin_types.h"
+#include "qrz-xml.h"
+#include "qrz-ratelimit.h"
+#include "hamqth.h"
+#include "backend.h"
+#include "session.h"
+#include "stats.h"
+#include "client.h"
+#include "pool.h"
+
+#define	HAMQTH_SESSION_LEN	64
+#define	HAMQTH_RATE_DEFAULT	2.0		// lookups a second
+#define	HAMQTH_BURST_DEFAULT	5.0
+
+extern struct Config Config;	// in callsign-lookup.c
+extern char *progname;
+static const char *hamqth_user = NULL, *hamqth_pass = NULL, *hamqth_api_url = NULL;
+static char hamqth_session_id[HAMQTH_SESSION_LEN];
+static online_session_t hamqth_sm;		// login state machine
+static pthread_mutex_t hamqth_lock = PTHREAD_MUTEX_INITIALIZER;	// protects hamqth_session_id and the token bucket
+static double hamqth_rate = HAMQTH_RATE_DEFAULT, hamqth_burst = HAMQTH_BURST_DEFAULT, hamqth_tokens = HAMQTH_BURST_DEFAULT;
+static uint64_t hamqth_refilled = 0;		// stats_now() of the last refill
+static atomic_ulong hamqth_limited = 0;		// lookups skipped for want of a token
+
+// a token for one request, false if we're going too fast (prefetches leave the last one)
+static bool hamqth_take_token(qrz_prio_t prio) {
+   uint64_t t = stats_now();
+   bool ok = false;
+
+   pthread_mutex_lock(&hamqth_lock);
+   hamqth_tokens += ((t - hamqth_refilled) / 1e9) * hamqth_rate;
+   if (hamqth_tokens > hamqth_burst) {
+      hamqth_tokens = hamqth_burst;
+   }
+   hamqth_refilled = t;
+
+   if (hamqth_tokens >= (prio == QRZ_PRIO_PREFETCH ? 2.0 : 1.0)) {
+      hamqth_tokens -= 1.0;
+      ok = true;
+   }
+   pthread_mutex_unlock(&hamqth_lock);
+
+   if (!ok) {
+      atomic_fetch_add(&hamqth_limited, 1);
+   }
+   return ok;
+}
+
+// s, %-escaped for a query string (free() it)
+static char *hamqth_escape(const char *s) {
+   char *e = curl_easy_escape(NULL, s, 0), *rv = NULL;
+
+   if (e == NULL || (rv = strdup(e)) == NULL) {
+      fprintf(stderr, "+ERROR hamqth_escape: out of memory!\n");
+      exit(ENOMEM);
+   }
+   curl_free(e);
+   return rv;
+}
+
+// copy the text of the first <tag>...</tag> in buf, with the usual entities decoded
+static bool hamqth_tag(const char *buf, const char *tag, char *out, size_t outsz) {
+   char open[32], close[32];
+   const char *start = NULL, *end = NULL;
+   size_t n = 0;
+
+   snprintf(open, sizeof(open), "<%s>", tag);
+   snprintf(close, sizeof(close), "</%s>", tag);
+
+   if ((start = strstr(buf, open)) == NULL) {
+      return false;
+   }
+   start += strlen(open);
+
+   if ((end = strstr(start, close)) == NULL) {
+      return false;
+   }
+
+   while (start < end && n + 1 < outsz) {
+      static const struct { const char *ent; char c; } ents[] = {
+         { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' }, { NULL, 0 }
+      };
+      int i;
+
+      for (i = 0; ents[i].ent != NULL; i++) {
+         size_t len = strlen(ents[i].ent);
+
+         if ((size_t)(end - start) >= len && strncmp(start, ents[i].ent, len) == 0) {
+            out[n++] = ents[i].c;
+            start += len;
+            break;
+         }
+      }
+
+      if (ents[i].ent == NULL) {
+         out[n++] = *start++;
+      }
+   }
+   out[n] = '\0';
+   return true;
+}
+
+// the <search> part of a reply, into calldata
+static bool hamqth_parse_search(const char *buf, calldata_t *calldata) {
+   const char *search = strstr(buf, "<search>");
+   char tmp[128];
+
+   if (search == NULL || !hamqth_tag(search, "callsign", calldata->callsign, sizeof(calldata->callsign))) {
+      return false;
+   }
+
+   for (char *c = calldata->callsign; *c != '\0'; c++) {
+      *c = toupper((unsigned char)*c);
+   }
+   calldata->origin = DATASRC_HAMQTH;
+
+   // adr_name is the whole name, nick is what they go by
+   if (hamqth_tag(search, "adr_name", tmp, sizeof(tmp)) && tmp[0] != '\0') {
+      char *last = strrchr(tmp, ' ');
+
+      if (last != NULL) {
+         *last++ = '\0';
+         snprintf(calldata->first_name, sizeof(calldata->first_name), "%.*s", (int)sizeof(calldata->first_name) - 1, tmp);
+         snprintf(calldata->last_name, sizeof(calldata->last_name), "%.*s", (int)sizeof(calldata->last_name) - 1, last);
+      } else {
+         snprintf(calldata->last_name, sizeof(calldata->last_name), "%.*s", (int)sizeof(calldata->last_name) - 1, tmp);
+      }
+   }
+
+   if (hamqth_tag(search, "nick", calldata->nickname, sizeof(calldata->nickname)) && calldata->first_name[0] == '\0') {
+      snprintf(calldata->first_name, sizeof(calldata->first_name), "%s", calldata->nickname);
+   }
+
+   hamqth_tag(search, "adr_street1", calldata->address1, sizeof(calldata->address1));
+   hamqth_tag(search, "adr_city", calldata->address2, sizeof(calldata->address2));
+   hamqth_tag(search, "adr_zip", calldata->zip, sizeof(calldata->zip));
+   hamqth_tag(search, "us_state", calldata->state, sizeof(calldata->state));
+   hamqth_tag(search, "us_county", calldata->county, sizeof(calldata->county));
+   hamqth_tag(search, "country", calldata->country, sizeof(calldata->country));
+   hamqth_tag(search, "grid", calldata->grid, sizeof(calldata->grid));
+   hamqth_tag(search, "email", calldata->email, sizeof(calldata->email));
+   hamqth_tag(search, "utc_offset", calldata->gmt_offset, sizeof(calldata->gmt_offset));
+
+   if (hamqth_tag(search, "adif", tmp, sizeof(tmp))) {
+      calldata->dxcc = calldata->country_code = atoi(tmp);
+   }
+
+   if (hamqth_tag(search, "cq", tmp, sizeof(tmp))) {
+      calldata->cq_zone = atoi(tmp);
+   }
+
+   if (hamqth_tag(search, "itu", tmp, sizeof(tmp))) {
+      calldata->itu_zone = atoi(tmp);
+   }
+
+   if (hamqth_tag(search, "latitude", tmp, sizeof(tmp))) {
+      calldata->latitude = atof(tmp);
+   }
+
+   if (hamqth_tag(search, "longitude", tmp, sizeof(tmp))) {
+      calldata->longitude = atof(tmp);
+   }
+   return true;
+}
+
+// called by the session state machine to (re)login
+static session_login_res_t hamqth_login(online_session_t *s) {
+   char url[1024], outbuf[4097], sid[HAMQTH_SESSION_LEN], error[256];
+   char *user = hamqth_escape(hamqth_user), *pass = hamqth_escape(hamqth_pass);
+
+   memset(outbuf, 0, sizeof(outbuf));
+   log_send(mainlog, LOG_DEBUG, "Trying to log into HamQTH XML API...");
+
+   snprintf(url, sizeof(url), "%s?u=%s&p=%s", hamqth_api_url, user, pass);
+   free(user);
+   free(pass);
+   Config.online_last_retry = time(NULL);
+
+   if (http_post(url, NULL, outbuf, sizeof(outbuf)) == false) {
+      return SESSION_LOGIN_FAILED;
+   }
+
+   if (hamqth_tag(outbuf, "session_id", sid, sizeof(sid)) && sid[0] != '\0') {
+      pthread_mutex_lock(&hamqth_lock);
+      snprintf(hamqth_session_id, sizeof(hamqth_session_id), "%s", sid);
+      pthread_mutex_unlock(&hamqth_lock);
+      log_send(mainlog, LOG_INFO, "Logged into HamQTH.");
+      return SESSION_LOGIN_OK;
+   }
+
+   if (hamqth_tag(outbuf, "error", error, sizeof(error))) {
+      log_send(mainlog, LOG_CRIT, "HamQTH login failed: %s", error);
+
+      // a bad username/password won't fix itself in a few seconds...
+      if (strcasestr(error, "wrong") != NULL || strcasestr(error, "password") != NULL) {
+         return SESSION_LOGIN_DENIED;
+      }
+   }
+   return SESSION_LOGIN_FAILED;
+}
+
+// keep the global online flag in sync with the session
+static void hamqth_session_changed(online_session_t *s, session_state_t old_state) {
+   backends_online_changed();
+
+   // forget the old id if we've lost the session
+   pthread_mutex_lock(&hamqth_lock);
+   if (s->reported_state == SESSION_OFFLINE) {
+      memset(hamqth_session_id, 0, sizeof(hamqth_session_id));
+   }
+   pthread_mutex_unlock(&hamqth_lock);
+}
+
+bool hamqth_start_session(struct ev_loop *loop) {
+   hamqth_user = cfg_get_str(cfg, "callsign-lookup/hamqth-username");
+   hamqth_pass = cfg_get_str(cfg, "callsign-lookup/hamqth-password");
+   hamqth_api_url = cfg_get_str(cfg, "callsign-lookup/hamqth-api-url");
+
+   // if any settings are missing cry and return error
+   if (hamqth_user == NULL || hamqth_pass == NULL || hamqth_api_url == NULL ||
+       *hamqth_user == '\0' || *hamqth_pass == '\0' || *hamqth_api_url == '\0') {
+      log_send(mainlog, LOG_CRIT, "please make sure callsign-lookup/hamqth-username hamqth-password and hamqth-api-url are all set in config.json and try again!");
+      return false;
+   }
+
+   http_init();
+
+   const char *s = cfg_get_str(cfg, "callsign-lookup/hamqth-rate-limit");
+   if (s != NULL && atof(s) > 0) {
+      hamqth_rate = atof(s);
+   }
+
+   s = cfg_get_str(cfg, "callsign-lookup/hamqth-rate-burst");
+   if (s != NULL && atof(s) >= 1) {
+      hamqth_burst = atof(s);
+   }
+   hamqth_tokens = hamqth_burst;
+   hamqth_refilled = stats_now();
+
+   memset(&hamqth_sm, 0, sizeof(hamqth_sm));
+   hamqth_sm.max_tries = cfg_get_int(cfg, "callsign-lookup/hamqth-max-login-tries");
+   hamqth_sm.backoff_max = Config.online_mode_retry;
+   session_init(&hamqth_sm, "HamQTH", loop, hamqth_login);
+   hamqth_sm.on_change = hamqth_session_changed;
+
+   // the first login happens from the event loop, so we don't hold up startup
+   session_start(&hamqth_sm);
+   return true;
+}
+
+bool hamqth_usable(void) {
+   if (hamqth_sm.loop == NULL) {
+      return false;
+   }
+   return session_usable(&hamqth_sm);
+}
+
+bool hamqth_login_pending(void) {
+   if (hamqth_sm.loop == NULL) {
+      return false;
+   }
+   return session_login_pending(&hamqth_sm);
+}
+
+void hamqth_set_online(bool online) {
+   if (hamqth_sm.loop == NULL) {
+      return;
+   }
+
+   if (online) {
+      session_retry_now(&hamqth_sm);
+   } else {
+      session_force_offline(&hamqth_sm);
+   }
+}
+
+void hamqth_session_dump(outbuf_t *ob) {
+   if (hamqth_sm.loop == NULL) {
+      return;
+   }
+
+   outbuf_printf(ob, "HamQTH-Session: %s", session_state_name[hamqth_sm.state]);
+   if (session_retry_in(&hamqth_sm) >= 0) {
+      outbuf_printf(ob, " (retry in %.0f sec)", session_retry_in(&hamqth_sm));
+   }
+   outbuf_printf(ob, "\n");
+   outbuf_printf(ob, "HamQTH-Limit: %.2f req/sec, burst %.0f, %lu lookups rate limited\n",
+         hamqth_rate, hamqth_burst, (unsigned long)atomic_load(&hamqth_limited));
+}
+
+// every request (the retry after a re-login too) takes a token at prio
+calldata_t *hamqth_lookup_callsign(const char *callsign, qrz_prio_t prio) {
+   char url[1024], outbuf[16385], error[256];
+   calldata_t *calldata = NULL;
+   char *call = NULL, *prg = NULL;
+
+   if (callsign == NULL) {
+      log_send(mainlog, LOG_DEBUG, "hamqth_lookup_callsign called with NULL callsign!");
+      return NULL;
+   }
+
+   // not logged in? the session state machine will get us back online, don't wait on it here
+   if (!hamqth_usable()) {
+      log_send(mainlog, LOG_DEBUG, "hamqth_lookup_callsign: HamQTH session is %s, skipping lookup of %s", session_state_name[hamqth_sm.state], callsign);
+      return NULL;
+   }
+
+   log_send(mainlog, LOG_INFO, "looking up callsign %s via HamQTH XML API", callsign);
+   call = hamqth_escape(callsign);
+   prg = hamqth_escape(progname);
+
+   for (int attempt = 0; attempt < 2; attempt++) {
+      if (!hamqth_take_token(prio)) {
+         log_send(mainlog, LOG_INFO, "hamqth rate limited, skipping %s lookup for %s", qrz_prio_name[prio], callsign);
+         goto fail;
+      }
+
+      memset(outbuf, 0, sizeof(outbuf));
+      pthread_mutex_lock(&hamqth_lock);
+      snprintf(url, sizeof(url), "%s?id=%s&callsign=%s&prg=%s", hamqth_api_url, hamqth_session_id, call, prg);
+      pthread_mutex_unlock(&hamqth_lock);
+
+      uint64_t t_http = stats_now();
+      bool http_ok = http_post(url, NULL, outbuf, sizeof(outbuf));
+      stats_record(STAT_HAMQTH_HTTP, t_http);
+
+      if (http_ok == false) {
+         session_request_failed(&hamqth_sm);
+         goto fail;
+      }
+
+      if (hamqth_tag(outbuf, "error", error, sizeof(error))) {
+         // session id timed out? log back in and try once more
+         if (strcasestr(error, "session") != NULL) {
+            if (attempt == 0 && session_expired(&hamqth_sm)) {
+               continue;
+            }
+            goto fail;
+         }
+
+         // Callsign not found, the service itself is fine
+         session_request_ok(&hamqth_sm);
+         goto fail;
+      }
+
+      session_request_ok(&hamqth_sm);
+      break;
+   }
+   free(call);
+   free(prg);
+
+   calldata = calldata_alloc();
+   snprintf(calldata->query_callsign, MAX_CALLSIGN, "%s", callsign);
+
+   if (!hamqth_parse_search(outbuf, calldata)) {
+      log_send(mainlog, LOG_WARNING, "hamqth: reply for %s had no callsign in it", callsign);
+      calldata_free(calldata);
+      return NULL;
+   }
+   return calldata;
+
+fail:
+   free(call);
+   free(prg);
+   return NULL;
+}
+
+////////////////////
+// lookup backend //
+////////////////////
+static bool backend_hamqth_usable(void) {
+   return (Config.use_hamqth && hamqth_usable());
+}
+
+static calldata_t *backend_hamqth_lookup(const char *callsign, qrz_prio_t prio, const atomic_bool *cancelled) {
+   if (atomic_load(cancelled)) {
+      return NULL;
+   }
+   return hamqth_lookup_callsign(callsign, prio);
+}
+
+static lookup_backend_t backend_hamqth = {
+   .name = "hamqth",
+   .origin = DATASRC_HAMQTH,
+   .online = true,
+   .default_timeout_ms = 5000,
+   .usable = backend_hamqth_usable,
+   .lookup = backend_hamqth_lookup
+};
+
+// before backends_init(), so callsign-lookup/backends can name it
+void hamqth_register(void) {
+   backend_register(&backend_hamqth);
+}
@@ -0,0 +1,575 @@
+/*
+ * Recently heard stations: how often each call is being asked about
+ *
+ * Every callsign a client sends (/CALL, /WATCH decodes, shm requests) is
+ * counted here, whether or not we know anything about it. Each station gets
+ * a small ring of time buckets (cfg:callsign-lookup/heard-bucket wide) with
+ * a request count, the bands it was reported on and the best SNR, so replies
+ * can say when it was last heard and how busy it's been, and /HEARD can show
+ * band activity without keeping a database of spots.
+ *
+ * Memory is fixed at startup: cfg:callsign-lookup/heard-max entries, found
+ * through an open addressing table of indexes into them. Once they're all
+ * in use, a new station takes the place of the least recently heard of the
+ * next few, round robin.
+ *
+ * Loop thread only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <libied/cfg.h>
+#include <libied/debuglog.h>
+#include <libied/util.h>
+#include "ft8goblin_types.h"
+#include "callsign-norm.h"
+#include "client.h"
+#include "heard.h"
+
+#define	HEARD_MAX_DEFAULT	10000
+#define	HEARD_WIDTH_DEFAULT	300		// 24 x 5 minutes = the last 2 hours
+#define	HEARD_EVICT_SAMPLE	16		// entries to look at for the least recently heard
+#define	HEARD_LIST_DEFAULT	20		// stations /HEARD lists
+#define	HEARD_LIST_MAX		200
+
+typedef struct heard_band {
+   const char	*name;
+   double	lo, hi;				// MHz
+} heard_band_t;
+
+// bit n of heard_bucket_t.bands is heard_bands[n]
+static const heard_band_t heard_bands[] = {
+   { "unknown",	0, 0 },
+   { "2200m",	0.1357, 0.1378 },
+   { "630m",	0.472, 0.479 },
+   { "160m",	1.8, 2.0 },
+   { "80m",	3.5, 4.0 },
+   { "60m",	5.25, 5.45 },
+   { "40m",	7.0, 7.3 },
+   { "30m",	10.1, 10.15 },
+   { "20m",	14.0, 14.35 },
+   { "17m",	18.068, 18.168 },
+   { "15m",	21.0, 21.45 },
+   { "12m",	24.89, 24.99 },
+   { "10m",	28.0, 29.7 },
+   { "6m",	50.0, 54.0 },
+   { "4m",	70.0, 71.0 },
+   { "2m",	144.0, 148.0 },
+   { "1.25m",	222.0, 225.0 },
+   { "70cm",	420.0, 450.0 },
+   { "23cm",	1240.0, 1300.0 }
+};
+#define	HEARD_BANDS	(int)(sizeof(heard_bands) / sizeof(heard_bands[0]))
+
+// one station's recent activity, for sorting /HEARD lists
+typedef struct heard_row {
+   const heard_entry_t	*e;
+   unsigned		count;
+   uint32_t		bands;
+   int			snr;
+} heard_row_t;
+
+extern time_t now;
+static heard_entry_t *heard_entries = NULL;	// heard_max of them, the first heard_used are in use
+static uint32_t *heard_slots = NULL;		// index into heard_entries + 1, 0 = empty
+static uint32_t heard_mask = 0;			// slots - 1, slots is a power of 2
+static int heard_max = 0, heard_used = 0, heard_hand = 0;
+static time_t heard_width = HEARD_WIDTH_DEFAULT;
+static uint64_t heard_requests = 0, heard_evicted = 0;
+
+static uint32_t heard_hash(const char *callsign) {
+   uint32_t h = 2166136261u;
+
+   while (*callsign != '\0') {
+      h ^= (uint8_t)*callsign++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+// the station's own call (VE3/K1ABC/P is K1ABC), false if it can't be one
+static bool heard_key(const char *callsign, char *buf) {
+   callsign_parts_t parts;
+   bool alpha = false, digit = false;
+   size_t len = 0;
+
+   if (!callsign_normalize(callsign, &parts)) {
+      return false;
+   }
+
+   for (const char *p = parts.base; *p != '\0'; p++, len++) {
+      alpha |= (isalpha((unsigned char)*p) != 0);
+      digit |= (isdigit((unsigned char)*p) != 0);
+   }
+
+   if (len < 3 || !alpha || !digit) {
+      return false;
+   }
+   memcpy(buf, parts.base, len + 1);
+   return true;
+}
+
+// slot holding callsign, or the empty one it would go in
+static uint32_t heard_slot(const char *callsign, uint32_t hash) {
+   uint32_t i = hash & heard_mask;
+
+   while (heard_slots[i] != 0 && strcmp(heard_entries[heard_slots[i] - 1].callsign, callsign) != 0) {
+      i = (i + 1) & heard_mask;
+   }
+   return i;
+}
+
+// empty slot i, moving anything after it that probed past it back into the gap
+static void heard_unlink(uint32_t i) {
+   uint32_t j = i;
+
+   heard_slots[i] = 0;
+
+   for (;;) {
+      uint32_t home;
+
+      j = (j + 1) & heard_mask;
+      if (heard_slots[j] == 0) {
+         return;
+      }
+
+      home = heard_entries[heard_slots[j] - 1].hash & heard_mask;
+      if (((j - home) & heard_mask) >= ((j - i) & heard_mask)) {
+         heard_slots[i] = heard_slots[j];
+         heard_slots[j] = 0;
+         i = j;
+      }
+   }
+}
+
+// all in use: give up the least recently heard of the next few
+static heard_entry_t *heard_evict(void) {
+   heard_entry_t *victim = NULL;
+
+   for (int n = 0; n < HEARD_EVICT_SAMPLE && n < heard_max; n++) {
+      heard_entry_t *e = &heard_entries[heard_hand];
+
+      heard_hand = (heard_hand + 1) % heard_max;
+      if (victim == NULL || e->last < victim->last) {
+         victim = e;
+      }
+   }
+   heard_unlink(heard_slot(victim->callsign, victim->hash));
+   heard_evicted++;
+   return victim;
+}
+
+bool heard_start(void) {
+   time_t width = timestr2time_t(cfg_get_str(cfg, "callsign-lookup/heard-bucket"));
+   uint32_t slots = 1;
+
+   if ((heard_max = cfg_get_int(cfg, "callsign-lookup/heard-max")) <= 0) {
+      heard_max = HEARD_MAX_DEFAULT;
+   }
+   heard_width = (width > 0 ? width : HEARD_WIDTH_DEFAULT);
+
+   // at most half full, so probes stay short
+   while (slots < (uint32_t)heard_max * 2) {
+      slots <<= 1;
+   }
+
+   heard_entries = calloc(heard_max, sizeof(heard_entry_t));
+   heard_slots = calloc(slots, sizeof(uint32_t));
+
+   if (heard_entries == NULL || heard_slots == NULL) {
+      fprintf(stderr, "+ERROR heard_start: out of memory!\n");
+      exit(ENOMEM);
+   }
+   heard_mask = slots - 1;
+   heard_used = heard_hand = 0;
+
+   log_send(mainlog, LOG_INFO, "heard: tracking up to %d stations, %d x %lu sec buckets (%lu KB)",
+         heard_max, HEARD_SLOTS, heard_width, (unsigned long)((heard_max * sizeof(heard_entry_t) + slots * sizeof(uint32_t)) / 1024));
+   return true;
+}
+
+void heard_stop(void) {
+   free(heard_entries);
+   free(heard_slots);
+   heard_entries = NULL;
+   heard_slots = NULL;
+   heard_used = 0;
+}
+
+// 20m, 20M or a frequency in MHz (14.074), HEARD_BAND_NONE for "", -1 if it's none of those
+int heard_band_parse(const char *s) {
+   char *end = NULL;
+   double mhz;
+
+   if (s == NULL || *s == '\0') {
+      return HEARD_BAND_NONE;
+   }
+
+   for (int i = 1; i < HEARD_BANDS; i++) {
+      if (strcasecmp(s, heard_bands[i].name) == 0) {
+         return i;
+      }
+   }
+
+   mhz = strtod(s, &end);
+   if (end != s && *end == '\0') {
+      for (int i = 1; i < HEARD_BANDS; i++) {
+         if (mhz >= heard_bands[i].lo && mhz <= heard_bands[i].hi) {
+            return i;
+         }
+      }
+   }
+   return -1;
+}
+
+// someone asked about callsign (on band, at snr dB, if they said)
+const heard_entry_t *heard_record(const char *callsign, int band, int snr) {
+   char call[MAX_CALLSIGN];
+   heard_entry_t *e = NULL;
+   heard_bucket_t *b = NULL;
+   uint32_t hash, i, start = now - (now % heard_width);
+
+   if (heard_entries == NULL || callsign == NULL || !heard_key(callsign, call)) {
+      return NULL;
+   }
+
+   hash = heard_hash(call);
+   i = heard_slot(call, hash);
+
+   if (heard_slots[i] != 0) {
+      e = &heard_entries[heard_slots[i] - 1];
+   } else {
+      if (heard_used < heard_max) {
+         e = &heard_entries[heard_used++];
+      } else {
+         // moving things around in the table may have moved our slot too
+         e = heard_evict();
+         i = heard_slot(call, hash);
+      }
+
+      memset(e, 0, sizeof(heard_entry_t));
+      memcpy(e->callsign, call, sizeof(call));
+      e->hash = hash;
+      e->first = now;
+      heard_slots[i] = (e - heard_entries) + 1;
+   }
+
+   // new bucket? the ring only holds buckets that saw something, so quiet stations keep more history
+   b = &e->ring[e->head];
+   if (b->start != start) {
+      if (b->start != 0) {
+         e->head = (e->head + 1) % HEARD_SLOTS;
+         b = &e->ring[e->head];
+      }
+      b->start = start;
+      b->bands = 0;
+      b->count = 0;
+      b->snr = HEARD_SNR_NONE;
+   }
+
+   if (b->count < UINT16_MAX) {
+      b->count++;
+   }
+
+   if (band > HEARD_BAND_NONE && band < HEARD_BANDS) {
+      b->bands |= (1u << band);
+   }
+
+   if (snr != HEARD_SNR_NONE) {
+      snr = (snr < -99 ? -99 : (snr > 99 ? 99 : snr));
+      if (b->snr == HEARD_SNR_NONE || snr > b->snr) {
+         b->snr = snr;
+      }
+   }
+
+   e->total++;
+   e->last = now;
+   heard_requests++;
+   return e;
+}
+
+const heard_entry_t *heard_find(const char *callsign) {
+   char call[MAX_CALLSIGN];
+   uint32_t i;
+
+   if (heard_entries == NULL || callsign == NULL || !heard_key(callsign, call)) {
+      return NULL;
+   }
+
+   i = heard_slot(call, heard_hash(call));
+   return (heard_slots[i] != 0 ? &heard_entries[heard_slots[i] - 1] : NULL);
+}
+
+// a lookup for callsign found it, so it's a real call (busted call corrections want those)
+void heard_found(const char *callsign) {
+   heard_entry_t *e = (heard_entry_t *)heard_find(callsign);
+
+   if (e != NULL) {
+      e->found = now;
+   }
+}
+
+// every station in the table, in no particular order
+void heard_each(void (*cb)(const heard_entry_t *e, void *priv), void *priv) {
+   for (int i = 0; i < heard_used; i++) {
+      cb(&heard_entries[i], priv);
+   }
+}
+
+// requests in the last HEARD_SLOTS buckets' worth of time, and the bands and best SNR they came with
+unsigned heard_recent(const heard_entry_t *e, uint32_t *bands, int *snr) {
+   time_t window = heard_width * HEARD_SLOTS;
+   unsigned count = 0;
+
+   if (bands != NULL) {
+      *bands = 0;
+   }
+
+   if (snr != NULL) {
+      *snr = HEARD_SNR_NONE;
+   }
+
+   for (int i = 0; i < HEARD_SLOTS; i++) {
+      const heard_bucket_t *b = &e->ring[i];
+
+      if (b->start == 0 || (time_t)b->start + window <= now) {
+         continue;
+      }
+      count += b->count;
+
+      if (bands != NULL) {
+         *bands |= b->bands;
+      }
+
+      if (snr != NULL && b->snr != HEARD_SNR_NONE && (*snr == HEARD_SNR_NONE || b->snr > *snr)) {
+         *snr = b->snr;
+      }
+   }
+   return count;
+}
+
+// requests an hour, over the window (or however long we've known them, if that's less)
+double heard_rate(const heard_entry_t *e) {
+   time_t span = now - e->first;
+
+   if (span > heard_width * HEARD_SLOTS) {
+      span = heard_width * HEARD_SLOTS;
+   }
+
+   if (span < heard_width) {
+      span = heard_width;
+   }
+   return heard_recent(e, NULL, NULL) * 3600.0 / span;
+}
+
+// 20m,40m or - if we weren't told
+static void heard_bands_str(uint32_t bands, char *buf, size_t sz) {
+   size_t len = 0;
+
+   buf[0] = '\0';
+   for (int i = 1; i < HEARD_BANDS && len < sz; i++) {
+      if (bands & (1u << i)) {
+         len += snprintf(buf + len, sz - len, "%s%s", (len > 0 ? "," : ""), heard_bands[i].name);
+      }
+   }
+
+   if (buf[0] == '\0') {
+      snprintf(buf, sz, "-");
+   }
+}
+
+static void heard_row_dump(const heard_row_t *r, outbuf_t *ob) {
+   char bands[128], snr[8] = "-";
+
+   heard_bands_str(r->bands, bands, sizeof(bands));
+   if (r->snr != HEARD_SNR_NONE) {
+      snprintf(snr, sizeof(snr), "%d", r->snr);
+   }
+   outbuf_printf(ob, "%s %u %.1f %lu %s %s\n", r->e->callsign, r->count, heard_rate(r->e), r->e->last, bands, snr);
+}
+
+// busiest first, then most recently heard
+static int heard_row_cmp(const void *a, const void *b) {
+   const heard_row_t *ra = (const heard_row_t *)a, *rb = (const heard_row_t *)b;
+
+   if (ra->count != rb->count) {
+      return (ra->count > rb->count ? -1 : 1);
+   }
+
+   if (ra->e->last != rb->e->last) {
+      return (ra->e->last > rb->e->last ? -1 : 1);
+   }
+   return strcmp(ra->e->callsign, rb->e->callsign);
+}
+
+// /HEARD K1ABC: everything we've got on one station, newest bucket first
+static void heard_station_dump(const char *callsign, outbuf_t *ob) {
+   const heard_entry_t *e = heard_find(callsign);
+
+   if (e == NULL) {
+      outbuf_printf(ob, "404 NOT FOUND %.*s\n", (int)strcspn(callsign, " \t"), callsign);
+      return;
+   }
+
+   outbuf_printf(ob, "200 OK HEARD %s %u requests since %lu, last %lu, %.1f/hr\n",
+         e->callsign, e->total, e->first, e->last, heard_rate(e));
+
+   for (int n = 0; n < HEARD_SLOTS; n++) {
+      const heard_bucket_t *b = &e->ring[(e->head + HEARD_SLOTS - n) % HEARD_SLOTS];
+      char bands[128], snr[8] = "-";
+
+      if (b->start == 0) {
+         break;
+      }
+      heard_bands_str(b->bands, bands, sizeof(bands));
+
+      if (b->snr != HEARD_SNR_NONE) {
+         snprintf(snr, sizeof(snr), "%d", b->snr);
+      }
+      outbuf_printf(ob, "%u %u %s %s\n", b->start, b->count, bands, snr);
+   }
+   outbuf_printf(ob, "+EOR\n\n");
+}
+
+// the next word of *arg, and move past it. false if it won't fit in buf
+static bool heard_word(const char **arg, char *buf, size_t bufsz) {
+   const char *p = *arg + strspn(*arg, " \t");
+   size_t len = strcspn(p, " \t");
+
+   *arg = p + len;
+   if (len >= bufsz) {
+      return false;
+   }
+   memcpy(buf, p, len);
+   buf[len] = '\0';
+   return true;
+}
+
+static bool heard_is_number(const char *s) {
+   return (*s != '\0' && strspn(s, "0123456789") == strlen(s));
+}
+
+// /HEARD [BAND] [MAX]: activity per band, then the busiest stations (on that band)
+void heard_query_dump(const char *arg, outbuf_t *ob) {
+   uint64_t band_requests[HEARD_BANDS] = { 0 };
+   int band_stations[HEARD_BANDS] = { 0 };
+   heard_row_t *rows = NULL;
+   char what[MAX_CALLSIGN] = "", max[16] = "";
+   int band = HEARD_BAND_NONE, limit = HEARD_LIST_DEFAULT, nrows = 0;
+   unsigned total = 0;
+
+   if (heard_entries == NULL) {
+      outbuf_printf(ob, "503 Service Unavailable - Not tracking heard stations\n");
+      return;
+   }
+
+   // a bare number is how many to show (/HEARD 50), frequencies need the decimal point (14.074)
+   if (!heard_word(&arg, what, sizeof(what)) || !heard_word(&arg, max, sizeof(max)) ||
+       (heard_is_number(what) && max[0] != '\0') || (max[0] != '\0' && !heard_is_number(max))) {
+      outbuf_printf(ob, "400 Bad Request - Try /HEARD [CALL|BAND] [MAX]\n");
+      return;
+   }
+
+   if (heard_is_number(what) || max[0] != '\0') {
+      long n = strtol(heard_is_number(what) ? what : max, NULL, 10);
+
+      if (n > 0) {
+         limit = (n > HEARD_LIST_MAX ? HEARD_LIST_MAX : (int)n);
+      }
+
+      if (heard_is_number(what)) {
+         what[0] = '\0';
+      }
+   }
+
+   // not a band? it's a callsign
+   if (what[0] != '\0' && (band = heard_band_parse(what)) <= HEARD_BAND_NONE) {
+      heard_station_dump(what, ob);
+      return;
+   }
+
+   if ((rows = malloc(heard_used * sizeof(heard_row_t) + 1)) == NULL) {
+      fprintf(stderr, "+ERROR heard_query_dump: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   for (int i = 0; i < heard_used; i++) {
+      const heard_entry_t *e = &heard_entries[i];
+      time_t window = heard_width * HEARD_SLOTS;
+      uint32_t seen_on = 0;
+      heard_row_t r = { e, 0, 0, HEARD_SNR_NONE };
+
+      // per band totals want the per bucket breakdown, not just heard_recent()
+      for (int s = 0; s < HEARD_SLOTS; s++) {
+         const heard_bucket_t *b = &e->ring[s];
+         uint32_t bb = b->bands;
+
+         if (b->start == 0 || (time_t)b->start + window <= now) {
+            continue;
+         }
+         r.count += b->count;
+         r.bands |= bb;
+
+         if (b->snr != HEARD_SNR_NONE && (r.snr == HEARD_SNR_NONE || b->snr > r.snr)) {
+            r.snr = b->snr;
+         }
+
+         if (bb == 0) {
+            bb = 1u << HEARD_BAND_NONE;
+         }
+
+         for (int n = 0; n < HEARD_BANDS; n++) {
+            if (bb & (1u << n)) {
+               band_requests[n] += b->count;
+            }
+         }
+         seen_on |= bb;
+      }
+
+      if (r.count == 0) {
+         continue;
+      }
+
+      for (int n = 0; n < HEARD_BANDS; n++) {
+         if (seen_on & (1u << n)) {
+            band_stations[n]++;
+         }
+      }
+
+      if (band == HEARD_BAND_NONE || (r.bands & (1u << band))) {
+         rows[nrows++] = r;
+         total += r.count;
+      }
+   }
+   qsort(rows, nrows, sizeof(heard_row_t), heard_row_cmp);
+
+   outbuf_printf(ob, "200 OK HEARD %s %d stations, %u requests in the last %lu sec\n",
+         (band > HEARD_BAND_NONE ? heard_bands[band].name : "ALL"), nrows, total, heard_width * HEARD_SLOTS);
+
+   for (int n = 0; n < HEARD_BANDS; n++) {
+      if (band_stations[n] > 0 && (band == HEARD_BAND_NONE || band == n)) {
+         outbuf_printf(ob, "Band %s: %lu requests, %d stations\n", heard_bands[n].name, band_requests[n], band_stations[n]);
+      }
+   }
+
+   for (int i = 0; i < nrows && i < limit; i++) {
+      heard_row_dump(&rows[i], ob);
+   }
+   outbuf_printf(ob, "+EOR\n\n");
+   free(rows);
+}
+
+void heard_dump(outbuf_t *ob) {
+   if (heard_entries == NULL) {
+      return;
+   }
+
+   outbuf_printf(ob, "Heard: %d stations (of %d, %lu KB), %lu requests, %lu evicted, %lu sec buckets\n",
+         heard_used, heard_max, (unsigned long)((heard_max * sizeof(heard_entry_t) + (heard_mask + 1) * sizeof(uint32_t)) / 1024),
+         heard_requests, heard_evicted, heard_width);
+}
@@ -0,0 +1,436 @@
+/*
+ * LoTW user activity: when did a station last upload to Logbook of the World?
+ *
+ * ARRL publishes every LoTW user and their last upload as one big CSV
+ * (cfg:callsign-lookup/lotw-url), lines like
+ *	K1ABC,2026-10-01,12:34:56
+ * We fetch it every cfg:callsign-lookup/lotw-activity-download on a worker,
+ * parsing it as it streams in, into an open addressing table keyed on the
+ * callsign packed into a uint64_t (base 38, up to 12 characters), so each
+ * user costs 12 bytes and a lookup is a hash and a probe or two.
+ *
+ * Replies ask lotw_last_upload() as they go out, so the date is always from
+ * the newest list, even on cached answers. A new table is built off to the
+ * side and swapped in under the write lock, lookups only ever wait on that
+ * pointer swap. file:// URLs work too (ex: a copy you fetch yourself).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <curl/curl.h>
+#include <ev.h>
+#include <libied/cfg.h>
+#include <libied/debuglog.h>
+#include <libied/util.h>
+#include "ft8goblin_types.h"
+#include "qrz-xml.h"
+#include "workers.h"
+#include "client.h"
+#include "lotw.h"
+#include "call-index.h"
+
+#define	LOTW_KEY_CHARS		12		// 38^12 < 2^64
+#define	LOTW_MIN_SLOTS		(1 << 16)
+#define	LOTW_LINE_MAX		128
+#define	LOTW_DEFAULT_URL	"https://lotw.arrl.org/lotw-user-activity.csv"
+
+typedef struct lotw_index {
+   uint64_t	*keys;			// packed callsign, 0 = empty slot
+   uint32_t	*when;			// last upload, unix time
+   uint32_t	mask;			// slots - 1, slots is a power of 2
+   uint32_t	n;
+} lotw_index_t;
+
+typedef struct lotw_fetch {
+   work_t	work;			// must be first
+   lotw_index_t	*idx;			// being built
+   char		line[LOTW_LINE_MAX];	// partial line carried between chunks
+   size_t	len;
+   bool		overlong;		// current line didn't fit, skip it
+   uint64_t	rows, skipped, bytes;
+   bool		ok;
+} lotw_fetch_t;
+
+extern char *progname;
+bool use_lotw = false;			// cfg:callsign-lookup/use-lotw-activity
+static const char *lotw_url = NULL;
+static lotw_index_t *lotw_cur = NULL;
+static pthread_rwlock_t lotw_lock = PTHREAD_RWLOCK_INITIALIZER;	// protects lotw_cur, not what it points at (read-only once swapped in)
+static time_t lotw_loaded = 0;
+static uint64_t lotw_loads = 0, lotw_failures = 0;
+static lotw_fetch_t *lotw_busy = NULL;	// a download in progress, only one at a time
+static atomic_bool lotw_cancelled = false;	// shutting down, abandon the download
+static struct ev_loop *lotw_loop = NULL;
+static ev_timer lotw_timer;
+
+// A-Z 0-9 and /, anything else (or too long) isn't a call we can index
+static uint64_t lotw_pack(const char *callsign, size_t len) {
+   uint64_t k = 0;
+
+   if (len == 0 || len > LOTW_KEY_CHARS) {
+      return 0;
+   }
+
+   for (size_t i = 0; i < len; i++) {
+      int c = toupper((unsigned char)callsign[i]), v;
+
+      if (c >= '0' && c <= '9') {
+         v = 1 + (c - '0');
+      } else if (c >= 'A' && c <= 'Z') {
+         v = 11 + (c - 'A');
+      } else if (c == '/') {
+         v = 37;
+      } else {
+         return 0;
+      }
+      k = k * 38 + v;
+   }
+   return k;
+}
+
+static void lotw_unpack(uint64_t k, char *out) {
+   static const char digits[] = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ/";
+   char tmp[LOTW_KEY_CHARS + 1];
+   int n = 0;
+
+   for (; k != 0 && n < LOTW_KEY_CHARS; k /= 38) {
+      tmp[n++] = digits[k % 38];
+   }
+
+   for (int i = 0; i < n; i++) {
+      out[i] = tmp[n - 1 - i];
+   }
+   out[n] = '\0';
+}
+
+static uint32_t lotw_slot(uint64_t k, uint32_t mask) {
+   k ^= k >> 33;
+   k *= 0xff51afd7ed558ccdULL;
+   k ^= k >> 33;
+   return (uint32_t)k & mask;
+}
+
+static lotw_index_t *lotw_index_new(uint32_t slots) {
+   lotw_index_t *idx = calloc(1, sizeof(lotw_index_t));
+
+   if (idx == NULL || (idx->keys = calloc(slots, sizeof(uint64_t))) == NULL ||
+       (idx->when = calloc(slots, sizeof(uint32_t))) == NULL) {
+      fprintf(stderr, "+ERROR lotw_index_new: out of memory!\n");
+      exit(ENOMEM);
+   }
+   idx->mask = slots - 1;
+   return idx;
+}
+
+static void lotw_index_free(lotw_index_t *idx) {
+   if (idx == NULL) {
+      return;
+   }
+   free(idx->keys);
+   free(idx->when);
+   free(idx);
+}
+
+// a user can be listed more than once, keep the newest upload
+static void lotw_index_put(lotw_index_t *idx, uint64_t k, uint32_t when) {
+   uint32_t i = lotw_slot(k, idx->mask);
+
+   while (idx->keys[i] != 0 && idx->keys[i] != k) {
+      i = (i + 1) & idx->mask;
+   }
+
+   if (idx->keys[i] == 0) {
+      idx->keys[i] = k;
+      idx->when[i] = when;
+      idx->n++;
+   } else if (when > idx->when[i]) {
+      idx->when[i] = when;
+   }
+}
+
+// keep it under 3/4 full, so probes stay short
+static lotw_index_t *lotw_index_grow(lotw_index_t *idx) {
+   if ((uint64_t)(idx->n + 1) * 4 < (uint64_t)(idx->mask + 1) * 3) {
+      return idx;
+   }
+
+   lotw_index_t *bigger = lotw_index_new((idx->mask + 1) * 2);
+
+   for (uint32_t i = 0; i <= idx->mask; i++) {
+      if (idx->keys[i] != 0) {
+         lotw_index_put(bigger, idx->keys[i], idx->when[i]);
+      }
+   }
+   lotw_index_free(idx);
+   return bigger;
+}
+
+// CALLSIGN,YYYY-MM-DD,HH:MM:SS
+static void lotw_parse_line(lotw_fetch_t *f, char *line) {
+   char *date = strchr(line, ','), *tm = NULL;
+   struct tm t;
+   uint64_t k;
+
+   if (date == NULL) {
+      f->skipped++;
+      return;
+   }
+
+   if ((tm = strchr(date + 1, ',')) != NULL) {
+      *tm++ = '\0';
+   }
+
+   memset(&t, 0, sizeof(t));
+   if (sscanf(date + 1, "%4d-%2d-%2d", &t.tm_year, &t.tm_mon, &t.tm_mday) != 3 ||
+       (k = lotw_pack(line, date - line)) == 0) {
+      f->skipped++;
+      return;
+   }
+
+   if (tm != NULL) {
+      sscanf(tm, "%2d:%2d:%2d", &t.tm_hour, &t.tm_min, &t.tm_sec);
+   }
+   t.tm_year -= 1900;
+   t.tm_mon -= 1;
+
+   f->idx = lotw_index_grow(f->idx);
+   lotw_index_put(f->idx, k, (uint32_t)timegm(&t));
+   f->rows++;
+}
+
+// curl hands us the file a chunk at a time, lines can span chunks
+static size_t lotw_write_cb(void *ptr, size_t size, size_t nmemb, void *priv) {
+   lotw_fetch_t *f = (lotw_fetch_t *)priv;
+   const char *p = (const char *)ptr;
+   size_t n = size * nmemb;
+
+   f->bytes += n;
+
+   for (size_t i = 0; i < n; i++) {
+      if (p[i] == '\n') {
+         if (!f->overlong && f->len > 0) {
+            if (f->line[f->len - 1] == '\r') {
+               f->len--;
+            }
+            f->line[f->len] = '\0';
+            lotw_parse_line(f, f->line);
+         } else if (f->overlong) {
+            f->skipped++;
+         }
+         f->len = 0;
+         f->overlong = false;
+      } else if (f->len + 1 < sizeof(f->line)) {
+         f->line[f->len++] = p[i];
+      } else {
+         f->overlong = true;
+      }
+   }
+   return n;
+}
+
+// curl calls this every so often, even while the transfer is stalled
+static int lotw_progress_cb(void *priv, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+   return (atomic_load(&lotw_cancelled) ? 1 : 0);
+}
+
+// worker thread: download and index the whole list
+static void lotw_fetch_run(work_t *w) {
+   lotw_fetch_t *f = (lotw_fetch_t *)w;
+   char useragent[128];
+   CURL *curl;
+   CURLcode res;
+
+   if ((curl = curl_easy_init()) == NULL) {
+      log_send(mainlog, LOG_WARNING, "lotw: curl_easy_init() failed");
+      return;
+   }
+
+   f->idx = lotw_index_new(LOTW_MIN_SLOTS);
+   snprintf(useragent, sizeof(useragent), "%s/%s", progname, VERSION);
+
+   curl_easy_setopt(curl, CURLOPT_URL, lotw_url);
+   curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, lotw_write_cb);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+   curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+   curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, lotw_progress_cb);
+
+   // it's a big file, so no total timeout, just give up if it stalls (or lotw_cancel() says to)
+   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+   curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+   curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+
+   if ((res = curl_easy_perform(curl)) != CURLE_OK) {
+      log_send(mainlog, LOG_WARNING, "lotw: fetching %s failed: %s", lotw_url, curl_easy_strerror(res));
+   } else {
+      // no newline at the end of the file?
+      if (f->len > 0 && !f->overlong) {
+         f->line[f->len] = '\0';
+         lotw_parse_line(f, f->line);
+      }
+      f->ok = (f->rows > 0);
+   }
+   curl_easy_cleanup(curl);
+}
+
+// loop thread: swap the new list in
+static void lotw_fetch_done(work_t *w) {
+   lotw_fetch_t *f = (lotw_fetch_t *)w;
+
+   if (f->ok) {
+      pthread_rwlock_wrlock(&lotw_lock);
+      lotw_index_t *old = lotw_cur;
+      lotw_cur = f->idx;
+      pthread_rwlock_unlock(&lotw_lock);
+
+      lotw_index_free(old);
+      lotw_loaded = time(NULL);
+      lotw_loads++;
+      // new users for /SEARCH
+      callidx_rebuild();
+      log_send(mainlog, LOG_INFO, "lotw: indexed %u users (%lu lines, %lu skipped, %lu KB) from %s", f->idx->n,
+            (unsigned long)f->rows, (unsigned long)f->skipped, (unsigned long)(f->bytes / 1024), lotw_url);
+   } else {
+      lotw_index_free(f->idx);
+      lotw_failures++;
+      log_send(mainlog, LOG_WARNING, "lotw: no users in %s, keeping the %s list", lotw_url, (lotw_cur != NULL ? "old" : "(empty)"));
+   }
+
+   free(f);
+   lotw_busy = NULL;
+}
+
+static void lotw_fetch(void) {
+   lotw_fetch_t *f;
+
+   // still working on the last one
+   if (lotw_busy != NULL) {
+      return;
+   }
+
+   if ((f = calloc(1, sizeof(lotw_fetch_t))) == NULL) {
+      fprintf(stderr, "+ERROR lotw_fetch: out of memory!\n");
+      exit(ENOMEM);
+   }
+   f->work.prio = WORK_PRIO_MAX - 1;
+   f->work.run = lotw_fetch_run;
+   f->work.done = lotw_fetch_done;
+   lotw_busy = f;
+   workers_submit(&f->work);
+}
+
+static void lotw_timer_cb(EV_P_ ev_timer *w, int revents) {
+   lotw_fetch();
+}
+
+// call after workers_init(), the first download starts right away
+bool lotw_start(struct ev_loop *loop) {
+   time_t interval = timestr2time_t(cfg_get_str(cfg, "callsign-lookup/lotw-activity-download"));
+
+   lotw_url = cfg_get_str(cfg, "callsign-lookup/lotw-url");
+   if (lotw_url == NULL || *lotw_url == '\0') {
+      lotw_url = LOTW_DEFAULT_URL;
+   }
+
+   if (interval <= 0) {
+      interval = 86400;
+   }
+
+   http_init();
+   lotw_loop = loop;
+   ev_timer_init(&lotw_timer, lotw_timer_cb, interval, interval);
+   ev_timer_start(loop, &lotw_timer);
+   lotw_fetch();
+   return true;
+}
+
+// stop a download in progress, so workers_stop() doesn't have to wait for the whole file
+void lotw_cancel(void) {
+   atomic_store(&lotw_cancelled, true);
+}
+
+// call after workers_stop(), a download still in flight never got to lotw_fetch_done()
+void lotw_stop(void) {
+   if (lotw_loop != NULL) {
+      ev_timer_stop(lotw_loop, &lotw_timer);
+      lotw_loop = NULL;
+   }
+
+   if (lotw_busy != NULL) {
+      lotw_index_free(lotw_busy->idx);
+      free(lotw_busy);
+      lotw_busy = NULL;
+   }
+
+   pthread_rwlock_wrlock(&lotw_lock);
+   lotw_index_free(lotw_cur);
+   lotw_cur = NULL;
+   pthread_rwlock_unlock(&lotw_lock);
+}
+
+// 0 if they're not a LoTW user (or we haven't got the list yet)
+time_t lotw_last_upload(const char *callsign) {
+   uint64_t k;
+   time_t when = 0;
+
+   if (callsign == NULL || (k = lotw_pack(callsign, strlen(callsign))) == 0) {
+      return 0;
+   }
+
+   pthread_rwlock_rdlock(&lotw_lock);
+   if (lotw_cur != NULL) {
+      for (uint32_t i = lotw_slot(k, lotw_cur->mask); lotw_cur->keys[i] != 0; i = (i + 1) & lotw_cur->mask) {
+         if (lotw_cur->keys[i] == k) {
+            when = lotw_cur->when[i];
+            break;
+         }
+      }
+   }
+   pthread_rwlock_unlock(&lotw_lock);
+   return when;
+}
+
+// every user on the current list, for the search index
+int lotw_each_callsign(void (*cb)(const char *callsign, void *priv), void *priv) {
+   int n = 0;
+
+   pthread_rwlock_rdlock(&lotw_lock);
+   for (uint32_t i = 0; lotw_cur != NULL && i <= lotw_cur->mask; i++) {
+      char callsign[LOTW_KEY_CHARS + 1];
+
+      if (lotw_cur->keys[i] != 0) {
+         lotw_unpack(lotw_cur->keys[i], callsign);
+         cb(callsign, priv);
+         n++;
+      }
+   }
+   pthread_rwlock_unlock(&lotw_lock);
+   return n;
+}
+
+// for /STATS
+void lotw_dump(outbuf_t *ob) {
+   if (lotw_loop == NULL) {
+      return;
+   }
+
+   pthread_rwlock_rdlock(&lotw_lock);
+   if (lotw_cur != NULL) {
+      outbuf_printf(ob, "LoTW: %u users, %lu KB, loaded %ld sec ago, %lu loads, %lu failed%s\n", lotw_cur->n,
+            (unsigned long)((lotw_cur->mask + 1) * (sizeof(uint64_t) + sizeof(uint32_t)) / 1024),
+            (long)(time(NULL) - lotw_loaded), (unsigned long)lotw_loads, (unsigned long)lotw_failures,
+            (lotw_busy != NULL ? ", refreshing" : ""));
+   } else {
+      outbuf_printf(ob, "LoTW: no list yet, %lu failed%s\n", (unsigned long)lotw_failures, (lotw_busy != NULL ? ", downloading" : ""));
+   }
+   pthread_rwlock_unlock(&lotw_lock);
+}
@@ -0,0 +1,288 @@
+/*
+ * In-memory cache of recently answered callsigns, in front of the sqlite cache
+ *
+ * Entries are compact records (callrec.h), so a warm cache of 100k stations
+ * is a few tens of MB rather than the ~2.7KB a calldata_t would cost each.
+ * Lookups run on the workers, so everything here is under one mutex; the
+ * critical sections are a hash probe and a couple of list links.
+ *
+ * memcache_find() returns a new reference, the caller must callrec_put() it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "callrec.h"
+#include "client.h"
+#include "memcache.h"
+
+typedef struct memcache_entry {
+   callrec_t			*rec;
+   uint32_t			hash;
+   struct memcache_entry	*hnext;			// hash chain
+   struct memcache_entry	*lru_prev, *lru_next;	// head is most recently used
+} memcache_entry_t;
+
+static pthread_mutex_t memcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static memcache_entry_t **buckets = NULL;
+static uint32_t bucket_mask = 0;
+static memcache_entry_t *lru_head = NULL, *lru_tail = NULL;
+static int max_entries = 0, n_entries = 0;
+static size_t n_bytes = 0;
+static uint64_t n_evicted = 0;
+static uint64_t generation = 0;				// bumped on every change, for snapshots
+
+// FNV-1a, case insensitive (callsigns are stored upper case, but clients send whatever)
+static uint32_t memcache_hash(const char *callsign) {
+   uint32_t h = 2166136261u;
+
+   while (*callsign != '\0') {
+      h ^= (uint8_t)toupper((unsigned char)*callsign++);
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static void lru_unlink(memcache_entry_t *e) {
+   if (e->lru_prev != NULL) {
+      e->lru_prev->lru_next = e->lru_next;
+   } else {
+      lru_head = e->lru_next;
+   }
+
+   if (e->lru_next != NULL) {
+      e->lru_next->lru_prev = e->lru_prev;
+   } else {
+      lru_tail = e->lru_prev;
+   }
+   e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(memcache_entry_t *e) {
+   e->lru_prev = NULL;
+   e->lru_next = lru_head;
+
+   if (lru_head != NULL) {
+      lru_head->lru_prev = e;
+   } else {
+      lru_tail = e;
+   }
+   lru_head = e;
+}
+
+// find the link pointing at callsign's entry (or the end of it's chain)
+static memcache_entry_t **memcache_slot(const char *callsign, uint32_t hash) {
+   memcache_entry_t **pp = &buckets[hash & bucket_mask];
+
+   while (*pp != NULL) {
+      if ((*pp)->hash == hash && strcasecmp(callrec_get((*pp)->rec, CR_CALLSIGN), callsign) == 0) {
+         break;
+      }
+      pp = &(*pp)->hnext;
+   }
+   return pp;
+}
+
+// unlink and free the entry *pp points at, caller holds the lock
+static void memcache_drop(memcache_entry_t **pp) {
+   memcache_entry_t *e = *pp;
+
+   *pp = e->hnext;
+   lru_unlink(e);
+   n_entries--;
+   generation++;
+   n_bytes -= callrec_size(e->rec) + sizeof(memcache_entry_t);
+   callrec_put(e->rec);
+   free(e);
+}
+
+bool memcache_init(int entries) {
+   uint32_t nbuckets = 1024;
+
+   if (entries <= 0) {
+      log_send(mainlog, LOG_INFO, "memcache: disabled");
+      return false;
+   }
+
+   // keep chains short: at least as many buckets as entries
+   while (nbuckets < (uint32_t)entries) {
+      nbuckets <<= 1;
+   }
+
+   if ((buckets = calloc(nbuckets, sizeof(memcache_entry_t *))) == NULL) {
+      fprintf(stderr, "+ERROR memcache_init: out of memory!\n");
+      exit(ENOMEM);
+   }
+   bucket_mask = nbuckets - 1;
+   max_entries = entries;
+   log_send(mainlog, LOG_INFO, "memcache: up to %d records (%u buckets)", max_entries, nbuckets);
+   return true;
+}
+
+void memcache_fini(void) {
+   pthread_mutex_lock(&memcache_lock);
+   while (lru_head != NULL) {
+      memcache_drop(memcache_slot(callrec_get(lru_head->rec, CR_CALLSIGN), lru_head->hash));
+   }
+   free(buckets);
+   buckets = NULL;
+   max_entries = 0;
+   pthread_mutex_unlock(&memcache_lock);
+}
+
+callrec_t *memcache_find(const char *callsign) {
+   callrec_t *rec = NULL;
+   uint32_t hash;
+
+   if (buckets == NULL || callsign == NULL) {
+      return NULL;
+   }
+
+   hash = memcache_hash(callsign);
+   pthread_mutex_lock(&memcache_lock);
+   memcache_entry_t *e = *memcache_slot(callsign, hash);
+
+   if (e != NULL) {
+      lru_unlink(e);
+      lru_push(e);
+      rec = callrec_ref(e->rec);
+   }
+   pthread_mutex_unlock(&memcache_lock);
+   return rec;
+}
+
+// Add (or replace) a record. The cache takes the caller's reference.
+void memcache_insert(callrec_t *rec) {
+   memcache_entry_t *e = NULL, **pp = NULL;
+   const char *callsign = NULL;
+   uint32_t hash;
+
+   if (rec == NULL) {
+      return;
+   }
+
+   callsign = callrec_get(rec, CR_CALLSIGN);
+   if (buckets == NULL || *callsign == '\0') {
+      callrec_put(rec);
+      return;
+   }
+
+   if ((e = malloc(sizeof(memcache_entry_t))) == NULL) {
+      fprintf(stderr, "+ERROR memcache_insert: out of memory!\n");
+      exit(ENOMEM);
+   }
+   hash = memcache_hash(callsign);
+   e->rec = rec;
+   e->hash = hash;
+
+   pthread_mutex_lock(&memcache_lock);
+   pp = memcache_slot(callsign, hash);
+
+   // newer data replaces the old
+   if (*pp != NULL) {
+      memcache_drop(pp);
+   }
+
+   // full? make room by dropping the least recently used
+   while (n_entries >= max_entries && lru_tail != NULL) {
+      memcache_drop(memcache_slot(callrec_get(lru_tail->rec, CR_CALLSIGN), lru_tail->hash));
+      n_evicted++;
+   }
+
+   pp = &buckets[hash & bucket_mask];
+   e->hnext = *pp;
+   *pp = e;
+   lru_push(e);
+   n_entries++;
+   generation++;
+   n_bytes += callrec_size(rec) + sizeof(memcache_entry_t);
+   pthread_mutex_unlock(&memcache_lock);
+}
+
+void memcache_remove(const char *callsign) {
+   memcache_entry_t **pp = NULL;
+
+   if (buckets == NULL || callsign == NULL) {
+      return;
+   }
+
+   pthread_mutex_lock(&memcache_lock);
+   pp = memcache_slot(callsign, memcache_hash(callsign));
+   if (*pp != NULL) {
+      memcache_drop(pp);
+   }
+   pthread_mutex_unlock(&memcache_lock);
+}
+
+// Take a reference to every record, most recently used first. *recs must be
+// freed and each record callrec_put() by the caller. Returns the count, or -1
+// if nothing changed since generation *gen (which is updated).
+int memcache_collect(callrec_t ***recs, uint64_t *gen) {
+   callrec_t **v = NULL;
+   int n = 0;
+
+   *recs = NULL;
+   pthread_mutex_lock(&memcache_lock);
+   if (gen != NULL && *gen == generation) {
+      pthread_mutex_unlock(&memcache_lock);
+      return -1;
+   }
+
+   if (n_entries > 0 && (v = malloc(n_entries * sizeof(callrec_t *))) == NULL) {
+      fprintf(stderr, "+ERROR memcache_collect: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   for (memcache_entry_t *e = lru_head; e != NULL; e = e->lru_next) {
+      v[n++] = callrec_ref(e->rec);
+   }
+
+   if (gen != NULL) {
+      *gen = generation;
+   }
+   pthread_mutex_unlock(&memcache_lock);
+   *recs = v;
+   return n;
+}
+
+int memcache_entries(void) {
+   int rv;
+
+   pthread_mutex_lock(&memcache_lock);
+   rv = n_entries;
+   pthread_mutex_unlock(&memcache_lock);
+   return rv;
+}
+
+size_t memcache_bytes(void) {
+   size_t rv;
+
+   pthread_mutex_lock(&memcache_lock);
+   rv = n_bytes;
+   pthread_mutex_unlock(&memcache_lock);
+   return rv;
+}
+
+void memcache_dump(outbuf_t *ob) {
+   int entries;
+   size_t bytes;
+   uint64_t evicted;
+
+   pthread_mutex_lock(&memcache_lock);
+   entries = n_entries;
+   bytes = n_bytes;
+   evicted = n_evicted;
+   pthread_mutex_unlock(&memcache_lock);
+
+   outbuf_printf(ob, "Memcache: %d/%d records, %zu KB (%zu bytes/record) + %zu KB index, %lu evicted\n",
+         entries, max_entries, bytes / 1024, (entries > 0 ? bytes / entries : 0),
+         (buckets != NULL ? (bucket_mask + 1) * sizeof(memcache_entry_t *) / 1024 : 0), evicted);
+   outbuf_printf(ob, "Interned: %d strings, %zu bytes\n", intern_count(), intern_bytes());
+}
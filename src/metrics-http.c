@@ -0,0 +1,281 @@
+/*
+ * Minimal HTTP listener for prometheus to scrape, on the main event loop.
+ *
+ * This only speaks enough HTTP/1.0 to answer GET /metrics: read the request
+ * head, render the metrics into memory, write it out and close. Scrapes are
+ * rare and tiny, so there's no keep-alive or pipelining, and a client that
+ * doesn't finish within METRICS_TIMEOUT seconds gets dropped.
+ *
+ * Enable with cfg:callsign-lookup/metrics-listen, ex: "127.0.0.1:9464". There
+ * is no authentication, so don't listen anywhere public!
+ */
+#define	_GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "qrz-xml.h"
+#include "qrz-ratelimit.h"
+#include "stats.h"
+#include "metrics-http.h"
+#include "pool.h"
+
+#define	METRICS_MAX_REQUEST	2048		// we don't care about headers, but must read them
+#define	METRICS_TIMEOUT		5.0		// seconds a client has to send the request and take the reply
+#define	METRICS_MAX_CLIENTS	8
+
+typedef struct metrics_client {
+   ev_io		io;			// must be first
+   ev_timer		timeout;
+   char			req[METRICS_MAX_REQUEST];
+   size_t		req_len;
+   char			*resp;			// from open_memstream, must be free()d
+   size_t		resp_len, resp_off;
+} metrics_client_t;
+
+static ev_io listen_watcher;
+static int listen_fd = -1;
+static int nclients = 0;
+static struct ev_loop *metrics_loop = NULL;
+
+void metrics_dump(FILE *fp) {
+   stats_dump_prometheus(fp);
+   pools_dump_prometheus(fp);
+
+   fprintf(fp, "# HELP callsign_lookup_offline 1 if online lookups are unavailable\n");
+   fprintf(fp, "# TYPE callsign_lookup_offline gauge\n");
+   fprintf(fp, "callsign_lookup_offline %d\n", (Config.offline ? 1 : 0));
+
+   if (Config.use_qrz) {
+      qrz_session_dump_prometheus(fp);
+      qrz_ratelimit_dump_prometheus(fp);
+   }
+}
+
+static void metrics_client_close(EV_P_ metrics_client_t *c) {
+   ev_io_stop(EV_A, &c->io);
+   ev_timer_stop(EV_A, &c->timeout);
+   close(c->io.fd);
+   free(c->resp);
+   free(c);
+   nclients--;
+}
+
+static void metrics_timeout_cb(EV_P_ ev_timer *w, int revents) {
+   metrics_client_t *c = (metrics_client_t *)w->data;
+
+   log_send(mainlog, LOG_DEBUG, "metrics: client timed out");
+   metrics_client_close(EV_A, c);
+}
+
+// build the whole reply up front, it's a few KB at most
+static void metrics_client_respond(metrics_client_t *c, int status, const char *reason, const char *body, bool metrics) {
+   FILE *fp = open_memstream(&c->resp, &c->resp_len);
+   char *payload = NULL;
+   size_t payload_len = 0;
+
+   if (fp == NULL) {
+      fprintf(stderr, "+ERROR metrics_client_respond: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   if (metrics) {
+      FILE *bp = open_memstream(&payload, &payload_len);
+
+      if (bp == NULL) {
+         fprintf(stderr, "+ERROR metrics_client_respond: out of memory!\n");
+         exit(ENOMEM);
+      }
+      metrics_dump(bp);
+      fclose(bp);
+      body = payload;
+   } else {
+      payload_len = strlen(body);
+   }
+
+   fprintf(fp, "HTTP/1.0 %d %s\r\n", status, reason);
+   fprintf(fp, "Content-Type: %s\r\n", (metrics ? "text/plain; version=0.0.4; charset=utf-8" : "text/plain"));
+   fprintf(fp, "Content-Length: %zu\r\n", payload_len);
+   fprintf(fp, "Connection: close\r\n\r\n");
+   fwrite(body, 1, payload_len, fp);
+   fclose(fp);
+   free(payload);
+   c->resp_off = 0;
+}
+
+static void metrics_client_cb(EV_P_ ev_io *w, int revents) {
+   metrics_client_t *c = (metrics_client_t *)w;
+
+   if (revents & EV_READ) {
+      ssize_t n = read(w->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+         return;
+      } else if (n <= 0) {
+         metrics_client_close(EV_A, c);
+         return;
+      }
+
+      c->req_len += n;
+      c->req[c->req_len] = '\0';
+
+      // wait for the whole request head
+      if (strstr(c->req, "\r\n\r\n") == NULL && strstr(c->req, "\n\n") == NULL) {
+         if (c->req_len >= sizeof(c->req) - 1) {
+            metrics_client_respond(c, 431, "Request Header Fields Too Large", "request too large\n", false);
+         } else {
+            return;
+         }
+      } else if (strncmp(c->req, "GET ", 4) != 0) {
+         metrics_client_respond(c, 405, "Method Not Allowed", "only GET is supported\n", false);
+      } else if (strncmp(c->req, "GET /metrics ", 13) == 0 || strncmp(c->req, "GET / ", 6) == 0) {
+         metrics_client_respond(c, 200, "OK", NULL, true);
+      } else {
+         metrics_client_respond(c, 404, "Not Found", "try /metrics\n", false);
+      }
+
+      // switch over to writing the reply
+      ev_io_stop(EV_A, w);
+      ev_io_set(w, w->fd, EV_WRITE);
+      ev_io_start(EV_A, w);
+      return;
+   }
+
+   if (revents & EV_WRITE) {
+      ssize_t n = write(w->fd, c->resp + c->resp_off, c->resp_len - c->resp_off);
+
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+         return;
+      } else if (n < 0) {
+         log_send(mainlog, LOG_DEBUG, "metrics: write failed: %s", strerror(errno));
+         metrics_client_close(EV_A, c);
+         return;
+      }
+
+      c->resp_off += n;
+      if (c->resp_off >= c->resp_len) {
+         metrics_client_close(EV_A, c);
+      }
+   }
+}
+
+static void metrics_accept_cb(EV_P_ ev_io *w, int revents) {
+   metrics_client_t *c = NULL;
+   int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+   if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+         log_send(mainlog, LOG_WARNING, "metrics: accept failed: %s", strerror(errno));
+      }
+      return;
+   }
+
+   if (nclients >= METRICS_MAX_CLIENTS) {
+      log_send(mainlog, LOG_WARNING, "metrics: too many clients, dropping connection");
+      close(fd);
+      return;
+   }
+
+   if ((c = malloc(sizeof(metrics_client_t))) == NULL) {
+      fprintf(stderr, "+ERROR metrics_accept_cb: out of memory!\n");
+      exit(ENOMEM);
+   }
+   memset(c, 0, sizeof(metrics_client_t));
+   nclients++;
+
+   ev_io_init(&c->io, metrics_client_cb, fd, EV_READ);
+   ev_io_start(EV_A, &c->io);
+   ev_timer_init(&c->timeout, metrics_timeout_cb, METRICS_TIMEOUT, 0.);
+   c->timeout.data = c;
+   ev_timer_start(EV_A, &c->timeout);
+}
+
+// listen_addr is "host:port", "[v6addr]:port" or just "port" (localhost)
+bool metrics_http_init(struct ev_loop *loop, const char *listen_addr) {
+   struct addrinfo hints, *res = NULL, *ai = NULL;
+   char host[256] = "127.0.0.1";
+   const char *port = listen_addr;
+   const char *colon = NULL;
+   int rc;
+
+   if (listen_addr == NULL || *listen_addr == '\0') {
+      return false;
+   }
+
+   if ((colon = strrchr(listen_addr, ':')) != NULL) {
+      const char *h = listen_addr;
+      size_t hlen = colon - listen_addr;
+
+      // strip the [] from ipv6 addresses
+      if (*h == '[' && hlen >= 2 && h[hlen - 1] == ']') {
+         h++;
+         hlen -= 2;
+      }
+
+      if (hlen >= sizeof(host)) {
+         log_send(mainlog, LOG_CRIT, "metrics: listen address %s is too long", listen_addr);
+         return false;
+      }
+      memcpy(host, h, hlen);
+      host[hlen] = '\0';
+      port = colon + 1;
+   }
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+
+   if ((rc = getaddrinfo((*host != '\0' ? host : NULL), port, &hints, &res)) != 0) {
+      log_send(mainlog, LOG_CRIT, "metrics: can't resolve listen address %s: %s", listen_addr, gai_strerror(rc));
+      return false;
+   }
+
+   for (ai = res; ai != NULL; ai = ai->ai_next) {
+      int on = 1;
+
+      listen_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+      if (listen_fd < 0) {
+         continue;
+      }
+
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+      if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(listen_fd, 16) == 0) {
+         break;
+      }
+      close(listen_fd);
+      listen_fd = -1;
+   }
+   freeaddrinfo(res);
+
+   if (listen_fd < 0) {
+      log_send(mainlog, LOG_CRIT, "metrics: can't listen on %s: %s", listen_addr, strerror(errno));
+      return false;
+   }
+
+   metrics_loop = loop;
+   ev_io_init(&listen_watcher, metrics_accept_cb, listen_fd, EV_READ);
+   ev_io_start(loop, &listen_watcher);
+   log_send(mainlog, LOG_INFO, "metrics: listening on %s", listen_addr);
+   return true;
+}
+
+void metrics_http_fini(void) {
+   if (listen_fd < 0) {
+      return;
+   }
+
+   ev_io_stop(metrics_loop, &listen_watcher);
+   close(listen_fd);
+   listen_fd = -1;
+}
@@ -0,0 +1,133 @@
+/*
+ * Freelists for the objects every request churns through
+ *
+ * A lookup used to malloc() a calldata_t (~2.7KB, then memset), a request and
+ * a handful of output chunks, and free them all a few milliseconds later.
+ * Now each thread keeps a short freelist of each, so once the pools have
+ * grown to the working set a request makes no heap calls at all. The high
+ * water marks in /STATS show how big that working set is.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+#include "pool.h"
+
+#define	CALLDATA_POOL_MAX	8		// per thread, a worker only has one or two at a time
+
+static pool_stats_t calldata_stats = POOL_STATS_INIT("calldata", sizeof(calldata_t));
+static __thread pool_t calldata_pool = POOL_INIT(&calldata_stats, CALLDATA_POOL_MAX);
+
+// every pool's stats, for /STATS and /metrics
+static pool_stats_t *all_pools = &calldata_stats;
+
+// objects on the freelist are just a link to the next one
+typedef struct pool_obj {
+   struct pool_obj	*next;
+} pool_obj_t;
+
+void *pool_get(pool_t *p) {
+   pool_stats_t *st = p->stats;
+   pool_obj_t *obj = p->free_list;
+
+   if (obj != NULL) {
+      p->free_list = obj->next;
+      p->n_free--;
+   } else {
+      if ((obj = malloc(st->obj_size)) == NULL) {
+         fprintf(stderr, "+ERROR pool_get: %s: out of memory!\n", st->name);
+         exit(ENOMEM);
+      }
+      atomic_fetch_add_explicit(&st->heap, 1, memory_order_relaxed);
+   }
+   atomic_fetch_add_explicit(&st->gets, 1, memory_order_relaxed);
+
+   long live = atomic_fetch_add_explicit(&st->live, 1, memory_order_relaxed) + 1;
+   long high = atomic_load_explicit(&st->high_water, memory_order_relaxed);
+   while (live > high && !atomic_compare_exchange_weak_explicit(&st->high_water, &high, live, memory_order_relaxed, memory_order_relaxed)) {
+      ;
+   }
+   return obj;
+}
+
+void pool_put(pool_t *p, void *ptr) {
+   pool_obj_t *obj = ptr;
+
+   if (obj == NULL) {
+      return;
+   }
+   atomic_fetch_sub_explicit(&p->stats->live, 1, memory_order_relaxed);
+
+   if (p->n_free >= p->max_free) {
+      free(obj);
+      return;
+   }
+
+   obj->next = p->free_list;
+   p->free_list = obj;
+   p->n_free++;
+}
+
+// give this thread's spares back to the heap (ex: the thread is exiting)
+void pool_drain(pool_t *p) {
+   pool_obj_t *obj = p->free_list;
+
+   while (obj != NULL) {
+      pool_obj_t *next = obj->next;
+      free(obj);
+      obj = next;
+   }
+   p->free_list = NULL;
+   p->n_free = 0;
+}
+
+// add a pool to the reports, call before starting the workers
+void pool_stats_register(pool_stats_t *st) {
+   st->next = all_pools;
+   all_pools = st;
+}
+
+void pools_dump(outbuf_t *ob) {
+   for (pool_stats_t *st = all_pools; st != NULL; st = st->next) {
+      outbuf_printf(ob, "Pool-%s: live=%ld high=%ld gets=%lu heap=%lu size=%zu\n", st->name,
+            atomic_load_explicit(&st->live, memory_order_relaxed),
+            atomic_load_explicit(&st->high_water, memory_order_relaxed),
+            atomic_load_explicit(&st->gets, memory_order_relaxed),
+            atomic_load_explicit(&st->heap, memory_order_relaxed),
+            st->obj_size);
+   }
+}
+
+void pools_dump_prometheus(FILE *fp) {
+   fprintf(fp, "# HELP callsign_lookup_pool_high_water Most objects of this kind in use at once\n");
+   fprintf(fp, "# TYPE callsign_lookup_pool_high_water gauge\n");
+   for (pool_stats_t *st = all_pools; st != NULL; st = st->next) {
+      fprintf(fp, "callsign_lookup_pool_high_water{pool=\"%s\"} %ld\n", st->name, atomic_load_explicit(&st->high_water, memory_order_relaxed));
+   }
+
+   fprintf(fp, "# HELP callsign_lookup_pool_heap_allocs_total Pool gets that had to call malloc\n");
+   fprintf(fp, "# TYPE callsign_lookup_pool_heap_allocs_total counter\n");
+   for (pool_stats_t *st = all_pools; st != NULL; st = st->next) {
+      fprintf(fp, "callsign_lookup_pool_heap_allocs_total{pool=\"%s\"} %lu\n", st->name, atomic_load_explicit(&st->heap, memory_order_relaxed));
+   }
+}
+
+calldata_t *calldata_alloc(void) {
+   calldata_t *cd = pool_get(&calldata_pool);
+
+   memset(cd, 0, sizeof(calldata_t));
+   return cd;
+}
+
+void calldata_free(calldata_t *cd) {
+   pool_put(&calldata_pool, cd);
+}
+
+void calldata_pool_drain(void) {
+   pool_drain(&calldata_pool);
+}
@@ -0,0 +1,433 @@
+/*
+ * Machine friendly reply formats, negotiated with /PROTO after the +PROTO banner
+ *
+ * The text format is nice for humans, but clients have to pick apart the
+ * "Key: value" lines. Here we serialize a whole record into one buffer, either
+ * as single line JSON (via yajl) or as a binary TLV frame (see proto.h), which
+ * is queued on the client's output buffer in one piece.
+ *
+ * Only the loop thread encodes replies, the JSON generator isn't shared.
+ *
+ * Timestamps are sent as unix time, it's up to the client to make them pretty.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <yajl/yajl_gen.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "callsign-lookup.h"
+#include "qrz-xml.h"
+#include "proto.h"
+#include "cty.h"
+#include "callsign-norm.h"
+#include "lotw.h"
+#include "heard.h"
+#include "call-index.h"
+
+const char *proto_format_name[PROTO_FMT_MAX + 1] = { "TEXT", "JSON", "BINARY", NULL };
+extern time_t now;
+
+// one generator for every reply, so JSON costs no allocations once it's warmed up
+static yajl_gen json_gen = NULL;
+static proto_buf_t *json_out = NULL;		// where json_print_cb() is writing to
+
+// returns the PROTO_FMT_* or -1 if we don't know it
+int proto_parse_format(const char *name) {
+   if (name == NULL) {
+      return -1;
+   }
+
+   for (int i = 0; i < PROTO_FMT_MAX; i++) {
+      if (strcasecmp(name, proto_format_name[i]) == 0) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+void proto_buf_append(proto_buf_t *b, const void *data, size_t len) {
+   if (b->len + len > b->size) {
+      size_t new_size = (b->size > 0 ? b->size : 1024);
+      char *p = NULL;
+
+      while (new_size < b->len + len) {
+         new_size *= 2;
+      }
+
+      if ((p = realloc(b->data, new_size)) == NULL) {
+         fprintf(stderr, "+ERROR proto_buf_append: out of memory!\n");
+         exit(ENOMEM);
+      }
+      b->data = p;
+      b->size = new_size;
+   }
+
+   memcpy(b->data + b->len, data, len);
+   b->len += len;
+}
+
+// empty it, but keep the memory for the next reply
+void proto_buf_reset(proto_buf_t *b) {
+   b->len = 0;
+}
+
+void proto_buf_free(proto_buf_t *b) {
+   free(b->data);
+   b->data = NULL;
+   b->len = b->size = 0;
+}
+
+/////////////
+// Binary //
+/////////////
+static void bin_put_field(proto_buf_t *b, proto_tag_t tag, const void *val, size_t len) {
+   uint8_t hdr[3];
+
+   if (len > UINT16_MAX) {
+      len = UINT16_MAX;
+   }
+
+   hdr[0] = tag;
+   hdr[1] = (len >> 8) & 0xff;
+   hdr[2] = len & 0xff;
+   proto_buf_append(b, hdr, sizeof(hdr));
+   proto_buf_append(b, val, len);
+}
+
+static void bin_put_str(proto_buf_t *b, proto_tag_t tag, const char *s) {
+   if (s == NULL || *s == '\0') {
+      return;
+   }
+   bin_put_field(b, tag, s, strlen(s));
+}
+
+static void bin_put_int(proto_buf_t *b, proto_tag_t tag, int64_t v) {
+   uint8_t be[8];
+   uint64_t u = (uint64_t)v;
+
+   for (int i = 7; i >= 0; i--) {
+      be[i] = u & 0xff;
+      u >>= 8;
+   }
+   bin_put_field(b, tag, be, sizeof(be));
+}
+
+static void bin_put_double(proto_buf_t *b, proto_tag_t tag, double v) {
+   uint64_t u;
+
+   memcpy(&u, &v, sizeof(u));
+   bin_put_int(b, tag, (int64_t)u);
+}
+
+static void bin_put_bool(proto_buf_t *b, proto_tag_t tag, bool v) {
+   uint8_t c = (v ? 1 : 0);
+   bin_put_field(b, tag, &c, 1);
+}
+
+static bool proto_encode_binary(proto_buf_t *b, const callrec_t *cd, const char *query, const char *tag) {
+   size_t start = b->len;
+   uint8_t hdr[PROTO_FRAME_HDR_LEN] = { PROTO_FRAME_MARKER, PROTO_FRAME_NOTFOUND, 0, 0, 0, 0 };
+   double distance = 0, bearing = 0;
+   callsign_parts_t parts;
+
+   // fill in the header once we know the length
+   proto_buf_append(b, hdr, sizeof(hdr));
+   bin_put_str(b, PROTO_TAG_REQUEST_TAG, tag);
+
+   if (cd == NULL) {
+      callidx_result_t fix;
+
+      bin_put_str(b, PROTO_TAG_QUERY, query);
+      bin_put_bool(b, PROTO_TAG_ONLINE, !Config.offline);
+      bin_put_int(b, PROTO_TAG_TIME, now);
+
+      // busted decode? what they probably meant, best first
+      if (callidx_correct(query, &fix)) {
+         for (int i = 0; i < fix.n; i++) {
+            char s[MAX_CALLSIGN + 8];
+
+            snprintf(s, sizeof(s), "%s %d", fix.match[i].callsign, fix.match[i].score);
+            bin_put_str(b, PROTO_TAG_SUGGESTION, s);
+         }
+      }
+   } else {
+      b->data[start + 1] = PROTO_FRAME_CALLDATA;
+      bin_put_str(b, PROTO_TAG_CALLSIGN, callrec_get(cd, CR_CALLSIGN));
+      bin_put_str(b, PROTO_TAG_QUERY, query);
+      bin_put_int(b, PROTO_TAG_ORIGIN, cd->origin);
+      bin_put_bool(b, PROTO_TAG_ONLINE, !Config.offline);
+      bin_put_int(b, PROTO_TAG_TIME, now);
+      bin_put_bool(b, PROTO_TAG_CACHED, cd->cached);
+
+      if (cd->cached) {
+         bin_put_int(b, PROTO_TAG_CACHE_FETCHED, cd->cache_fetched);
+         bin_put_int(b, PROTO_TAG_CACHE_EXPIRY, cd->cache_expiry);
+      }
+
+      bin_put_str(b, PROTO_TAG_FIRST_NAME, callrec_get(cd, CR_FIRST_NAME));
+      bin_put_str(b, PROTO_TAG_LAST_NAME, callrec_get(cd, CR_LAST_NAME));
+      bin_put_str(b, PROTO_TAG_CLASS, calldata_opclass(cd));
+      bin_put_str(b, PROTO_TAG_GRID, callrec_get(cd, CR_GRID));
+
+      if (cd->latitude != 0 && cd->longitude != 0) {
+         bin_put_double(b, PROTO_TAG_LATITUDE, cd->latitude);
+         bin_put_double(b, PROTO_TAG_LONGITUDE, cd->longitude);
+      }
+
+      if (calldata_heading(cd, &distance, &bearing)) {
+         bin_put_double(b, PROTO_TAG_DISTANCE, distance);
+         bin_put_double(b, PROTO_TAG_BEARING, bearing);
+      }
+
+      if (cd->alias_count > 0) {
+         bin_put_str(b, PROTO_TAG_ALIASES, callrec_get(cd, CR_ALIASES));
+      }
+
+      if (cd->dxcc != 0) {
+         bin_put_int(b, PROTO_TAG_DXCC, cd->dxcc);
+      }
+
+      bin_put_str(b, PROTO_TAG_EMAIL, callrec_get(cd, CR_EMAIL));
+      bin_put_str(b, PROTO_TAG_ADDRESS1, callrec_get(cd, CR_ADDRESS1));
+      bin_put_str(b, PROTO_TAG_ADDRESS_ATTN, callrec_get(cd, CR_ADDRESS_ATTN));
+      bin_put_str(b, PROTO_TAG_ADDRESS2, callrec_get(cd, CR_ADDRESS2));
+      bin_put_str(b, PROTO_TAG_STATE, callrec_get_interned(cd, CR_STATE));
+      bin_put_str(b, PROTO_TAG_ZIP, callrec_get(cd, CR_ZIP));
+      bin_put_str(b, PROTO_TAG_COUNTY, callrec_get_interned(cd, CR_COUNTY));
+      bin_put_str(b, PROTO_TAG_FIPS, callrec_get(cd, CR_FIPS));
+
+      if (cd->license_effective > 0) {
+         bin_put_int(b, PROTO_TAG_LICENSE_EFFECTIVE, cd->license_effective);
+      }
+
+      if (cd->license_expiry > 0) {
+         bin_put_int(b, PROTO_TAG_LICENSE_EXPIRY, cd->license_expiry);
+      }
+
+      if (*callrec_get_interned(cd, CR_COUNTRY) != '\0') {
+         bin_put_str(b, PROTO_TAG_COUNTRY, callrec_get_interned(cd, CR_COUNTRY));
+         bin_put_int(b, PROTO_TAG_COUNTRY_CODE, cd->country_code);
+      }
+
+      time_t lotw = lotw_last_upload(callrec_get(cd, CR_CALLSIGN));
+      if (lotw > 0) {
+         bin_put_int(b, PROTO_TAG_LOTW_UPLOAD, lotw);
+      }
+
+      const heard_entry_t *heard = heard_find(callrec_get(cd, CR_CALLSIGN));
+      if (heard != NULL) {
+         bin_put_int(b, PROTO_TAG_HEARD_LAST, heard->last);
+         bin_put_int(b, PROTO_TAG_HEARD_COUNT, heard->total);
+         bin_put_double(b, PROTO_TAG_HEARD_RATE, heard_rate(heard));
+      }
+
+      if (query != NULL && callsign_normalize(query, &parts) && parts.portable) {
+         bin_put_str(b, PROTO_TAG_OP_CALLSIGN, parts.full);
+
+         if (parts.entity != NULL) {
+            bin_put_str(b, PROTO_TAG_OP_ENTITY, parts.entity->entity->name);
+            bin_put_str(b, PROTO_TAG_OP_PREFIX, parts.entity->entity->prefix);
+            bin_put_str(b, PROTO_TAG_OP_CONTINENT, parts.entity->continent);
+            bin_put_int(b, PROTO_TAG_OP_CQ_ZONE, parts.entity->cq_zone);
+            bin_put_int(b, PROTO_TAG_OP_ITU_ZONE, parts.entity->itu_zone);
+         }
+      }
+   }
+
+   uint32_t len = b->len - start - PROTO_FRAME_HDR_LEN;
+   b->data[start + 2] = (len >> 24) & 0xff;
+   b->data[start + 3] = (len >> 16) & 0xff;
+   b->data[start + 4] = (len >> 8) & 0xff;
+   b->data[start + 5] = len & 0xff;
+   return true;
+}
+
+///////////
+// JSON //
+///////////
+static void json_print_cb(void *ctx, const char *str, size_t len) {
+   proto_buf_append(*(proto_buf_t **)ctx, str, len);
+}
+
+static void json_put_key(yajl_gen g, const char *key) {
+   yajl_gen_string(g, (const unsigned char *)key, strlen(key));
+}
+
+static void json_put_str(yajl_gen g, const char *key, const char *val) {
+   if (val == NULL || *val == '\0') {
+      return;
+   }
+   json_put_key(g, key);
+   yajl_gen_string(g, (const unsigned char *)val, strlen(val));
+}
+
+static void json_put_int(yajl_gen g, const char *key, long long val) {
+   json_put_key(g, key);
+   yajl_gen_integer(g, val);
+}
+
+static void json_put_double(yajl_gen g, const char *key, double val) {
+   json_put_key(g, key);
+   yajl_gen_double(g, val);
+}
+
+static void json_put_bool(yajl_gen g, const char *key, bool val) {
+   json_put_key(g, key);
+   yajl_gen_bool(g, val);
+}
+
+static bool proto_encode_json(proto_buf_t *b, const callrec_t *cd, const char *query, const char *tag) {
+   double distance = 0, bearing = 0;
+   callsign_parts_t parts;
+
+   if (json_gen == NULL) {
+      if ((json_gen = yajl_gen_alloc(NULL)) == NULL) {
+         fprintf(stderr, "+ERROR proto_encode_json: out of memory!\n");
+         exit(ENOMEM);
+      }
+
+      // write straight into the caller's buffer, rather than yajl's and then copying
+      yajl_gen_config(json_gen, yajl_gen_print_callback, json_print_cb, &json_out);
+   }
+
+   yajl_gen g = json_gen;
+   json_out = b;
+   yajl_gen_reset(g, NULL);
+   yajl_gen_map_open(g);
+   json_put_str(g, "tag", tag);
+
+   if (cd == NULL) {
+      callidx_result_t fix;
+
+      json_put_int(g, "status", 404);
+      json_put_str(g, "query", query);
+      json_put_bool(g, "online", !Config.offline);
+      json_put_int(g, "time", now);
+
+      // busted decode? what they probably meant, best first
+      if (callidx_correct(query, &fix)) {
+         json_put_key(g, "suggestions");
+         yajl_gen_array_open(g);
+
+         for (int i = 0; i < fix.n; i++) {
+            yajl_gen_map_open(g);
+            json_put_str(g, "callsign", fix.match[i].callsign);
+            json_put_int(g, "score", fix.match[i].score);
+            yajl_gen_map_close(g);
+         }
+         yajl_gen_array_close(g);
+      }
+   } else {
+      json_put_int(g, "status", 200);
+      json_put_str(g, "callsign", callrec_get(cd, CR_CALLSIGN));
+      json_put_str(g, "query", query);
+      json_put_str(g, "origin", origin_name[cd->origin]);
+      json_put_bool(g, "online", !Config.offline);
+      json_put_int(g, "time", now);
+      json_put_bool(g, "cached", cd->cached);
+
+      if (cd->cached) {
+         json_put_int(g, "cache_fetched", cd->cache_fetched);
+         json_put_int(g, "cache_expiry", cd->cache_expiry);
+      }
+
+      json_put_str(g, "first_name", callrec_get(cd, CR_FIRST_NAME));
+      json_put_str(g, "last_name", callrec_get(cd, CR_LAST_NAME));
+      json_put_str(g, "class", calldata_opclass(cd));
+      json_put_str(g, "grid", callrec_get(cd, CR_GRID));
+
+      if (cd->latitude != 0 && cd->longitude != 0) {
+         json_put_double(g, "latitude", cd->latitude);
+         json_put_double(g, "longitude", cd->longitude);
+      }
+
+      if (calldata_heading(cd, &distance, &bearing)) {
+         json_put_double(g, "distance_km", distance);
+         json_put_double(g, "bearing", bearing);
+      }
+
+      if (cd->alias_count > 0) {
+         json_put_str(g, "aliases", callrec_get(cd, CR_ALIASES));
+      }
+
+      if (cd->dxcc != 0) {
+         json_put_int(g, "dxcc", cd->dxcc);
+      }
+
+      json_put_str(g, "email", callrec_get(cd, CR_EMAIL));
+      json_put_str(g, "address1", callrec_get(cd, CR_ADDRESS1));
+      json_put_str(g, "address_attn", callrec_get(cd, CR_ADDRESS_ATTN));
+      json_put_str(g, "address2", callrec_get(cd, CR_ADDRESS2));
+      json_put_str(g, "state", callrec_get_interned(cd, CR_STATE));
+      json_put_str(g, "zip", callrec_get(cd, CR_ZIP));
+      json_put_str(g, "county", callrec_get_interned(cd, CR_COUNTY));
+      json_put_str(g, "fips", callrec_get(cd, CR_FIPS));
+
+      if (cd->license_effective > 0) {
+         json_put_int(g, "license_effective", cd->license_effective);
+      }
+
+      if (cd->license_expiry > 0) {
+         json_put_int(g, "license_expiry", cd->license_expiry);
+      }
+
+      if (*callrec_get_interned(cd, CR_COUNTRY) != '\0') {
+         json_put_str(g, "country", callrec_get_interned(cd, CR_COUNTRY));
+         json_put_int(g, "country_code", cd->country_code);
+      }
+
+      time_t lotw = lotw_last_upload(callrec_get(cd, CR_CALLSIGN));
+      if (lotw > 0) {
+         json_put_int(g, "lotw_upload", lotw);
+      }
+
+      const heard_entry_t *heard = heard_find(callrec_get(cd, CR_CALLSIGN));
+      if (heard != NULL) {
+         json_put_int(g, "heard_last", heard->last);
+         json_put_int(g, "heard_count", heard->total);
+         json_put_double(g, "heard_rate", heard_rate(heard));
+      }
+
+      if (query != NULL && callsign_normalize(query, &parts) && parts.portable) {
+         json_put_str(g, "op_callsign", parts.full);
+
+         if (parts.entity != NULL) {
+            json_put_str(g, "op_entity", parts.entity->entity->name);
+            json_put_str(g, "op_prefix", parts.entity->entity->prefix);
+            json_put_str(g, "op_continent", parts.entity->continent);
+            json_put_int(g, "op_cq_zone", parts.entity->cq_zone);
+            json_put_int(g, "op_itu_zone", parts.entity->itu_zone);
+         }
+      }
+   }
+
+   yajl_gen_map_close(g);
+   json_out = NULL;
+   proto_buf_append(b, "\n", 1);
+   return true;
+}
+
+void proto_fini(void) {
+   if (json_gen != NULL) {
+      yajl_gen_free(json_gen);
+      json_gen = NULL;
+   }
+}
+
+// Serialize a reply (cd == NULL for not found) onto the end of b
+bool proto_encode_calldata(proto_buf_t *b, proto_format_t fmt, const callrec_t *cd, const char *query, const char *tag) {
+   switch (fmt) {
+      case PROTO_FMT_JSON:
+         return proto_encode_json(b, cd, query, tag);
+      case PROTO_FMT_BINARY:
+         return proto_encode_binary(b, cd, query, tag);
+      default:
+         log_send(mainlog, LOG_CRIT, "proto_encode_calldata: format %d can't be encoded", fmt);
+         return false;
+   }
+}
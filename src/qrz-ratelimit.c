@@ -0,0 +1,300 @@
+/*
+ * Token bucket rate limiter and priority scheduler for QRZ XML API requests.
+ *
+ * QRZ counts every lookup against a daily quota and will throttle us if we
+ * hammer it, so every request must pass through here before it goes out.
+ *
+ * Interactive requests (/CALL) may spend the whole budget, batch lookups stop
+ * when QRZ_RESERVE_BATCH percent remains and prefetch/refresh stops at
+ * QRZ_RESERVE_PREFETCH percent, so clients always have something left.
+ *
+ * Requests that can't get a token right now can be queued and are drained by
+ * qrz_sched_run(), called from the periodic timer, highest priority first.
+ *
+ * Lookups run on the worker threads, so everything here is under rl_lock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libied/cfg.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "qrz-ratelimit.h"
+#include "client.h"
+
+#define	QRZ_SCHED_QUEUE_LEN	256		// deferred requests per priority
+#define	QRZ_RESERVE_BATCH	10		// % of daily budget held back from batch
+#define	QRZ_RESERVE_PREFETCH	25		// % of daily budget held back from prefetch
+
+typedef struct qrz_sched_queue {
+   char		callsign[QRZ_SCHED_QUEUE_LEN][MAX_CALLSIGN];
+   int		head, tail, depth;
+} qrz_sched_queue_t;
+
+typedef struct qrz_ratelimit {
+   double	rate;			// tokens added per second
+   double	burst;			// maximum tokens in the bucket
+   double	tokens;			// tokens currently available
+   double	last_refill;		// monotonic time of last refill
+   int		daily_budget;		// max lookups per day (0 = unlimited)
+   int		used_today;		// lookups spent today (synced with QRZ <Count>)
+   time_t	day;			// which UTC day used_today refers to
+   qrz_sched_queue_t queue[QRZ_PRIO_MAX];
+} qrz_ratelimit_t;
+
+const char *qrz_prio_name[QRZ_PRIO_MAX + 1] = { "interactive", "batch", "prefetch", NULL };
+static qrz_ratelimit_t rl = {
+   .rate = 1.0,
+   .burst = 5.0,
+   .tokens = 5.0
+};
+static pthread_mutex_t rl_lock = PTHREAD_MUTEX_INITIALIZER;
+extern time_t now;
+
+static double mono_now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+void qrz_ratelimit_init(void) {
+   const char *s = cfg_get_str(cfg, "callsign-lookup/qrz-rate-limit");
+
+   if (s != NULL && atof(s) > 0) {
+      rl.rate = atof(s);
+   }
+
+   s = cfg_get_str(cfg, "callsign-lookup/qrz-rate-burst");
+   if (s != NULL && atof(s) >= 1) {
+      rl.burst = atof(s);
+   }
+
+   rl.daily_budget = cfg_get_int(cfg, "callsign-lookup/qrz-daily-budget");
+   if (rl.daily_budget < 0) {
+      rl.daily_budget = 0;
+   }
+
+   rl.tokens = rl.burst;
+   rl.last_refill = mono_now();
+   rl.day = now / 86400;
+   log_send(mainlog, LOG_DEBUG, "qrz rate limit: %.2f req/sec, burst %.0f, daily budget %d", rl.rate, rl.burst, rl.daily_budget);
+}
+
+// must hold rl_lock
+static void qrz_ratelimit_refill(void) {
+   double t = mono_now();
+
+   rl.tokens += (t - rl.last_refill) * rl.rate;
+   if (rl.tokens > rl.burst) {
+      rl.tokens = rl.burst;
+   }
+   rl.last_refill = t;
+
+   // new UTC day, so the quota starts over
+   if ((now / 86400) != rl.day) {
+      rl.day = now / 86400;
+      rl.used_today = 0;
+   }
+}
+
+// must hold rl_lock
+static int qrz_budget_remaining_locked(void) {
+   if (rl.daily_budget <= 0) {
+      return -1;
+   }
+
+   if (rl.used_today >= rl.daily_budget) {
+      return 0;
+   }
+   return rl.daily_budget - rl.used_today;
+}
+
+int qrz_budget_remaining(void) {
+   int remaining;
+
+   pthread_mutex_lock(&rl_lock);
+   remaining = qrz_budget_remaining_locked();
+   pthread_mutex_unlock(&rl_lock);
+   return remaining;
+}
+
+// is there enough of today's budget left for this priority class? (must hold rl_lock)
+static bool qrz_budget_allows(qrz_prio_t prio) {
+   int remaining = qrz_budget_remaining_locked();
+   int reserve = 0;
+
+   if (remaining < 0) {
+      return true;
+   }
+
+   if (prio == QRZ_PRIO_BATCH) {
+      reserve = (rl.daily_budget * QRZ_RESERVE_BATCH) / 100;
+   } else if (prio == QRZ_PRIO_PREFETCH) {
+      reserve = (rl.daily_budget * QRZ_RESERVE_PREFETCH) / 100;
+   }
+   return (remaining > reserve);
+}
+
+// Try to take a token for an immediate request, returns false if we must wait
+bool qrz_sched_try(qrz_prio_t prio) {
+   if (prio < 0 || prio >= QRZ_PRIO_MAX) {
+      return false;
+   }
+
+   pthread_mutex_lock(&rl_lock);
+   qrz_ratelimit_refill();
+
+   if (!qrz_budget_allows(prio)) {
+      pthread_mutex_unlock(&rl_lock);
+      return false;
+   }
+
+   // don't let a lower priority request jump ahead of queued higher priority ones
+   for (int i = 0; i < prio; i++) {
+      if (rl.queue[i].depth > 0) {
+         pthread_mutex_unlock(&rl_lock);
+         return false;
+      }
+   }
+
+   if (rl.tokens < 1.0) {
+      pthread_mutex_unlock(&rl_lock);
+      return false;
+   }
+
+   rl.tokens -= 1.0;
+   rl.used_today++;
+   pthread_mutex_unlock(&rl_lock);
+   return true;
+}
+
+bool qrz_sched_enqueue(const char *callsign, qrz_prio_t prio) {
+   if (callsign == NULL || prio < 0 || prio >= QRZ_PRIO_MAX) {
+      return false;
+   }
+
+   pthread_mutex_lock(&rl_lock);
+   qrz_sched_queue_t *q = &rl.queue[prio];
+
+   // already waiting? don't spend quota on it twice
+   for (int i = 0, idx = q->head; i < q->depth; i++, idx = (idx + 1) % QRZ_SCHED_QUEUE_LEN) {
+      if (strcasecmp(q->callsign[idx], callsign) == 0) {
+         pthread_mutex_unlock(&rl_lock);
+         return true;
+      }
+   }
+
+   if (q->depth >= QRZ_SCHED_QUEUE_LEN) {
+      pthread_mutex_unlock(&rl_lock);
+      log_send(mainlog, LOG_WARNING, "qrz scheduler: %s queue full, dropping request for %s", qrz_prio_name[prio], callsign);
+      return false;
+   }
+
+   snprintf(q->callsign[q->tail], MAX_CALLSIGN, "%s", callsign);
+   q->tail = (q->tail + 1) % QRZ_SCHED_QUEUE_LEN;
+   q->depth++;
+   pthread_mutex_unlock(&rl_lock);
+   return true;
+}
+
+// Run as many queued requests as the bucket allows, returns how many were sent
+int qrz_sched_run(qrz_sched_cb_t cb) {
+   int sent = 0;
+
+   if (cb == NULL) {
+      return 0;
+   }
+
+   pthread_mutex_lock(&rl_lock);
+   qrz_ratelimit_refill();
+
+   for (int prio = 0; prio < QRZ_PRIO_MAX; prio++) {
+      qrz_sched_queue_t *q = &rl.queue[prio];
+
+      while (q->depth > 0) {
+         if (rl.tokens < 1.0 || !qrz_budget_allows(prio)) {
+            // lower priorities must wait for this one to drain
+            pthread_mutex_unlock(&rl_lock);
+            return sent;
+         }
+
+         char callsign[MAX_CALLSIGN];
+         memcpy(callsign, q->callsign[q->head], MAX_CALLSIGN);
+         q->head = (q->head + 1) % QRZ_SCHED_QUEUE_LEN;
+         q->depth--;
+
+         rl.tokens -= 1.0;
+         rl.used_today++;
+         sent++;
+
+         // the callback may well want to queue more, so don't hold the lock
+         pthread_mutex_unlock(&rl_lock);
+         cb(callsign, prio);
+         pthread_mutex_lock(&rl_lock);
+      }
+   }
+   pthread_mutex_unlock(&rl_lock);
+   return sent;
+}
+
+// QRZ tells us how many lookups we've used today, trust it over our own count
+void qrz_ratelimit_sync_count(int count) {
+   pthread_mutex_lock(&rl_lock);
+   if (count > rl.used_today) {
+      rl.used_today = count;
+   }
+   pthread_mutex_unlock(&rl_lock);
+}
+
+int qrz_sched_queue_depth(qrz_prio_t prio) {
+   if (prio < 0 || prio >= QRZ_PRIO_MAX) {
+      return -1;
+   }
+   pthread_mutex_lock(&rl_lock);
+   int depth = rl.queue[prio].depth;
+   pthread_mutex_unlock(&rl_lock);
+   return depth;
+}
+
+void qrz_ratelimit_dump(outbuf_t *ob) {
+   pthread_mutex_lock(&rl_lock);
+   qrz_ratelimit_refill();
+
+   outbuf_printf(ob, "Rate: %.2f/sec (burst %.0f), tokens: %.2f\n", rl.rate, rl.burst, rl.tokens);
+
+   if (rl.daily_budget > 0) {
+      outbuf_printf(ob, "Budget: %d of %d used today, %d remaining\n", rl.used_today, rl.daily_budget, qrz_budget_remaining_locked());
+   } else {
+      outbuf_printf(ob, "Budget: %d used today, unlimited\n", rl.used_today);
+   }
+
+   for (int i = 0; i < QRZ_PRIO_MAX; i++) {
+      outbuf_printf(ob, "Queue-%s: %d\n", qrz_prio_name[i], rl.queue[i].depth);
+   }
+   pthread_mutex_unlock(&rl_lock);
+}
+
+void qrz_ratelimit_dump_prometheus(FILE *fp) {
+   pthread_mutex_lock(&rl_lock);
+   qrz_ratelimit_refill();
+
+   fprintf(fp, "# HELP callsign_lookup_qrz_used_today QRZ lookups spent today (synced with the QRZ Count)\n");
+   fprintf(fp, "# TYPE callsign_lookup_qrz_used_today gauge\n");
+   fprintf(fp, "callsign_lookup_qrz_used_today %d\n", rl.used_today);
+   fprintf(fp, "# HELP callsign_lookup_qrz_daily_budget QRZ lookups allowed per day (0 = unlimited)\n");
+   fprintf(fp, "# TYPE callsign_lookup_qrz_daily_budget gauge\n");
+   fprintf(fp, "callsign_lookup_qrz_daily_budget %d\n", rl.daily_budget);
+   fprintf(fp, "# HELP callsign_lookup_qrz_tokens Rate limiter tokens available\n");
+   fprintf(fp, "# TYPE callsign_lookup_qrz_tokens gauge\n");
+   fprintf(fp, "callsign_lookup_qrz_tokens %.2f\n", rl.tokens);
+   fprintf(fp, "# HELP callsign_lookup_qrz_queue_depth QRZ requests waiting on the rate limiter\n");
+   fprintf(fp, "# TYPE callsign_lookup_qrz_queue_depth gauge\n");
+
+   for (int i = 0; i < QRZ_PRIO_MAX; i++) {
+      fprintf(fp, "callsign_lookup_qrz_queue_depth{prio=\"%s\"} %d\n", qrz_prio_name[i], rl.queue[i].depth);
+   }
+   pthread_mutex_unlock(&rl_lock);
+}
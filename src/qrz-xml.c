@@ -9,16 +9,30 @@
  * Reference: https://www.qrz.com/XML/current_spec.html
  * Current Version: 1.34
  */
-#define	_XOPEN_SOURCE
+#define	_GNU_SOURCE
 #include <libied/cfg.h>
 #include <libied/debuglog.h>
 #include <libied/sql.h>
+#include <libied/util.h>
 #include <curl/curl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/param.h>
 #include <string.h>
 #include <time.h>
 #include "ft8goblin_types.h"
 #include "qrz-xml.h"
+#include "qrz-ratelimit.h"
+#include "backend.h"
+#include "session.h"
+#include "stats.h"
+#include "client.h"
+#include "pool.h"
+
+#define	HTTP_CONNECT_TIMEOUT_MS		5000		// cfg:callsign-lookup/http-connect-timeout
+#define	HTTP_TIMEOUT_MS			15000		// cfg:callsign-lookup/http-timeout
+#define	QRZ_HEDGE_MIN_SAMPLES		20		// QRZ round trips to see before we trust the p95
+#define	QRZ_HEDGE_MIN_US		100000		// never hedge sooner than this
 
 extern struct Config Config;	// in callsign-lookup.c
 extern char *progname;
@@ -27,9 +41,13 @@ static qrz_session_t *qrz_session = NULL;
 static bool already_logged_in = false;
 bool qrz_active = true;
 extern time_t now;
-// XXX: Add some code to support retrying login a few times, if error other than invalid credentials occurs
-static int qrz_login_tries = 0, qrz_max_login_tries = 3;
+static online_session_t qrz_sm;		// login state machine
+static pthread_mutex_t qrz_lock = PTHREAD_MUTEX_INITIALIZER;	// protects qrz_session, lookups run on worker threads
 static time_t qrz_last_login_try = -1;
+static pthread_once_t http_once = PTHREAD_ONCE_INIT;
+static long http_connect_timeout_ms = HTTP_CONNECT_TIMEOUT_MS, http_timeout_ms = HTTP_TIMEOUT_MS;
+static bool qrz_hedge = false;		// cfg:callsign-lookup/qrz-hedge
+static atomic_ulong qrz_hedges_sent = 0, qrz_hedges_won = 0;
 
 static void qrz_init_string(qrz_string_t *s) {
   s->len = 0;
@@ -144,11 +162,35 @@ bool qrz_parse_http_data(const char *buf, calldata_t *calldata) {
             log_send(mainlog, LOG_CRIT, "qrz_xml_api: Got invalid response from atoi: %d: %s", errno, strerror(errno));
          } else {
             q->count = n;
+            qrz_ratelimit_sync_count(n);
 //            log_send(mainlog, LOG_DEBUG, "qrz_xml_api: Got Count: %d", q->count);
          }
       }
    }	// count != NULL
 
+   // keep the last <Error> around so the caller can tell a bad session key from a miss
+   if (q->last_error != NULL) {
+      free(q->last_error);
+      q->last_error = NULL;
+   }
+
+   char *errp = strstr(buf, "<Error>");
+   if (errp != NULL) {
+      errp += 7;
+      char *err_end = strstr(errp, "</Error>");
+
+      if (err_end != NULL && err_end > errp) {
+         size_t err_len = (err_end - errp);
+
+         if ((q->last_error = malloc(err_len + 1)) == NULL) {
+            fprintf(stderr, "qrz_parse_http_data: out of memory!\n");
+            exit(ENOMEM);
+         }
+         memcpy(q->last_error, errp, err_len);
+         q->last_error[err_len] = '\0';
+      }
+   }
+
    // is the session started?
    if (q->sub_expiration > 0 && q->key[0] != '\0' && q->count >= -1) {
       char datebuf[128];
@@ -433,41 +475,77 @@ static size_t qrz_http_post_cb(void *ptr, size_t size, size_t nmemb, qrz_string_
    return size * nmemb;
 }
 
-// We should probably move to the curl_multi_* api to avoid blocking, or maybe spawn this whole mess into a thread
-bool http_post(const char *url, const char *postdata, char *buf, size_t bufsz) {
-   CURL *curl;
-   CURLcode res;
-   qrz_string_t s;
+// read the HTTP settings and set up curl, once, before any worker uses it
+static void http_init_once(void) {
+   // this isn't thread safe, so do it once, before any worker can use curl
+   curl_global_init(CURL_GLOBAL_ALL);
 
-   if (buf == NULL || url == NULL) {
-      log_send(mainlog, LOG_DEBUG, "qrz: http_post called with out <%p>> || url <%p> NULL, this is incorrect!", buf, url);
-      return false;
+   if ((http_connect_timeout_ms = cfg_get_int(cfg, "callsign-lookup/http-connect-timeout")) <= 0) {
+      http_connect_timeout_ms = HTTP_CONNECT_TIMEOUT_MS;
    }
 
-   curl_global_init(CURL_GLOBAL_ALL);
+   if ((http_timeout_ms = cfg_get_int(cfg, "callsign-lookup/http-timeout")) <= 0) {
+      http_timeout_ms = HTTP_TIMEOUT_MS;
+   }
+   qrz_hedge = str2bool(cfg_get_str(cfg, "callsign-lookup/qrz-hedge"), false);
+
+   log_send(mainlog, LOG_INFO, "http: connect timeout %ld ms, total timeout %ld ms, QRZ hedging %s",
+         http_connect_timeout_ms, http_timeout_ms, (qrz_hedge ? "on" : "off"));
+}
+
+void http_init(void) {
+   pthread_once(&http_once, http_init_once);
+}
+
+// a curl handle for url, with our timeouts, writing into *s
+static CURL *http_easy_new(const char *url, const char *postdata, qrz_string_t *s) {
+   CURL *curl;
+   char useragent[128];
 
    // create a curl instance
    if (!(curl = curl_easy_init())) {
       log_send(mainlog, LOG_WARNING, "qrz: http_post failed on curl_easy_init()");
-      return false;
+      return NULL;
    }
 
-   qrz_init_string(&s);
+   qrz_init_string(s);
    curl_easy_setopt(curl, CURLOPT_URL, url);
    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, qrz_http_post_cb);
-   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &s);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
 
-   char useragent[128];
    memset(useragent, 0, 128);
    snprintf(useragent, 128, "%s/%s", progname, VERSION);
   
    curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
 
+   // a stuck connection mustn't hold a worker forever (NOSIGNAL: we're threaded, no SIGALRM for DNS timeouts)
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, http_connect_timeout_ms);
+   curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, http_timeout_ms);
+
    // if we have POST data, attach it...
    if (postdata != NULL) {
       curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
    }
+   return curl;
+}
+
+bool http_post(const char *url, const char *postdata, char *buf, size_t bufsz) {
+   CURL *curl;
+   CURLcode res;
+   qrz_string_t s;
+
+   if (buf == NULL || url == NULL) {
+      log_send(mainlog, LOG_DEBUG, "qrz: http_post called with out <%p>> || url <%p> NULL, this is incorrect!", buf, url);
+      return false;
+   }
+
+   http_init();
+
+   if ((curl = http_easy_new(url, postdata, &s)) == NULL) {
+      return false;
+   }
 
 //   log_send(mainlog, LOG_DEBUG, "qrz:http_post: Fetching %s", url);
 
@@ -476,15 +554,13 @@ bool http_post(const char *url, const char *postdata, char *buf, size_t bufsz) {
 
    if (res != CURLE_OK) {
       log_send(mainlog, LOG_CRIT, "qrz: http_post: curl_easy_perform() failed: %s", curl_easy_strerror(res));
-      fprintf(stdout, "+ERROR Error accessing QRZ: %s\n", curl_easy_strerror(res));
-      Config.offline = true;
+      // (we're on a worker thread, so clients hear about this from the session state change)
       // cleanup
       // free the string since the result was a failure
       free(s.ptr);
       s.ptr = NULL;
       s.len = -1;
       curl_easy_cleanup(curl);
-      curl_global_cleanup();
 
       return false;
    } else if (s.len > 0) {
@@ -496,18 +572,191 @@ bool http_post(const char *url, const char *postdata, char *buf, size_t bufsz) {
    s.ptr = NULL;
    s.len = -1;
    curl_easy_cleanup(curl);
-   curl_global_cleanup();
 
    return true;
 }
 
-bool qrz_start_session(void) {
+// GET url, and if there's no answer after hedge_us, send it again on another
+// connection (if may_hedge() says we can afford it) and take whichever answers
+// first. *elapsed_us is how long the caller waited, from the first request going out.
+static bool http_get_hedged(const char *url, char *buf, size_t bufsz, uint64_t hedge_us, bool (*may_hedge)(void), uint64_t *elapsed_us) {
+   CURLM *multi;
+   CURL *curl[2] = { NULL, NULL };
+   qrz_string_t s[2];
+   uint64_t started = 0;
+   bool failed[2] = { false, false };
+   int n = 0, winner = -1;
+   bool hedge_tried = false;
+
+   http_init();
+
+   if ((multi = curl_multi_init()) == NULL) {
+      return false;
+   }
+
+   if ((curl[0] = http_easy_new(url, NULL, &s[0])) == NULL) {
+      curl_multi_cleanup(multi);
+      return false;
+   }
+   curl_multi_add_handle(multi, curl[0]);
+   started = stats_now();
+   n = 1;
+
+   while (winner < 0) {
+      CURLMsg *msg;
+      int running = 0, left = 0;
+
+      curl_multi_perform(multi, &running);
+
+      while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+         if (msg->msg != CURLMSG_DONE) {
+            continue;
+         }
+
+         for (int i = 0; i < n; i++) {
+            if (msg->easy_handle != curl[i]) {
+               continue;
+            }
+
+            if (msg->data.result == CURLE_OK) {
+               if (winner < 0) {
+                  winner = i;
+               }
+            } else {
+               log_send(mainlog, LOG_CRIT, "qrz: http_get_hedged: request %d failed: %s", i, curl_easy_strerror(msg->data.result));
+               failed[i] = true;
+            }
+         }
+      }
+
+      if (winner >= 0) {
+         break;
+      }
+
+      // the first one failed before we hedged, that's a plain failure
+      if (failed[0] && (n == 1 || failed[1])) {
+         break;
+      }
+
+      uint64_t waited_us = (stats_now() - started) / 1000;
+      int wait_ms = 100;
+
+      if (!hedge_tried) {
+         if (waited_us >= hedge_us) {
+            hedge_tried = true;
+
+            if (may_hedge() && (curl[1] = http_easy_new(url, NULL, &s[1])) != NULL) {
+               curl_multi_add_handle(multi, curl[1]);
+               n = 2;
+               atomic_fetch_add_explicit(&qrz_hedges_sent, 1, memory_order_relaxed);
+               log_send(mainlog, LOG_DEBUG, "qrz: no answer after %lu ms, hedging %s", (unsigned long)(waited_us / 1000), url);
+               continue;
+            }
+         } else {
+            wait_ms = (int)((hedge_us - waited_us + 999) / 1000);
+         }
+      }
+      curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+   }
+
+   if (winner >= 0) {
+      // not from when the winner went out: a hedge that wins was sent late, timing it from then would
+      // pull the p95 (and with it the hedge trigger) down every time one won
+      *elapsed_us = (stats_now() - started) / 1000;
+
+      if (s[winner].len > 0) {
+         snprintf(buf, bufsz, "%s", s[winner].ptr);
+      }
+
+      if (winner == 1) {
+         atomic_fetch_add_explicit(&qrz_hedges_won, 1, memory_order_relaxed);
+      }
+   }
+
+   // the loser (if any) is cancelled here
+   for (int i = 0; i < n; i++) {
+      curl_multi_remove_handle(multi, curl[i]);
+      curl_easy_cleanup(curl[i]);
+      free(s[i].ptr);
+   }
+   curl_multi_cleanup(multi);
+   return (winner >= 0);
+}
+
+// hedges are extra requests, they come out of the rate limit and daily budget like any other (at the lowest priority)
+static bool qrz_may_hedge(void) {
+   return qrz_sched_try(QRZ_PRIO_PREFETCH);
+}
+
+// did QRZ tell us our session key is no good? (must hold qrz_lock)
+static bool qrz_session_key_expired(void) {
+   if (qrz_session == NULL || qrz_session->last_error == NULL) {
+      return false;
+   }
+
+   if (strcasestr(qrz_session->last_error, "Session Timeout") != NULL ||
+       strcasestr(qrz_session->last_error, "Invalid session key") != NULL) {
+      return true;
+   }
+   return false;
+}
+
+// called by the session state machine to (re)login
+static session_login_res_t qrz_login(online_session_t *s) {
    char buf[4097];
    char outbuf[4097];
 
    memset(buf, 0, 4097);
    memset(outbuf, 0, 4097);
 
+   log_send(mainlog, LOG_DEBUG, "Trying to log into QRZ XML API...");
+
+   snprintf(buf, sizeof(buf), "%s?username=%s;password=%s;agent=%s-%s", qrz_api_url, qrz_user, qrz_pass, progname, VERSION);
+   qrz_last_login_try = time(NULL);
+   Config.online_last_retry = qrz_last_login_try;
+
+   // send the request, once it completes, we should have all the data
+   if (http_post(buf, NULL, outbuf, sizeof(outbuf)) == false) {
+      return SESSION_LOGIN_FAILED;
+   }
+
+//   log_send(mainlog, LOG_DEBUG, "sending %lu bytes to parser <%s>", strlen(outbuf), outbuf);
+   calldata_t calldata;
+   session_login_res_t res = SESSION_LOGIN_FAILED;
+   memset(&calldata, 0, sizeof(calldata_t));
+
+   pthread_mutex_lock(&qrz_lock);
+   qrz_parse_http_data(outbuf, &calldata);
+
+   if (qrz_session != NULL && qrz_session->key[0] != '\0' && qrz_session->last_error == NULL) {
+      res = SESSION_LOGIN_OK;
+   } else if (qrz_session != NULL && qrz_session->last_error != NULL) {
+      log_send(mainlog, LOG_CRIT, "QRZ login failed: %s", qrz_session->last_error);
+
+      // a bad username/password won't fix itself in a few seconds...
+      if (strcasestr(qrz_session->last_error, "incorrect") != NULL ||
+          strcasestr(qrz_session->last_error, "password") != NULL ||
+          strcasestr(qrz_session->last_error, "subscription") != NULL) {
+         res = SESSION_LOGIN_DENIED;
+      }
+   }
+   pthread_mutex_unlock(&qrz_lock);
+   return res;
+}
+
+// keep the global online flag in sync with the session
+static void qrz_session_changed(online_session_t *s, session_state_t old_state) {
+   backends_online_changed();
+
+   // forget the old key if we've lost the session
+   pthread_mutex_lock(&qrz_lock);
+   if (s->reported_state == SESSION_OFFLINE && qrz_session != NULL) {
+      memset(qrz_session->key, 0, sizeof(qrz_session->key));
+   }
+   pthread_mutex_unlock(&qrz_lock);
+}
+
+bool qrz_start_session(struct ev_loop *loop) {
    qrz_user = cfg_get_str(cfg, "callsign-lookup/qrz-username");
    qrz_pass = cfg_get_str(cfg, "callsign-lookup/qrz-password");
    qrz_api_url = cfg_get_str(cfg, "callsign-lookup/qrz-api-url");
@@ -515,72 +764,173 @@ bool qrz_start_session(void) {
    // if any settings are missing cry and return error
    if (qrz_user == NULL || qrz_pass == NULL || qrz_api_url == NULL) {
       log_send(mainlog, LOG_CRIT, "please make sure callsign-lookup/qrz-username qrz-password and qrz-api-key are all set in config.json and try again!");
-      return NULL;
+      return false;
    }
 
-   log_send(mainlog, LOG_DEBUG, "Trying to log into QRZ XML API...");
+   http_init();
 
-   snprintf(buf, sizeof(buf), "%s?username=%s;password=%s;agent=%s-%s", qrz_api_url, qrz_user, qrz_pass, progname, VERSION);
-   qrz_last_login_try = time(NULL);
+   memset(&qrz_sm, 0, sizeof(qrz_sm));
+   qrz_sm.max_tries = cfg_get_int(cfg, "callsign-lookup/qrz-max-login-tries");
+   qrz_sm.backoff_max = Config.online_mode_retry;
+   session_init(&qrz_sm, "QRZ", loop, qrz_login);
+   qrz_sm.on_change = qrz_session_changed;
 
-   // send the request, once it completes, we should have all the data
-   if (http_post(buf, NULL, outbuf, sizeof(outbuf)) != false) {
-//      log_send(mainlog, LOG_DEBUG, "sending %lu bytes to parser <%s>", strlen(outbuf), outbuf);
-      calldata_t calldata;
-      qrz_parse_http_data(outbuf, &calldata);
-
-      // reset the failure counter...
-      qrz_login_tries = 0;
-      Config.offline = false;
-      return true;
-   } else {
-      Config.offline = true;
+   // the first login happens from the event loop, so we don't hold up startup
+   session_start(&qrz_sm);
+   return true;
+}
 
-      // log a failed attempt
-      qrz_login_tries++;
+bool qrz_usable(void) {
+   if (qrz_sm.loop == NULL) {
+      return false;
+   }
+   return session_usable(&qrz_sm);
+}
 
-      // XXX: We should check <Error> to see if it's a credentials problem...
+bool qrz_login_pending(void) {
+   if (qrz_sm.loop == NULL) {
+      return false;
    }
-   return false;
+   return session_login_pending(&qrz_sm);
 }
 
-calldata_t *qrz_lookup_callsign(const char *callsign) {
-   char buf[32769], outbuf[32769];
-   calldata_t *calldata = malloc(sizeof(calldata_t));
+void qrz_set_online(bool online) {
+   if (qrz_sm.loop == NULL) {
+      return;
+   }
 
-   if (calldata == NULL) {
-      fprintf(stderr, "qrz_lookup_callsign: out of memory!\n");
-      exit(ENOMEM);
+   if (online) {
+      session_retry_now(&qrz_sm);
+   } else {
+      session_force_offline(&qrz_sm);
+   }
+}
+
+void qrz_session_dump(outbuf_t *ob) {
+   outbuf_printf(ob, "Session: %s", session_state_name[qrz_sm.state]);
+
+   if (qrz_sm.loop != NULL && session_retry_in(&qrz_sm) >= 0) {
+      outbuf_printf(ob, " (retry in %.0f sec)", session_retry_in(&qrz_sm));
    }
+   outbuf_printf(ob, "\n");
+
+   pthread_mutex_lock(&qrz_lock);
+   if (qrz_session != NULL && qrz_session->count >= 0) {
+      outbuf_printf(ob, "Count: %d\n", qrz_session->count);
+   }
+   pthread_mutex_unlock(&qrz_lock);
+
+   if (qrz_hedge) {
+      outbuf_printf(ob, "Hedges: %lu sent, %lu answered first, after %lu ms (p95)\n",
+            atomic_load(&qrz_hedges_sent), atomic_load(&qrz_hedges_won),
+            (unsigned long)(stats_percentile(STAT_QRZ_HTTP, 95) / 1000));
+   }
+}
+
+// the caller has already taken a token (at prio) for the first request, a retry takes another
+calldata_t *qrz_lookup_callsign(const char *callsign, qrz_prio_t prio) {
+   char buf[32769], outbuf[32769];
+   calldata_t *calldata = NULL;
 
    if (callsign == NULL) {
       log_send(mainlog, LOG_DEBUG, "qrz_lookup_callsign called with NULL callsign!");
-      return false;
+      return NULL;
    }
-   
-   if (qrz_session == NULL && (qrz_start_session() == false)) {
-      log_send(mainlog, LOG_CRIT, "Attempting to start QRZ session failed!");
-      // yuck
-      sleep(1);
+
+   // not logged in? the session state machine will get us back online, don't wait on it here
+   if (!qrz_usable() || qrz_session == NULL) {
+      log_send(mainlog, LOG_DEBUG, "qrz_lookup_callsign: QRZ session is %s, skipping lookup of %s", session_state_name[qrz_sm.state], callsign);
+      return NULL;
    }
 
-   memset(calldata, 0, sizeof(calldata_t));
-   memset(buf, 0, sizeof(buf));
-   snprintf(buf, sizeof(buf), "%s?s=%s;callsign=%s", qrz_api_url, qrz_session->key, callsign);
+   calldata = calldata_alloc();
 
-   memcpy(calldata->query_callsign, callsign, MAX_CALLSIGN);
    log_send(mainlog, LOG_INFO, "looking up callsign %s via QRZ XML API", callsign);
 
-   if (http_post(buf, NULL, outbuf, sizeof(outbuf)) != false) {
+   for (int attempt = 0; attempt < 2; attempt++) {
+      memset(calldata, 0, sizeof(calldata_t));
+      snprintf(calldata->query_callsign, MAX_CALLSIGN, "%s", callsign);
+      memset(buf, 0, sizeof(buf));
+      pthread_mutex_lock(&qrz_lock);
+      snprintf(buf, sizeof(buf), "%s?s=%s;callsign=%s", qrz_api_url, qrz_session->key, callsign);
+      pthread_mutex_unlock(&qrz_lock);
+
+      uint64_t t_http = stats_now();
+      bool http_ok;
+
+      // slower than the usual p95? send it again and take whichever answers first
+      if (qrz_hedge && stats_count(STAT_QRZ_HTTP) >= QRZ_HEDGE_MIN_SAMPLES) {
+         uint64_t hedge_us = stats_percentile(STAT_QRZ_HTTP, 95), took_us = 0;
+
+         if (hedge_us < QRZ_HEDGE_MIN_US) {
+            hedge_us = QRZ_HEDGE_MIN_US;
+         }
+
+         // record how long we waited for the answer, whichever request it came from
+         if ((http_ok = http_get_hedged(buf, outbuf, sizeof(outbuf), hedge_us, qrz_may_hedge, &took_us))) {
+            stats_record_usec(STAT_QRZ_HTTP, took_us);
+         }
+      } else {
+         http_ok = http_post(buf, NULL, outbuf, sizeof(outbuf));
+         stats_record(STAT_QRZ_HTTP, t_http);
+      }
+
+      if (http_ok == false) {
+         session_request_failed(&qrz_sm);
+         calldata_free(calldata);
+         return NULL;
+      }
+
+      uint64_t t_parse = stats_now();
+      pthread_mutex_lock(&qrz_lock);
       qrz_parse_http_data(outbuf, calldata);
-      if (calldata->callsign[0] == '\0') {
-         log_send(mainlog, LOG_WARNING, "result for callsign %s returned, but calldata->callsign is NULL... wtf?", callsign);
-         free(calldata);
+      stats_record(STAT_XML_PARSE, t_parse);
+      bool expired = qrz_session_key_expired();
+      pthread_mutex_unlock(&qrz_lock);
+
+      // session key timed out? log back in and try once more, if the rate limit lets us
+      if (expired) {
+         if (attempt == 0 && session_expired(&qrz_sm)) {
+            if (qrz_sched_try(prio)) {
+               continue;
+            }
+            log_send(mainlog, LOG_INFO, "qrz rate limited, deferring %s retry for %s", qrz_prio_name[prio], callsign);
+            qrz_sched_enqueue(callsign, prio);
+         }
+         calldata_free(calldata);
          return NULL;
       }
-   } else {
-      free(calldata);
+
+      session_request_ok(&qrz_sm);
+      break;
+   }
+
+   if (calldata->callsign[0] == '\0') {
+      log_send(mainlog, LOG_WARNING, "result for callsign %s returned, but calldata->callsign is NULL... wtf?", callsign);
+      calldata_free(calldata);
       return NULL;
    }
    return calldata;
 }
+
+void qrz_session_dump_prometheus(FILE *fp) {
+   if (qrz_sm.loop == NULL) {
+      return;
+   }
+
+   session_state_t state = session_get_state(&qrz_sm);
+
+   fprintf(fp, "# HELP callsign_lookup_qrz_session_state QRZ session state (1 for the current one)\n");
+   fprintf(fp, "# TYPE callsign_lookup_qrz_session_state gauge\n");
+   for (int i = SESSION_OFFLINE; i <= SESSION_DEGRADED; i++) {
+      fprintf(fp, "callsign_lookup_qrz_session_state{state=\"%s\"} %d\n", session_state_name[i], (state == i ? 1 : 0));
+   }
+
+   pthread_mutex_lock(&qrz_lock);
+   if (qrz_session != NULL && qrz_session->count >= 0) {
+      fprintf(fp, "# HELP callsign_lookup_qrz_count Lookups QRZ says we've done today\n");
+      fprintf(fp, "# TYPE callsign_lookup_qrz_count gauge\n");
+      fprintf(fp, "callsign_lookup_qrz_count %d\n", qrz_session->count);
+   }
+   pthread_mutex_unlock(&qrz_lock);
+}
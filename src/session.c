@@ -0,0 +1,339 @@
+/*
+ * Login session state machine for online lookup services (QRZ, etc)
+ *
+ *	OFFLINE --(retry timer)--> REAUTH --(ok)--> ONLINE <--(ok)--> DEGRADED
+ *	   ^                          |                                  |
+ *	   +-------(failed/denied)----+----(max_failures requests)-------+
+ *
+ * Login retries back off exponentially from backoff_min up to backoff_max
+ * (cfg:callsign-lookup/retry-delay), with a little jitter so we don't thump
+ * the server on the second. After max_tries failures in a row, or if the
+ * server tells us our credentials are bad, we wait the full backoff_max.
+ *
+ * Nothing here ever sleeps or blocks the loop: scheduled logins run on a
+ * worker thread, and since lookups report back from worker threads too, all
+ * state is under s->lock. Only the loop thread touches the retry timer and
+ * reports state changes, workers poke it through the s->notify ev_async.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <ev.h>
+#include <libied/debuglog.h>
+#include "session.h"
+#include "workers.h"
+#include "client.h"
+
+const char *session_state_name[5] = { "OFFLINE", "REAUTH", "ONLINE", "DEGRADED", NULL };
+
+// must hold s->lock
+static void session_set_state(online_session_t *s, session_state_t state) {
+   if (s->state == state) {
+      return;
+   }
+
+   s->state = state;
+   s->last_change = ev_time();
+   ev_async_send(s->loop, &s->notify);
+}
+
+// must hold s->lock, the loop thread will (re)start the timer
+static void session_schedule_retry(online_session_t *s, ev_tstamp delay) {
+   s->retry_pending = true;
+   s->retry_delay = delay;
+   ev_async_send(s->loop, &s->notify);
+}
+
+// must hold s->lock
+static ev_tstamp session_next_backoff(online_session_t *s) {
+   ev_tstamp delay = s->backoff;
+
+   // double it for next time, up to the limit
+   s->backoff *= 2;
+   if (s->backoff > s->backoff_max) {
+      s->backoff = s->backoff_max;
+   }
+
+   // +/- 10% jitter
+   delay += delay * (((rand() % 2001) - 1000) / 10000.0);
+   return delay;
+}
+
+// Runs the login callback and moves the state machine along. May block, so
+// it must only be called from a worker thread.
+static void session_do_login(online_session_t *s) {
+   session_login_res_t res;
+
+   pthread_mutex_lock(&s->login_lock);
+   pthread_mutex_lock(&s->lock);
+   s->attempts++;
+   session_set_state(s, SESSION_REAUTH);
+   pthread_mutex_unlock(&s->lock);
+
+   res = s->login(s);
+
+   pthread_mutex_lock(&s->lock);
+   if (res == SESSION_LOGIN_OK && s->manual_offline) {
+      // /OFFLINE came in while we were logging in, it wins
+      s->tries = 0;
+      s->backoff = s->backoff_min;
+      session_set_state(s, SESSION_OFFLINE);
+   } else if (res == SESSION_LOGIN_OK) {
+      s->tries = 0;
+      s->failures = 0;
+      s->backoff = s->backoff_min;
+      s->last_login = ev_time();
+      session_set_state(s, SESSION_ONLINE);
+   } else {
+      s->tries++;
+      session_set_state(s, SESSION_OFFLINE);
+
+      if (s->manual_offline) {
+         // user doesn't want us online, so don't bother retrying
+      } else if (res == SESSION_LOGIN_DENIED || s->tries >= s->max_tries) {
+         log_send(mainlog, LOG_CRIT, "%s session: login %s (%d tries), waiting %.0f seconds before trying again", s->name,
+                  (res == SESSION_LOGIN_DENIED ? "denied" : "failed"), s->tries, s->backoff_max);
+         s->tries = 0;
+         s->backoff = s->backoff_min;
+         session_schedule_retry(s, s->backoff_max);
+      } else {
+         ev_tstamp delay = session_next_backoff(s);
+         log_send(mainlog, LOG_WARNING, "%s session: login failed (try %d of %d), retrying in %.1f seconds", s->name, s->tries, s->max_tries, delay);
+         session_schedule_retry(s, delay);
+      }
+   }
+   pthread_mutex_unlock(&s->lock);
+   pthread_mutex_unlock(&s->login_lock);
+}
+
+static void session_login_run(work_t *w) {
+   session_do_login((online_session_t *)w);
+}
+
+// loop thread: login_work is off the results queue now, so it can be queued again
+static void session_login_done(work_t *w) {
+   online_session_t *s = (online_session_t *)w;
+
+   pthread_mutex_lock(&s->lock);
+   s->login_busy = false;
+   pthread_mutex_unlock(&s->lock);
+}
+
+// loop thread: hand a login to the worker pool, unless one's already going
+static void session_queue_login(online_session_t *s) {
+   pthread_mutex_lock(&s->lock);
+   if (s->login_busy) {
+      pthread_mutex_unlock(&s->lock);
+      return;
+   }
+   s->login_busy = true;
+   pthread_mutex_unlock(&s->lock);
+
+   s->login_work.prio = 0;
+   s->login_work.run = session_login_run;
+   s->login_work.done = session_login_done;
+   workers_submit(&s->login_work);
+}
+
+static void session_retry_cb(EV_P_ ev_timer *w, int revents) {
+   online_session_t *s = (online_session_t *)w->data;
+
+   if (s->manual_offline) {
+      return;
+   }
+   session_queue_login(s);
+}
+
+// loop thread: report state changes and start any retry a worker asked for
+static void session_notify_cb(EV_P_ ev_async *w, int revents) {
+   online_session_t *s = (online_session_t *)w->data;
+   session_state_t old_state, state;
+   bool retry;
+   ev_tstamp delay;
+
+   pthread_mutex_lock(&s->lock);
+   old_state = s->reported_state;
+   state = s->reported_state = s->state;
+   retry = s->retry_pending;
+   delay = s->retry_delay;
+   s->retry_pending = false;
+   pthread_mutex_unlock(&s->lock);
+
+   if (old_state != state) {
+      log_send(mainlog, LOG_NOTICE, "%s session: %s -> %s", s->name, session_state_name[old_state], session_state_name[state]);
+      clients_notice("+NOTICE %s session %s -> %s\n", s->name, session_state_name[old_state], session_state_name[state]);
+
+      if (s->on_change != NULL) {
+         s->on_change(s, old_state);
+      }
+   }
+
+   if (retry) {
+      ev_timer_stop(EV_A, &s->retry_timer);
+      ev_timer_set(&s->retry_timer, delay, 0.);
+      ev_timer_start(EV_A, &s->retry_timer);
+   }
+}
+
+void session_init(online_session_t *s, const char *name, struct ev_loop *loop, session_login_cb_t login) {
+   s->name = name;
+   s->state = s->reported_state = SESSION_OFFLINE;
+   s->loop = loop;
+   s->login = login;
+   s->tries = s->failures = s->attempts = 0;
+
+   if (s->max_tries <= 0) {
+      s->max_tries = 3;
+   }
+
+   if (s->max_failures <= 0) {
+      s->max_failures = 3;
+   }
+
+   if (s->backoff_min <= 0) {
+      s->backoff_min = 5;
+   }
+
+   if (s->backoff_max < s->backoff_min) {
+      s->backoff_max = s->backoff_min;
+   }
+
+   s->backoff = s->backoff_min;
+   pthread_mutex_init(&s->lock, NULL);
+   pthread_mutex_init(&s->login_lock, NULL);
+   ev_timer_init(&s->retry_timer, session_retry_cb, 0., 0.);
+   s->retry_timer.data = s;
+   ev_async_init(&s->notify, session_notify_cb);
+   s->notify.data = s;
+   ev_async_start(loop, &s->notify);
+}
+
+// Kick off the first login from the event loop
+void session_start(online_session_t *s) {
+   pthread_mutex_lock(&s->lock);
+   session_schedule_retry(s, 0.);
+   pthread_mutex_unlock(&s->lock);
+}
+
+// User asked us to go online (/ONLINE), try now instead of waiting
+void session_retry_now(online_session_t *s) {
+   pthread_mutex_lock(&s->lock);
+   s->manual_offline = false;
+   s->tries = 0;
+   s->backoff = s->backoff_min;
+
+   if (s->state != SESSION_ONLINE && s->state != SESSION_DEGRADED) {
+      session_schedule_retry(s, 0.);
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+void session_force_offline(online_session_t *s) {
+   ev_timer_stop(s->loop, &s->retry_timer);
+
+   pthread_mutex_lock(&s->lock);
+   s->manual_offline = true;
+   s->retry_pending = false;
+   session_set_state(s, SESSION_OFFLINE);
+   pthread_mutex_unlock(&s->lock);
+}
+
+void session_request_ok(online_session_t *s) {
+   pthread_mutex_lock(&s->lock);
+   s->failures = 0;
+
+   if (s->state == SESSION_DEGRADED) {
+      session_set_state(s, SESSION_ONLINE);
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+void session_request_failed(online_session_t *s) {
+   pthread_mutex_lock(&s->lock);
+   if (s->state != SESSION_ONLINE && s->state != SESSION_DEGRADED) {
+      pthread_mutex_unlock(&s->lock);
+      return;
+   }
+
+   s->failures++;
+
+   if (s->failures >= s->max_failures) {
+      log_send(mainlog, LOG_CRIT, "%s session: %d requests failed in a row, going offline", s->name, s->failures);
+      s->failures = 0;
+      session_set_state(s, SESSION_OFFLINE);
+
+      if (!s->manual_offline) {
+         session_schedule_retry(s, session_next_backoff(s));
+      }
+   } else {
+      session_set_state(s, SESSION_DEGRADED);
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+// The server says our session key is no good anymore. Log in again right away
+// and return true if the caller can retry its request. Worker threads only!
+bool session_expired(online_session_t *s) {
+   ev_tstamp last_login;
+   bool manual_offline;
+
+   pthread_mutex_lock(&s->lock);
+   last_login = s->last_login;
+   manual_offline = s->manual_offline;
+   pthread_mutex_unlock(&s->lock);
+
+   // they sent /OFFLINE, so don't log back in behind their back
+   if (manual_offline) {
+      return false;
+   }
+
+   pthread_mutex_lock(&s->login_lock);
+   pthread_mutex_lock(&s->lock);
+   // did another worker already get us a fresh key while we waited?
+   bool fresh = (s->last_login > last_login || (ev_time() - s->last_login) < 5.);
+   pthread_mutex_unlock(&s->lock);
+   pthread_mutex_unlock(&s->login_lock);
+
+   if (!fresh) {
+      log_send(mainlog, LOG_INFO, "%s session: session key expired, logging in again", s->name);
+      session_do_login(s);
+   }
+   return session_usable(s);
+}
+
+bool session_usable(online_session_t *s) {
+   bool usable;
+
+   pthread_mutex_lock(&s->lock);
+   usable = (s->state == SESSION_ONLINE || s->state == SESSION_DEGRADED);
+   pthread_mutex_unlock(&s->lock);
+   return usable;
+}
+
+session_state_t session_get_state(online_session_t *s) {
+   session_state_t state;
+
+   pthread_mutex_lock(&s->lock);
+   state = s->state;
+   pthread_mutex_unlock(&s->lock);
+   return state;
+}
+
+// are we still waiting on our first login? (used by one-shot command line lookups)
+bool session_login_pending(online_session_t *s) {
+   bool pending;
+
+   pthread_mutex_lock(&s->lock);
+   pending = (!s->manual_offline && (s->login_busy || s->attempts == 0));
+   pthread_mutex_unlock(&s->lock);
+   return pending;
+}
+
+// how long until the next login attempt? (-1 if none scheduled), loop thread only
+ev_tstamp session_retry_in(const online_session_t *s) {
+   if (!ev_is_active(&s->retry_timer)) {
+      return -1;
+   }
+   return ev_timer_remaining(s->loop, (ev_timer *)&s->retry_timer);
+}
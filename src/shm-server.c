@@ -0,0 +1,424 @@
+/*
+ * Shared memory lookup channel for clients on the same box
+ *
+ * A client connects to a unix socket and gets back a memfd with a request
+ * ring and a response ring in it, plus an eventfd for each direction (see
+ * shm-ring.h for the layout). From then on requests and replies never pass
+ * through the kernel: the client writes a callsign into the ring and kicks
+ * the eventfd, we answer memory cache hits right there on the loop and
+ * everything else when the workers get to it. A whole batch of replies costs
+ * one eventfd write. The socket is only kept open so we notice the client
+ * going away.
+ *
+ * Enable with cfg:callsign-lookup/shm-listen, ex: "/run/user/1000/callsign-lookup.sock"
+ */
+#define	_GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <ev.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "callsign-lookup.h"
+#include "proto.h"
+#include "heard.h"
+#include "shm-ring.h"
+#include "shm-server.h"
+
+#define	SHM_REQ_RING_SIZE	(64 * 1024)		// ~2000 requests in flight
+#define	SHM_RESP_RING_SIZE	(1024 * 1024)		// replies are a few hundred bytes
+#define	SHM_MAX_CLIENTS		8
+
+// a reply that didn't fit in the response ring, sent once the client makes room
+typedef struct shm_overflow {
+   struct shm_overflow	*next;
+   uint32_t		len;
+   char			data[];
+} shm_overflow_t;
+
+typedef struct shm_client {
+   int			sock;
+   int			req_efd, resp_efd;
+   ev_io		sock_watcher;
+   ev_io		req_watcher;
+   shm_hdr_t		*hdr;
+   size_t		map_len;
+   int			inflight;		// lookups that will still call shm_reply()
+   bool			dead;			// hung up, free once inflight is 0
+   bool			kick;			// wrote replies, wake the client before we sleep
+   shm_overflow_t	*overflow_head, *overflow_tail;
+   struct shm_client	*next;
+} shm_client_t;
+
+static struct ev_loop *shm_loop = NULL;
+static ev_io listen_watcher;
+static ev_prepare kick_watcher;
+static int listen_fd = -1;
+static char *listen_path = NULL;
+static shm_client_t *shm_clients = NULL;
+static int nclients = 0;
+static proto_buf_t shm_scratch = { NULL, 0, 0 };
+
+static void shm_client_free(shm_client_t *c) {
+   shm_overflow_t *o = c->overflow_head;
+
+   while (o != NULL) {
+      shm_overflow_t *next = o->next;
+      free(o);
+      o = next;
+   }
+   free(c);
+}
+
+static void shm_client_close(shm_client_t *c) {
+   shm_client_t **pp = &shm_clients;
+
+   while (*pp != NULL) {
+      if (*pp == c) {
+         *pp = c->next;
+         break;
+      }
+      pp = &(*pp)->next;
+   }
+
+   ev_io_stop(shm_loop, &c->sock_watcher);
+   ev_io_stop(shm_loop, &c->req_watcher);
+   close(c->sock);
+   close(c->req_efd);
+   close(c->resp_efd);
+   munmap(c->hdr, c->map_len);
+   c->hdr = NULL;
+   nclients--;
+   log_send(mainlog, LOG_INFO, "shm: client disconnected (%d lookups still out)", c->inflight);
+
+   // workers still have lookups for it, shm_reply() will finish the job
+   if (c->inflight > 0) {
+      c->dead = true;
+      return;
+   }
+   shm_client_free(c);
+}
+
+// send replies that were waiting for room, false if the ring filled up again
+static bool shm_overflow_flush(shm_client_t *c) {
+   char *base = (char *)c->hdr;
+
+   while (c->overflow_head != NULL) {
+      shm_overflow_t *o = c->overflow_head;
+
+      if (!shm_ring_put(&c->hdr->resp, base, o->data, o->len)) {
+         return false;
+      }
+      c->overflow_head = o->next;
+      if (c->overflow_head == NULL) {
+         c->overflow_tail = NULL;
+      }
+      free(o);
+      c->kick = true;
+   }
+   atomic_fetch_and_explicit(&c->hdr->flags, ~SHM_F_RESP_FULL, memory_order_release);
+   return true;
+}
+
+static void shm_reply(lookup_req_t *req) {
+   shm_client_t *c = (shm_client_t *)req->priv;
+
+   c->inflight--;
+   if (c->dead) {
+      if (c->inflight == 0) {
+         shm_client_free(c);
+      }
+      return;
+   }
+
+   proto_buf_reset(&shm_scratch);
+   if (!proto_encode_calldata(&shm_scratch, PROTO_FMT_BINARY, req->result, req->callsign, req->tag)) {
+      return;
+   }
+
+   // keep replies in order behind any that are already waiting
+   if (c->overflow_head == NULL && shm_ring_put(&c->hdr->resp, (char *)c->hdr, shm_scratch.data, shm_scratch.len)) {
+      c->kick = true;
+      return;
+   }
+
+   shm_overflow_t *o = malloc(sizeof(shm_overflow_t) + shm_scratch.len);
+   if (o == NULL) {
+      fprintf(stderr, "+ERROR shm_reply: out of memory!\n");
+      exit(ENOMEM);
+   }
+   o->next = NULL;
+   o->len = shm_scratch.len;
+   memcpy(o->data, shm_scratch.data, shm_scratch.len);
+
+   if (c->overflow_tail != NULL) {
+      c->overflow_tail->next = o;
+   } else {
+      c->overflow_head = o;
+   }
+   c->overflow_tail = o;
+   atomic_fetch_or_explicit(&c->hdr->flags, SHM_F_RESP_FULL, memory_order_release);
+   c->kick = true;
+}
+
+// the client put requests in the ring (or made room for replies)
+static void shm_req_cb(EV_P_ ev_io *w, int revents) {
+   shm_client_t *c = (shm_client_t *)w->data;
+   char *base = (char *)c->hdr;
+   const char *rec = NULL;
+   uint64_t count;
+   uint32_t len;
+
+   if (read(c->req_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      log_send(mainlog, LOG_WARNING, "shm: reading request eventfd failed: %s", strerror(errno));
+   }
+
+   if (c->overflow_head != NULL) {
+      shm_overflow_flush(c);
+   }
+
+   while ((rec = shm_ring_peek(&c->hdr->req, base, &len)) != NULL) {
+      char callsign[MAX_CALLSIGN], tag[LOOKUP_TAG_LEN + 1];
+      uint32_t id;
+      size_t call_len = (len > sizeof(id) ? len - sizeof(id) : 0);
+
+      // id, then a NUL terminated callsign. The client can still write to the ring,
+      // so check our copy of it, not the original
+      if (call_len > 0 && call_len <= MAX_CALLSIGN) {
+         memcpy(&id, rec, sizeof(id));
+         memcpy(callsign, rec + sizeof(id), call_len);
+      }
+
+      if (call_len > 0 && call_len <= MAX_CALLSIGN && callsign[call_len - 1] == '\0') {
+         snprintf(tag, sizeof(tag), "%u", id);
+         shm_ring_done(&c->hdr->req, len);
+
+         c->inflight++;
+         heard_record(callsign, HEARD_BAND_NONE, HEARD_SNR_NONE);
+         lookup_submit(callsign, QRZ_PRIO_INTERACTIVE, tag, PROTO_FMT_BINARY, shm_reply, c);
+      } else {
+         log_send(mainlog, LOG_WARNING, "shm: dropping malformed request (%u bytes)", len);
+         shm_ring_done(&c->hdr->req, len);
+      }
+   }
+}
+
+// the socket only carries the handshake, so anything here is the client hanging up
+static void shm_sock_cb(EV_P_ ev_io *w, int revents) {
+   shm_client_t *c = (shm_client_t *)w->data;
+   char buf[64];
+   ssize_t n = read(w->fd, buf, sizeof(buf));
+
+   if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return;
+   }
+   shm_client_close(c);
+}
+
+// about to block: wake every client we wrote replies for, once per loop iteration
+static void shm_kick_cb(EV_P_ ev_prepare *w, int revents) {
+   for (shm_client_t *c = shm_clients; c != NULL; c = c->next) {
+      uint64_t one = 1;
+
+      if (!c->kick) {
+         continue;
+      }
+      c->kick = false;
+
+      if (write(c->resp_efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+         log_send(mainlog, LOG_WARNING, "shm: writing response eventfd failed: %s", strerror(errno));
+      }
+   }
+}
+
+// hand the segment and eventfds to the client
+static bool shm_send_hello(int sock, int memfd, int req_efd, int resp_efd, size_t map_len) {
+   char hello[64];
+   int fds[3] = { memfd, req_efd, resp_efd };
+   char cbuf[CMSG_SPACE(sizeof(fds))];
+   struct iovec iov;
+   struct msghdr msg;
+   struct cmsghdr *cmsg = NULL;
+
+   snprintf(hello, sizeof(hello), "+SHM %d %zu\n", SHM_VERSION, map_len);
+   iov.iov_base = hello;
+   iov.iov_len = strlen(hello);
+
+   memset(&msg, 0, sizeof(msg));
+   memset(cbuf, 0, sizeof(cbuf));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+   return (sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len);
+}
+
+static void shm_accept_cb(EV_P_ ev_io *w, int revents) {
+   shm_client_t *c = NULL;
+   int sock = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   int memfd = -1, req_efd = -1, resp_efd = -1;
+   size_t hdr_len = (sizeof(shm_hdr_t) + 4095) & ~(size_t)4095;
+   size_t map_len = hdr_len + SHM_REQ_RING_SIZE + SHM_RESP_RING_SIZE;
+   shm_hdr_t *hdr = MAP_FAILED;
+
+   if (sock < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+         log_send(mainlog, LOG_WARNING, "shm: accept failed: %s", strerror(errno));
+      }
+      return;
+   }
+
+   if (nclients >= SHM_MAX_CLIENTS) {
+      log_send(mainlog, LOG_WARNING, "shm: too many clients, dropping connection");
+      close(sock);
+      return;
+   }
+
+   if ((memfd = memfd_create("callsign-lookup-shm", MFD_CLOEXEC)) < 0 ||
+       ftruncate(memfd, map_len) < 0 ||
+       (hdr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED ||
+       (req_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+       (resp_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      log_send(mainlog, LOG_WARNING, "shm: setting up client segment failed: %s", strerror(errno));
+      goto fail;
+   }
+
+   memset(hdr, 0, sizeof(shm_hdr_t));
+   hdr->magic = SHM_MAGIC;
+   hdr->version = SHM_VERSION;
+   hdr->req.size = SHM_REQ_RING_SIZE;
+   hdr->req.offset = hdr_len;
+   hdr->resp.size = SHM_RESP_RING_SIZE;
+   hdr->resp.offset = hdr_len + SHM_REQ_RING_SIZE;
+
+   if (!shm_send_hello(sock, memfd, req_efd, resp_efd, map_len)) {
+      log_send(mainlog, LOG_WARNING, "shm: sending handshake failed: %s", strerror(errno));
+      goto fail;
+   }
+
+   // the client has it's own copy of the fd and we have the mapping
+   close(memfd);
+
+   if ((c = calloc(1, sizeof(shm_client_t))) == NULL) {
+      fprintf(stderr, "+ERROR shm_accept_cb: out of memory!\n");
+      exit(ENOMEM);
+   }
+   c->sock = sock;
+   c->req_efd = req_efd;
+   c->resp_efd = resp_efd;
+   c->hdr = hdr;
+   c->map_len = map_len;
+   c->next = shm_clients;
+   shm_clients = c;
+   nclients++;
+
+   ev_io_init(&c->sock_watcher, shm_sock_cb, sock, EV_READ);
+   c->sock_watcher.data = c;
+   ev_io_start(EV_A, &c->sock_watcher);
+   ev_io_init(&c->req_watcher, shm_req_cb, req_efd, EV_READ);
+   c->req_watcher.data = c;
+   ev_io_start(EV_A, &c->req_watcher);
+   log_send(mainlog, LOG_INFO, "shm: client connected, %zu byte segment", map_len);
+   return;
+
+fail:
+   if (hdr != MAP_FAILED) {
+      munmap(hdr, map_len);
+   }
+   if (memfd >= 0) {
+      close(memfd);
+   }
+   if (req_efd >= 0) {
+      close(req_efd);
+   }
+   if (resp_efd >= 0) {
+      close(resp_efd);
+   }
+   close(sock);
+}
+
+bool shm_server_init(struct ev_loop *loop, const char *path) {
+   struct sockaddr_un addr;
+
+   if (path == NULL || *path == '\0') {
+      return false;
+   }
+
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      log_send(mainlog, LOG_CRIT, "shm: socket path %s is too long", path);
+      return false;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+   if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      log_send(mainlog, LOG_CRIT, "shm: socket failed: %s", strerror(errno));
+      return false;
+   }
+
+   // left over from last time?
+   unlink(path);
+
+   // the client gets our memory, so only let our own user in
+   mode_t old_umask = umask(0077);
+   int rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+   umask(old_umask);
+
+   if (rc < 0 || listen(listen_fd, 8) < 0) {
+      log_send(mainlog, LOG_CRIT, "shm: can't listen on %s: %s", path, strerror(errno));
+      close(listen_fd);
+      listen_fd = -1;
+      return false;
+   }
+
+   listen_path = strdup(path);
+   shm_loop = loop;
+   ev_io_init(&listen_watcher, shm_accept_cb, listen_fd, EV_READ);
+   ev_io_start(loop, &listen_watcher);
+   ev_prepare_init(&kick_watcher, shm_kick_cb);
+   ev_prepare_start(loop, &kick_watcher);
+   log_send(mainlog, LOG_INFO, "shm: listening on %s", path);
+   return true;
+}
+
+void shm_server_fini(void) {
+   if (listen_fd < 0) {
+      return;
+   }
+
+   while (shm_clients != NULL) {
+      shm_client_close(shm_clients);
+   }
+
+   ev_io_stop(shm_loop, &listen_watcher);
+   ev_prepare_stop(shm_loop, &kick_watcher);
+   close(listen_fd);
+   listen_fd = -1;
+
+   if (listen_path != NULL) {
+      unlink(listen_path);
+      free(listen_path);
+      listen_path = NULL;
+   }
+   proto_buf_free(&shm_scratch);
+}
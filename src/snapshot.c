@@ -0,0 +1,272 @@
+/*
+ * Periodic mmap-able snapshot of the memory cache (see snapshot.h for the layout)
+ *
+ * Log exporters, the band map etc. want to look up stations without asking
+ * us, and without opening the sqlite cache under our feet. Every so often the
+ * loop grabs a reference to every record in the memory cache (a pointer copy
+ * each, under the memcache lock) and a worker writes them out with an index,
+ * then renames the file into place. Nothing is written if the cache hasn't
+ * changed since last time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ev.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "callrec.h"
+#include "memcache.h"
+#include "workers.h"
+#include "stats.h"
+#include "snapshot.h"
+
+#define	SNAPSHOT_ALIGN(x)	(((x) + 7) & ~(uint64_t)7)
+
+typedef struct snapshot_job {
+   work_t		work;			// must be first
+   callrec_t		**recs;
+   int			n_recs;
+   bool			ok;
+   size_t		bytes;
+   double		ms;
+} snapshot_job_t;
+
+static struct ev_loop *snapshot_loop = NULL;
+static ev_timer snapshot_timer;
+static char *snapshot_path = NULL;
+static snapshot_job_t snapshot_job;
+static bool snapshot_busy = false;
+static uint64_t snapshot_gen = 0;
+static time_t snapshot_last = 0;
+static uint32_t snapshot_last_records = 0;
+static size_t snapshot_last_bytes = 0;
+static double snapshot_last_ms = 0;
+static uint64_t snapshot_writes = 0, snapshot_failures = 0;
+
+extern time_t now;
+
+static bool snapshot_write(snapshot_job_t *job) {
+   snapshot_hdr_t hdr;
+   snapshot_slot_t *index = NULL;
+   uint32_t *str_offs = NULL;
+   uint64_t off, str_len = 0;
+   char tmp_path[PATH_MAX];
+   FILE *fp = NULL;
+   int fd = -1;
+   bool rv = false;
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = SNAPSHOT_MAGIC;
+   hdr.version = SNAPSHOT_VERSION;
+   hdr.rec_size = sizeof(callrec_t);
+   hdr.n_records = job->n_recs;
+   hdr.created = time(NULL);
+   hdr.n_strings = intern_count();
+
+   // at most half full, so misses stop quickly
+   hdr.index_slots = 16;
+   while (hdr.index_slots < (uint32_t)job->n_recs * 2) {
+      hdr.index_slots <<= 1;
+   }
+
+   if ((index = calloc(hdr.index_slots, sizeof(snapshot_slot_t))) == NULL ||
+       (str_offs = malloc((hdr.n_strings + 1) * sizeof(uint32_t))) == NULL) {
+      fprintf(stderr, "+ERROR snapshot_write: out of memory!\n");
+      exit(ENOMEM);
+   }
+
+   for (uint32_t i = 0; i <= hdr.n_strings; i++) {
+      str_offs[i] = str_len;
+      str_len += strlen(interned_string(i)) + 1;
+   }
+
+   hdr.index_off = SNAPSHOT_ALIGN(sizeof(snapshot_hdr_t));
+   hdr.strings_off = hdr.index_off + hdr.index_slots * sizeof(snapshot_slot_t);
+   hdr.records_off = SNAPSHOT_ALIGN(hdr.strings_off + (hdr.n_strings + 1) * sizeof(uint32_t) + str_len);
+
+   // lay out the records and index them
+   off = hdr.records_off;
+   for (int i = 0; i < job->n_recs; i++) {
+      const char *callsign = callrec_get(job->recs[i], CR_CALLSIGN);
+      uint32_t hash = snapshot_hash(callsign), slot = hash & (hdr.index_slots - 1);
+
+      if (off > UINT32_MAX) {
+         log_send(mainlog, LOG_WARNING, "snapshot: over 4GB, not writing it");
+         goto out;
+      }
+
+      while (index[slot].off != 0) {
+         slot = (slot + 1) & (hdr.index_slots - 1);
+      }
+      index[slot].hash = hash;
+      index[slot].off = off;
+      off += SNAPSHOT_ALIGN(callrec_size(job->recs[i]));
+   }
+   hdr.file_len = off;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+   if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+      log_send(mainlog, LOG_WARNING, "snapshot: can't create %s: %s", tmp_path, strerror(errno));
+      if (fd >= 0) {
+         close(fd);
+      }
+      goto out;
+   }
+
+   static const char zeros[8] = { 0 };
+   fwrite(&hdr, sizeof(hdr), 1, fp);
+   fwrite(zeros, hdr.index_off - sizeof(hdr), 1, fp);
+   fwrite(index, sizeof(snapshot_slot_t), hdr.index_slots, fp);
+   fwrite(str_offs, sizeof(uint32_t), hdr.n_strings + 1, fp);
+   for (uint32_t i = 0; i <= hdr.n_strings; i++) {
+      const char *s = interned_string(i);
+      fwrite(s, strlen(s) + 1, 1, fp);
+   }
+   fwrite(zeros, hdr.records_off - (hdr.strings_off + (hdr.n_strings + 1) * sizeof(uint32_t) + str_len), 1, fp);
+
+   for (int i = 0; i < job->n_recs; i++) {
+      const callrec_t *rec = job->recs[i];
+      size_t len = callrec_size(rec), head = offsetof(callrec_t, origin);
+
+      // the reference count means nothing outside this process
+      fwrite(zeros, head, 1, fp);
+      fwrite((const char *)rec + head, len - head, 1, fp);
+      fwrite(zeros, SNAPSHOT_ALIGN(len) - len, 1, fp);
+   }
+
+   if (fflush(fp) != 0 || ferror(fp) || fdatasync(fd) != 0) {
+      log_send(mainlog, LOG_WARNING, "snapshot: writing %s failed: %s", tmp_path, strerror(errno));
+      fclose(fp);
+      unlink(tmp_path);
+      goto out;
+   }
+   fclose(fp);
+
+   if (rename(tmp_path, snapshot_path) != 0) {
+      log_send(mainlog, LOG_WARNING, "snapshot: can't rename %s to %s: %s", tmp_path, snapshot_path, strerror(errno));
+      unlink(tmp_path);
+      goto out;
+   }
+   job->bytes = hdr.file_len;
+   rv = true;
+
+out:
+   free(index);
+   free(str_offs);
+   return rv;
+}
+
+// worker thread
+static void snapshot_run(work_t *w) {
+   snapshot_job_t *job = (snapshot_job_t *)w;
+   uint64_t start = stats_now();
+
+   job->ok = snapshot_write(job);
+   job->ms = (stats_now() - start) / 1000000.0;
+}
+
+// back on the loop
+static void snapshot_done(work_t *w) {
+   snapshot_job_t *job = (snapshot_job_t *)w;
+
+   for (int i = 0; i < job->n_recs; i++) {
+      callrec_put(job->recs[i]);
+   }
+   free(job->recs);
+   job->recs = NULL;
+
+   if (job->ok) {
+      snapshot_writes++;
+      snapshot_last = now;
+      snapshot_last_records = job->n_recs;
+      snapshot_last_bytes = job->bytes;
+      snapshot_last_ms = job->ms;
+      log_send(mainlog, LOG_DEBUG, "snapshot: wrote %d records, %zu bytes in %.1f ms", job->n_recs, job->bytes, job->ms);
+   } else {
+      snapshot_failures++;
+      snapshot_gen = UINT64_MAX;	// try again next time, even if nothing changes
+   }
+   snapshot_busy = false;
+}
+
+static void snapshot_timer_cb(EV_P_ ev_timer *w, int revents) {
+   callrec_t **recs = NULL;
+   int n;
+
+   // the last one is still being written? it'll be fresh enough
+   if (snapshot_busy) {
+      return;
+   }
+
+   if ((n = memcache_collect(&recs, &snapshot_gen)) < 0) {
+      return;
+   }
+
+   memset(&snapshot_job, 0, sizeof(snapshot_job));
+   snapshot_job.recs = recs;
+   snapshot_job.n_recs = n;
+   snapshot_job.work.prio = WORK_PRIO_MAX - 1;
+   snapshot_job.work.run = snapshot_run;
+   snapshot_job.work.done = snapshot_done;
+   snapshot_busy = true;
+   workers_submit(&snapshot_job.work);
+}
+
+bool snapshot_init(struct ev_loop *loop, const char *path, time_t interval) {
+   if (path == NULL || *path == '\0' || interval <= 0) {
+      return false;
+   }
+
+   if (strlen(path) + 5 > PATH_MAX) {
+      log_send(mainlog, LOG_CRIT, "snapshot: path %s is too long", path);
+      return false;
+   }
+
+   snapshot_path = strdup(path);
+   snapshot_loop = loop;
+   ev_timer_init(&snapshot_timer, snapshot_timer_cb, interval, interval);
+   ev_timer_start(loop, &snapshot_timer);
+   log_send(mainlog, LOG_INFO, "snapshot: writing %s every %lu seconds", path, interval);
+   return true;
+}
+
+// call after workers_stop(), a write the workers abandoned (or finished) never got to snapshot_done()
+void snapshot_fini(void) {
+   if (snapshot_path == NULL) {
+      return;
+   }
+
+   ev_timer_stop(snapshot_loop, &snapshot_timer);
+
+   if (snapshot_busy) {
+      for (int i = 0; i < snapshot_job.n_recs; i++) {
+         callrec_put(snapshot_job.recs[i]);
+      }
+      free(snapshot_job.recs);
+      snapshot_job.recs = NULL;
+      snapshot_busy = false;
+   }
+   free(snapshot_path);
+   snapshot_path = NULL;
+}
+
+void snapshot_dump(outbuf_t *ob) {
+   if (snapshot_path == NULL) {
+      return;
+   }
+
+   if (snapshot_writes == 0) {
+      outbuf_printf(ob, "Snapshot: %s, not written yet, %lu failures\n", snapshot_path, snapshot_failures);
+      return;
+   }
+   outbuf_printf(ob, "Snapshot: %s, %u records, %zu KB, %lu seconds old, took %.1f ms, %lu written, %lu failures\n",
+         snapshot_path, snapshot_last_records, snapshot_last_bytes / 1024, (now - snapshot_last),
+         snapshot_last_ms, snapshot_writes, snapshot_failures);
+}
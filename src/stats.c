@@ -0,0 +1,328 @@
+/*
+ * Latency histograms and counters, so we can see where time goes.
+ *
+ * Each stage gets an HDR-style log-linear histogram of microseconds: values
+ * below STAT_SUB_BUCKETS get a bucket each, above that every power of two is
+ * split into STAT_SUB_BUCKETS linear buckets, so any recorded value is within
+ * ~3% of the bucket it lands in. Buckets are plain atomic counters, so worker
+ * threads can record without taking any locks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "stats.h"
+#include "workers.h"
+#include "client.h"
+
+#define	STAT_SUB_BITS		4
+#define	STAT_SUB_BUCKETS	(1 << STAT_SUB_BITS)	// 16 buckets per power of two
+#define	STAT_MAX_EXP		40			// ~12 days in usec, anything longer is clamped
+#define	STAT_BUCKETS		((STAT_MAX_EXP - STAT_SUB_BITS + 2) * STAT_SUB_BUCKETS)
+
+typedef struct stat_histogram {
+   _Atomic uint64_t	buckets[STAT_BUCKETS];
+   _Atomic uint64_t	count;
+   _Atomic uint64_t	sum;		// usec
+   _Atomic uint64_t	max;		// usec
+} stat_histogram_t;
+
+const char *stat_stage_name[STAT_STAGE_MAX + 1] = {
+   "request", "cache-find", "uls", "qrz-http", "hamqth-http", "xml-parse", "cache-save", "response-write", NULL
+};
+static const char *stat_origin_name[STAT_ORIGIN_MAX] = { "NONE", "ULS", "QRZ", "CACHE", "HAMQTH", "NOTFOUND" };
+static const char *stat_cache_name[STAT_CACHE_MAX] = { "hit", "miss", "stale" };
+
+// histogram buckets (usec) we hand to prometheus, it doesn't need all of ours
+static const uint64_t prom_bounds[] = {
+   100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+   250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000
+};
+
+static stat_histogram_t histograms[STAT_STAGE_MAX];
+static _Atomic uint64_t origin_counts[STAT_ORIGIN_MAX];
+static _Atomic uint64_t cache_counts[STAT_CACHE_MAX];
+static time_t stats_started = 0;
+extern time_t now;
+
+static inline int stat_bucket(uint64_t v) {
+   if (v < STAT_SUB_BUCKETS) {
+      return (int)v;
+   }
+
+   // position of the highest set bit picks the group, the next STAT_SUB_BITS bits the bucket in it
+   int exp = 63 - __builtin_clzll(v);
+
+   if (exp > STAT_MAX_EXP) {
+      return STAT_BUCKETS - 1;
+   }
+
+   int sub = (int)((v >> (exp - STAT_SUB_BITS)) & (STAT_SUB_BUCKETS - 1));
+   return ((exp - STAT_SUB_BITS + 1) * STAT_SUB_BUCKETS) + sub;
+}
+
+// the value in the middle of a bucket
+static uint64_t stat_bucket_value(int idx) {
+   if (idx < STAT_SUB_BUCKETS) {
+      return idx;
+   }
+
+   int exp = (idx / STAT_SUB_BUCKETS) + STAT_SUB_BITS - 1;
+   int sub = idx % STAT_SUB_BUCKETS;
+   uint64_t width = 1ULL << (exp - STAT_SUB_BITS);
+   uint64_t lo = (1ULL << exp) + (sub * width);
+   return lo + (width / 2);
+}
+
+void stats_init(void) {
+   memset(histograms, 0, sizeof(histograms));
+   memset(origin_counts, 0, sizeof(origin_counts));
+   memset(cache_counts, 0, sizeof(cache_counts));
+   stats_started = time(NULL);
+}
+
+void stats_record_usec(stat_stage_t stage, uint64_t usec) {
+   if (stage < 0 || stage >= STAT_STAGE_MAX) {
+      return;
+   }
+
+   stat_histogram_t *h = &histograms[stage];
+   atomic_fetch_add_explicit(&h->buckets[stat_bucket(usec)], 1, memory_order_relaxed);
+   atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+   atomic_fetch_add_explicit(&h->sum, usec, memory_order_relaxed);
+
+   uint64_t old_max = atomic_load_explicit(&h->max, memory_order_relaxed);
+   while (usec > old_max && !atomic_compare_exchange_weak_explicit(&h->max, &old_max, usec, memory_order_relaxed, memory_order_relaxed)) {
+      // old_max was updated, try again
+   }
+}
+
+// record the time since start_ns (from stats_now()) against a stage
+void stats_record(stat_stage_t stage, uint64_t start_ns) {
+   uint64_t end_ns = stats_now();
+
+   stats_record_usec(stage, (end_ns > start_ns ? (end_ns - start_ns) / 1000 : 0));
+}
+
+void stats_count_origin(int origin) {
+   if (origin < 0 || origin >= STAT_ORIGIN_MAX) {
+      return;
+   }
+   atomic_fetch_add_explicit(&origin_counts[origin], 1, memory_order_relaxed);
+}
+
+void stats_count_cache(stat_cache_t what) {
+   if (what < 0 || what >= STAT_CACHE_MAX) {
+      return;
+   }
+   atomic_fetch_add_explicit(&cache_counts[what], 1, memory_order_relaxed);
+}
+
+uint64_t stats_cache_count(stat_cache_t what) {
+   if (what < 0 || what >= STAT_CACHE_MAX) {
+      return 0;
+   }
+   return atomic_load_explicit(&cache_counts[what], memory_order_relaxed);
+}
+
+uint64_t stats_count(stat_stage_t stage) {
+   if (stage < 0 || stage >= STAT_STAGE_MAX) {
+      return 0;
+   }
+   return atomic_load_explicit(&histograms[stage].count, memory_order_relaxed);
+}
+
+uint64_t stats_origin_count(int origin) {
+   if (origin < 0 || origin >= STAT_ORIGIN_MAX) {
+      return 0;
+   }
+   return atomic_load_explicit(&origin_counts[origin], memory_order_relaxed);
+}
+
+// pct is 0-100, returns usec
+uint64_t stats_percentile(stat_stage_t stage, double pct) {
+   if (stage < 0 || stage >= STAT_STAGE_MAX) {
+      return 0;
+   }
+
+   stat_histogram_t *h = &histograms[stage];
+   uint64_t total = 0;
+
+   // count the buckets rather than trusting h->count, a worker may be mid-update
+   for (int i = 0; i < STAT_BUCKETS; i++) {
+      total += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+   }
+
+   if (total == 0) {
+      return 0;
+   }
+
+   uint64_t target = (uint64_t)((pct / 100.0) * total);
+   uint64_t seen = 0;
+
+   if (target >= total) {
+      target = total - 1;
+   }
+
+   for (int i = 0; i < STAT_BUCKETS; i++) {
+      seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+
+      if (seen > target) {
+         uint64_t v = stat_bucket_value(i);
+         uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+         return (v > max ? max : v);
+      }
+   }
+   return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+// resident set size, from /proc/self/statm
+long stats_rss_kb(void) {
+   long pages = 0, resident = 0;
+   FILE *fp = fopen("/proc/self/statm", "r");
+
+   if (fp == NULL) {
+      return -1;
+   }
+
+   if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+      resident = -1;
+   }
+   fclose(fp);
+
+   if (resident < 0) {
+      return -1;
+   }
+   return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void stats_dump(outbuf_t *ob) {
+   time_t uptime = (now > stats_started ? now - stats_started : 1);
+   uint64_t answered = 0;
+
+   for (int i = 0; i < STAT_ORIGIN_MAX; i++) {
+      answered += stats_origin_count(i);
+   }
+
+   outbuf_printf(ob, "Uptime: %lu\n", (unsigned long)uptime);
+   outbuf_printf(ob, "Requests: %lu (%.2f/sec)\n", (unsigned long)answered, (double)answered / uptime);
+
+   for (int i = 0; i < STAT_ORIGIN_MAX; i++) {
+      uint64_t n = stats_origin_count(i);
+
+      if (i == DATASRC_NONE && n == 0) {
+         continue;
+      }
+      outbuf_printf(ob, "Origin-%s: %lu (%.1f%%)\n", stat_origin_name[i], (unsigned long)n, (answered ? (100.0 * n) / answered : 0.0));
+   }
+
+   for (int i = 0; i < STAT_STAGE_MAX; i++) {
+      uint64_t count = stats_count(i);
+
+      if (count == 0) {
+         continue;
+      }
+
+      uint64_t sum = atomic_load_explicit(&histograms[i].sum, memory_order_relaxed);
+      outbuf_printf(ob, "Latency-%s: n=%lu avg=%luus p50=%luus p99=%luus p999=%luus max=%luus\n",
+              stat_stage_name[i], (unsigned long)count, (unsigned long)(sum / count),
+              (unsigned long)stats_percentile(i, 50), (unsigned long)stats_percentile(i, 99),
+              (unsigned long)stats_percentile(i, 99.9),
+              (unsigned long)atomic_load_explicit(&histograms[i].max, memory_order_relaxed));
+   }
+
+   outbuf_printf(ob, "Workers: %d (%d busy, %d queued)\n", workers_count(), workers_busy(), workers_queue_depth());
+   outbuf_printf(ob, "RSS: %ld kB\n", stats_rss_kb());
+}
+
+// one line summary for the log, from the periodic stats timer (and at respawn)
+void stats_log(void) {
+   time_t uptime = (now > stats_started ? now - stats_started : 1);
+   uint64_t answered = 0, found = 0;
+
+   for (int i = 0; i < STAT_ORIGIN_MAX; i++) {
+      answered += stats_origin_count(i);
+   }
+   found = answered - stats_origin_count(STAT_ORIGIN_NOTFOUND);
+
+   log_send(mainlog, LOG_INFO, "stats: %lu requests (%.2f/sec), %.1f%% found, %.1f%% cache, request p50=%luus p99=%luus p999=%luus, qrz p99=%luus, rss %ld kB",
+            (unsigned long)answered, (double)answered / uptime,
+            (answered ? (100.0 * found) / answered : 0.0),
+            (answered ? (100.0 * stats_origin_count(DATASRC_CACHE)) / answered : 0.0),
+            (unsigned long)stats_percentile(STAT_REQUEST, 50), (unsigned long)stats_percentile(STAT_REQUEST, 99),
+            (unsigned long)stats_percentile(STAT_REQUEST, 99.9), (unsigned long)stats_percentile(STAT_QRZ_HTTP, 99),
+            stats_rss_kb());
+}
+
+// Our counters and histograms in prometheus text exposition format, for the
+// metrics listener. Stage names use _ instead of -, times are in seconds.
+void stats_dump_prometheus(FILE *fp) {
+   int nbounds = sizeof(prom_bounds) / sizeof(prom_bounds[0]);
+
+   fprintf(fp, "# HELP callsign_lookup_requests_total Lookups answered, by where the answer came from\n");
+   fprintf(fp, "# TYPE callsign_lookup_requests_total counter\n");
+   for (int i = 0; i < STAT_ORIGIN_MAX; i++) {
+      fprintf(fp, "callsign_lookup_requests_total{origin=\"%s\"} %lu\n", stat_origin_name[i], (unsigned long)stats_origin_count(i));
+   }
+
+   fprintf(fp, "# HELP callsign_lookup_cache_total Cache lookups, by result\n");
+   fprintf(fp, "# TYPE callsign_lookup_cache_total counter\n");
+   for (int i = 0; i < STAT_CACHE_MAX; i++) {
+      fprintf(fp, "callsign_lookup_cache_total{result=\"%s\"} %lu\n", stat_cache_name[i], (unsigned long)stats_cache_count(i));
+   }
+
+   fprintf(fp, "# HELP callsign_lookup_stage_seconds Time spent in each stage of a lookup\n");
+   fprintf(fp, "# TYPE callsign_lookup_stage_seconds histogram\n");
+   for (int i = 0; i < STAT_STAGE_MAX; i++) {
+      stat_histogram_t *h = &histograms[i];
+      char stage[32];
+      uint64_t seen = 0;
+      int b = 0;
+
+      snprintf(stage, sizeof(stage), "%s", stat_stage_name[i]);
+      for (char *p = stage; *p != '\0'; p++) {
+         if (*p == '-') {
+            *p = '_';
+         }
+      }
+
+      // our buckets are much finer, so walk them once and emit each bound as we pass it
+      for (int j = 0; j < STAT_BUCKETS && b < nbounds; j++) {
+         while (b < nbounds && stat_bucket_value(j) > prom_bounds[b]) {
+            fprintf(fp, "callsign_lookup_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stage, prom_bounds[b] / 1e6, (unsigned long)seen);
+            b++;
+         }
+         seen += atomic_load_explicit(&h->buckets[j], memory_order_relaxed);
+      }
+
+      for (; b < nbounds; b++) {
+         fprintf(fp, "callsign_lookup_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stage, prom_bounds[b] / 1e6, (unsigned long)seen);
+      }
+
+      // +Inf must match _count, so use the bucket total rather than h->count
+      fprintf(fp, "callsign_lookup_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stage, (unsigned long)seen);
+      fprintf(fp, "callsign_lookup_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage, atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e6);
+      fprintf(fp, "callsign_lookup_stage_seconds_count{stage=\"%s\"} %lu\n", stage, (unsigned long)seen);
+   }
+
+   fprintf(fp, "# HELP callsign_lookup_workers Worker threads\n");
+   fprintf(fp, "# TYPE callsign_lookup_workers gauge\n");
+   fprintf(fp, "callsign_lookup_workers %d\n", workers_count());
+   fprintf(fp, "# HELP callsign_lookup_workers_busy Worker threads running a job\n");
+   fprintf(fp, "# TYPE callsign_lookup_workers_busy gauge\n");
+   fprintf(fp, "callsign_lookup_workers_busy %d\n", workers_busy());
+   fprintf(fp, "# HELP callsign_lookup_worker_queue_depth Jobs waiting for a worker\n");
+   fprintf(fp, "# TYPE callsign_lookup_worker_queue_depth gauge\n");
+   fprintf(fp, "callsign_lookup_worker_queue_depth %d\n", workers_queue_depth());
+   fprintf(fp, "# HELP callsign_lookup_uptime_seconds Seconds since startup\n");
+   fprintf(fp, "# TYPE callsign_lookup_uptime_seconds gauge\n");
+   fprintf(fp, "callsign_lookup_uptime_seconds %lu\n", (unsigned long)(now > stats_started ? now - stats_started : 0));
+   fprintf(fp, "# HELP callsign_lookup_rss_bytes Resident set size\n");
+   fprintf(fp, "# TYPE callsign_lookup_rss_bytes gauge\n");
+   fprintf(fp, "callsign_lookup_rss_bytes %ld\n", stats_rss_kb() * 1024);
+}
@@ -0,0 +1,210 @@
+/*
+ * /WATCH: streaming lookups for decode feeds
+ *
+ * A front end in watch mode just writes the callsigns it decodes, as fast as
+ * it decodes them, and we push answers back when we have them. The same
+ * station gets decoded every cycle, so each client keeps a table of what it
+ * sent recently and repeats within the window are dropped here, before they
+ * cost a lookup.
+ *
+ * Loop thread only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <libied/debuglog.h>
+#include "ft8goblin_types.h"
+#include "client.h"
+#include "callsign-norm.h"
+#include "watch.h"
+
+#define	WATCH_TABLE_MIN		256
+#define	WATCH_TABLE_MAX		65536		// a very busy band is a few thousand stations an hour
+
+extern time_t now;
+static watch_t *watches = NULL;
+
+static uint32_t watch_hash(const char *callsign) {
+   uint32_t h = 2166136261u;
+
+   while (*callsign != '\0') {
+      h ^= (uint8_t)*callsign++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static watch_entry_t *watch_table_alloc(int size) {
+   watch_entry_t *t = calloc(size, sizeof(watch_entry_t));
+
+   if (t == NULL) {
+      fprintf(stderr, "+ERROR watch_table_alloc: out of memory!\n");
+      exit(ENOMEM);
+   }
+   return t;
+}
+
+// slot holding callsign, or the empty slot it would go in
+static watch_entry_t *watch_slot(watch_entry_t *table, int size, const char *callsign) {
+   uint32_t i = watch_hash(callsign) & (size - 1);
+
+   while (table[i].callsign[0] != '\0' && strcmp(table[i].callsign, callsign) != 0) {
+      i = (i + 1) & (size - 1);
+   }
+   return &table[i];
+}
+
+// Getting full: rebuild without the entries that have aged out, growing it if that's not enough.
+// false if it's as big as it gets and still full, there's no room for another
+static bool watch_rehash(watch_t *w) {
+   int live = 0, new_size = w->size;
+
+   // already tried this second? nothing's aged out since
+   if (w->size >= WATCH_TABLE_MAX && w->rehashed == now) {
+      return false;
+   }
+   w->rehashed = now;
+
+   for (int i = 0; i < w->size; i++) {
+      if (w->table[i].callsign[0] != '\0' && (w->table[i].seen + w->window) > now) {
+         live++;
+      }
+   }
+
+   while (live * 2 >= new_size && new_size < WATCH_TABLE_MAX) {
+      new_size *= 2;
+   }
+
+   watch_entry_t *t = watch_table_alloc(new_size);
+   for (int i = 0; i < w->size; i++) {
+      watch_entry_t *e = &w->table[i];
+
+      if (e->callsign[0] != '\0' && (e->seen + w->window) > now) {
+         *watch_slot(t, new_size, e->callsign) = *e;
+      }
+   }
+   free(w->table);
+   w->table = t;
+   w->size = new_size;
+   w->used = live;
+   return ((live + 1) * 4 < new_size * 3);
+}
+
+watch_t *watch_start(client_t *cl, time_t window) {
+   watch_t *w = NULL;
+
+   if ((w = calloc(1, sizeof(watch_t))) == NULL) {
+      fprintf(stderr, "+ERROR watch_start: out of memory!\n");
+      exit(ENOMEM);
+   }
+   w->cl = cl;
+   w->window = window;
+   w->size = WATCH_TABLE_MIN;
+   w->table = watch_table_alloc(w->size);
+   w->next = watches;
+   watches = w;
+   return w;
+}
+
+void watch_stop(watch_t *w) {
+   watch_t **pp = &watches;
+
+   while (*pp != NULL) {
+      if (*pp == w) {
+         *pp = w->next;
+         break;
+      }
+      pp = &(*pp)->next;
+   }
+   free(w->table);
+   free(w);
+}
+
+// normalize a decoded callsign, false if it doesn't look like one. Keyed on the
+// base call, so k1abc and K1ABC/P are the same station
+static bool watch_normalize(const char *callsign, callsign_parts_t *parts) {
+   bool alpha = false, digit = false;
+   size_t i = 0;
+
+   if (!callsign_normalize(callsign, parts)) {
+      return false;
+   }
+
+   for (; parts->base[i] != '\0'; i++) {
+      alpha |= (isalpha((unsigned char)parts->base[i]) != 0);
+      digit |= (isdigit((unsigned char)parts->base[i]) != 0);
+   }
+   return (i >= 3 && alpha && digit);
+}
+
+// A callsign was decoded. Returns it's entry if it needs looking up, NULL if it's a repeat (or junk)
+watch_entry_t *watch_decode(watch_t *w, const char *callsign) {
+   callsign_parts_t parts;
+   const char *call = parts.base;
+   watch_entry_t *e = NULL;
+
+   w->decodes++;
+
+   if (!watch_normalize(callsign, &parts)) {
+      return NULL;
+   }
+
+   e = watch_slot(w->table, w->size, call);
+   if (e->callsign[0] != '\0') {
+      bool repeat = (e->seen + w->window) > now;
+
+      e->seen = now;
+      if (repeat) {
+         w->dups++;
+         return NULL;
+      }
+      snprintf(e->query, sizeof(e->query), "%s", parts.full);
+      e->state = WATCH_LOOKUP;
+      w->lookups++;
+      return e;
+   }
+
+   if ((w->used + 1) * 4 >= w->size * 3) {
+      // as big as it gets and nothing's aged out: skip new calls until some do
+      if (!watch_rehash(w)) {
+         if (w->refused++ == 0) {
+            log_send(mainlog, LOG_WARNING, "watch: %d callsigns decoded in %lu seconds, dedup table is full, ignoring new ones", w->used, w->window);
+         }
+         return NULL;
+      }
+      e = watch_slot(w->table, w->size, call);
+   }
+
+   snprintf(e->callsign, sizeof(e->callsign), "%s", call);
+   snprintf(e->query, sizeof(e->query), "%s", parts.full);
+   e->seen = now;
+   e->state = WATCH_LOOKUP;
+   w->used++;
+   w->lookups++;
+   return e;
+}
+
+watch_entry_t *watch_find(watch_t *w, const char *callsign) {
+   callsign_parts_t parts;
+   watch_entry_t *e = NULL;
+
+   if (!watch_normalize(callsign, &parts)) {
+      return NULL;
+   }
+
+   e = watch_slot(w->table, w->size, parts.base);
+   return (e->callsign[0] != '\0' ? e : NULL);
+}
+
+watch_t *watch_list(void) {
+   return watches;
+}
+
+void watch_dump(watch_t *w, outbuf_t *ob) {
+   outbuf_printf(ob, "window=%lu decodes=%lu dups=%lu lookups=%lu pushed=%lu enriched=%lu refused=%lu tracked=%d\n",
+         w->window, w->decodes, w->dups, w->lookups, w->pushed, w->enriched, w->refused, w->used);
+}
@@ -0,0 +1,253 @@
+/*
+ * Fixed size worker thread pool for blocking lookups (sqlite, http)
+ *
+ * The event loop hands work_t's to the pool with workers_submit(). Jobs wait
+ * in a small priority queue (mutex + condvar, they're only ever touched for a
+ * moment) until a worker picks them up and calls ->run().
+ *
+ * Finished jobs are pushed onto a lock-free MPSC queue and the loop is poked
+ * with an ev_async, where ->done() is called on the loop thread. That way only
+ * the loop thread ever touches clients, output or libev watchers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ev.h>
+#include <libied/debuglog.h>
+#include "workers.h"
+
+#define	MAX_WORKERS	64
+
+typedef struct work_list {
+   work_t	*head, *tail;
+} work_list_t;
+
+typedef struct worker_pool {
+   pthread_t		threads[MAX_WORKERS];
+   int			nthreads;
+   pthread_mutex_t	lock;
+   pthread_cond_t	cond;
+   work_list_t		pending[WORK_PRIO_MAX];	// waiting for a worker, by priority
+   int			depth;			// jobs waiting
+   _Atomic int		busy;			// workers running a job
+   bool			stopping;
+   mpsc_queue_t		results;		// finished jobs, waiting for the loop
+   ev_async		results_watcher;
+   struct ev_loop	*loop;
+   worker_thread_cb_t	thread_init, thread_fini;
+} worker_pool_t;
+
+static worker_pool_t pool;
+
+void mpsc_init(mpsc_queue_t *q) {
+   atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+   atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+   q->tail = &q->stub;
+}
+
+void mpsc_push(mpsc_queue_t *q, work_t *w) {
+   work_t *prev;
+
+   atomic_store_explicit(&w->next, NULL, memory_order_relaxed);
+   prev = atomic_exchange_explicit(&q->head, w, memory_order_acq_rel);
+   atomic_store_explicit(&prev->next, w, memory_order_release);
+}
+
+// Only the consumer (loop thread) may call this. Returns NULL if empty, or if
+// a producer is halfway through a push (it'll ev_async_send once it's done).
+work_t *mpsc_pop(mpsc_queue_t *q) {
+   work_t *tail = q->tail;
+   work_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+   if (tail == &q->stub) {
+      if (next == NULL) {
+         return NULL;
+      }
+      q->tail = next;
+      tail = next;
+      next = atomic_load_explicit(&next->next, memory_order_acquire);
+   }
+
+   if (next != NULL) {
+      q->tail = next;
+      return tail;
+   }
+
+   if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+      return NULL;
+   }
+
+   // tail is the last real item, put the stub back behind it so we can hand it out
+   mpsc_push(q, &q->stub);
+   next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+   if (next != NULL) {
+      q->tail = next;
+      return tail;
+   }
+   return NULL;
+}
+
+static void workers_results_cb(EV_P_ ev_async *w, int revents) {
+   work_t *wk;
+
+   while ((wk = mpsc_pop(&pool.results)) != NULL) {
+      if (wk->done != NULL) {
+         wk->done(wk);
+      }
+   }
+}
+
+static work_t *workers_next_job(void) {
+   for (int i = 0; i < WORK_PRIO_MAX; i++) {
+      work_list_t *l = &pool.pending[i];
+      work_t *w = l->head;
+
+      if (w != NULL) {
+         l->head = atomic_load_explicit(&w->next, memory_order_relaxed);
+         if (l->head == NULL) {
+            l->tail = NULL;
+         }
+         pool.depth--;
+         return w;
+      }
+   }
+   return NULL;
+}
+
+static void *worker_main(void *arg) {
+   int id = (int)(intptr_t)arg;
+
+   if (pool.thread_init != NULL) {
+      pool.thread_init(id);
+   }
+
+   while (true) {
+      work_t *w = NULL;
+
+      pthread_mutex_lock(&pool.lock);
+      while (!pool.stopping && (w = workers_next_job()) == NULL) {
+         pthread_cond_wait(&pool.cond, &pool.lock);
+      }
+      pthread_mutex_unlock(&pool.lock);
+
+      if (w == NULL) {		// stopping
+         break;
+      }
+
+      atomic_fetch_add(&pool.busy, 1);
+      w->run(w);
+      atomic_fetch_sub(&pool.busy, 1);
+
+      mpsc_push(&pool.results, w);
+      ev_async_send(pool.loop, &pool.results_watcher);
+   }
+
+   if (pool.thread_fini != NULL) {
+      pool.thread_fini(id);
+   }
+   return NULL;
+}
+
+bool workers_init(struct ev_loop *loop, int nthreads, worker_thread_cb_t thread_init, worker_thread_cb_t thread_fini) {
+   if (nthreads <= 0) {
+      nthreads = 1;
+   } else if (nthreads > MAX_WORKERS) {
+      log_send(mainlog, LOG_WARNING, "workers_init: %d threads is too many, using %d", nthreads, MAX_WORKERS);
+      nthreads = MAX_WORKERS;
+   }
+
+   memset(&pool, 0, sizeof(pool));
+   pool.loop = loop;
+   pool.thread_init = thread_init;
+   pool.thread_fini = thread_fini;
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.cond, NULL);
+   mpsc_init(&pool.results);
+
+   ev_async_init(&pool.results_watcher, workers_results_cb);
+   ev_async_start(loop, &pool.results_watcher);
+
+   for (int i = 0; i < nthreads; i++) {
+      int rc = pthread_create(&pool.threads[i], NULL, worker_main, (void *)(intptr_t)i);
+
+      if (rc != 0) {
+         log_send(mainlog, LOG_CRIT, "workers_init: pthread_create failed: %d: %s", rc, strerror(rc));
+         break;
+      }
+      pool.nthreads++;
+   }
+
+   if (pool.nthreads == 0) {
+      ev_async_stop(loop, &pool.results_watcher);
+      return false;
+   }
+
+   log_send(mainlog, LOG_INFO, "started %d lookup worker threads", pool.nthreads);
+   return true;
+}
+
+void workers_submit(work_t *w) {
+   if (w == NULL || w->run == NULL) {
+      return;
+   }
+
+   if (w->prio < 0 || w->prio >= WORK_PRIO_MAX) {
+      w->prio = WORK_PRIO_MAX - 1;
+   }
+
+   atomic_store_explicit(&w->next, NULL, memory_order_relaxed);
+
+   pthread_mutex_lock(&pool.lock);
+   work_list_t *l = &pool.pending[w->prio];
+
+   if (l->tail != NULL) {
+      atomic_store_explicit(&l->tail->next, w, memory_order_relaxed);
+   } else {
+      l->head = w;
+   }
+   l->tail = w;
+   pool.depth++;
+   pthread_cond_signal(&pool.cond);
+   pthread_mutex_unlock(&pool.lock);
+}
+
+// Let the workers finish what they're doing and exit
+void workers_stop(void) {
+   if (pool.nthreads == 0) {
+      return;
+   }
+
+   pthread_mutex_lock(&pool.lock);
+   pool.stopping = true;
+   pthread_cond_broadcast(&pool.cond);
+   pthread_mutex_unlock(&pool.lock);
+
+   for (int i = 0; i < pool.nthreads; i++) {
+      pthread_join(pool.threads[i], NULL);
+   }
+   pool.nthreads = 0;
+   ev_async_stop(pool.loop, &pool.results_watcher);
+}
+
+int workers_queue_depth(void) {
+   int depth;
+
+   pthread_mutex_lock(&pool.lock);
+   depth = pool.depth;
+   pthread_mutex_unlock(&pool.lock);
+   return depth;
+}
+
+int workers_busy(void) {
+   return atomic_load(&pool.busy);
+}
+
+int workers_count(void) {
+   return pool.nthreads;
+}
@@ -0,0 +1,106 @@
+/*
+ * geo_heading_batch() against geo_heading_scalar()
+ *
+ * Random points all over the globe, in batches of every size from 0 to 13 (so
+ * every remainder after the 4 wide vector loop gets run) and one big batch,
+ * plus a few awkward ones: the poles, either side of the date line, next door.
+ * Distances have to agree to within GEO_TEST_KM_TOL and bearings (allowing for
+ * 359.99... vs 0) to within GEO_TEST_DEG_TOL.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "geo.h"
+
+#define	GEO_TEST_KM_TOL		1e-6		// a millimeter
+#define	GEO_TEST_DEG_TOL	1e-6		// very short hops (cm) lose a few digits of bearing
+#define	GEO_TEST_BIG		1001
+#define	GEO_TEST_ROUNDS		200
+
+static int failures = 0, checked = 0;
+static double worst_km = 0, worst_deg = 0;
+
+static void check_batch(double my_lat, double my_lon, const double *lat, const double *lon, int n) {
+   double *d_vec = calloc(n + 1, sizeof(double)), *b_vec = calloc(n + 1, sizeof(double));
+   double *d_ref = calloc(n + 1, sizeof(double)), *b_ref = calloc(n + 1, sizeof(double));
+
+   if (d_vec == NULL || b_vec == NULL || d_ref == NULL || b_ref == NULL) {
+      fprintf(stderr, "+ERROR check_batch: out of memory!\n");
+      exit(1);
+   }
+
+   geo_heading_batch(my_lat, my_lon, lat, lon, n, d_vec, b_vec);
+   geo_heading_scalar(my_lat, my_lon, lat, lon, n, d_ref, b_ref);
+
+   for (int i = 0; i < n; i++) {
+      double dk = fabs(d_vec[i] - d_ref[i]);
+      double db = fabs(b_vec[i] - b_ref[i]);
+
+      if (db > 180.0) {
+         db = 360.0 - db;
+      }
+
+      if (dk > worst_km) {
+         worst_km = dk;
+      }
+
+      if (db > worst_deg) {
+         worst_deg = db;
+      }
+
+      if (dk > GEO_TEST_KM_TOL || db > GEO_TEST_DEG_TOL || isnan(d_vec[i]) || isnan(b_vec[i])) {
+         if (failures++ < 10) {
+            fprintf(stderr, "FAIL: n=%d [%d] from %.6f,%.6f to %.6f,%.6f: batch %.9f km %.9f deg, scalar %.9f km %.9f deg\n",
+                  n, i, my_lat, my_lon, lat[i], lon[i], d_vec[i], b_vec[i], d_ref[i], b_ref[i]);
+         }
+      }
+      checked++;
+   }
+   free(d_vec);
+   free(b_vec);
+   free(d_ref);
+   free(b_ref);
+}
+
+static double rand_lat(void) {
+   return drand48() * 180.0 - 90.0;
+}
+
+static double rand_lon(void) {
+   return drand48() * 360.0 - 180.0;
+}
+
+int main(int argc, char **argv) {
+   static double lat[GEO_TEST_BIG], lon[GEO_TEST_BIG];
+   static const double edge_lat[] = { 90.0, -90.0, 0.0, 0.0, 41.714775, 41.714776, -33.9, 64.1, 0.0 };
+   static const double edge_lon[] = { 0.0, 0.0, 179.999, -179.999, -72.727260, -72.727259, 18.4, -21.9, 0.0 };
+   const int n_edge = sizeof(edge_lat) / sizeof(edge_lat[0]);
+
+   srand48(20230524);
+
+   // every batch size up to a few vectors' worth, so each remainder gets run
+   for (int round = 0; round < GEO_TEST_ROUNDS; round++) {
+      for (int n = 0; n <= 13; n++) {
+         for (int i = 0; i < n; i++) {
+            lat[i] = rand_lat();
+            lon[i] = rand_lon();
+         }
+         check_batch(rand_lat(), rand_lon(), lat, lon, n);
+      }
+   }
+
+   for (int i = 0; i < GEO_TEST_BIG; i++) {
+      lat[i] = rand_lat();
+      lon[i] = rand_lon();
+   }
+   check_batch(rand_lat(), rand_lon(), lat, lon, GEO_TEST_BIG);
+
+   // from W1AW to the awkward ones, and from each of them to the rest
+   check_batch(41.714775, -72.727260, edge_lat, edge_lon, n_edge);
+   for (int i = 0; i < n_edge; i++) {
+      check_batch(edge_lat[i], edge_lon[i], edge_lat, edge_lon, n_edge);
+   }
+
+   printf("geo-test: %d headings checked, worst %.3g km, %.3g deg, %d failed\n", checked, worst_km, worst_deg, failures);
+   return (failures > 0 ? 1 : 0);
+}
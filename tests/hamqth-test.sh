@@ -0,0 +1,47 @@
+#!/bin/sh
+# HamQTH backend against tests/mock-hamqth.py: login (with a password that
+# needs escaping), a hit, a miss, an expired session id logging in again, the
+# rate limit, and bad credentials leaving us offline instead of hanging.
+. "$(dirname "$0")/lib.sh"
+
+start_mock_hamqth
+
+# hamqth_config password [more settings]
+hamqth_config() {
+   write_config "
+      \"use-hamqth\": \"true\",
+      \"hamqth-api-url\": \"http://127.0.0.1:${MOCK_PORT}/xml.php\",
+      \"hamqth-username\": \"test\",
+      \"hamqth-password\": \"$1\",
+      \"hamqth-max-login-tries\": 1,$2
+      \"backends\": \"hamqth\""
+}
+
+hamqth_config 'p&ss=w+rd%20'
+out=$(run OK1RR XX1XX)
+expect "login and lookup" "${out}" "^200 OK OK1RR ONLINE [0-9]+ HAMQTH"
+expect "XML entities decoded" "${out}" "Hlozek & Co"
+expect "grid parsed" "${out}" "JN99AF|JN99af"
+expect "not found" "${out}" "^404 NOT FOUND XX1XX"
+
+# the first session expires under OK1EXP, which has to wait out the 5 second grace for a fresh login
+kill ${MOCK_PID}
+start_mock_hamqth
+hamqth_config 'p&ss=w+rd%20'
+out=$( (sleep 1; echo "/CALL OK1RR"; sleep 5; echo "/CALL OK1EXP"; sleep 1; echo "/EXIT") | run_stdin)
+expect "first session" "${out}" "^Address1: Sess1"
+expect "expired session retried" "${out}" "^200 OK OK1EXP ONLINE [0-9]+ HAMQTH"
+expect "after logging in again" "${out}" "^Address1: Sess2"
+
+hamqth_config secret "
+      \"hamqth-rate-limit\": \"0.1\",
+      \"hamqth-rate-burst\": \"2\","
+out=$(run OK1AA OK1AB OK1AC)
+expect "burst answered" "${out}" "^200 OK OK1AB ONLINE"
+expect "then rate limited" "${out}" "^404 NOT FOUND OK1AC"
+
+hamqth_config wrong
+out=$(run OK1RR)
+expect "bad password goes offline" "${out}" "^404 NOT FOUND OK1RR OFFLINE"
+
+exit ${failed}
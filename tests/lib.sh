@@ -0,0 +1,85 @@
+# Shared by the tests/*-test.sh scripts (sourced, not run): a scratch $HOME
+# holding the config, and helpers to run bin/callsign-lookup in it.
+#
+# BIN=/path/to/callsign-lookup overrides the binary under test.
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+BIN=${BIN:-${TESTS}/../bin/callsign-lookup}
+T=$(mktemp -d "${TMPDIR:-/tmp}/callsign-lookup-test.XXXXXX")
+MOCK_PID=
+failed=0
+
+cleanup() {
+   [ -n "${MOCK_PID}" ] && kill ${MOCK_PID} 2>/dev/null
+   rm -rf "${T}"
+}
+trap cleanup EXIT
+
+# $1 = the inside of the "callsign-lookup" section
+write_config() {
+   mkdir -p "${T}/.callsign-lookup"
+   cat > "${T}/.callsign-lookup/config.json" <<EOC
+{
+   "version": 1,
+   "logging": {
+      "callsign-lookup-logpath": "file://${T}/callsign-lookup.log",
+      "callsign-lookup-loglevel": "debug"
+   },
+   "site": {
+      "mycall": "N0CALL",
+      "gridsquare": "FN31pr"
+   },
+   "callsign-lookup": {
+      "use-cache": "false",
+      "use-qrz": "false",
+      "use-uls": "false",
+      "use-gnis": "false",
+      $1
+   }
+}
+EOC
+   cp "${T}/.callsign-lookup/config.json" "${T}/.callsign-lookupd.json"
+}
+
+# start tests/$1 (one of the mock-*.py servers), sets MOCK_PORT
+start_mock() {
+   python3 "${TESTS}/$1" > "${T}/mock.port" &
+   MOCK_PID=$!
+
+   for i in 1 2 3 4 5 6 7 8 9 10; do
+      MOCK_PORT=$(head -n 1 "${T}/mock.port")
+      [ -n "${MOCK_PORT}" ] && return 0
+      sleep 0.2
+   done
+   echo "FAIL: $1 didn't start"
+   exit 1
+}
+
+start_mock_hamqth() {
+   start_mock mock-hamqth.py
+}
+
+start_mock_qrz() {
+   start_mock mock-qrz.py
+}
+
+# one-shot lookups: run callsign...
+run() {
+   (cd "${T}" && HOME="${T}" timeout ${TIMEOUT:-30} "${BIN}" "$@" < /dev/null 2>&1)
+}
+
+# daemon mode, commands on stdin: run_stdin < commands
+run_stdin() {
+   (cd "${T}" && HOME="${T}" timeout ${TIMEOUT:-30} "${BIN}" 2>&1)
+}
+
+# expect "what" "output" "grep -E pattern"
+expect() {
+   if printf '%s\n' "$2" | grep -Eq -- "$3"; then
+      echo "ok: $1"
+   else
+      echo "FAIL: $1 (wanted /$3/)"
+      printf '%s\n' "$2" | sed 's/^/   | /'
+      failed=1
+   fi
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# LoTW activity list from a file:// URL: loaded in daemon mode and shown in
+# replies, and never started for one-shot lookups (which would have to wait on it).
+. "$(dirname "$0")/lib.sh"
+
+start_mock_hamqth
+
+cat > "${T}/lotw.csv" <<EOC
+K1ABC,2026-10-01,12:34:56
+W1AW,2026-09-15,01:02:03
+OK1RR,2025-01-02,03:04:05
+EOC
+
+write_config "
+      \"use-hamqth\": \"true\",
+      \"hamqth-api-url\": \"http://127.0.0.1:${MOCK_PORT}/xml.php\",
+      \"hamqth-username\": \"test\",
+      \"hamqth-password\": \"secret\",
+      \"backends\": \"hamqth\",
+      \"use-lotw-activity\": \"true\",
+      \"lotw-url\": \"file://${T}/lotw.csv\""
+
+out=$( (sleep 2; echo "/STATS"; echo "/CALL OK1RR"; echo "/EXIT") | run_stdin)
+expect "list loaded" "${out}" "LoTW: 3 users"
+expect "last upload shown" "${out}" "LoTW Last Upload: 2025-01-02 03:04:05 UTC"
+
+start=$(date +%s)
+out=$(TIMEOUT=10 run OK1RR)
+took=$(( $(date +%s) - start ))
+expect "one-shot lookup" "${out}" "^200 OK OK1RR"
+expect "one-shot doesn't wait for LoTW (${took}s)" "${took}" "^[0-2]$"
+
+exit ${failed}
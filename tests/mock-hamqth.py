@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# A stand-in for www.hamqth.com/xml.php, for the tests: user "test" / password
+# "secret" (or "p&ss=w+rd%20", to check it's escaped) logs in and gets a new
+# session id each time (sess1, sess2, ...). OK1EXP's first lookup with sess1
+# says the session expired, calls starting with X aren't found, everything else
+# is OK1RR's record under the requested call, with the session that answered
+# as the street ("Sess1", "Sess2", ...). Prints the port it's listening on
+# (127.0.0.1, picked by the kernel) then serves until killed.
+import http.server, threading, urllib.parse
+
+PASSWORDS = ('secret', 'p&ss=w+rd%20')
+lock = threading.Lock()
+logins = 0
+expired = False
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        global logins, expired
+        q = dict(urllib.parse.parse_qsl(urllib.parse.urlparse(self.path).query))
+        call = q.get('callsign', '').upper()
+
+        with lock:
+            if 'u' in q:
+                if q.get('u') == 'test' and q.get('p') in PASSWORDS:
+                    logins += 1
+                    body = '<session><session_id>sess%d</session_id></session>' % logins
+                else:
+                    body = '<session><error>Wrong user name or password</error></session>'
+            elif not q.get('id', '').startswith('sess') or (call == 'OK1EXP' and q['id'] == 'sess1' and not expired):
+                expired = expired or call == 'OK1EXP'
+                body = '<session><error>Session does not exist or expired</error></session>'
+            elif call.startswith('X'):
+                body = '<session><error>Callsign not found</error></session>'
+            else:
+                body = ('<search><callsign>%s</callsign><nick>Petr</nick><adr_name>Petr Hlozek &amp; Co</adr_name>'
+                        '<adr_street1>%s</adr_street1><adr_city>Prerov</adr_city><country>Czech Republic</country>'
+                        '<adif>503</adif><itu>28</itu><cq>15</cq><grid>JN99af</grid><latitude>49.45</latitude>'
+                        '<longitude>17.45</longitude><utc_offset>-1</utc_offset></search>') % (call.lower(), q['id'].capitalize())
+
+        out = ('<?xml version="1.0"?><HamQTH version="2.8" xmlns="https://www.hamqth.com">%s</HamQTH>' % body).encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/xml')
+        self.send_header('Content-Length', str(len(out)))
+        self.end_headers()
+        self.wfile.write(out)
+
+server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+print(server.server_address[1], flush=True)
+server.serve_forever()
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# A stand-in for the QRZ XML API, for the tests: user "test" / password "secret"
+# logs in and gets a new session key each time (key1, key2, ...), user "slow"
+# does too, but takes 2 seconds about it. Lookups:
+#   K1EXP	"Session Timeout" the first time it's asked with key1, found after
+#   ZZ...	the connection is dropped without an answer (an HTTP failure)
+#   X...	not found
+#   anything else is found, with the key's login number as the first name
+# (Key1, Key2, ...) so the tests can see which session answered. Prints the
+# port it's listening on (127.0.0.1, picked by the kernel) then serves until killed.
+import http.server, re, threading, time
+
+lock = threading.Lock()
+logins = 0
+expired = False
+
+def session(key, extra=''):
+    return ('<Session><Key>%s</Key><Count>%d</Count><SubExp>Wed Jan 1 12:34:03 2031</SubExp>'
+            '<GMTime>Sun Aug 16 03:51:47 2026</GMTime>%s</Session>') % (key, logins, extra)
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        global logins, expired
+        query = self.path.split('?', 1)[1] if '?' in self.path else ''
+        q = dict(p.split('=', 1) for p in re.split('[;&]', query) if '=' in p)
+        call = q.get('callsign', '').upper()
+
+        if q.get('username') == 'slow':
+            time.sleep(2)
+
+        with lock:
+            if 'username' in q:
+                if q.get('username') in ('test', 'slow') and q.get('password') == 'secret':
+                    logins += 1
+                    body = session('key%d' % logins)
+                else:
+                    body = '<Session><Error>Username/password incorrect</Error></Session>'
+            elif call.startswith('ZZ'):
+                self.close_connection = True
+                self.connection.shutdown(2)
+                return
+            elif not q.get('s', '').startswith('key'):
+                body = '<Session><Error>Invalid session key</Error></Session>'
+            elif call == 'K1EXP' and q.get('s') == 'key1' and not expired:
+                expired = True
+                body = '<Session><Error>Session Timeout</Error></Session>'
+            elif call.startswith('X'):
+                body = session(q['s'], '<Error>Not found: %s</Error>' % call)
+            else:
+                body = ('<Callsign><call>%s</call><fname>Key%s</fname><name>Op</name><addr2>Town</addr2><state>CT</state>'
+                        '<country>United States</country><lat>41.7</lat><lon>-72.7</lon><grid>FN31pr</grid>'
+                        '<class>E</class><dxcc>291</dxcc></Callsign>%s') % (call, q['s'][3:], session(q['s']))
+
+        out = ('<?xml version="1.0" ?><QRZDatabase version="1.34">%s</QRZDatabase>' % body).encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/xml')
+        self.send_header('Content-Length', str(len(out)))
+        self.end_headers()
+        self.wfile.write(out)
+
+server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+print(server.server_address[1], flush=True)
+server.serve_forever()
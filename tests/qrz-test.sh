@@ -0,0 +1,55 @@
+#!/bin/sh
+# QRZ session state machine against tests/mock-qrz.py: bad credentials back
+# off for the whole retry-delay, an expired session key logs in again and
+# retries the lookup (if the rate limit has a token for it), requests that
+# keep failing go DEGRADED, then OFFLINE, and /OFFLINE sticks even if it comes
+# in while a login is going.
+. "$(dirname "$0")/lib.sh"
+
+start_mock_qrz
+
+# qrz_config password [username] [more settings]
+qrz_config() {
+   write_config "
+      \"use-qrz\": \"true\",
+      \"qrz-api-url\": \"http://127.0.0.1:${MOCK_PORT}/xml/current/\",
+      \"qrz-username\": \"${2:-test}\",
+      \"qrz-password\": \"$1\",$3
+      \"qrz-max-login-tries\": 3,
+      \"retry-delay\": \"120s\",
+      \"backends\": \"qrz\""
+}
+
+qrz_config wrong
+out=$( (sleep 1; echo "/QUOTA"; echo "/EXIT") | run_stdin)
+expect "bad credentials go offline" "${out}" "^Session: OFFLINE"
+expect "and wait out retry-delay" "${out}" "^Session: OFFLINE \\(retry in 1(19|20) sec\\)"
+
+# the first key expires under K1EXP, which has to wait out the 5 second grace for a fresh login
+qrz_config secret
+out=$( (sleep 1; echo "/CALL K1ABC"; sleep 5; echo "/CALL K1EXP"; sleep 1; echo "/EXIT") | run_stdin)
+expect "login and lookup" "${out}" "^200 OK K1ABC ONLINE [0-9]+ QRZ"
+expect "first session" "${out}" "^Name: Key1 Op"
+expect "expired key retried" "${out}" "^200 OK K1EXP ONLINE [0-9]+ QRZ"
+expect "after logging in again" "${out}" "^Name: Key2 Op"
+
+out=$( (sleep 1; echo "/CALL ZZ1A"; sleep 0.5; echo "/CALL ZZ1B"; sleep 0.5; echo "/CALL ZZ1C"; sleep 0.5; echo "/QUOTA"; echo "/EXIT") | run_stdin)
+expect "failed request degrades" "${out}" "^\\+NOTICE QRZ session ONLINE -> DEGRADED"
+expect "three in a row go offline" "${out}" "^\\+NOTICE QRZ session DEGRADED -> OFFLINE"
+expect "and retry later" "${out}" "^Session: OFFLINE \\(retry in [0-9]+ sec\\)"
+
+# again, but the retry after logging in again has no token left, so it waits its turn instead of going out
+kill ${MOCK_PID}
+start_mock_qrz
+qrz_config secret test "
+      \"qrz-rate-limit\": \"0.01\",
+      \"qrz-rate-burst\": \"2\","
+out=$( (sleep 1; echo "/CALL K1ABC"; sleep 5; echo "/CALL K1EXP"; sleep 1; echo "/QUOTA"; echo "/EXIT") | run_stdin)
+expect "retry without a token isn't sent" "${out}" "^404 NOT FOUND K1EXP"
+expect "it's queued instead" "${out}" "^Queue-interactive: 1"
+
+qrz_config secret slow
+out=$( (sleep 0.5; echo "/OFFLINE"; sleep 3; echo "/QUOTA"; echo "/EXIT") | run_stdin)
+expect "/OFFLINE during a login sticks" "${out}" "^Session: OFFLINE$"
+
+exit ${failed}